@@ -14,6 +14,10 @@
 //                         |
 // <ringsocket_queue.h> <--/      # Ring buffer update queuing and thread waking
 //   |
+//   \---> <ringsocket_metrics.h>   # Live counters shared through shared memory
+//                            |
+//   /------------------------/
+//   |
 //   \--> <ringsocket_wsframe.h>   # RFC 6455 WebSocket frame protocol interface
 //                           |
 // <ringsocket_app.h> <------/    # Definition of RS_APP() and descendent macros
@@ -36,7 +40,8 @@
 static inline uint64_t rs_get_client_id(
     rs_t const * rs
 ) {
-    rs_guard_cb(__func__, rs->cb, RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE);
+    rs_guard_cb(__func__, rs->cb,
+        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_PAUSE);
     return *((uint64_t *) (uint32_t []){
         // Offset worker index by 1 to prevent ever returning an ID value of 0.
         rs->inbound_worker_i + 1,
@@ -56,7 +61,8 @@ static inline int rs_get_client_addr(
 static inline uint64_t rs_get_endpoint_id(
     rs_t const * rs
 ) {
-    rs_guard_cb(__func__, rs->cb, RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE);
+    rs_guard_cb(__func__, rs->cb,
+        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_PAUSE);
     return rs->inbound_endpoint_id;
 }
 
@@ -73,19 +79,47 @@ static inline struct rs_conf const * rs_get_conf(
     return rs->conf;
 }
 
+// Apps configured with a "thread_c" greater than 1 run that many instances of
+// the same callbacks, each in its own thread and with its own share of peers.
+// Returns which of those instances the calling thread is (starting from 0).
+static inline unsigned rs_get_app_instance_i(
+    rs_t const * rs
+) {
+    return rs->conf->apps[rs->app_i].instance_i;
+}
+
+static inline unsigned rs_get_app_instance_c(
+    rs_t const * rs
+) {
+    return rs->conf->apps[rs->app_i].instance_c;
+}
+
 static inline void * rs_get_app_data(
     rs_t const * rs
 ) {
     return rs->app_data;
 }
 
+// To be called from the RS_INIT() callback of apps with any endpoint of which
+// the "backpressure_policy" is "pause": pause_cb is then called with is_paused
+// set to true once a client ID stops receiving messages because it can't keep
+// up, and with is_paused set to false once it has caught up again. Its return
+// value is interpreted in the same manner as that of RS_OPEN() callbacks.
+static inline void rs_set_pause_cb(
+    rs_t * rs,
+    int (* pause_cb)(rs_t *, bool is_paused)
+) {
+    rs_guard_cb(__func__, rs->cb, RS_CB_INIT);
+    rs->pause_cb = pause_cb;
+}
+
 static inline void rs_w_p(
     rs_t * rs,
     void const * src,
     size_t size
 ) {
     rs_guard_cb(__func__, rs->cb,
-        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER);
+        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER | RS_CB_PAUSE);
     RS_GUARD_APP(rs_check_app_wsize(rs, size));
     memcpy(rs->wbuf + rs->wbuf_i, src, size);
     rs->wbuf_i += size;
@@ -103,7 +137,7 @@ static inline void rs_w_uint8(
     uint8_t u8
 ) {
     rs_guard_cb(__func__, rs->cb,
-        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER);
+        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER | RS_CB_PAUSE);
     RS_GUARD_APP(rs_check_app_wsize(rs, 1));
     rs->wbuf[rs->wbuf_i++] = u8;
 }
@@ -113,7 +147,7 @@ static inline void rs_w_uint16(
     uint16_t u16
 ) {
     rs_guard_cb(__func__, rs->cb,
-        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER);
+        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER | RS_CB_PAUSE);
     RS_GUARD_APP(rs_check_app_wsize(rs, 2));
     *((uint16_t *) (rs->wbuf + rs->wbuf_i)) = u16;
     rs->wbuf_i += 2;
@@ -124,7 +158,7 @@ static inline void rs_w_uint32(
     uint32_t u32
 ) {
     rs_guard_cb(__func__, rs->cb,
-        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER);
+        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER | RS_CB_PAUSE);
     RS_GUARD_APP(rs_check_app_wsize(rs, 4));
     *((uint32_t *) (rs->wbuf + rs->wbuf_i)) = u32;
     rs->wbuf_i += 4;
@@ -135,7 +169,7 @@ static inline void rs_w_uint64(
     uint64_t u64
 ) {
     rs_guard_cb(__func__, rs->cb,
-        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER);
+        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER | RS_CB_PAUSE);
     RS_GUARD_APP(rs_check_app_wsize(rs, 8));
     *((uint64_t *) (rs->wbuf + rs->wbuf_i)) = u64;
     rs->wbuf_i += 8;
@@ -211,13 +245,43 @@ static inline void rs_w_int64_hton(
     rs_w_uint64_hton(rs, i64);
 }
 
+static inline void * rs_reserve_single(
+    rs_t * rs,
+    uint64_t client_id,
+    size_t max_payload_size
+) {
+    rs_guard_cb(__func__, rs->cb,
+        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER | RS_CB_PAUSE);
+    uint32_t * u32 = (uint32_t *) &client_id;
+    return rs_reserve_outbound_payload(rs, *u32 - 1, u32[1], max_payload_size);
+}
+
+static inline void * rs_reserve_cur(
+    rs_t * rs,
+    size_t max_payload_size
+) {
+    rs_guard_cb(__func__, rs->cb, RS_CB_OPEN | RS_CB_READ);
+    return rs_reserve_outbound_payload(rs, rs->inbound_worker_i,
+        rs->inbound_peer_i, max_payload_size);
+}
+
+static inline void rs_commit(
+    rs_t * rs,
+    enum rs_data_kind data_kind,
+    size_t payload_size
+) {
+    rs_guard_cb(__func__, rs->cb,
+        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER | RS_CB_PAUSE);
+    rs_commit_reserved(rs, data_kind, payload_size);
+}
+
 static inline void rs_to_single(
     rs_t * rs,
     enum rs_data_kind data_kind,
     uint64_t client_id
 ) {
     uint32_t * u32 = (uint32_t *) &client_id;
-    rs_send(rs, *u32 - 1, RS_OUTBOUND_SINGLE, u32 + 1, 1, data_kind);
+    rs_send(rs, *u32 - 1, RS_OUTBOUND_SINGLE, u32 + 1, 1, data_kind, NULL);
     rs->wbuf_i = 0;
 }
 
@@ -227,35 +291,20 @@ static inline void rs_to_multi(
     uint64_t const * client_ids,
     size_t client_c
 ) {
-    for (size_t i = 0; i < rs->conf->worker_c; i++) {
-        uint32_t cur_clients[client_c];
-        size_t cur_client_c = 0;
-        for (size_t j = 0; j < client_c; j++) {
-            uint32_t * u32 = (uint32_t *) (client_ids + j);
-            if (*u32++ - 1 != i) {
-                continue;
-            }
-            for (size_t k = 0; k < cur_client_c; k++) {
-                if (cur_clients[k] == *u32) {
-                    RS_LOG(LOG_WARNING, "Ignoring duplicate client_id %" PRIu64
-                        ": please fix your app code!", client_ids[j]);
-                    goto next_client;
-                }
-            }
-            cur_clients[cur_client_c++] = *u32;
-            next_client:;
-        }
-        switch (cur_client_c) {
-        case 0:
-            continue;
-        case 1:
-            rs_send(rs, i, RS_OUTBOUND_SINGLE, cur_clients, 1, data_kind);
-            continue;
-        default:
-            rs_send(rs, i, RS_OUTBOUND_ARRAY, cur_clients, cur_client_c,
-                data_kind);
-            continue;
+    if (!client_c) {
+        rs->wbuf_i = 0;
+        return;
+    }
+    uint64_t keys[client_c];
+    size_t key_c = rs_get_recipient_keys(client_ids, client_c, keys);
+    uint32_t peer_is[key_c];
+    for (size_t i = 0, k = 0; i < rs->conf->worker_c; i++) {
+        size_t peer_c = 0;
+        for (; k < key_c && keys[k] >> 32 == i; k++) {
+            peer_is[peer_c++] = keys[k];
         }
+        rs_send_to_recipient_set(rs, i, false, peer_is, peer_c, data_kind,
+            NULL);
     }
     rs->wbuf_i = 0;
 }
@@ -266,7 +315,7 @@ static inline void rs_to_cur(
 ) {
     rs_guard_cb(__func__, rs->cb, RS_CB_OPEN | RS_CB_READ);
     rs_send(rs, rs->inbound_worker_i, RS_OUTBOUND_SINGLE,
-        (uint32_t []){rs->inbound_peer_i}, 1, data_kind);
+        (uint32_t []){rs->inbound_peer_i}, 1, data_kind, NULL);
     rs->wbuf_i = 0;
 }
 
@@ -274,8 +323,10 @@ static inline void rs_to_every(
     rs_t * rs,
     enum rs_data_kind data_kind
 ) {
+    struct rs_shared_frame * shared = NULL;
+    RS_GUARD_APP(rs_get_shared_frame(rs, data_kind, &shared));
     for (size_t i = 0; i < rs->conf->worker_c; i++) {
-        rs_send(rs, i, RS_OUTBOUND_EVERY, NULL, 0, data_kind);
+        rs_send(rs, i, RS_OUTBOUND_EVERY, NULL, 0, data_kind, shared);
     }
     rs->wbuf_i = 0;
 }
@@ -286,12 +337,14 @@ static inline void rs_to_every_except_single(
     uint64_t client_id
 ) {
     uint32_t * u32 = (uint32_t *) &client_id;
+    struct rs_shared_frame * shared = NULL;
+    RS_GUARD_APP(rs_get_shared_frame(rs, data_kind, &shared));
     for (size_t i = 0; i < rs->conf->worker_c; i++) {
         if (*u32 - 1 == i) {
             rs_send(rs, i, RS_OUTBOUND_EVERY_EXCEPT_SINGLE, u32 + 1, 1,
-                data_kind);
+                data_kind, shared);
         } else {
-            rs_send(rs, i, RS_OUTBOUND_EVERY, NULL, 0, data_kind);
+            rs_send(rs, i, RS_OUTBOUND_EVERY, NULL, 0, data_kind, shared);
         }
     }
     rs->wbuf_i = 0;
@@ -303,37 +356,22 @@ static inline void rs_to_every_except_multi(
     uint64_t const * client_ids,
     size_t client_c
 ) {
-    for (size_t i = 0; i < rs->conf->worker_c; i++) {
-        uint32_t cur_clients[client_c];
-        size_t cur_client_c = 0;
-        for (size_t j = 0; j < client_c; j++) {
-            uint32_t * u32 = (uint32_t *) (client_ids + j);
-            if (*u32++ - 1 != i) {
-                continue;
-            }
-            for (size_t k = 0; k < cur_client_c; k++) {
-                if (cur_clients[k] == *u32) {
-                    RS_LOG(LOG_WARNING, "Ignoring duplicate client_id %" PRIu64
-                        ": please fix your app code!", client_ids[j]);
-                    goto next_client;
-                }
-            }
-            cur_clients[cur_client_c++] = *u32;
-            next_client:;
-        }
-        switch (cur_client_c) {
-        case 0:
-            rs_send(rs, i, RS_OUTBOUND_EVERY, NULL, 0, data_kind);
-            continue;
-        case 1:
-            rs_send(rs, i, RS_OUTBOUND_EVERY_EXCEPT_SINGLE, cur_clients, 1,
-                data_kind);
-            continue;
-        default:
-            rs_send(rs, i, RS_OUTBOUND_EVERY_EXCEPT_ARRAY, cur_clients,
-                cur_client_c, data_kind);
-            continue;
+    if (!client_c) {
+        rs_to_every(rs, data_kind);
+        return;
+    }
+    uint64_t keys[client_c];
+    size_t key_c = rs_get_recipient_keys(client_ids, client_c, keys);
+    uint32_t peer_is[key_c];
+    struct rs_shared_frame * shared = NULL;
+    RS_GUARD_APP(rs_get_shared_frame(rs, data_kind, &shared));
+    for (size_t i = 0, k = 0; i < rs->conf->worker_c; i++) {
+        size_t peer_c = 0;
+        for (; k < key_c && keys[k] >> 32 == i; k++) {
+            peer_is[peer_c++] = keys[k];
         }
+        rs_send_to_recipient_set(rs, i, true, peer_is, peer_c, data_kind,
+            shared);
     }
     rs->wbuf_i = 0;
 }
@@ -343,12 +381,14 @@ static inline void rs_to_every_except_cur(
     enum rs_data_kind data_kind
 ) {
     rs_guard_cb(__func__, rs->cb, RS_CB_OPEN | RS_CB_READ);
+    struct rs_shared_frame * shared = NULL;
+    RS_GUARD_APP(rs_get_shared_frame(rs, data_kind, &shared));
     for (size_t i = 0; i < rs->conf->worker_c; i++) {
         if (i == rs->inbound_worker_i) {
             rs_send(rs, i, RS_OUTBOUND_EVERY_EXCEPT_SINGLE,
-                (uint32_t []){rs->inbound_peer_i}, 1, data_kind);
+                (uint32_t []){rs->inbound_peer_i}, 1, data_kind, shared);
         } else {
-            rs_send(rs, i, RS_OUTBOUND_EVERY, NULL, 0, data_kind);
+            rs_send(rs, i, RS_OUTBOUND_EVERY, NULL, 0, data_kind, shared);
         }
     }
     rs->wbuf_i = 0;
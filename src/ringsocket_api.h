@@ -15,6 +15,10 @@
 //                         |
 // <ringsocket_queue.h> <--/      # Ring buffer update queuing and thread waking
 //   |
+//   \---> <ringsocket_metrics.h>   # Live counters shared through shared memory
+//                            |
+//   /------------------------/
+//   |
 //   \--> <ringsocket_wsframe.h>   # RFC 6455 WebSocket frame protocol interface
 //                           |
 // <ringsocket_app.h> <------/    # Definition of RS_APP() and descendent macros
@@ -189,10 +193,12 @@ extern int _rs_log_max;
 // Unique thread_local logging prefix string with the following format:
 // * During RingSocket startup: unused (i.e., an empty "").
 // * Worker threads: "Worker #%u: " with a %u of (worker_i + 1).
-// * App threads: "App %s: " with %s matching the app conf's JSON "name" keyval.
+// * App threads: "%s: " with %s matching the app conf's JSON "name" keyval,
+//   or "%s#%u: " with %u being the instance number if its "thread_c" > 1.
 extern thread_local char _rs_thread_id_str[];
 #define RS_APP_NAME_MAX_STRLEN 32
-#define RS_THREAD_ID_MAX_STRLEN (RS_APP_NAME_MAX_STRLEN + RS_CONST_STRLEN(": "))
+#define RS_THREAD_ID_MAX_STRLEN (RS_APP_NAME_MAX_STRLEN + \
+    RS_CONST_STRLEN("#256") + RS_CONST_STRLEN(": "))
 
 // Accordingly, the following macro must be invoked in exactly one translation
 // unit, in order to declare the two variables above. In the case of apps, this
@@ -304,3 +310,12 @@ do { \
     /* Don't let the compiler move atomic_load_explicit() to later code */ \
     RS_PREVENT_COMPILER_REORDERING; \
 } while (0)
+
+// The ring buffer pointers of struct rs_ring_atomic are stored with release
+// semantics instead if "ring_ordering" is set to "acquire_release", and are
+// always loaded with acquire semantics: see ringsocket_queue.h.
+#define RS_ATOMIC_STORE_RELEASE(store, val) \
+    atomic_store_explicit((store), (val), memory_order_release)
+
+#define RS_CASTED_ATOMIC_LOAD_ACQUIRE(store, val, cast) \
+    (val) = cast atomic_load_explicit((store), memory_order_acquire)
@@ -14,6 +14,10 @@
 //                         |
 // <ringsocket_queue.h> <--/      # Ring buffer update queuing and thread waking
 //   |
+//   \---> <ringsocket_metrics.h>   # Live counters shared through shared memory
+//                            |
+//   /------------------------/
+//   |
 //   \--> <ringsocket_wsframe.h>   # RFC 6455 WebSocket frame protocol interface
 //                           |
 //   [YOU ARE HERE]          |
@@ -40,6 +44,7 @@ struct rs_app_args {
     struct rs_sleep_state * sleep_state; // This app's sleep state
     struct rs_sleep_state * * worker_sleep_states;
     int const * worker_eventfds;
+    struct rs_metrics_head * metrics_head; // See ringsocket_metrics.h
     size_t app_i;
     int log_max;
 };
@@ -54,15 +59,29 @@ struct rs_app_args {
 enum rs_inbound_kind {
     RS_INBOUND_OPEN = 0, // Implies an imsg->payload of 0 bytes.
     RS_INBOUND_READ = 1, // Implies an imsg->payload of 1 or more bytes.
-    RS_INBOUND_CLOSE = 2 // Implies an imsg->payload of 0 bytes.
+    RS_INBOUND_CLOSE = 2, // Implies an imsg->payload of 0 bytes.
+    // Only sent to apps with endpoints of which the "backpressure_policy" is
+    // "pause": the peer's queue of pending messages hit its limit, as a result
+    // of which messages to it are discarded until that queue is fully drained,
+    // at which point RS_INBOUND_RESUME follows. Both imply 0 payload bytes.
+    RS_INBOUND_PAUSE = 3,
+    RS_INBOUND_RESUME = 4
 };
 
 struct rs_inbound_msg {
+    // The rs_get_spin_time_ns() at which the worker read the (last part of the)
+    // message from its socket if "latency_histograms" is enabled and
+    // inbound_kind is RS_INBOUND_READ, or 0 otherwise (see
+    // ringsocket_metrics.h)
+    uint64_t read_time_ns;
     uint32_t peer_i;
     uint32_t socket_fd;
     uint16_t endpoint_id;
     uint8_t data_kind; // Enum rs_data_kind compressed into a single byte
     uint8_t inbound_kind; // Enum rs_inbound_kind compressed into a single byte
+    // Explicit tail padding: payload must start at sizeof(struct
+    // rs_inbound_msg), where the worker writes it (checked in rs_to_app.c).
+    uint8_t padding[4];
     uint8_t const payload[]; // Size: cons->size - sizeof(struct rs_inbound_msg)
 };
 
@@ -78,9 +97,21 @@ enum rs_outbound_kind { // The outbound message format depends on the enum value
     RS_OUTBOUND_ARRAY = 1, // uint8_t kind, uint32_t peer_c, uint32_t peer_i[]
     RS_OUTBOUND_EVERY = 2, // uint8_t kind
     RS_OUTBOUND_EVERY_EXCEPT_SINGLE = 3, // Same format as RS_OUTBOUND_SINGLE
-    RS_OUTBOUND_EVERY_EXCEPT_ARRAY = 4 // Same format as RS_OUTBOUND_ARRAY
+    RS_OUTBOUND_EVERY_EXCEPT_ARRAY = 4, // Same format as RS_OUTBOUND_ARRAY
+    // uint8_t kind, uint32_t word_c + 1, uint32_t base_peer_i, uint32_t word[]
+    RS_OUTBOUND_BITMAP = 5,
+    RS_OUTBOUND_EVERY_EXCEPT_BITMAP = 6 // Same format as RS_OUTBOUND_BITMAP
 };
 
+// The peer_i[] elements of RS_OUTBOUND_(EVERY_EXCEPT_)ARRAY messages are unique
+// and sorted in ascending order, which allows worker threads to test peers for
+// exclusion through a single merge-style pass.
+//
+// RS_OUTBOUND_(EVERY_EXCEPT_)BITMAP messages are a denser alternative for
+// recipient sets that are clustered closely enough together, where bit b of
+// word[w] represents peer_i == base_peer_i + 32 * w + b (see
+// rs_send_to_recipient_set() in ringsocket_helper.h).
+
 // Following the enum byte and any uint32_t peer_c/peer_i sequence; every
 // outbound message ends with a full WebSocket message that will be sent as-is
 // to every peer_i it's addressed to (see rs_send() in ringsocket_helper.h).
@@ -88,6 +119,32 @@ enum rs_outbound_kind { // The outbound message format depends on the enum value
 // write buffers, because they never have to alter the contents of the messages
 // they relay.
 //
+// The exception to that rule is when the enum byte has the following bit flag
+// set, in which case the WebSocket message is replaced by a single pointer to a
+// struct rs_shared_frame. This allows broadcasting apps to build a (potentially
+// large) frame only once, instead of copying it to every worker's outbound ring
+// separately (see rs_send_shared() in ringsocket_helper.h).
+#define RS_OUTBOUND_SHARED 0x80
+
+// If "latency_histograms" is enabled, every outbound message's enum byte has
+// the following bit flag set too, in which case the enum byte is immediately
+// followed by a uint64_t produce_time_ns at which the app produced the message
+// and a uint64_t read_time_ns copied from the rs_inbound_msg of the callback
+// that produced it (or 0 if none), before any uint32_t peer_c/peer_i sequence.
+#define RS_OUTBOUND_TIMED 0x40
+#define RS_OUTBOUND_TIMING_SIZE 16
+
+// Heap-allocated by the app and free()d by whichever worker thread happens to
+// be the last to finish sending it to all of its recipient peers.
+struct rs_shared_frame {
+    // Initialized to the number of worker threads receiving a reference to this
+    // frame. Each such worker decrements it once it has no further use for it.
+    atomic_uint_least32_t ref_c;
+    uint32_t:32; // Make sure .frame_size and .frame are 64-bit aligned.
+    uint64_t frame_size;
+    uint8_t frame[];
+};
+//
 // For any outbound ring buffer WebSocket message arriving from an app, worker
 // threads determine whether to keep or shut down the peer(s) it's addressed to
 // simply by checking whether its WebSocket opcode is a RS_WS_OPC_FIN_CLOSE
@@ -121,7 +178,8 @@ enum rs_callback {
     RS_CB_OPEN  = 0x02,
     RS_CB_READ  = 0x04,
     RS_CB_CLOSE = 0x08,
-    RS_CB_TIMER = 0x10
+    RS_CB_TIMER = 0x10,
+    RS_CB_PAUSE = 0x20
 };
 
 struct rs_app_cb_args { // AKA rs_t (typedef located in ringsocket_api.h)
@@ -132,15 +190,28 @@ struct rs_app_cb_args { // AKA rs_t (typedef located in ringsocket_api.h)
     struct rs_ring_queue * ring_queue;
     struct rs_sleep_state * worker_sleep_states;
     int const * worker_eventfds;
+    // This app's counters, and its worker_c length array of ring pair counters
+    // (see ringsocket_metrics.h)
+    struct rs_app_metrics * metrics;
+    struct rs_ring_pair_metrics * * ring_metrics;
+    struct rs_app_latency * latency; // NULL unless "latency_histograms" is set
+    // NULL unless set with rs_set_pause_cb() (see ringsocket.h)
+    int (* pause_cb)(rs_t *, bool);
+    uint64_t inbound_read_time_ns; // See RS_OUTBOUND_TIMED
     uint8_t * wbuf;
     size_t wbuf_size;
     size_t wbuf_i;
+    // Set by rs_reserve_...() until the next rs_commit() (see ringsocket.h)
+    uint8_t * reserved_payload;
+    uint64_t reserved_payload_size;
+    size_t reserved_worker_i;
     uint32_t inbound_peer_i;
     int inbound_socket_fd;
     unsigned cb; // unsigned version of enum rs_callback
     enum rs_data_kind read_data_kind;
     uint16_t inbound_endpoint_id;
     uint16_t inbound_worker_i;
+    uint16_t app_i; // Index of this app (instance) in conf->apps
 };
 
 struct rs_app_schedule {
@@ -149,6 +220,8 @@ struct rs_app_schedule {
     int (* timer_cb)(rs_t *);
     uint64_t timestamp_microsec;
     uint64_t interval_microsec;
+    uint64_t dequeue_time_ns; // Of the inbound message being handled, if timed
+    struct rs_spin spin; // See ringsocket_queue.h
     bool disable_sleep_timeout;
 };
 
@@ -170,8 +243,15 @@ rs_ret ringsocket_app( \
 ) { \
     /* Update RS_LOG_VARS below to match the values obtained in rs_conf.c */ \
     _rs_log_max = app_args->log_max; \
-    sprintf(_rs_thread_id_str, "%s: ", \
-        app_args->conf->apps[app_args->app_i].name); \
+    struct rs_conf_app const * conf_app = \
+        app_args->conf->apps + app_args->app_i; \
+    if (conf_app->instance_c > 1) { \
+        snprintf(_rs_thread_id_str, RS_THREAD_ID_MAX_STRLEN + 1, "%s#%u: ", \
+            conf_app->name, conf_app->instance_i + 1); \
+    } else { \
+        snprintf(_rs_thread_id_str, RS_THREAD_ID_MAX_STRLEN + 1, "%s: ", \
+            conf_app->name); \
+    } \
     \
     struct rs_app_cb_args rs = { \
         .cb = RS_CB_INIT, \
@@ -190,6 +270,8 @@ rs_ret ringsocket_app( \
         .sleep_state = app_args->sleep_state \
     }; \
     RS_GUARD_APP(rs_get_consumers_from_producers(&rs, &sched)); \
+    rs_init_spin(&sched.spin, conf_app->busy_poll_microsec, \
+        app_args->conf->busy_poll_hint); /* See ringsocket_queue.h */ \
     \
     /* See rs_init_app_cb_args() for why this assignment must occur here */ \
     rs.worker_sleep_states = *app_args->worker_sleep_states; \
@@ -210,6 +292,14 @@ rs_ret ringsocket_app( \
             continue; \
         case RS_INBOUND_READ: \
             break; \
+        case RS_INBOUND_PAUSE: case RS_INBOUND_RESUME: \
+            RS_ENQUEUE_APP_READ_UPDATE; \
+            if (rs.pause_cb) { \
+                rs.cb = RS_CB_PAUSE; \
+                RS_GUARD_APP(rs_guard_peer_cb(&rs, rs.pause_cb(&rs, \
+                    imsg->inbound_kind == RS_INBOUND_PAUSE))); \
+            } \
+            continue; \
         case RS_INBOUND_CLOSE: default: \
             RS_ENQUEUE_APP_READ_UPDATE; \
             call_close_cb: \
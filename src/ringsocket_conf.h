@@ -15,6 +15,10 @@
 //                         |
 // <ringsocket_queue.h> <--/      # Ring buffer update queuing and thread waking
 //   |
+//   \---> <ringsocket_metrics.h>   # Live counters shared through shared memory
+//                            |
+//   /------------------------/
+//   |
 //   \--> <ringsocket_wsframe.h>   # RFC 6455 WebSocket frame protocol interface
 //                           |
 // <ringsocket_app.h> <------/    # Definition of RS_APP() and descendent macros
@@ -46,6 +50,9 @@ struct rs_conf {
     struct rs_conf_port * ports;
     struct rs_conf_cert * certs;
     struct rs_conf_app * apps;
+    struct rs_route_index * route_index; // See rs_route.c
+    struct rs_conf_pin * worker_pins; // worker_c length array or NULL if unset
+    char * metrics_path; // NULL if unset (see ringsocket_metrics.h)
     size_t inbound_ring_buf_size;
     size_t outbound_ring_buf_size;
     size_t worker_rbuf_size;
@@ -54,17 +61,58 @@ struct rs_conf {
     double realloc_multiplier;
     uint32_t fd_alloc_c;
     uint32_t owrefs_elem_c;
+    uint32_t tls_ticket_key_lifetime; // in seconds
+    uint32_t tls_session_cache_size; // 0 if disabled
+    uint32_t busy_poll_microsec; // 0 if disabled (see ringsocket_queue.h)
     uint16_t epoll_buf_elem_c;
     uint16_t port_c;
     uint16_t cert_c;
     uint16_t app_c;
     uint16_t worker_c;
+    uint16_t ring_shrink_wait; // in seconds
     uint8_t update_queue_size;
     uint8_t hostname_max_strlen;
     uint8_t url_max_strlen;
     uint8_t allowed_origin_max_strlen;
     uint8_t shutdown_wait_http; // in seconds
     uint8_t shutdown_wait_ws; // in seconds
+    uint8_t tls_session_tickets; // boolean
+    uint8_t event_loop; // enum rs_event_loop
+    uint8_t busy_poll_hint; // enum rs_spin_hint
+    uint8_t ring_ordering; // enum rs_ring_ordering
+    uint8_t latency_histograms; // boolean (see ringsocket_metrics.h)
+};
+
+enum rs_event_loop {
+    RS_EVENT_LOOP_EPOLL = 0,
+    RS_EVENT_LOOP_IO_URING = 1
+};
+
+// How ring buffer pointer updates are published: see ringsocket_queue.h
+enum rs_ring_ordering {
+    RS_RING_ORDERING_DELAYED = 0, // Relaxed stores delayed by an update queue
+    RS_RING_ORDERING_ACQUIRE_RELEASE = 1 // Immediate release stores
+};
+
+// The instruction or syscall with which busy polling threads pause in between
+// polls: see ringsocket_queue.h
+enum rs_spin_hint {
+    RS_SPIN_HINT_PAUSE = 0, // PAUSE on x86 (YIELD on ARM): the default
+    RS_SPIN_HINT_TPAUSE = 1, // x86 WAITPKG TPAUSE into the C0.1 power state
+    RS_SPIN_HINT_SCHED_YIELD = 2 // Leave the CPU to any other runnable thread
+};
+
+// The CPU or NUMA node that a worker or app thread is pinned to: see
+// rs_affinity.c
+struct rs_conf_pin {
+    uint16_t i; // The number of the CPU or NUMA node (depending on kind)
+    uint8_t kind; // enum rs_pin_kind
+};
+
+enum rs_pin_kind {
+    RS_PIN_NONE = 0,
+    RS_PIN_CPU = 1,
+    RS_PIN_NUMA_NODE = 2
 };
 
 struct rs_conf_port {
@@ -101,21 +149,61 @@ struct rs_conf_app {
     char * name;
     char * app_path;
     struct rs_conf_endpoint * endpoints;
+    struct rs_conf_pin pin;
     uint32_t endpoint_c;
     uint32_t wbuf_size;
+    uint32_t busy_poll_microsec; // 0 if disabled (see ringsocket_queue.h)
     uint16_t wants_open_notification; // boolean
     uint16_t wants_close_notification; // boolean
+    // The "thread_c" number of instances of this app, and the index of this
+    // one among them: see expand_app_instances() in rs_conf.c
+    uint16_t instance_c;
+    uint16_t instance_i;
+    uint8_t shard_by; // enum rs_shard_by
     uint8_t update_queue_size;
+    // The lowest server_max_window_bits of all permessage_deflate endpoints
+    uint8_t deflate_window_bits;
+};
+
+// How worker threads choose which instance of an app to assign a peer to.
+enum rs_shard_by {
+    RS_SHARD_BY_CLIENT_ID = 0, // A hash of the client ID of the peer
+    RS_SHARD_BY_ENDPOINT_ID = 1 // The endpoint_id modulo the instance count
 };
 
 struct rs_conf_endpoint {
     char * hostname;
     char * url;
     char * * allowed_origins;
+    // Slow consumer limits on the messages pending to be written to any single
+    // peer, beyond which backpressure_policy applies: see rs_from_app.c
+    size_t max_queued_byte_c;
+    uint16_t max_queued_msg_c;
+    uint16_t backpressure_close_code; // Sent if RS_BACKPRESSURE_DISCONNECT
+    uint8_t backpressure_policy; // enum rs_backpressure_policy
+    uint8_t:8;
     uint16_t allowed_origin_c;
     uint16_t endpoint_id;
     uint16_t port_number;
     uint16_t is_encrypted; // boolean
+    // permessage-deflate (RFC 7692) extension settings: see rs_deflate.c
+    uint8_t permessage_deflate; // boolean
+    uint8_t client_no_context_takeover; // boolean
+    uint8_t client_max_window_bits;
+    uint8_t server_max_window_bits;
+};
+
+// What to do with a message from an app that would make the queue of pending
+// messages of a peer exceed its endpoint's max_queued_[msg|byte]_c.
+enum rs_backpressure_policy {
+    // Close the connection with backpressure_close_code: the default
+    RS_BACKPRESSURE_DISCONNECT = 0,
+    RS_BACKPRESSURE_DROP_NEWEST = 1, // Discard the message
+    RS_BACKPRESSURE_DROP_OLDEST = 2, // Discard pending messages to make room
+    // Discard the message and any further messages until the queue has been
+    // fully drained, notifying the app of both transitions (see
+    // RS_INBOUND_PAUSE in ringsocket_app.h)
+    RS_BACKPRESSURE_PAUSE = 3
 };
 
 // #############################################################################
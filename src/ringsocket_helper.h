@@ -16,6 +16,10 @@
 //                         |
 // <ringsocket_queue.h> <--/      # Ring buffer update queuing and thread waking
 //   |
+//   \---> <ringsocket_metrics.h>   # Live counters shared through shared memory
+//                            |
+//   /------------------------/
+//   |
 //   \--> <ringsocket_wsframe.h>   # RFC 6455 WebSocket frame protocol interface
 //                           |
 // <ringsocket_app.h> <------/    # Definition of RS_APP() and descendent macros
@@ -43,18 +47,30 @@ static inline void rs_guard_cb(
     unsigned allowed_cb_mask
 ) {
     if (!(cb & allowed_cb_mask)) {
-        RS_LOG(LOG_ERR, "%s must not be called from an RS_%s() callback "
-            "function: shutting down...", function_str,
-            (char *[]){/* 0*/"",
-                /* 1*/"INIT", /* 2*/"OPEN", /* 3*/"", /* 4*/"READ...",
-                /* 5*/"",     /* 6*/"",     /* 7*/"", /* 8*/"CLOSE",
-                /* 9*/"",     /*10*/"",     /*11*/"", /*12*/"",
-                /*13*/"",     /*14*/"",     /*15*/"", /*16*/"TIMER..."
-            }[RS_MIN(16, cb)]);
+        // Index the callback names by the position of the (only) bit set
+        RS_LOG(LOG_ERR, "%s must not be called from an %s callback function: "
+            "shutting down...", function_str, (char *[]){
+                "RS_INIT()", "RS_OPEN()", "RS_READ...()", "RS_CLOSE()",
+                "RS_TIMER...()", "rs_set_pause_cb()"
+            }[__builtin_ctz(cb)]);
         RS_APP_FATAL;
     }
 }
 
+// Reservations made with rs_reserve_...() must be rs_commit()ed before anything
+// else is written to an outbound ring, and before the callback returns.
+static inline rs_ret rs_guard_reservation(
+    rs_t const * rs,
+    char const * action_str
+) {
+    if (rs->reserved_payload) {
+        RS_LOG(LOG_ERR, "%s while an rs_reserve_...() reservation has not been "
+            "rs_commit()ed yet: shutting down...", action_str);
+        return RS_FATAL;
+    }
+    return RS_OK;
+}
+
 static inline rs_ret rs_check_app_wsize(
     rs_t * rs,
     size_t incr_size
@@ -69,16 +85,97 @@ static inline rs_ret rs_check_app_wsize(
     return RS_OK;
 }
 
+// Write the head of a frame with a payload of payload_size bytes, returning the
+// size of that head.
+static inline uint64_t rs_set_outbound_frame_head(
+    union rs_wsframe * frame,
+    enum rs_data_kind data_kind,
+    uint64_t payload_size
+) {
+    rs_clear_wsframe_bit_fields(frame);
+    rs_set_wsframe_is_final(frame, true);
+    rs_set_wsframe_opcode(frame, data_kind == RS_UTF8 ?
+        RS_WSFRAME_OPC_TEXT : RS_WSFRAME_OPC_BIN);
+    return rs_set_wsframe_sc_payload_size(frame, payload_size);
+}
+
+static inline uint64_t rs_set_outbound_frame(
+    union rs_wsframe * frame,
+    enum rs_data_kind data_kind,
+    void const * payload,
+    uint64_t payload_size
+) {
+    uint64_t head_size =
+        rs_set_outbound_frame_head(frame, data_kind, payload_size);
+    memcpy((uint8_t *) frame + head_size, payload, payload_size);
+    return head_size + payload_size;
+}
+
+// If "latency_histograms" is enabled, set the RS_OUTBOUND_TIMED flag of the
+// outbound message enum byte at w, and write the timestamps following it.
+// Returns the number of bytes written after the enum byte.
+static inline size_t rs_set_outbound_timing(
+    rs_t * rs,
+    uint8_t * w
+) {
+    if (!rs->latency) {
+        return 0;
+    }
+    *w |= RS_OUTBOUND_TIMED;
+    uint64_t const produce_time_ns = rs_get_spin_time_ns();
+    memcpy(w + 1, &produce_time_ns, 8);
+    memcpy(w + 9, &rs->inbound_read_time_ns, 8);
+    return RS_OUTBOUND_TIMING_SIZE;
+}
+
+// Broadcasting a payload smaller than this to every worker is cheaper through
+// plain per-worker copying than through the heap allocation and atomic
+// reference counting incurred by a struct rs_shared_frame.
+#define RS_SHARED_FRAME_MIN_PAYLOAD_SIZE 0x400 // 1 KB
+
+// Return a struct rs_shared_frame containing the frame to be broadcast to every
+// one of the worker_c worker threads, or NULL if the payload in rs->wbuf is
+// small enough for plain copying to each outbound ring to be preferable.
+static inline rs_ret rs_get_shared_frame(
+    rs_t * rs,
+    enum rs_data_kind data_kind,
+    struct rs_shared_frame * * shared
+) {
+    *shared = NULL;
+    if (rs->conf->worker_c < 2 ||
+        rs->wbuf_i < RS_SHARED_FRAME_MIN_PAYLOAD_SIZE ||
+        rs->wbuf_i > rs->conf->max_ws_msg_size) {
+        // Leave reporting of any excessive wbuf_i to rs_send().
+        return RS_OK;
+    }
+    uint8_t * bytes = NULL;
+    RS_CALLOC(bytes, sizeof(struct rs_shared_frame) +
+        rs_get_wsframe_sc_size_from_payload_size(rs->wbuf_i));
+    *shared = (struct rs_shared_frame *) bytes;
+    atomic_init(&(*shared)->ref_c, rs->conf->worker_c);
+    (*shared)->frame_size = rs_set_outbound_frame(
+        (union rs_wsframe *) (*shared)->frame, data_kind, rs->wbuf, rs->wbuf_i);
+    // Similar to the ring buffer contents themselves, the frame written above
+    // will have become visible to worker threads by the time they receive the
+    // pointer to it, courtesy of the delay imposed by rs_enqueue_ring_update().
+    return RS_OK;
+}
+
+// If shared is not NULL, only a pointer to it is placed on the outbound ring
+// of worker_i, instead of a full copy of the frame built from rs->wbuf.
 static inline void rs_send(
     rs_t * rs,
     size_t worker_i,
     enum rs_outbound_kind outbound_kind,
     uint32_t const * recipients,
     uint32_t recipient_c,
-    enum rs_data_kind data_kind
+    enum rs_data_kind data_kind,
+    struct rs_shared_frame * shared
 ) {
     rs_guard_cb(__func__, rs->cb,
-        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER);
+        RS_CB_OPEN | RS_CB_READ | RS_CB_CLOSE | RS_CB_TIMER | RS_CB_PAUSE);
+
+    RS_GUARD_APP(rs_guard_reservation(rs, "Attempt to send a message"));
 
     if (rs->wbuf_i > rs->conf->max_ws_msg_size) {
         RS_LOG(LOG_ERR, "Payload of size %zu exceeds the configured "
@@ -89,15 +186,19 @@ static inline void rs_send(
 
     size_t msg_size =
         1 + // uint8_t outbound_kind
+        RS_OUTBOUND_TIMING_SIZE * !!rs->latency + // See RS_OUTBOUND_TIMED
         4 * (recipient_c > 1) + // if (recipient_c > 1): uint32_t recipient_c
         4 * recipient_c + // uint32_t array of recipients (peer_i elements)
-        rs_get_wsframe_sc_size_from_payload_size(rs->wbuf_i);
+        (shared ? sizeof(shared) :
+        rs_get_wsframe_sc_size_from_payload_size(rs->wbuf_i));
 
     struct rs_ring_producer * prod = rs->outbound_producers + worker_i;
     RS_GUARD_APP(rs_produce_ring_msg(&rs->ring_pairs[worker_i]->outbound_ring,
-        prod, rs->conf->realloc_multiplier, msg_size));
+        prod, rs->conf->realloc_multiplier, rs->conf->ring_shrink_wait,
+        msg_size));
 
-    *prod->w++ = (uint8_t) outbound_kind;
+    *prod->w = (uint8_t) outbound_kind | (shared ? RS_OUTBOUND_SHARED : 0);
+    prod->w += 1 + rs_set_outbound_timing(rs, prod->w);
     if (recipient_c) {
         if (recipient_c > 1) {
             *((uint32_t *) prod->w) = recipient_c;
@@ -108,14 +209,177 @@ static inline void rs_send(
             prod->w += 4;
         } while (--recipient_c);
     }
-    union rs_wsframe * frame = (union rs_wsframe *) prod->w;
-    rs_clear_wsframe_bit_fields(frame);
-    rs_set_wsframe_is_final(frame, true);
-    rs_set_wsframe_opcode(frame, data_kind == RS_UTF8 ?
-        RS_WSFRAME_OPC_TEXT : RS_WSFRAME_OPC_BIN);
-    prod->w += rs_set_wsframe_sc_payload_and_get_frame_size(frame, rs->wbuf,
-        rs->wbuf_i);
+    if (shared) {
+        *((struct rs_shared_frame * *) prod->w) = shared;
+        prod->w += sizeof(shared);
+    } else {
+        prod->w += rs_set_outbound_frame((union rs_wsframe *) prod->w,
+            data_kind, rs->wbuf, rs->wbuf_i);
+    }
 
+    rs_count_produced_ring_msg(&rs->ring_metrics[worker_i]->outbound_ring,
+        prod, msg_size);
+    RS_GUARD_APP(rs_enqueue_ring_update(rs->ring_queue, rs->ring_pairs,
+        rs->worker_sleep_states, rs->worker_eventfds, prod->w, worker_i, true));
+}
+
+static inline int rs_compare_recipient_keys(
+    void const * a,
+    void const * b
+) {
+    uint64_t key_a = *((uint64_t const *) a);
+    uint64_t key_b = *((uint64_t const *) b);
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+// Convert client_ids into (worker_i << 32 | peer_i) keys sorted in ascending
+// order, such that the recipients of each worker form a contiguous range of
+// ascending peer_i values. Any duplicates are omitted: returns the number of
+// unique keys.
+static inline size_t rs_get_recipient_keys(
+    uint64_t const * client_ids,
+    size_t client_c,
+    uint64_t * keys
+) {
+    for (size_t i = 0; i < client_c; i++) {
+        uint32_t const * u32 = (uint32_t const *) (client_ids + i);
+        keys[i] = (uint64_t) (u32[0] - 1) << 32 | u32[1];
+    }
+    qsort(keys, client_c, sizeof(uint64_t), rs_compare_recipient_keys);
+    size_t key_c = 0;
+    for (size_t i = 0; i < client_c; i++) {
+        if (key_c && keys[key_c - 1] == keys[i]) {
+            RS_LOG(LOG_WARNING, "Ignoring duplicate client_id with worker "
+                "index %" PRIu32 " and peer index %" PRIu32 ": please fix your "
+                "app code!", (uint32_t) (keys[i] >> 32), (uint32_t) keys[i]);
+            continue;
+        }
+        keys[key_c++] = keys[i];
+    }
+    return key_c;
+}
+
+// Send to (or if is_exclusion is true: send to every peer except) the
+// peer_c peer_i values of sorted unique array peer_is belonging to worker_i;
+// encoded either as-is or as a bitmap, depending on which is more compact.
+static inline void rs_send_to_recipient_set(
+    rs_t * rs,
+    size_t worker_i,
+    bool is_exclusion,
+    uint32_t const * peer_is,
+    size_t peer_c,
+    enum rs_data_kind data_kind,
+    struct rs_shared_frame * shared
+) {
+    switch (peer_c) {
+    case 0:
+        if (is_exclusion) {
+            rs_send(rs, worker_i, RS_OUTBOUND_EVERY, NULL, 0, data_kind,
+                shared);
+        }
+        return;
+    case 1:
+        rs_send(rs, worker_i, is_exclusion ? RS_OUTBOUND_EVERY_EXCEPT_SINGLE :
+            RS_OUTBOUND_SINGLE, peer_is, 1, data_kind, shared);
+        return;
+    default:
+        break;
+    }
+    uint32_t base_peer_i = *peer_is & ~UINT32_C(0x1F);
+    size_t word_c = (peer_is[peer_c - 1] - base_peer_i) / 32 + 1;
+    if (word_c + 1 >= peer_c) {
+        rs_send(rs, worker_i, is_exclusion ? RS_OUTBOUND_EVERY_EXCEPT_ARRAY :
+            RS_OUTBOUND_ARRAY, peer_is, peer_c, data_kind, shared);
+        return;
+    }
+    // The bitmap is smaller than the array it encodes, so it fits in a VLA
+    // no larger than that.
+    uint32_t bitmap[word_c + 1];
+    memset(bitmap, 0, sizeof(bitmap));
+    bitmap[0] = base_peer_i;
+    for (size_t i = 0; i < peer_c; i++) {
+        uint32_t bit_i = peer_is[i] - base_peer_i;
+        bitmap[1 + bit_i / 32] |= UINT32_C(1) << bit_i % 32;
+    }
+    rs_send(rs, worker_i, is_exclusion ? RS_OUTBOUND_EVERY_EXCEPT_BITMAP :
+        RS_OUTBOUND_BITMAP, bitmap, word_c + 1, data_kind, shared);
+}
+
+// Reserve room for a single-recipient message with a payload of up to
+// max_payload_size bytes directly on the outbound ring of worker_i, and return
+// a pointer to where its payload should be written. The frame head preceding
+// it is sized for max_payload_size, and only filled in by rs_commit_reserved().
+static inline void * rs_reserve_outbound_payload(
+    rs_t * rs,
+    size_t worker_i,
+    uint32_t peer_i,
+    uint64_t max_payload_size
+) {
+    RS_GUARD_APP(rs_guard_reservation(rs, "Attempt to rs_reserve_...()"));
+    if (max_payload_size > rs->conf->max_ws_msg_size) {
+        RS_LOG(LOG_ERR, "Reserved payload size %" PRIu64 " exceeds the "
+            "configured max_ws_msg_size %zu. Shutting down to avert further "
+            "trouble...", max_payload_size, rs->conf->max_ws_msg_size);
+        RS_APP_FATAL;
+    }
+    struct rs_ring_producer * prod = rs->outbound_producers + worker_i;
+    RS_GUARD_APP(rs_produce_ring_msg(&rs->ring_pairs[worker_i]->outbound_ring,
+        prod, rs->conf->realloc_multiplier, rs->conf->ring_shrink_wait,
+        1 + RS_OUTBOUND_TIMING_SIZE * !!rs->latency + 4 +
+        rs_get_wsframe_sc_size_from_payload_size(max_payload_size)));
+    // Leave prod->w at the start of the message until rs_commit_reserved(),
+    // which also leaves any RS_OUTBOUND_TIMED timestamps to be written then.
+    uint8_t * peer_i_dst =
+        prod->w + 1 + RS_OUTBOUND_TIMING_SIZE * !!rs->latency;
+    *prod->w = RS_OUTBOUND_SINGLE;
+    memcpy(peer_i_dst, &peer_i, 4);
+    rs->reserved_payload = peer_i_dst + 4 +
+        rs_get_wsframe_sc_size_from_payload_size(max_payload_size) -
+        max_payload_size;
+    rs->reserved_payload_size = max_payload_size;
+    rs->reserved_worker_i = worker_i;
+    return rs->reserved_payload;
+}
+
+static inline void rs_commit_reserved(
+    rs_t * rs,
+    enum rs_data_kind data_kind,
+    uint64_t payload_size
+) {
+    if (!rs->reserved_payload) {
+        RS_LOG(LOG_ERR, "Attempt to rs_commit() without a preceding "
+            "rs_reserve_...() call: shutting down...");
+        RS_APP_FATAL;
+    }
+    if (payload_size > rs->reserved_payload_size) {
+        RS_LOG(LOG_ERR, "Committed payload size %" PRIu64 " exceeds the "
+            "reserved payload size %" PRIu64 ": shutting down...",
+            payload_size, rs->reserved_payload_size);
+        RS_APP_FATAL;
+    }
+    size_t worker_i = rs->reserved_worker_i;
+    struct rs_ring_producer * prod = rs->outbound_producers + worker_i;
+    size_t const timing_size = rs_set_outbound_timing(rs, prod->w);
+    union rs_wsframe * frame =
+        (union rs_wsframe *) (prod->w + 1 + timing_size + 4);
+    uint64_t head_size =
+        rs_set_outbound_frame_head(frame, data_kind, payload_size);
+    if ((uint8_t *) frame + head_size != rs->reserved_payload) {
+        // RFC 6455 requires payload sizes to be encoded in the minimal number
+        // of bytes, so a payload considerably smaller than reserved for may
+        // need a smaller frame head, in which case it must be moved left.
+        memmove((uint8_t *) frame + head_size, rs->reserved_payload,
+            payload_size);
+    }
+    uint64_t msg_size = 1 + timing_size + 4 + head_size + payload_size;
+    // Overwrite the msg_size written by rs_produce_ring_msg() for the reserved
+    // size, to let the consumer know the size of the message as committed.
+    *((uint64_t *) prod->w - 1) = msg_size;
+    prod->w += msg_size;
+    rs->reserved_payload = NULL;
+    rs->reserved_payload_size = 0;
+    rs_count_produced_ring_msg(&rs->ring_metrics[worker_i]->outbound_ring,
+        prod, msg_size);
     RS_GUARD_APP(rs_enqueue_ring_update(rs->ring_queue, rs->ring_pairs,
         rs->worker_sleep_states, rs->worker_eventfds, prod->w, worker_i, true));
 }
@@ -130,6 +394,7 @@ static inline rs_ret rs_init_outbound_producers(
     for (size_t i = 0; i < rs->conf->worker_c; i++) {
         struct rs_ring_producer * prod = rs->outbound_producers + i;
         prod->ring_size = rs->conf->outbound_ring_buf_size;
+        prod->min_ring_size = prod->ring_size;
         RS_CACHE_ALIGNED_CALLOC(prod->ring, prod->ring_size);
         prod->w = prod->ring;
         RS_ATOMIC_STORE_RELAXED(&rs->ring_pairs[i]->outbound_ring.w,
@@ -149,6 +414,7 @@ static inline rs_ret rs_init_app_cb_args(
     struct rs_conf const * conf = app_args->conf;
     struct rs_conf_app const * conf_app = conf->apps + app_args->app_i;
     rs->conf = conf;
+    rs->app_i = app_args->app_i;
 
     // Allocate all ring buffer pairs between this app and each worker
     RS_CACHE_ALIGNED_CALLOC(*app_args->ring_pairs, conf->worker_c);
@@ -176,14 +442,23 @@ static inline rs_ret rs_init_app_cb_args(
     
     rs->worker_eventfds = app_args->worker_eventfds;
 
+    // This app's ring pair counters are spread out over those of each worker:
+    // see ringsocket_metrics.h.
+    rs->metrics = rs_get_app_metrics(app_args->metrics_head, app_args->app_i);
+    RS_CALLOC(rs->ring_metrics, conf->worker_c);
+    for (size_t i = 0; i < conf->worker_c; i++) {
+        rs->ring_metrics[i] = rs_get_ring_pair_metrics(app_args->metrics_head,
+            i, app_args->app_i);
+    }
+    rs->latency = rs_get_app_latency(app_args->metrics_head, app_args->app_i);
+
     // Don't allocate rs->wbuf yet, but do so instead during the 1st rs_w_...()
     // call, if any. This saves memory for apps that never call rs_w_...()
     // functions, and instead write/send everything "in one go" with rs_w_to_...
     rs->wbuf_size = conf_app->wbuf_size;
     
-    rs->ring_queue->size = conf_app->update_queue_size;
-    RS_CALLOC(rs->ring_queue->updates, conf_app->update_queue_size);
-    return RS_OK;
+    return rs_init_ring_queue(rs->ring_queue, conf_app->update_queue_size,
+        conf->worker_c, conf->ring_ordering);
 }
 
 static inline rs_ret rs_get_consumers_from_producers(
@@ -280,7 +555,20 @@ static inline rs_wait_for_inbound_msg(
     struct rs_inbound_msg * * imsg,
     size_t * payload_size
 ) {
+    // Wake up any workers to which ring updates were published while handling
+    // the previous message (see rs_wake_up_pending() in ringsocket_queue.h).
+    RS_GUARD(rs_wake_up_pending(rs->ring_queue, rs->worker_sleep_states,
+        rs->worker_eventfds));
+    rs_publish_thread_metrics(&rs->metrics->thread, rs->ring_queue,
+        &sched->spin);
+    if (sched->dequeue_time_ns) {
+        // The callback of the previous message has returned.
+        rs_record_latency(&rs->latency->callback, sched->dequeue_time_ns,
+            rs_get_spin_time_ns());
+        sched->dequeue_time_ns = 0;
+    }
     bool disable_sleep_timeout_once = false;
+    bool is_spinning = false;
     size_t idle_c = 0;
     for (;;rs->inbound_worker_i++, rs->inbound_worker_i %= rs->conf->worker_c) {
         struct rs_ring_atomic * inbound_ring =
@@ -289,8 +577,21 @@ static inline rs_wait_for_inbound_msg(
             sched->inbound_consumers + rs->inbound_worker_i;
         struct rs_consumer_msg * cmsg = rs_consume_ring_msg(inbound_ring, cons);
         if (cmsg) {
+            rs_end_idle(&sched->spin);
             *imsg = (struct rs_inbound_msg *) cmsg->msg;
             *payload_size = cmsg->size - sizeof(**imsg);
+            rs_count_consumed_ring_msg(
+                &rs->ring_metrics[rs->inbound_worker_i]->inbound_ring, cmsg);
+            RS_METRICS_ADD(
+                rs->metrics->inbound_c_by_kind[(*imsg)->inbound_kind], 1);
+            if (rs->latency) {
+                sched->dequeue_time_ns = rs_get_spin_time_ns();
+                rs->inbound_read_time_ns = (*imsg)->read_time_ns;
+                if (rs->inbound_read_time_ns) {
+                    rs_record_latency(&rs->latency->inbound,
+                        rs->inbound_read_time_ns, sched->dequeue_time_ns);
+                }
+            }
             return RS_OK;
         }
         if (++idle_c == 2 * RS_MAX(4, rs->conf->worker_c)) {
@@ -330,10 +631,30 @@ static inline rs_wait_for_inbound_msg(
         if (idle_c < 4 * RS_MAX(4, rs->conf->worker_c)) {
             continue;
         }
+        if (rs_keep_spinning(&sched->spin)) {
+            // Busy poll: withdraw the sleep announcement made above for the
+            // duration of the spin to spare workers any FUTEX_WAKE syscalls,
+            // and poll every inbound ring once more before checking back here.
+            if (!is_spinning) {
+                is_spinning = true;
+                RS_ATOMIC_STORE_RELAXED(&sched->sleep_state->is_asleep, false);
+            }
+            idle_c = 3 * RS_MAX(4, rs->conf->worker_c);
+            continue;
+        }
+        if (is_spinning) {
+            // The spin is over: announce sleep again, with all the same
+            // precautions as above, before actually going to sleep.
+            is_spinning = false;
+            idle_c = 2 * RS_MAX(4, rs->conf->worker_c) - 1;
+            continue;
+        }
         idle_c = 0;
         if (disable_sleep_timeout_once || !sched->timer_cb) {
             RS_LOG(LOG_DEBUG, "Going to sleep without setting a timeout...");
+            rs_begin_sleep(&sched->spin);
             RS_GUARD(rs_wait_for_worker(sched->sleep_state, RS_TIME_INFINITE));
+            rs_end_sleep(&sched->spin);
             RS_ATOMIC_STORE_RELAXED(&sched->sleep_state->is_asleep, false);
             RS_LOG(LOG_DEBUG, "Awoken by a worker thread.");
             disable_sleep_timeout_once = false;
@@ -343,9 +664,12 @@ static inline rs_wait_for_inbound_msg(
         RS_GUARD(rs_get_cur_time_microsec(&timestamp_microsec));
         if (timestamp_microsec <
             sched->timestamp_microsec + sched->interval_microsec) {
-            switch (rs_wait_for_worker(sched->sleep_state,
+            rs_begin_sleep(&sched->spin);
+            rs_ret const sleep_ret = rs_wait_for_worker(sched->sleep_state,
                 sched->timestamp_microsec + sched->interval_microsec -
-                timestamp_microsec)) {
+                timestamp_microsec);
+            rs_end_sleep(&sched->spin);
+            switch (sleep_ret) {
             case RS_OK: // A worker thread already woke this thread up.
                 RS_LOG(LOG_DEBUG, "Awoken by a worker thread.");
                 RS_ATOMIC_STORE_RELAXED(&sched->sleep_state->is_asleep, false);
@@ -363,8 +687,12 @@ static inline rs_wait_for_inbound_msg(
             sched->timestamp_microsec = timestamp_microsec;
         }
         RS_ATOMIC_STORE_RELAXED(&sched->sleep_state->is_asleep, false);
+        rs_end_idle(&sched->spin);
         rs->cb = RS_CB_TIMER;
+        rs->inbound_read_time_ns = 0; // Timer callbacks have no inbound message
+        RS_METRICS_ADD(rs->metrics->timer_c, 1);
         rs_ret timer_ret = sched->timer_cb(rs);
+        RS_GUARD(rs_guard_reservation(rs, "Timer callback returned"));
         switch (timer_ret) {
         case -1:
             RS_LOG(LOG_WARNING,
@@ -397,12 +725,17 @@ static inline rs_ret rs_close_peer(
     rs_t * rs,
     uint16_t ws_close_code
 ) {
+    // The close frame must not end up behind a message that is still being
+    // written on the same outbound ring.
+    RS_GUARD(rs_guard_reservation(rs, "Attempt to close a WebSocket client"));
     struct rs_ring_producer * prod =
         rs->outbound_producers + rs->inbound_worker_i;
+    uint64_t const msg_size = 9 + RS_OUTBOUND_TIMING_SIZE * !!rs->latency;
     RS_GUARD(rs_produce_ring_msg(
         &rs->ring_pairs[rs->inbound_worker_i]->outbound_ring, prod,
-        rs->conf->realloc_multiplier, 9));
-    *prod->w++ = RS_OUTBOUND_SINGLE;
+        rs->conf->realloc_multiplier, rs->conf->ring_shrink_wait, msg_size));
+    *prod->w = RS_OUTBOUND_SINGLE;
+    prod->w += 1 + rs_set_outbound_timing(rs, prod->w);
     *((uint32_t *) prod->w) = rs->inbound_peer_i;
     prod->w += 4;
 
@@ -415,6 +748,9 @@ static inline rs_ret rs_close_peer(
     RS_W_HTON16(&net_bytes, ws_close_code);
     prod->w += rs_set_wsframe_sc_payload_and_get_frame_size(frame,
         &net_bytes, sizeof(net_bytes));
+    rs_count_produced_ring_msg(
+        &rs->ring_metrics[rs->inbound_worker_i]->outbound_ring, prod,
+        msg_size);
  
     RS_GUARD(rs_enqueue_ring_update(rs->ring_queue, rs->ring_pairs,
         rs->worker_sleep_states, rs->worker_eventfds, prod->w,
@@ -449,7 +785,7 @@ static inline rs_ret rs_guard_peer_cb(
             "Shutting down: read/open callback returned -1 (fatal error).");
         return RS_FATAL;
     case 0:
-        return RS_OK;
+        return rs_guard_reservation(rs, "Callback returned");
     default:
         if (ret >= 4000 && ret < 4900) {
             return rs_close_peer(rs, ret);
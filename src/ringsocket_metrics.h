@@ -0,0 +1,407 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#pragma once
+
+#include <ringsocket_queue.h>
+// <ringsocket_variadic.h>           # Arity-based macro expansion helper macros
+//   |
+//   \---> <ringsocket_api.h>                            # RingSocket's core API
+//                        |
+// <ringsocket_conf.h> <--/   # Definition of struct rs_conf and its descendents
+//   |
+//   \---> <ringsocket_ring.h> # Single producer single consumer ring buffer API
+//                         |
+// <ringsocket_queue.h> <--/      # Ring buffer update queuing and thread waking
+//   |
+//   |        [YOU ARE HERE]
+//   \---> <ringsocket_metrics.h>   # Live counters shared through shared memory
+//                            |
+//   /------------------------/
+//   |
+//   \--> <ringsocket_wsframe.h>   # RFC 6455 WebSocket frame protocol interface
+//                           |
+// <ringsocket_app.h> <------/    # Definition of RS_APP() and descendent macros
+//   |            |
+//   |            |
+//   |            \--------------> [ Worker translation units: see rs_worker.h ]
+//   |
+//   |
+//   \--> <ringsocket_helper.h> # Definitions of app helper functions (internal)
+//                          |
+//  <ringsocket.h> <--------/        # Definitions of app helper functions (API)
+//    |
+//    |
+//    \-------------------------------> [ Any RingSocket app translation units ]
+
+// Every worker and app thread maintains its own set of counters in a single
+// "metrics segment": a MAP_SHARED mapping of the "metrics_path" file if
+// configured (see README.md), or of anonymous memory otherwise. Each thread's
+// counters occupy cache lines of their own, which only that thread ever stores
+// to; so all counters are simply stored with memory_order_relaxed, without any
+// locks or read-modify-write instructions. Any other process can therefore
+// mmap() the same file read-only and load them at will without disturbing
+// RingSocket, which is what the ringsocket_stat tool does (see
+// tools/ringsocket_stat.c).
+//
+// The segment consists of the following, in order:
+// * The struct rs_metrics_head below, including the names of all apps;
+// * One struct rs_worker_metrics for each worker thread;
+// * One struct rs_app_metrics for each app thread (i.e., app instance);
+// * One struct rs_ring_pair_metrics for each worker and app pair, ordered by
+//   worker first. (See rs_get_ring_pair_metrics() below.)
+// * Only if "latency_histograms" is enabled: one struct rs_app_latency for each
+//   app thread, followed by one struct rs_pair_latency for each worker and app
+//   pair, ordered in the same way.
+//
+// All of which are aligned to RS_CACHE_LINE_SIZE, the value of which must
+// therefore be the same for any reader of the segment.
+
+#define RS_METRICS_MAGIC "RSMETRIC" // Not followed by '\0' in the segment
+#define RS_METRICS_VERSION 4 // Incremented whenever the segment layout changes
+
+// Room for an app's name and its instance suffix, if any: see RS_APP()
+#define RS_METRICS_NAME_SIZE (RS_APP_NAME_MAX_STRLEN + RS_CONST_STRLEN("#256") \
+    + 1)
+
+#define RS_METRICS_ADD(counter, n) \
+    atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), \
+        memory_order_relaxed) + (n), memory_order_relaxed)
+
+#define RS_METRICS_SUB(counter, n) \
+    atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), \
+        memory_order_relaxed) - (n), memory_order_relaxed)
+
+#define RS_METRICS_SET(counter, val) \
+    atomic_store_explicit(&(counter), (val), memory_order_relaxed)
+
+struct rs_metrics_head {
+    char magic[RS_CONST_STRLEN(RS_METRICS_MAGIC)];
+    uint32_t version;
+    uint32_t cache_line_size; // RS_CACHE_LINE_SIZE
+    uint32_t worker_c;
+    uint32_t app_c;
+    int64_t pid; // Of the RingSocket process
+    int64_t start_time; // Unix time at which RingSocket started
+    uint32_t has_latencies; // Whether "latency_histograms" is enabled
+    uint32_t:32; // Make sure app_names is 64-bit aligned.
+    char app_names[][RS_METRICS_NAME_SIZE]; // app_c '\0'-terminated names
+};
+
+// Peer closures are counted by the reason that initiated them, as far as the
+// worker can tell.
+enum rs_close_reason {
+    // The peer sent a WebSocket Close frame.
+    RS_CLOSE_REASON_PEER = 0,
+    // The app sent a WebSocket Close frame (e.g., with rs_close()).
+    RS_CLOSE_REASON_APP = 1,
+    // The HTTP Upgrade request was rejected with an HTTP error response.
+    RS_CLOSE_REASON_HTTP = 2,
+    // The peer violated the WebSocket protocol (or the configured limits).
+    RS_CLOSE_REASON_WEBSOCKET = 3,
+    // The TLS handshake failed.
+    RS_CLOSE_REASON_TLS = 4,
+    // The connection was lost without any closing handshake: EOF, an I/O error,
+    // EPOLLERR, or EPOLLHUP.
+    RS_CLOSE_REASON_HANGUP = 5,
+    // The peer's queue of pending messages exceeded its endpoint's limits under
+    // the "disconnect" backpressure_policy (see rs_from_app.c).
+    RS_CLOSE_REASON_BACKPRESSURE = 6
+};
+#define RS_CLOSE_REASON_C 7
+
+// Copies of the wake-up counters of struct rs_ring_queue and the busy polling
+// counters of struct rs_spin (see ringsocket_queue.h), as published by each
+// thread through rs_publish_thread_metrics().
+struct rs_thread_metrics {
+    atomic_uint_least64_t needed_wake_c;
+    atomic_uint_least64_t sent_wake_c;
+    atomic_uint_least64_t sleep_c;
+    atomic_uint_least64_t sleep_ns;
+    atomic_uint_least64_t spin_hit_c;
+    atomic_uint_least64_t spin_ns;
+};
+
+struct rs_worker_metrics {
+    // WebSocket traffic (i.e., excluding HTTP and TLS handshakes): bytes and
+    // messages read from peers, and bytes and messages fully written to peers
+    // (counting broadcast messages once for every recipient).
+    alignas(RS_CACHE_LINE_SIZE) atomic_uint_least64_t inbound_byte_c;
+    atomic_uint_least64_t inbound_msg_c;
+    atomic_uint_least64_t outbound_byte_c;
+    atomic_uint_least64_t outbound_msg_c;
+    // Reads from and writes to WebSocket peers cut short by EAGAIN
+    atomic_uint_least64_t read_eagain_c;
+    atomic_uint_least64_t write_eagain_c;
+    // Peer lifetime counters: connections accepted (or rejected for lack of
+    // peer slots), upgraded to WebSocket, and eventually closed; of which the
+    // closures are also counted per enum rs_close_reason, as well as the ones
+    // due to the shutdown deadline expiring (see rs_timer.c).
+    atomic_uint_least64_t accept_c;
+    atomic_uint_least64_t reject_c;
+    atomic_uint_least64_t upgrade_c;
+    atomic_uint_least64_t close_c;
+    atomic_uint_least64_t close_c_by_reason[RS_CLOSE_REASON_C];
+    atomic_uint_least64_t shutdown_timeout_c;
+    // Completed TLS handshakes: full ones, and abbreviated ones resuming a
+    // session through a session ID or a session ticket (see rs_tls.c).
+    atomic_uint_least64_t full_tls_handshake_c;
+    atomic_uint_least64_t resumed_tls_handshake_c;
+    // Gauges of the messages from apps still pending to be written to one or
+    // more peers (i.e., owrefs in use: see rs_from_app.c), and of the sum of
+    // all peers' owref queue lengths.
+    atomic_uint_least64_t owref_c;
+    atomic_uint_least64_t queued_owref_c;
+    // Messages from apps discarded instead of being queued for (or while
+    // queued for) a peer exceeding its endpoint's backpressure limits, and the
+    // number of times such a peer was paused (see rs_from_app.c).
+    atomic_uint_least64_t backpressure_drop_c;
+    atomic_uint_least64_t backpressure_pause_c;
+    struct rs_thread_metrics thread;
+};
+
+struct rs_app_metrics {
+    // Messages consumed from inbound rings, indexed by enum rs_inbound_kind:
+    // i.e., the number of open, read, close, and pause callbacks (the latter
+    // split into pause and resume notifications) due respectively.
+    alignas(RS_CACHE_LINE_SIZE) atomic_uint_least64_t inbound_c_by_kind[5];
+    atomic_uint_least64_t timer_c; // Timer callback invocations
+    struct rs_thread_metrics thread;
+};
+
+// The counters of a single ring buffer, split between the cache line of its
+// producer thread and that of its consumer thread. The number of bytes in use
+// follows from the difference between produced_byte_c and consumed_byte_c.
+struct rs_ring_metrics {
+    // Only stored to by the producer thread
+    alignas(RS_CACHE_LINE_SIZE) atomic_uint_least64_t produced_byte_c;
+    atomic_uint_least64_t produced_msg_c;
+    atomic_uint_least64_t ring_size; // See struct rs_ring_producer
+    atomic_uint_least64_t high_water_size; // See struct rs_ring_producer
+    atomic_uint_least64_t realloc_c; // The number of times grown or shrunk
+    // Only stored to by the consumer thread
+    alignas(RS_CACHE_LINE_SIZE) atomic_uint_least64_t consumed_byte_c;
+    atomic_uint_least64_t consumed_msg_c;
+};
+
+struct rs_ring_pair_metrics {
+    struct rs_ring_metrics inbound_ring; // producing worker --> consuming app
+    struct rs_ring_metrics outbound_ring; // producing app --> consuming worker
+};
+
+// Latency histograms are "HDR-style": log-linear, in that every power of 2
+// range of nanoseconds is split into 2^RS_HISTOGRAM_SUB_BIT_C linear sub-buckets,
+// which limits the relative error of any recorded value to 1/16th; while the
+// 1st 16 buckets hold the values 0 through 15 exactly. Values of 2^40 ns
+// (about 18 minutes) or more all end up in the last bucket.
+#define RS_HISTOGRAM_SUB_BIT_C 4
+#define RS_HISTOGRAM_MAX_BIT_C 40
+#define RS_HISTOGRAM_BUCKET_C \
+    ((RS_HISTOGRAM_MAX_BIT_C - RS_HISTOGRAM_SUB_BIT_C + 1) << \
+    RS_HISTOGRAM_SUB_BIT_C)
+
+struct rs_histogram {
+    atomic_uint_least64_t bucket_c[RS_HISTOGRAM_BUCKET_C];
+};
+
+// The stages of the worker --> app --> worker path of which the latencies of
+// every message passing through are recorded: both the inbound stage and the
+// callback stage by app threads...
+struct rs_app_latency {
+    // From the read() of a WebSocket message by its worker to its dequeueing
+    // by the app: i.e., the time spent on the inbound ring.
+    alignas(RS_CACHE_LINE_SIZE) struct rs_histogram inbound;
+    // From the dequeueing of an inbound message until the app callback it was
+    // passed to returns.
+    struct rs_histogram callback;
+};
+
+// ...and both the outbound stage and the end-to-end total by worker threads.
+struct rs_pair_latency {
+    // From rs_send() (or the like) by the app to the worker writing the message
+    // out completely: i.e., the time spent on the outbound ring plus the time
+    // spent waiting for any pending owrefs of the peer to be written first.
+    alignas(RS_CACHE_LINE_SIZE) struct rs_histogram outbound;
+    // From the read() of an inbound message to the completed write of any
+    // message sent by the app callback it was passed to.
+    struct rs_histogram end_to_end;
+};
+
+static inline size_t rs_get_metrics_head_size(
+    size_t app_c
+) {
+    size_t const size =
+        sizeof(struct rs_metrics_head) + app_c * RS_METRICS_NAME_SIZE;
+    return (size + RS_CACHE_LINE_SIZE - 1) & ~((size_t) RS_CACHE_LINE_SIZE - 1);
+}
+
+static inline size_t rs_get_metrics_size(
+    size_t worker_c,
+    size_t app_c,
+    bool has_latencies
+) {
+    return rs_get_metrics_head_size(app_c) +
+        worker_c * sizeof(struct rs_worker_metrics) +
+        app_c * sizeof(struct rs_app_metrics) +
+        worker_c * app_c * sizeof(struct rs_ring_pair_metrics) +
+        has_latencies * (app_c * sizeof(struct rs_app_latency) +
+        worker_c * app_c * sizeof(struct rs_pair_latency));
+}
+
+static inline struct rs_worker_metrics * rs_get_worker_metrics(
+    struct rs_metrics_head * head,
+    size_t worker_i
+) {
+    return (struct rs_worker_metrics *) ((uint8_t *) head +
+        rs_get_metrics_head_size(head->app_c)) + worker_i;
+}
+
+static inline struct rs_app_metrics * rs_get_app_metrics(
+    struct rs_metrics_head * head,
+    size_t app_i
+) {
+    return (struct rs_app_metrics *)
+        rs_get_worker_metrics(head, head->worker_c) + app_i;
+}
+
+static inline struct rs_ring_pair_metrics * rs_get_ring_pair_metrics(
+    struct rs_metrics_head * head,
+    size_t worker_i,
+    size_t app_i
+) {
+    return (struct rs_ring_pair_metrics *) rs_get_app_metrics(head,
+        head->app_c) + worker_i * head->app_c + app_i;
+}
+
+// Returns NULL if "latency_histograms" is disabled.
+static inline struct rs_app_latency * rs_get_app_latency(
+    struct rs_metrics_head * head,
+    size_t app_i
+) {
+    if (!head->has_latencies) {
+        return NULL;
+    }
+    return (struct rs_app_latency *) rs_get_ring_pair_metrics(head,
+        head->worker_c, 0) + app_i;
+}
+
+// Returns NULL if "latency_histograms" is disabled.
+static inline struct rs_pair_latency * rs_get_pair_latency(
+    struct rs_metrics_head * head,
+    size_t worker_i,
+    size_t app_i
+) {
+    if (!head->has_latencies) {
+        return NULL;
+    }
+    return (struct rs_pair_latency *) rs_get_app_latency(head, head->app_c) +
+        worker_i * head->app_c + app_i;
+}
+
+static inline size_t rs_get_histogram_bucket_i(
+    uint64_t ns
+) {
+    if (ns >> RS_HISTOGRAM_MAX_BIT_C) {
+        return RS_HISTOGRAM_BUCKET_C - 1;
+    }
+    if (ns >> RS_HISTOGRAM_SUB_BIT_C) {
+        unsigned const shift =
+            63 - __builtin_clzll(ns) - RS_HISTOGRAM_SUB_BIT_C;
+        // The leading bit of ns >> shift itself accounts for the "+ 1" here.
+        return ((size_t) shift << RS_HISTOGRAM_SUB_BIT_C) + (ns >> shift);
+    }
+    return ns;
+}
+
+// The highest value of nanoseconds recorded into the bucket at bucket_i
+static inline uint64_t rs_get_histogram_bucket_max(
+    size_t bucket_i
+) {
+    if (bucket_i >> RS_HISTOGRAM_SUB_BIT_C) {
+        unsigned const shift = (bucket_i >> RS_HISTOGRAM_SUB_BIT_C) - 1;
+        uint64_t const sub_i = bucket_i & ((1 << RS_HISTOGRAM_SUB_BIT_C) - 1);
+        return (((1 << RS_HISTOGRAM_SUB_BIT_C) + sub_i + 1) << shift) - 1;
+    }
+    return bucket_i;
+}
+
+// Of the histogram with the bucket counts bucket_c minus any prev_bucket_c (of
+// an earlier snapshot of the same histogram), holding count values in total,
+// get the highest value equivalent to the one at the given quantile (like
+// HdrHistogram does), or 0 if count is 0.
+static inline uint64_t rs_get_histogram_quantile(
+    uint64_t const * bucket_c,
+    uint64_t const * prev_bucket_c, // NULL if none
+    uint64_t count,
+    double quantile
+) {
+    if (!count) {
+        return 0;
+    }
+    // The rank of the value sought, as the number of values preceding it
+    uint64_t const rank = RS_MIN(count - 1, (uint64_t) (quantile * count));
+    uint64_t sum = 0;
+    for (size_t i = 0; i < RS_HISTOGRAM_BUCKET_C; i++) {
+        sum += bucket_c[i] - (prev_bucket_c ? prev_bucket_c[i] : 0);
+        if (sum > rank) {
+            return rs_get_histogram_bucket_max(i);
+        }
+    }
+    return 0;
+}
+
+// To be called only by the thread the histogram belongs to, with two
+// timestamps obtained with rs_get_spin_time_ns() (see ringsocket_queue.h).
+static inline void rs_record_latency(
+    struct rs_histogram * histogram,
+    uint64_t start_ns,
+    uint64_t end_ns
+) {
+    // Different threads' CPUs may disagree about the time by a few ns.
+    RS_METRICS_ADD(histogram->bucket_c[rs_get_histogram_bucket_i(
+        end_ns > start_ns ? end_ns - start_ns : 0)], 1);
+}
+
+// To be called by the producer thread after each rs_produce_ring_msg(), or
+// rather after the message was completed: with its final msg_size.
+static inline void rs_count_produced_ring_msg(
+    struct rs_ring_metrics * metrics,
+    struct rs_ring_producer const * prod,
+    uint64_t msg_size
+) {
+    RS_METRICS_ADD(metrics->produced_byte_c, RS_RING_HEAD_SIZE + msg_size);
+    RS_METRICS_ADD(metrics->produced_msg_c, 1);
+    uint64_t ring_size = 0;
+    RS_ATOMIC_LOAD_RELAXED(&metrics->ring_size, ring_size);
+    if (ring_size != prod->ring_size) {
+        if (ring_size) {
+            RS_METRICS_ADD(metrics->realloc_c, 1);
+        }
+        RS_METRICS_SET(metrics->ring_size, prod->ring_size);
+    }
+    RS_METRICS_SET(metrics->high_water_size, prod->high_water_size);
+}
+
+// To be called by the consumer thread after each rs_consume_ring_msg() that
+// returned a message.
+static inline void rs_count_consumed_ring_msg(
+    struct rs_ring_metrics * metrics,
+    struct rs_consumer_msg const * cmsg
+) {
+    RS_METRICS_ADD(metrics->consumed_byte_c, RS_RING_HEAD_SIZE + cmsg->size);
+    RS_METRICS_ADD(metrics->consumed_msg_c, 1);
+}
+
+// Called by each thread once per loop iteration of its own.
+static inline void rs_publish_thread_metrics(
+    struct rs_thread_metrics * metrics,
+    struct rs_ring_queue const * queue,
+    struct rs_spin const * spin
+) {
+    RS_METRICS_SET(metrics->needed_wake_c, queue->needed_wake_c);
+    RS_METRICS_SET(metrics->sent_wake_c, queue->sent_wake_c);
+    RS_METRICS_SET(metrics->sleep_c, spin->sleep_c);
+    RS_METRICS_SET(metrics->sleep_ns, spin->sleep_ns);
+    RS_METRICS_SET(metrics->spin_hit_c, spin->spin_hit_c);
+    RS_METRICS_SET(metrics->spin_ns, spin->spin_ns);
+}
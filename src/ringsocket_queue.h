@@ -15,6 +15,10 @@
 //    [YOU ARE HERE]       |
 // <ringsocket_queue.h> <--/      # Ring buffer update queuing and thread waking
 //   |
+//   \---> <ringsocket_metrics.h>   # Live counters shared through shared memory
+//                            |
+//   /------------------------/
+//   |
 //   \--> <ringsocket_wsframe.h>   # RFC 6455 WebSocket frame protocol interface
 //                           |
 // <ringsocket_app.h> <------/    # Definition of RS_APP() and descendent macros
@@ -33,9 +37,16 @@
 #define _GNU_SOURCE // syscall()
 #include <inttypes.h> // PRI print format of stdint.h types
 #include <linux/futex.h> // FUTEX_WAKE_PRIVATE
+#include <sched.h> // sched_yield()
 #include <sys/syscall.h> // SYS_futex
+#include <time.h> // clock_gettime()
 #include <unistd.h> // syscall()
 
+#if defined(__x86_64__) || defined(__i386__)
+#define RS_SPIN_X86
+#include <immintrin.h> // _mm_pause(), _tpause(), __rdtsc()
+#endif
+
 // If you're new to RingSocket, check ringsocket_ring.h before reading all this.
 //
 // Ring buffer producers and consumers communicate their write and read pointer
@@ -82,6 +93,21 @@
 // performed on "the other side" of the systemcalls involved in epol_wait()
 // and futex_wait()), and then finally they are called a 2nd time with the
 // timeout actually intended (if any).
+//
+// Alternatively, setting "ring_ordering" to "acquire_release" makes RingSocket
+// forgo the update queue entirely, and instead publish each ring buffer update
+// immediately with a memory_order_release store; which (combined with the
+// memory_order_acquire loads that ringsocket_ring.h always uses to read "r"
+// and "w") makes the C11 memory model itself order each message's contents
+// before the publication of its ring buffer position, rather than relying on
+// update queue delays found safe empirically. That guarantee does not extend to
+// the sleep/wake handshake described above though: its relaxed is_asleep flags
+// remain protected only by the doubled epoll_wait()/futex_wait() calls and
+// the system calls involved, in either mode. On x86 release stores and acquire
+// loads compile to plain MOVs anyway, so the cost is mainly that of more
+// frequent publication (i.e., more cache line transfers between cores); whereas
+// on weakly ordered CPUs such as ARM they cost an STLR/LDAR each. See
+// tests/rst_bench_ordering.c for a comparison of both modes.
 
 struct rs_sleep_state { // Indicates whether or not a certain thread is dormant.
     // is_asleep is a boolean flag, but implemented as an atomic uint32_t for
@@ -95,56 +121,134 @@ struct rs_ring_update {
     bool is_write;
 };
 
+// Rather than making a wake-up syscall each time a ring update is published to
+// a thread that is asleep, the publishing thread only marks that destination
+// thread as pending a wake-up (see rs_defer_wake_up()), and then wakes up all
+// pending threads at once when its own loop iteration is done with (see
+// rs_wake_up_pending()). This way any number of ring updates published to
+// the same thread in the same iteration cost a single FUTEX_WAKE or eventfd
+// write(), rather than one each.
+#define RS_WAKE_LOG_INTERVAL 60 // Log wake-up counters once a minute at most
+
 struct rs_ring_queue {
     struct rs_ring_update * updates;
     size_t size;
     size_t oldest_i;
+    bool is_immediate; // "ring_ordering" is "acquire_release"
+    // The indices of the destination threads pending a wake-up, and a boolean
+    // for each destination thread to tell whether it's already among them.
+    uint32_t * pending_wake_is;
+    uint8_t * wake_is_pending;
+    size_t pending_wake_c;
+    // Wake-up counters: needed_wake_c counts ring updates published to threads
+    // found to be asleep, whereas sent_wake_c counts the wake-up syscalls that
+    // were actually made as a result.
+    uint64_t needed_wake_c;
+    uint64_t sent_wake_c;
+    uint64_t logged_needed_wake_c;
+    time_t wake_log_time;
 };
 
+static inline rs_ret rs_init_ring_queue(
+    struct rs_ring_queue * queue,
+    size_t size,
+    size_t dest_thread_c,
+    uint8_t ring_ordering
+) {
+    queue->size = size;
+    queue->is_immediate = ring_ordering == RS_RING_ORDERING_ACQUIRE_RELEASE;
+    RS_CALLOC(queue->updates, size);
+    RS_CALLOC(queue->pending_wake_is, dest_thread_c);
+    RS_CALLOC(queue->wake_is_pending, dest_thread_c);
+    return RS_OK;
+}
+
+static inline void rs_defer_wake_up(
+    struct rs_ring_queue * queue,
+    struct rs_sleep_state * sleep_state,
+    uint32_t thread_i
+) {
+    bool is_asleep = false;
+    RS_ATOMIC_LOAD_RELAXED(&sleep_state->is_asleep, is_asleep);
+    if (is_asleep) {
+        queue->needed_wake_c++;
+        if (!queue->wake_is_pending[thread_i]) {
+            queue->wake_is_pending[thread_i] = true;
+            queue->pending_wake_is[queue->pending_wake_c++] = thread_i;
+        }
+    }
+}
+
+// Unset is_asleep, returning whether it was still set. Multiple threads may
+// race to wake up the same thread: of those, only the one for which this
+// returns true makes the wake-up syscall.
+static inline bool rs_claim_wake_up(
+    struct rs_sleep_state * sleep_state
+) {
+    RS_PREVENT_COMPILER_REORDERING;
+    bool const was_asleep = atomic_exchange_explicit(&sleep_state->is_asleep,
+        false, memory_order_relaxed);
+    RS_PREVENT_COMPILER_REORDERING;
+    return was_asleep;
+}
+
 static inline rs_ret rs_wake_up_app(
     struct rs_sleep_state * app_sleep_state,
     uint32_t app_i
 ) {
-    bool app_is_asleep = false;
-    RS_ATOMIC_LOAD_RELAXED(&app_sleep_state->is_asleep, app_is_asleep);
-    if (app_is_asleep) {
-        RS_ATOMIC_STORE_RELAXED(&app_sleep_state->is_asleep, false);
-        if (syscall(SYS_futex, &app_sleep_state->is_asleep, FUTEX_WAKE_PRIVATE,
-            1, NULL, NULL, 0) == -1) {
-            RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful syscall(SYS_futex, %d, "
-                "FUTEX_WAKE_PRIVATE, ...) for app_i %" PRIu32,
-                app_sleep_state->is_asleep, app_i);
-            return RS_FATAL;
-        }
-        //RS_LOG(LOG_DEBUG, "Called syscall(SYS_futex, %d, FUTEX_WAKE_PRIVATE, "
-        //    "...) for app_i %" PRIu32, app_sleep_state->is_asleep, app_i);
-    } else {
-        RS_LOG(LOG_DEBUG, "Not making a FUTEX_WAKE_PRIVATE syscall() for "
-            "app_i %" PRIu32 ", because app_is_asleep seem to be false", app_i);
+    if (syscall(SYS_futex, &app_sleep_state->is_asleep, FUTEX_WAKE_PRIVATE, 1,
+        NULL, NULL, 0) == -1) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful syscall(SYS_futex, %d, "
+            "FUTEX_WAKE_PRIVATE, ...) for app_i %" PRIu32,
+            app_sleep_state->is_asleep, app_i);
+        return RS_FATAL;
     }
+    //RS_LOG(LOG_DEBUG, "Called syscall(SYS_futex, %d, FUTEX_WAKE_PRIVATE, "
+    //    "...) for app_i %" PRIu32, app_sleep_state->is_asleep, app_i);
     return RS_OK;
 }
 
 static inline rs_ret rs_wake_up_worker(
-    struct rs_sleep_state * worker_sleep_state,
     int worker_eventfd,
     uint32_t worker_i
 ) {
-    bool worker_is_asleep = false;
-    RS_ATOMIC_LOAD_RELAXED(&worker_sleep_state->is_asleep, worker_is_asleep);
-    if (worker_is_asleep) {
-        RS_ATOMIC_STORE_RELAXED(&worker_sleep_state->is_asleep, false);
-        if (write(worker_eventfd, (uint64_t []){1}, 8) != 8) {
-            RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful write(worker_eventfd, ...) to "
-                "worker #%" PRIu32, worker_i + 1);
-            return RS_FATAL;
+    if (write(worker_eventfd, (uint64_t []){1}, 8) != 8) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful write(worker_eventfd, ...) to "
+            "worker #%" PRIu32, worker_i + 1);
+        return RS_FATAL;
+    }
+    //RS_LOG(LOG_DEBUG, "Successful write(worker_eventfd, ...) to worker #%"
+    //    PRIu32, worker_i + 1);
+    return RS_OK;
+}
+
+static inline rs_ret rs_wake_up_pending(
+    struct rs_ring_queue * queue,
+    struct rs_sleep_state * sleep_states,
+    int const * eventfds // NULL if called by a worker thread
+) {
+    for (size_t i = 0; i < queue->pending_wake_c; i++) {
+        uint32_t const thread_i = queue->pending_wake_is[i];
+        queue->wake_is_pending[thread_i] = false;
+        if (!rs_claim_wake_up(sleep_states + thread_i)) {
+            continue; // Already woken up (or awake) in the meantime
+        }
+        if (eventfds) { // This function was called by an app thread.
+            RS_GUARD(rs_wake_up_worker(eventfds[thread_i], thread_i));
+        } else { // This function was called by a worker thread.
+            RS_GUARD(rs_wake_up_app(sleep_states + thread_i, thread_i));
+        }
+        queue->sent_wake_c++;
+    }
+    queue->pending_wake_c = 0;
+    if (queue->needed_wake_c != queue->logged_needed_wake_c) {
+        time_t const now = time(NULL);
+        if (now - queue->wake_log_time >= RS_WAKE_LOG_INTERVAL) {
+            RS_LOG(LOG_INFO, "Wake-up totals: %" PRIu64 " needed, %" PRIu64
+                " sent", queue->needed_wake_c, queue->sent_wake_c);
+            queue->logged_needed_wake_c = queue->needed_wake_c;
+            queue->wake_log_time = now;
         }
-        //RS_LOG(LOG_DEBUG, "Successful write(worker_eventfd, ...) to worker #%"
-        //    PRIu32, worker_i + 1);
-    } else {
-        RS_LOG(LOG_DEBUG, "Not calling write(worker_eventfd, ...) for worker #%"
-            PRIu32 ", because worker_is_asleep seems to be false",
-            worker_i + 1);
     }
     return RS_OK;
 }
@@ -158,6 +262,22 @@ static inline rs_ret rs_enqueue_ring_update(
     size_t thread_i,
     bool is_write
 ) {
+    if (queue->is_immediate) {
+        // Apps write to outbound rings and read from inbound rings, whereas
+        // workers do the opposite.
+        struct rs_ring_atomic * atomic = (eventfds ? !is_write : is_write) ?
+            &ring_pairs[thread_i]->inbound_ring :
+            &ring_pairs[thread_i]->outbound_ring;
+        if (is_write) {
+            RS_ATOMIC_STORE_RELEASE(&atomic->w,
+                (atomic_uintptr_t) new_ring_position);
+            rs_defer_wake_up(queue, sleep_states + thread_i, thread_i);
+        } else {
+            RS_ATOMIC_STORE_RELEASE(&atomic->r,
+                (atomic_uintptr_t) new_ring_position);
+        }
+        return RS_OK;
+    }
     struct rs_ring_update * update = queue->updates + queue->oldest_i++;
     queue->oldest_i %= queue->size;
     // If an update exists at the oldest index, carry out dequeue procedures.
@@ -168,8 +288,8 @@ static inline rs_ret rs_enqueue_ring_update(
                     &ring_pairs[update->thread_i]->outbound_ring.w,
                     (atomic_uintptr_t) update->ring_position
                 );
-                RS_GUARD(rs_wake_up_worker(sleep_states + update->thread_i,
-                    eventfds[update->thread_i], update->thread_i));
+                rs_defer_wake_up(queue, sleep_states + update->thread_i,
+                    update->thread_i);
             } else {
                 RS_ATOMIC_STORE_RELAXED(
                     &ring_pairs[update->thread_i]->inbound_ring.r,
@@ -182,8 +302,8 @@ static inline rs_ret rs_enqueue_ring_update(
                     &ring_pairs[update->thread_i]->inbound_ring.w,
                     (atomic_uintptr_t) update->ring_position
                 );
-                RS_GUARD(rs_wake_up_app(sleep_states + update->thread_i,
-                    update->thread_i));
+                rs_defer_wake_up(queue, sleep_states + update->thread_i,
+                    update->thread_i);
             } else {
                 RS_ATOMIC_STORE_RELAXED(
                     &ring_pairs[update->thread_i]->outbound_ring.r,
@@ -206,6 +326,10 @@ static inline rs_ret rs_flush_ring_updates(
     int const * eventfds,
     size_t dest_thread_c
 ) {
+    if (queue->is_immediate) {
+        // Everything was already published by rs_enqueue_ring_update().
+        return rs_wake_up_pending(queue, sleep_states, eventfds);
+    }
     size_t const newest_i = (queue->oldest_i + queue->size - 1) % queue->size;
     for (size_t i = 0; i < dest_thread_c; i++) {
         bool updated_to_newer_r = false;
@@ -221,9 +345,8 @@ static inline rs_ret rs_flush_ring_updates(
                                 &ring_pairs[update->thread_i]->outbound_ring.w,
                                 (atomic_uintptr_t) update->ring_position
                             );
-                            RS_GUARD(rs_wake_up_worker(sleep_states +
-                                update->thread_i, eventfds[update->thread_i],
-                                update->thread_i));
+                            rs_defer_wake_up(queue, sleep_states +
+                                update->thread_i, update->thread_i);
                             updated_to_newer_w = true;
                         }
                     } else if (!updated_to_newer_r) {
@@ -240,8 +363,8 @@ static inline rs_ret rs_flush_ring_updates(
                                 &ring_pairs[update->thread_i]->inbound_ring.w,
                                 (atomic_uintptr_t) update->ring_position
                             );
-                            RS_GUARD(rs_wake_up_app(sleep_states +
-                                update->thread_i, update->thread_i));
+                            rs_defer_wake_up(queue, sleep_states +
+                                update->thread_i, update->thread_i);
                             updated_to_newer_w = true;
                         }
                     } else if (!updated_to_newer_r) {
@@ -260,5 +383,176 @@ static inline rs_ret rs_flush_ring_updates(
             j %= queue->size;
         } while (j != newest_i);
     }
-    return RS_OK;
+    return rs_wake_up_pending(queue, sleep_states, eventfds);
+}
+
+// #############################################################################
+// # Busy polling ##############################################################
+
+// Rather than going to sleep as soon as it runs out of work, a worker or app
+// thread can be configured to first busy poll for new work for up to
+// "busy_poll_microsec" (see README.md). Going to sleep and being woken up again
+// costs several microseconds worth of syscalls and context switches, which
+// busy polling avoids at the expense of burning CPU time: a trade-off that is
+// only worthwhile if new work tends to arrive before that spin budget runs out.
+//
+// Each thread therefore adapts the length of time it actually spins to the
+// recent arrival rate of its work: it keeps a moving average of the duration of
+// its idle periods (i.e., the time from running out of work until new work
+// arrives, whether or not it went to sleep in between), and spins for up to
+// twice that average; or doesn't spin at all if that average exceeds the
+// budget, because then the next arrival is unlikely to be caught in time.
+
+#define RS_SPIN_LOG_INTERVAL_NS 60000000000 // Log spin counters once a minute
+#define RS_SPIN_TPAUSE_TSC_C 1000 // TPAUSE for about 1000 TSC ticks per poll
+
+struct rs_spin {
+    uint64_t budget_ns; // 0 if busy polling is disabled
+    uint64_t avg_idle_ns; // Moving average of recent idle period durations
+    uint64_t idle_start_ns; // 0 unless currently idle
+    uint64_t sleep_start_ns;
+    uint64_t logged_ns;
+    // Counters of the time spent spinning versus sleeping: these accumulate
+    // from thread start onward, and are logged by rs_end_idle() periodically.
+    uint64_t spin_ns;
+    uint64_t sleep_ns;
+    uint64_t spin_hit_c; // Idle periods ended by new work arriving mid-spin
+    uint64_t sleep_c; // Times gone to sleep
+    bool is_spent; // Spinning is over for the current idle period
+    uint8_t hint; // enum rs_spin_hint
+};
+
+static inline void rs_init_spin(
+    struct rs_spin * spin,
+    uint32_t budget_microsec,
+    uint8_t hint
+) {
+    *spin = (struct rs_spin){
+        .budget_ns = 1000 * (uint64_t) budget_microsec,
+        // Start out spinning for the full budget, until arrivals say otherwise.
+        .avg_idle_ns = 500 * (uint64_t) budget_microsec,
+        .hint = hint
+    };
+}
+
+// The functions below need clock_gettime() with CLOCK_MONOTONIC, which is only
+// visible to translation units that define _POSIX_C_SOURCE or _GNU_SOURCE
+// before including anything: i.e., apps (see ringsocket_helper.h), and the
+// worker translation units of the event loops that busy poll or of the socket
+// IO that timestamps messages for "latency_histograms" (see
+// ringsocket_metrics.h).
+#ifdef CLOCK_MONOTONIC
+
+static inline uint64_t rs_get_spin_time_ns(
+    void
+) {
+    // Unlike the CLOCK_MONOTONIC_COARSE used elsewhere, this needs a precision
+    // well below a microsecond. (Given a valid pointer, clock_gettime() can't
+    // fail on this clock; so the return value is not checked.)
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000000 * (uint64_t) ts.tv_sec + ts.tv_nsec;
+}
+
+#ifdef RS_SPIN_X86
+// Only called if rs_conf.c found the CPU to support WAITPKG.
+__attribute__((target("waitpkg")))
+static inline void rs_tpause(
+    void
+) {
+    // A control value of 1 selects C0.1: a shallower, but faster waking state.
+    _tpause(1, __rdtsc() + RS_SPIN_TPAUSE_TSC_C);
+}
+#endif
+
+static inline void rs_pause_spin(
+    uint8_t hint
+) {
+    switch (hint) {
+    case RS_SPIN_HINT_PAUSE: default:
+#ifdef RS_SPIN_X86
+        _mm_pause();
+#elif defined(__aarch64__)
+        __asm__ volatile("yield");
+#endif
+        return;
+    case RS_SPIN_HINT_TPAUSE:
+#ifdef RS_SPIN_X86
+        rs_tpause();
+#endif
+        return;
+    case RS_SPIN_HINT_SCHED_YIELD:
+        sched_yield();
+    }
+}
+
+// Call whenever the calling thread finds no work to do. Returns true (after
+// pausing briefly) if it should poll for work again, or false if it should go
+// to sleep instead; in which case it keeps returning false until rs_end_idle().
+static inline bool rs_keep_spinning(
+    struct rs_spin * spin
+) {
+    if (!spin->budget_ns || spin->is_spent) {
+        return false;
+    }
+    uint64_t const now_ns = rs_get_spin_time_ns();
+    if (!spin->idle_start_ns) {
+        spin->idle_start_ns = now_ns;
+    }
+    uint64_t const limit_ns = spin->avg_idle_ns < spin->budget_ns ?
+        RS_MIN(2 * spin->avg_idle_ns, spin->budget_ns) : 0;
+    if (now_ns - spin->idle_start_ns < limit_ns) {
+        rs_pause_spin(spin->hint);
+        return true;
+    }
+    spin->spin_ns += now_ns - spin->idle_start_ns;
+    spin->is_spent = true;
+    return false;
+}
+
+// Call right before and right after each time the calling thread sleeps.
+static inline void rs_begin_sleep(
+    struct rs_spin * spin
+) {
+    if (spin->budget_ns) {
+        spin->sleep_start_ns = rs_get_spin_time_ns();
+    }
 }
+
+static inline void rs_end_sleep(
+    struct rs_spin * spin
+) {
+    if (spin->budget_ns) {
+        spin->sleep_ns += rs_get_spin_time_ns() - spin->sleep_start_ns;
+        spin->sleep_c++;
+    }
+}
+
+// Call whenever the calling thread has work to do again.
+static inline void rs_end_idle(
+    struct rs_spin * spin
+) {
+    if (!spin->idle_start_ns) {
+        return; // Busy polling is disabled, or this thread wasn't idle.
+    }
+    uint64_t const now_ns = rs_get_spin_time_ns();
+    uint64_t const idle_ns = now_ns - spin->idle_start_ns;
+    spin->avg_idle_ns = (7 * spin->avg_idle_ns + idle_ns) / 8;
+    if (!spin->is_spent) {
+        spin->spin_ns += idle_ns;
+        spin->spin_hit_c++;
+    }
+    spin->idle_start_ns = 0;
+    spin->is_spent = false;
+    if (!spin->logged_ns) {
+        spin->logged_ns = now_ns;
+    } else if (now_ns - spin->logged_ns >= RS_SPIN_LOG_INTERVAL_NS) {
+        RS_LOG(LOG_INFO, "Busy polling totals: %" PRIu64 " ms spent spinning "
+            "(new work arrived mid-spin %" PRIu64 " times); %" PRIu64 " ms "
+            "spent sleeping (%" PRIu64 " times)", spin->spin_ns / 1000000,
+            spin->spin_hit_c, spin->sleep_ns / 1000000, spin->sleep_c);
+        spin->logged_ns = now_ns;
+    }
+}
+
+#endif
@@ -15,6 +15,10 @@
 //                         |
 // <ringsocket_queue.h> <--/      # Ring buffer update queuing and thread waking
 //   |
+//   \---> <ringsocket_metrics.h>   # Live counters shared through shared memory
+//                            |
+//   /------------------------/
+//   |
 //   \--> <ringsocket_wsframe.h>   # RFC 6455 WebSocket frame protocol interface
 //                           |
 // <ringsocket_app.h> <------/    # Definition of RS_APP() and descendent macros
@@ -30,6 +34,8 @@
 //    |
 //    \-------------------------------> [ Any RingSocket app translation units ]
 
+#include <time.h> // time() for ring buffer shrinking
+
 // RingSocket's atomic interface to its single producer single consumer ring
 // buffers, as shared between its threads.
 struct rs_ring_atomic { // C11 atomic types with C11 alignas
@@ -63,11 +69,13 @@ struct rs_ring_producer {
     // up-to-date write poiner, whereas the "w" of rs_ring_atomic will generally
     // be a slightly delayed version thereof.
     //
-    // Why? Well, RingSocket loads and stores the atomic pointers in struct
+    // Why? Well, by default RingSocket stores the atomic pointers in struct
     // rs_ring_atomic with memory_order_relaxed for max speed without any locks
     // or fences. To nonetheless guard itself against CPU memory reordering,
     // RingSocket briefly queues ring buffer read and write updates before
     // publicizing them in struct rs_ring_atomic: see ringsocket_queue.h.
+    // (Unless "ring_ordering" is set to "acquire_release", in which case both
+    // "w"s are always equal.)
     uint8_t * w;
 
     // In the event that the write pointer "w" speeds ahead of the consumer
@@ -84,6 +92,21 @@ struct rs_ring_producer {
 
     // The size in bytes of the current heap-allocated ring buffer
     size_t ring_size;
+
+    // The reverse also applies: once a ring buffer has grown beyond its initial
+    // size, it gets replaced with a smaller one if its occupancy has remained
+    // low for the configured "ring_shrink_wait" period, using the same route
+    // instruction and prev_ring handoff as when growing. This prevents a single
+    // burst of traffic from permanently inflating memory usage.
+    size_t min_ring_size; // The initial ring_size, below which it never shrinks
+    time_t period_start; // Start of the current shrink eligibility period
+
+    // High-water statistics: the largest number of ring buffer bytes occupied
+    // by unconsumed messages (as far as the producer can tell from its latest
+    // view of r), both over the producer's entire lifetime and over the current
+    // shrink eligibility period.
+    size_t high_water_size;
+    size_t period_high_water_size;
 };
 
 // RingSocket's consumer-only interface to a RingSocket ring buffer: not shared
@@ -135,6 +158,47 @@ static inline bool rs_would_clobber(
     return w + RS_RING_HEAD_SIZE + msg_size + RS_RING_ROUTE_SIZE > unwritable;
 }
 
+// Update the high-water statistics of prod, and return the size of the smaller
+// ring buffer that prod should switch to if the current one has been underused
+// for at least shrink_wait seconds; or return 0 if no shrinking should happen.
+static inline size_t rs_get_shrunk_ring_size(
+    uint8_t const * r,
+    struct rs_ring_producer * prod,
+    double alloc_multiplier,
+    uint16_t shrink_wait, // in seconds (0: never shrink)
+    uint64_t msg_size
+) {
+    size_t used_size = RS_RING_HEAD_SIZE + msg_size + (prod->w < r ?
+        prod->ring_size - (size_t) (r - prod->w) : (size_t) (prod->w - r));
+    if (used_size > prod->period_high_water_size) {
+        prod->period_high_water_size = used_size;
+        if (used_size > prod->high_water_size) {
+            prod->high_water_size = used_size;
+        }
+    }
+    if (!shrink_wait || prod->ring_size <= prod->min_ring_size) {
+        // Only inflated rings pay for the time() call below.
+        return 0;
+    }
+    time_t now = time(NULL);
+    if (now < prod->period_start + shrink_wait) {
+        return 0;
+    }
+    // Shrink by (at most) the same factor with which rings grow, and only if
+    // the period's high-water mark would have fit comfortably: i.e., if even a
+    // subsequent growth step would not have been needed to accommodate it.
+    size_t shrunk_size = RS_MAX(prod->ring_size / alloc_multiplier,
+        prod->min_ring_size);
+    size_t period_high_water_size = prod->period_high_water_size;
+    prod->period_start = now;
+    prod->period_high_water_size = 0;
+    if (period_high_water_size * alloc_multiplier > shrunk_size ||
+        RS_RING_HEAD_SIZE + msg_size + RS_RING_ROUTE_SIZE > shrunk_size) {
+        return 0;
+    }
+    return shrunk_size;
+}
+
 // Ensure that the calling producer thread can safely write msg_size message
 // bytes to prod->w if RS_OK is returned. This will update the members of
 // the prod instance where necessary in order to make said guarantee.
@@ -148,10 +212,11 @@ static inline rs_ret rs_produce_ring_msg(
     struct rs_ring_atomic const * atomic,
     struct rs_ring_producer * prod,
     double alloc_multiplier, // If allocated, how big should a new ring buf be?
+    uint16_t shrink_wait, // Seconds of underuse after which to shrink (0: never)
     uint64_t msg_size
 ) {
     uint8_t const * r = NULL;
-    RS_CASTED_ATOMIC_LOAD_RELAXED(&atomic->r, r, (uint8_t const *));
+    RS_CASTED_ATOMIC_LOAD_ACQUIRE(&atomic->r, r, (uint8_t const *));
     if (r >= prod->ring && r < prod->ring + prod->ring_size) {
         // r and w are currently both within bounds of the same prod->ring.
         if (prod->prev_ring) {
@@ -160,6 +225,12 @@ static inline rs_ret rs_produce_ring_msg(
                 prod->prev_ring);
             RS_FREE(prod->prev_ring);
         }
+        size_t new_ring_size = rs_get_shrunk_ring_size(r, prod,
+            alloc_multiplier, shrink_wait, msg_size);
+        if (new_ring_size) {
+            goto route_to_new_ring;
+        }
+        new_ring_size = prod->ring_size * alloc_multiplier;
         if (prod->w < r) {
             // The w position has wrapped from the end of the ring back to the
             // front, while r has not reached the end of the same ring yet.
@@ -175,18 +246,21 @@ static inline rs_ret rs_produce_ring_msg(
             if (rs_would_clobber(r, prod->ring, msg_size)) {
                 // Can't wrap the message to the start of the ring buffer
                 // either: doing so would clobber r.
-                route_to_new_ring: // Allocate a new larger ring buffer instead.
+                route_to_new_ring: // Allocate a new ring buffer instead: a
+                // larger one, unless the current one is being shrunk.
                 // Hold on to the existing buffer as prev_ring, until the
                 // producer thread has verified that the reader has reached the
                 // new buffer.
                 prod->prev_ring = prod->ring;
                 prod->ring = NULL;
-                prod->ring_size *= alloc_multiplier;
+                prod->ring_size = new_ring_size;
+                prod->period_start = time(NULL);
                 // Use RS_CACHE_ALIGNED_CALLOC() to eliminate possibility of
                 // false sharing with preceding or trailing heap bytes.
                 RS_CACHE_ALIGNED_CALLOC(prod->ring, prod->ring_size);
-                RS_LOG(LOG_NOTICE, "Allocated a new %zu byte ring buffer at %p",
-                    prod->ring_size, prod->ring);
+                RS_LOG(LOG_NOTICE, "Allocated a new %zu byte ring buffer at %p "
+                    "(high-water mark: %zu bytes)", prod->ring_size, prod->ring,
+                    prod->high_water_size);
             } else {
                 RS_LOG(LOG_DEBUG, "Insufficient ring buffer tail space: "
                     "wrapping message around to the start of the buffer at %p",
@@ -226,7 +300,7 @@ static inline struct rs_consumer_msg * rs_consume_ring_msg(
     struct rs_ring_consumer * cons
 ) {
     uint8_t * w = NULL;
-    RS_CASTED_ATOMIC_LOAD_RELAXED(&atomic->w, w, (uint8_t *));
+    RS_CASTED_ATOMIC_LOAD_ACQUIRE(&atomic->w, w, (uint8_t *));
     if (cons->r == w) {
         // The consumer has already caught up with the producer (i.e., the
         // producer hasn't publicized any new message yet).
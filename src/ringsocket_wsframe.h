@@ -3,7 +3,7 @@
 
 #pragma once
 
-#include <ringsocket_queue.h>
+#include <ringsocket_metrics.h>
 // <ringsocket_variadic.h>           # Arity-based macro expansion helper macros
 //   |
 //   \---> <ringsocket_api.h>                            # RingSocket's core API
@@ -14,6 +14,9 @@
 //                         |
 // <ringsocket_queue.h> <--/      # Ring buffer update queuing and thread waking
 //   |
+//   \---> <ringsocket_metrics.h>   # Live counters shared through shared memory
+//                            |
+//   /------------------------/
 //   |        [YOU ARE HERE]
 //   \--> <ringsocket_wsframe.h>   # RFC 6455 WebSocket frame protocol interface
 //                           |
@@ -299,26 +302,34 @@ static inline uint64_t rs_copy_wsframe_cs_payload(
 }
 
 
-static inline uint64_t rs_set_wsframe_sc_payload_and_get_frame_size(
+// Set the payload size of a server-to-client frame, and return the size of the
+// frame's head (i.e., the offset at which its payload starts).
+static inline uint64_t rs_set_wsframe_sc_payload_size(
     union rs_wsframe * frame,
-    void const * payload_src,
     uint64_t payload_size
 ) {
     if (payload_size <= 125) {
         frame->payload_size_x7F |= payload_size;
-        memcpy(frame->sc_small.payload, payload_src, payload_size);
-        return sizeof(frame->sc_small) + payload_size;
+        return sizeof(frame->sc_small);
     }
     if (payload_size <= UINT16_MAX) {
         frame->payload_size_x7F |= 126;
         RS_W_HTON16(frame->sc_medium.payload_size, payload_size);
-        memcpy(frame->sc_medium.payload, payload_src, payload_size);
-        return sizeof(frame->sc_medium) + payload_size;
+        return sizeof(frame->sc_medium);
     }
     frame->payload_size_x7F |= 127;
     RS_W_HTON64(frame->sc_large.payload_size, payload_size);
-    memcpy(frame->sc_large.payload, payload_src, payload_size);
-    return sizeof(frame->sc_large) + payload_size;
+    return sizeof(frame->sc_large);
+}
+
+static inline uint64_t rs_set_wsframe_sc_payload_and_get_frame_size(
+    union rs_wsframe * frame,
+    void const * payload_src,
+    uint64_t payload_size
+) {
+    uint64_t head_size = rs_set_wsframe_sc_payload_size(frame, payload_size);
+    memcpy((uint8_t *) frame + head_size, payload_src, payload_size);
+    return head_size + payload_size;
 }
 
 static inline void rs_clear_wsframe_bit_fields(
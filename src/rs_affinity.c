@@ -0,0 +1,286 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#define _GNU_SOURCE // sched_setaffinity(), CPU_ALLOC(), etc
+
+#include "rs_affinity.h"
+
+#include <inttypes.h> // PRIu16
+#include <sched.h> // sched_getaffinity(), sched_setaffinity()
+#include <stdio.h> // fopen(), fgets(), sprintf()
+#include <unistd.h> // sysconf()
+
+// Threads are pinned by setting the CPU affinity of the main thread prior to
+// spawning each thread, which then inherits that affinity from the very start
+// (C11 threads lack any equivalent of pthread_attr_setaffinity_np()). Each
+// thread therefore performs all of its own allocations while already running
+// on its designated CPU(s): under Linux's default "first touch" NUMA policy,
+// this means that a worker's peers array and rbuf, and the ring buffers each
+// thread produces into, end up in memory local to that thread's NUMA node.
+// Memory shared between an app and its workers is thus local to both if the
+// configuration pins them to the same NUMA node.
+//
+// Everything here is only accessed by the main thread prior to spawning any
+// worker thread other than itself, so none of it needs synchronization.
+
+#define RS_SYSFS_CPU_LIST_SIZE 0x1000
+#define RS_SYSFS_NODE_PATH "/sys/devices/system/node/"
+
+static size_t cpu_c = 0;
+static size_t cpu_alloc_c = 0; // cpu_c, or more if the kernel supports more
+static size_t cpu_set_size = 0; // Byte size of each cpu_set_t below
+static cpu_set_t * default_cpus = NULL; // The CPU affinity at startup
+static cpu_set_t * spawn_cpus = NULL; // As last set by set_spawn_affinity()
+static cpu_set_t * * node_cpus = NULL; // NULL elements for missing nodes
+static size_t node_c = 0; // Highest NUMA node number + 1 (or 0 if none)
+
+static rs_ret read_cpu_list(
+    char const * path,
+    char * str, // Must have room for RS_SYSFS_CPU_LIST_SIZE chars
+    bool * file_exists
+) {
+    FILE * f = fopen(path, "r");
+    if (!f) {
+        if (errno == ENOENT) {
+            *file_exists = false;
+            return RS_OK;
+        }
+        RS_LOG_ERRNO(LOG_ERR, "Unsuccessful fopen(\"%s\", \"r\")", path);
+        return RS_FATAL;
+    }
+    *file_exists = true;
+    if (!fgets(str, RS_SYSFS_CPU_LIST_SIZE, f)) {
+        *str = '\0';
+    }
+    fclose(f);
+    str[strcspn(str, "\n")] = '\0';
+    return RS_OK;
+}
+
+// Parse a list of comma-separated numbers and/or number ranges in the format
+// used by sysfs (e.g., "0-3,8,10-11") into either a CPU set or a node count.
+static rs_ret parse_cpu_list(
+    char const * str,
+    cpu_set_t * cpus, // May be NULL if highest_i is not
+    size_t * highest_i // May be NULL if cpus is not
+) {
+    char const * list_str = str;
+    while (*str) {
+        char * end = NULL;
+        size_t first = strtoul(str, &end, 10);
+        size_t last = first;
+        if (end == str) {
+            goto parse_error;
+        }
+        if (*end == '-') {
+            str = end + 1;
+            last = strtoul(str, &end, 10);
+            if (end == str || last < first) {
+                goto parse_error;
+            }
+        }
+        if (highest_i) {
+            *highest_i = RS_MAX(*highest_i, last);
+        }
+        if (cpus) {
+            if (last >= cpu_set_size * 8) {
+                goto parse_error;
+            }
+            for (size_t i = first; i <= last; i++) {
+                CPU_SET_S(i, cpu_set_size, cpus);
+            }
+        }
+        if (*end && *end != ',') {
+            goto parse_error;
+        }
+        str = *end ? end + 1 : end;
+    }
+    return RS_OK;
+    parse_error:
+    RS_LOG(LOG_ERR, "Unable to parse sysfs CPU list: \"%s\"", list_str);
+    return RS_FATAL;
+}
+
+static rs_ret read_numa_topology(
+    void
+) {
+    char str[RS_SYSFS_CPU_LIST_SIZE] = {0};
+    bool file_exists = false;
+    RS_GUARD(read_cpu_list(RS_SYSFS_NODE_PATH "online", str, &file_exists));
+    if (!file_exists) {
+        RS_LOG(LOG_NOTICE, "No NUMA topology found in " RS_SYSFS_NODE_PATH
+            ": assuming all CPUs belong to a single node");
+        return RS_OK;
+    }
+    size_t highest_node_i = 0;
+    RS_GUARD(parse_cpu_list(str, NULL, &highest_node_i));
+    node_c = highest_node_i + 1;
+    RS_CALLOC(node_cpus, node_c);
+    for (size_t i = 0; i < node_c; i++) {
+        char path[sizeof(RS_SYSFS_NODE_PATH) + 32] = {0};
+        sprintf(path, RS_SYSFS_NODE_PATH "node%zu/cpulist", i);
+        RS_GUARD(read_cpu_list(path, str, &file_exists));
+        if (!file_exists) {
+            continue;
+        }
+        node_cpus[i] = CPU_ALLOC(cpu_alloc_c);
+        if (!node_cpus[i]) {
+            RS_LOG(LOG_ALERT, "Failed to CPU_ALLOC().");
+            return RS_FATAL;
+        }
+        CPU_ZERO_S(cpu_set_size, node_cpus[i]);
+        RS_GUARD(parse_cpu_list(str, node_cpus[i], NULL));
+        RS_LOG(LOG_NOTICE, "NUMA node %zu: CPUs %s", i, *str ? str : "none");
+    }
+    return RS_OK;
+}
+
+static size_t get_node_i_by_cpu(
+    size_t cpu
+) {
+    for (size_t i = 0; i < node_c; i++) {
+        if (node_cpus[i] && CPU_ISSET_S(cpu, cpu_set_size, node_cpus[i])) {
+            return i;
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Set spawn_cpus to the set of CPUs that pin stands for, optionally logging the
+// result.
+static rs_ret get_pin_cpus(
+    struct rs_conf_pin const * pin,
+    char const * thread_name,
+    bool is_logged
+) {
+    CPU_ZERO_S(cpu_set_size, spawn_cpus);
+    switch (pin ? pin->kind : RS_PIN_NONE) {
+    case RS_PIN_NONE: default:
+        memcpy(spawn_cpus, default_cpus, cpu_set_size);
+        return RS_OK;
+    case RS_PIN_CPU:
+        if (pin->i >= cpu_c ||
+            !CPU_ISSET_S(pin->i, cpu_set_size, default_cpus)) {
+            RS_LOG(LOG_ERR, "%s is configured to be pinned to CPU %" PRIu16
+                ", but that CPU is not available to RingSocket.", thread_name,
+                pin->i);
+            return RS_FATAL;
+        }
+        CPU_SET_S(pin->i, cpu_set_size, spawn_cpus);
+        if (is_logged) {
+            size_t node_i = get_node_i_by_cpu(pin->i);
+            if (node_i == SIZE_MAX) {
+                RS_LOG(LOG_NOTICE, "%s: pinned to CPU %" PRIu16, thread_name,
+                    pin->i);
+            } else {
+                RS_LOG(LOG_NOTICE, "%s: pinned to CPU %" PRIu16 " of NUMA "
+                    "node %zu", thread_name, pin->i, node_i);
+            }
+        }
+        return RS_OK;
+    case RS_PIN_NUMA_NODE:
+        if (pin->i >= node_c || !node_cpus[pin->i]) {
+            RS_LOG(LOG_ERR, "%s is configured to be pinned to NUMA node %"
+                PRIu16 ", but no such node exists.", thread_name, pin->i);
+            return RS_FATAL;
+        }
+        // Only include the node's CPUs this process is allowed to run on.
+        CPU_AND_S(cpu_set_size, spawn_cpus, node_cpus[pin->i], default_cpus);
+        if (!CPU_COUNT_S(cpu_set_size, spawn_cpus)) {
+            RS_LOG(LOG_ERR, "%s is configured to be pinned to NUMA node %"
+                PRIu16 ", but none of its CPUs are available to RingSocket.",
+                thread_name, pin->i);
+            return RS_FATAL;
+        }
+        if (is_logged) {
+            RS_LOG(LOG_NOTICE, "%s: pinned to the %d available CPUs of NUMA "
+                "node %" PRIu16, thread_name,
+                CPU_COUNT_S(cpu_set_size, spawn_cpus), pin->i);
+        }
+        return RS_OK;
+    }
+}
+
+rs_ret init_affinity(
+    struct rs_conf const * conf
+) {
+    long ret = sysconf(_SC_NPROCESSORS_CONF);
+    if (ret == -1) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful sysconf(_SC_NPROCESSORS_CONF)");
+        return RS_FATAL;
+    }
+    // Account for kernels compiled for more CPUs than present on this system,
+    // which would make sched_getaffinity() fail with EINVAL for smaller sets.
+    cpu_c = ret;
+    cpu_alloc_c = RS_MAX(cpu_c, CPU_SETSIZE);
+    cpu_set_size = CPU_ALLOC_SIZE(cpu_alloc_c);
+    default_cpus = CPU_ALLOC(cpu_alloc_c);
+    spawn_cpus = CPU_ALLOC(cpu_alloc_c);
+    if (!default_cpus || !spawn_cpus) {
+        RS_LOG(LOG_ALERT, "Failed to CPU_ALLOC().");
+        return RS_FATAL;
+    }
+    if (sched_getaffinity(0, cpu_set_size, default_cpus) == -1) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful sched_getaffinity(0, %zu, ...)",
+            cpu_set_size);
+        return RS_FATAL;
+    }
+    RS_GUARD(read_numa_topology());
+    // Validate and log all pins up front, rather than bailing out on an
+    // invalid one only after other threads were already spawned.
+    char thread_name[RS_APP_NAME_MAX_STRLEN + 16] = {0};
+    for (size_t i = 0; i < conf->app_c; i++) {
+        sprintf(thread_name, "App \"%s\"", conf->apps[i].name);
+        RS_GUARD(get_pin_cpus(&conf->apps[i].pin, thread_name, true));
+    }
+    if (conf->worker_pins) {
+        for (size_t i = 0; i < conf->worker_c; i++) {
+            sprintf(thread_name, "Worker#%zu", i + 1);
+            RS_GUARD(get_pin_cpus(conf->worker_pins + i, thread_name, true));
+        }
+    }
+    return RS_OK;
+}
+
+rs_ret set_spawn_affinity(
+    struct rs_conf_pin const * pin
+) {
+    // All pins were already validated by init_affinity()
+    RS_GUARD(get_pin_cpus(pin, "The thread to be spawned", false));
+    if (sched_setaffinity(0, cpu_set_size, spawn_cpus) == -1) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful sched_setaffinity(0, %zu, ...)",
+            cpu_set_size);
+        return RS_FATAL;
+    }
+    return RS_OK;
+}
+
+size_t get_cpu_c(
+    void
+) {
+    return cpu_c;
+}
+
+bool get_worker_i_by_cpu(
+    struct rs_conf const * conf,
+    size_t cpu,
+    size_t * worker_i
+) {
+    if (!conf->worker_pins) {
+        return false;
+    }
+    size_t node_i = get_node_i_by_cpu(cpu);
+    size_t matches[conf->worker_c];
+    size_t match_c = 0;
+    for (size_t i = 0; i < conf->worker_c; i++) {
+        struct rs_conf_pin const * pin = conf->worker_pins + i;
+        if (pin->kind == RS_PIN_CPU ? pin->i == cpu : pin->i == node_i) {
+            matches[match_c++] = i;
+        }
+    }
+    if (!match_c) {
+        return false;
+    }
+    *worker_i = matches[cpu % match_c];
+    return true;
+}
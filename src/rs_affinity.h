@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#pragma once
+
+#include <ringsocket_api.h> // rs_ret
+#include <ringsocket_conf.h> // struct rs_conf, struct rs_conf_pin
+
+// Read the CPU and NUMA node topology of the system, check that the pins of
+// all worker and app threads configured are compatible with it, and log both.
+rs_ret init_affinity(
+    struct rs_conf const * conf
+);
+
+// Set the CPU affinity of the calling thread to pin, such that it will be
+// inherited by the next thread spawned; or restore the CPU affinity this
+// process started out with if pin is NULL or of kind RS_PIN_NONE.
+rs_ret set_spawn_affinity(
+    struct rs_conf_pin const * pin
+);
+
+// The number of CPUs configured on this system (online or not).
+size_t get_cpu_c(
+    void
+);
+
+// Returns false if no worker is pinned to (the NUMA node of) cpu. Otherwise
+// sets worker_i to the index of such a worker; choosing between them in
+// round-robin fashion (by CPU number) if there are multiple.
+bool get_worker_i_by_cpu(
+    struct rs_conf const * conf,
+    size_t cpu,
+    size_t * worker_i
+);
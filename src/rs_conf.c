@@ -2,12 +2,20 @@
 // Copyright © 2019 William Budd
 
 #include "rs_conf.h"
+#include "rs_route.h" // build_route_index()
 #include "rs_tls.h" // derive_cert_index_from_hostname()
 
 #include <ifaddrs.h> // getifaddrs()
 #include <jgrandson.h> // JSON conf file parsing: https://github/wbudd/jgrandson
 #include <net/if.h> // IF_NAMESIZE
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h> // __get_cpuid_count()
+#ifndef bit_WAITPKG
+#define bit_WAITPKG (1 << 5) // CPUID.(EAX=7,ECX=0):ECX[bit 5]
+#endif
+#endif
+
 RS_LOG_VARS; // See the RS_LOG() section in ringsocket_api.h for explanation.
 
 #define RS_GUARD_JG(_jg_ret) do { \
@@ -36,6 +44,7 @@ RS_LOG_VARS; // See the RS_LOG() section in ringsocket_api.h for explanation.
 #define RS_DEFAULT_REALLOC_MULTIPLIER 1.5
 #define RS_MIN_REALLOC_MULTIPLIER 1.05
 #define RS_MAX_REALLOC_MULTIPLIER 2.5
+#define RS_DEFAULT_RING_SHRINK_WAIT 60 // in seconds
 #define RS_DEFAULT_OWREFS_ELEM_C 10000
 #define RS_MIN_OWREFS_ELEM_C 1000
 #define RS_DEFAULT_EPOLL_BUF_ELEM_C 100
@@ -50,8 +59,17 @@ RS_LOG_VARS; // See the RS_LOG() section in ringsocket_api.h for explanation.
 #define RS_URL_MAX_STRLEN 0x1FFF // 8191
 #define RS_MAX_ALLOWED_ORIGIN_C 0x1FFF // 8191
 #define RS_ALLOWED_ORIGIN_MAX_STRLEN 0x1FFF // 8191
+#define RS_DEFAULT_DEFLATE_WINDOW_BITS 15 // The maximum allowed by RFC 7692
+#define RS_MIN_CLIENT_MAX_WINDOW_BITS 8
+#define RS_MIN_SERVER_MAX_WINDOW_BITS 9 // zlib can't deflate with less than 9
 #define RS_DEFAULT_SHUTDOWN_WAIT_HTTP 15 // in seconds
 #define RS_DEFAULT_SHUTDOWN_WAIT_WS 30
+#define RS_DEFAULT_BACKPRESSURE_CLOSE_CODE 1008 // Policy Violation
+#define RS_DEFAULT_TLS_TICKET_KEY_LIFETIME 3600 // in seconds
+#define RS_MIN_TLS_TICKET_KEY_LIFETIME 60
+#define RS_MAX_TLS_TICKET_KEY_LIFETIME 302400 // 3.5 days
+#define RS_MAX_TLS_SESSION_CACHE_SIZE 0x100000 // 1 GB worth of 1 KB slots
+#define RS_MAX_BUSY_POLL_MICROSEC 1000000 // 1 second
 
 static char const default_conf_path[] = "/etc/ringsocket.json";
 
@@ -135,6 +153,64 @@ static rs_ret check_if_endpoint_is_duplicate(
     return RS_FATAL;
 }
 
+static rs_ret parse_endpoint_backpressure(
+    jg_t * jg,
+    jg_obj_get_t * obj,
+    struct rs_conf_endpoint * endpoint
+) {
+    RS_GUARD_JG(jg_obj_get_uint16(jg, obj, "max_queued_msg_c",
+        &(jg_obj_uint16){
+            .defa = &(uint16_t){UINT16_MAX},
+            .min = &(uint16_t){1},
+            .min_reason = "At least one message must be allowed to be queued, "
+                "given that any write may be met with EAGAIN.",
+        }, &endpoint->max_queued_msg_c));
+    RS_GUARD_JG(jg_obj_get_sizet(jg, obj, "max_queued_byte_c",
+        &(jg_obj_sizet){
+            .defa = &(size_t){SIZE_MAX},
+            .min = &(size_t){1}
+        }, &endpoint->max_queued_byte_c));
+    {
+        char policy[] = "drop_newest";
+        RS_GUARD_JG(jg_obj_get_callerstr(jg, obj, "backpressure_policy",
+            &(jg_obj_callerstr){
+                .defa = "disconnect",
+                .max_byte_c = RS_CONST_STRLEN("drop_newest"),
+            }, policy));
+        if (!strcmp(policy, "disconnect")) {
+            endpoint->backpressure_policy = RS_BACKPRESSURE_DISCONNECT;
+        } else if (!strcmp(policy, "drop_newest")) {
+            endpoint->backpressure_policy = RS_BACKPRESSURE_DROP_NEWEST;
+        } else if (!strcmp(policy, "drop_oldest")) {
+            endpoint->backpressure_policy = RS_BACKPRESSURE_DROP_OLDEST;
+        } else if (!strcmp(policy, "pause")) {
+            endpoint->backpressure_policy = RS_BACKPRESSURE_PAUSE;
+        } else {
+            RS_LOG(LOG_ERR, "Unrecognized backpressure_policy configuration "
+                "value \"%s\". Value must be one of: \"disconnect\", "
+                "\"drop_newest\", \"drop_oldest\", or \"pause\".", policy);
+            return RS_FATAL;
+        }
+    }
+    RS_GUARD_JG(jg_obj_get_uint16(jg, obj, "backpressure_close_code",
+        &(jg_obj_uint16){
+            .defa = &(uint16_t){RS_DEFAULT_BACKPRESSURE_CLOSE_CODE},
+            .min = &(uint16_t){1000},
+            .max = &(uint16_t){4999},
+            .min_reason = "RFC 6455 doesn't define any close codes below 1000.",
+            .max_reason = "RFC 6455 doesn't define any close codes above 4999."
+        }, &endpoint->backpressure_close_code));
+    switch (endpoint->backpressure_close_code) {
+    case 1004: case 1005: case 1006: case 1015:
+        RS_LOG(LOG_ERR, "The backpressure_close_code %" PRIu16 " is reserved "
+            "by RFC 6455 for purposes other than being sent in a Close frame.",
+            endpoint->backpressure_close_code);
+        return RS_FATAL;
+    default:
+        return RS_OK;
+    }
+}
+
 static rs_ret parse_endpoint(
     jg_t * jg,
     jg_obj_get_t * obj,
@@ -168,6 +244,47 @@ static rs_ret parse_endpoint(
         }
     }
 
+    {
+        bool permessage_deflate = false;
+        RS_GUARD_JG(jg_obj_get_bool(jg, obj, "permessage_deflate",
+            &(bool){false}, &permessage_deflate));
+        endpoint->permessage_deflate = permessage_deflate;
+    }
+    {
+        bool client_no_context_takeover = false;
+        RS_GUARD_JG(jg_obj_get_bool(jg, obj, "client_no_context_takeover",
+            &(bool){false}, &client_no_context_takeover));
+        endpoint->client_no_context_takeover = client_no_context_takeover;
+    }
+    RS_GUARD_JG(jg_obj_get_uint8(jg, obj, "client_max_window_bits",
+        &(jg_obj_uint8){
+            .defa = &(uint8_t){RS_DEFAULT_DEFLATE_WINDOW_BITS},
+            .min = &(uint8_t){RS_MIN_CLIENT_MAX_WINDOW_BITS},
+            .max = &(uint8_t){RS_DEFAULT_DEFLATE_WINDOW_BITS},
+            .min_reason = "RFC 7692 doesn't allow LZ77 windows smaller than "
+                "2^8 bytes.",
+            .max_reason = "RFC 7692 doesn't allow LZ77 windows larger than "
+                "2^15 bytes."
+        }, &endpoint->client_max_window_bits));
+    RS_GUARD_JG(jg_obj_get_uint8(jg, obj, "server_max_window_bits",
+        &(jg_obj_uint8){
+            .defa = &(uint8_t){RS_DEFAULT_DEFLATE_WINDOW_BITS},
+            .min = &(uint8_t){RS_MIN_SERVER_MAX_WINDOW_BITS},
+            .max = &(uint8_t){RS_DEFAULT_DEFLATE_WINDOW_BITS},
+            .min_reason = "zlib doesn't support deflating with LZ77 windows "
+                "smaller than 2^9 bytes.",
+            .max_reason = "RFC 7692 doesn't allow LZ77 windows larger than "
+                "2^15 bytes."
+        }, &endpoint->server_max_window_bits));
+    if (endpoint->permessage_deflate) {
+        // All of an app's outbound messages are deflated only once, so they
+        // must fit every one of its endpoints' windows.
+        app->deflate_window_bits = app->deflate_window_bits ?
+            RS_MIN(app->deflate_window_bits, endpoint->server_max_window_bits) :
+            endpoint->server_max_window_bits;
+    }
+    RS_GUARD(parse_endpoint_backpressure(jg, obj, endpoint));
+
     char * url = NULL;
     RS_GUARD_JG(jg_obj_get_str(jg, obj, "url",
         &(jg_obj_str){
@@ -425,6 +542,68 @@ static rs_ret parse_app(
             .min_reason = "Setting an app's wbuf_size any lower is a bad idea"
         }, &app->wbuf_size));
 
+    RS_GUARD_JG(jg_obj_get_uint32(jg, obj, "busy_poll_microsec",
+        &(jg_obj_uint32){
+            .defa = &(uint32_t){conf->busy_poll_microsec},
+            .max = &(uint32_t){RS_MAX_BUSY_POLL_MICROSEC},
+            .max_reason = "Busy polling any longer than a second before "
+                "sleeping is a bad idea."
+        }, &app->busy_poll_microsec));
+
+    RS_GUARD_JG(jg_obj_get_uint16(jg, obj, "thread_c",
+        &(jg_obj_uint16){
+            .defa = &(uint16_t){1},
+            .min = &(uint16_t){1},
+            .min_reason = "An app must run in at least one thread."
+        }, &app->instance_c));
+    {
+        char shard_by[] = "endpoint_id";
+        RS_GUARD_JG(jg_obj_get_callerstr(jg, obj, "shard_by",
+            &(jg_obj_callerstr){
+                .defa = "client_id",
+                .max_byte_c = RS_CONST_STRLEN("endpoint_id"),
+            }, shard_by));
+        if (!strcmp(shard_by, "client_id")) {
+            app->shard_by = RS_SHARD_BY_CLIENT_ID;
+        } else if (!strcmp(shard_by, "endpoint_id")) {
+            app->shard_by = RS_SHARD_BY_ENDPOINT_ID;
+        } else {
+            RS_LOG(LOG_ERR, "Unrecognized shard_by configuration value \"%s\" "
+                "of app \"%s\". Value must be either \"client_id\" or "
+                "\"endpoint_id\".", shard_by, app->name);
+            return RS_FATAL;
+        }
+    }
+    {
+        uint16_t cpu = UINT16_MAX;
+        uint16_t numa_node = UINT16_MAX;
+        RS_GUARD_JG(jg_obj_get_uint16(jg, obj, "cpu",
+            &(jg_obj_uint16){
+                .defa = &(uint16_t){UINT16_MAX}
+            }, &cpu));
+        RS_GUARD_JG(jg_obj_get_uint16(jg, obj, "numa_node",
+            &(jg_obj_uint16){
+                .defa = &(uint16_t){UINT16_MAX}
+            }, &numa_node));
+        if (cpu != UINT16_MAX) {
+            if (numa_node != UINT16_MAX) {
+                RS_LOG(LOG_ERR, "Error parsing configuration file: the "
+                    "\"cpu\" and \"numa_node\" keys of app \"%s\" are "
+                    "mutually exclusive.", app->name);
+                return RS_FATAL;
+            }
+            if (app->instance_c > 1) {
+                RS_LOG(LOG_ERR, "Error parsing configuration file: app "
+                    "\"%s\" can't pin all of its %" PRIu16 " threads to a "
+                    "single \"cpu\". Consider pinning it to a \"numa_node\" "
+                    "instead.", app->name, app->instance_c);
+                return RS_FATAL;
+            }
+            app->pin = (struct rs_conf_pin){cpu, RS_PIN_CPU};
+        } else if (numa_node != UINT16_MAX) {
+            app->pin = (struct rs_conf_pin){numa_node, RS_PIN_NUMA_NODE};
+        }
+    }
     {
         bool no_open_cb = false;
         RS_GUARD_JG(jg_obj_get_bool(jg, obj, "no_open_cb", &(bool){false},
@@ -455,6 +634,138 @@ static rs_ret parse_app(
     return RS_OK;
 }
 
+// Replace each app configured with a "thread_c" greater than 1 with that many
+// consecutive copies of itself in conf->apps, each of which is then spawned as
+// a separate app thread with its own ring buffer pairs, just like any other
+// app. Only the 1st copy of each app is referred to by the route index: worker
+// threads then assign peers to one of the app's copies in
+// send_open_to_app() of rs_to_app.c.
+static rs_ret expand_app_instances(
+    struct rs_conf * conf
+) {
+    size_t instance_c = 0;
+    for (size_t i = 0; i < conf->app_c; i++) {
+        instance_c += conf->apps[i].instance_c;
+    }
+    // Peers refer to their app through a uint8_t app_i: see rs_worker.h.
+    if (instance_c > UINT8_MAX + 1) {
+        RS_LOG(LOG_ERR, "Error parsing configuration file: the sum of all "
+            "apps' \"thread_c\" values (%zu) must not exceed %d.",
+            instance_c, UINT8_MAX + 1);
+        return RS_FATAL;
+    }
+    if (instance_c == conf->app_c) {
+        return RS_OK;
+    }
+    struct rs_conf_app * apps = NULL;
+    RS_CALLOC(apps, instance_c);
+    struct rs_conf_app * instance = apps;
+    for (struct rs_conf_app * app = conf->apps;
+        app < conf->apps + conf->app_c; app++) {
+        for (uint16_t i = 0; i < app->instance_c; i++) {
+            // The copies share the same heap-allocated name, path and endpoints
+            *instance = *app;
+            instance->instance_i = i;
+            instance++;
+        }
+    }
+    RS_FREE(conf->apps);
+    conf->apps = apps;
+    conf->app_c = instance_c;
+    return RS_OK;
+}
+
+// Parse either "worker_cpus" or "worker_numa_nodes" (but not both) into
+// conf->worker_pins; the validity of each CPU and NUMA node number of which is
+// checked later by init_affinity() of rs_affinity.c.
+static rs_ret parse_worker_pins(
+    jg_t * jg,
+    jg_obj_get_t * root_obj,
+    struct rs_conf * conf
+) {
+    char const * keys[] = {"worker_cpus", "worker_numa_nodes"};
+    uint8_t kinds[] = {RS_PIN_CPU, RS_PIN_NUMA_NODE};
+    for (size_t k = 0; k < RS_ELEM_C(keys); k++) {
+        jg_arr_get_t * arr = NULL;
+        size_t elem_c = 0;
+        RS_GUARD_JG(jg_obj_get_arr_defa(jg, root_obj, keys[k],
+            &(jg_obj_arr_defa){
+                .max_c = UINT16_MAX
+            }, &arr, &elem_c));
+        if (!elem_c) {
+            continue;
+        }
+        if (conf->worker_pins) {
+            RS_LOG(LOG_ERR, "Error parsing configuration file: \"%s\" and "
+                "\"%s\" are mutually exclusive.", keys[0], keys[1]);
+            return RS_FATAL;
+        }
+        if (!conf->worker_c) {
+            conf->worker_c = elem_c;
+        } else if (conf->worker_c != elem_c) {
+            RS_LOG(LOG_ERR, "Error parsing configuration file: the number of "
+                "\"%s\" elements (%zu) must be equal to \"worker_c\" "
+                "(%" PRIu16 ") when both are specified.", keys[k], elem_c,
+                conf->worker_c);
+            return RS_FATAL;
+        }
+        RS_CALLOC(conf->worker_pins, elem_c);
+        for (size_t i = 0; i < elem_c; i++) {
+            RS_GUARD_JG(jg_arr_get_uint16(jg, arr, i, NULL,
+                &conf->worker_pins[i].i));
+            conf->worker_pins[i].kind = kinds[k];
+        }
+    }
+    return RS_OK;
+}
+
+static bool waitpkg_is_supported(
+    void
+) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned a = 0;
+    unsigned b = 0;
+    unsigned c = 0;
+    unsigned d = 0;
+    return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (c & bit_WAITPKG);
+#else
+    return false;
+#endif
+}
+
+static rs_ret parse_busy_poll_hint(
+    jg_t * jg,
+    jg_obj_get_t * root_obj,
+    struct rs_conf * conf
+) {
+    char hint[] = "sched_yield";
+    RS_GUARD_JG(jg_obj_get_callerstr(jg, root_obj, "busy_poll_hint",
+        &(jg_obj_callerstr){
+            .defa = "pause",
+            .max_byte_c = RS_CONST_STRLEN("sched_yield"),
+        }, hint));
+    if (!strcmp(hint, "pause")) {
+        conf->busy_poll_hint = RS_SPIN_HINT_PAUSE;
+    } else if (!strcmp(hint, "tpause")) {
+        if (waitpkg_is_supported()) {
+            conf->busy_poll_hint = RS_SPIN_HINT_TPAUSE;
+        } else {
+            RS_LOG(LOG_WARNING, "This CPU does not support the WAITPKG "
+                "instructions needed for busy_poll_hint \"tpause\": falling "
+                "back to \"pause\" instead.");
+            conf->busy_poll_hint = RS_SPIN_HINT_PAUSE;
+        }
+    } else if (!strcmp(hint, "sched_yield")) {
+        conf->busy_poll_hint = RS_SPIN_HINT_SCHED_YIELD;
+    } else {
+        RS_LOG(LOG_ERR, "Unrecognized busy_poll_hint configuration value "
+            "\"%s\". Value must be one of: \"pause\", \"tpause\", or "
+            "\"sched_yield\".", hint);
+        return RS_FATAL;
+    }
+    return RS_OK;
+}
+
 static rs_ret parse_configuration(
     jg_t * jg,
     struct rs_conf * conf
@@ -470,6 +781,45 @@ static rs_ret parse_configuration(
             }, log_level));
         RS_GUARD(rs_set_log_level(log_level));
     }
+    RS_GUARD_JG(jg_obj_get_str(jg, root_obj, "metrics_path",
+        &(jg_obj_str){
+            .defa = "",
+            .nullify_empty_str = true,
+            .max_byte_c = RS_PATH_MAX_STRLEN
+        }, &conf->metrics_path));
+    {
+        bool latency_histograms = false;
+        RS_GUARD_JG(jg_obj_get_bool(jg, root_obj, "latency_histograms",
+            &(bool){false}, &latency_histograms));
+        conf->latency_histograms = latency_histograms;
+    }
+    {
+        char event_loop[] = "io_uring";
+        RS_GUARD_JG(jg_obj_get_callerstr(jg, root_obj, "event_loop",
+            &(jg_obj_callerstr){
+                .defa = "epoll",
+                .max_byte_c = RS_CONST_STRLEN("io_uring"),
+            }, event_loop));
+        if (!strcmp(event_loop, "epoll")) {
+            conf->event_loop = RS_EVENT_LOOP_EPOLL;
+        } else if (!strcmp(event_loop, "io_uring")) {
+            conf->event_loop = RS_EVENT_LOOP_IO_URING;
+        } else {
+            RS_LOG(LOG_ERR, "Unrecognized event_loop configuration value "
+                "\"%s\". Value must be either \"epoll\" or \"io_uring\".",
+                event_loop);
+            return RS_FATAL;
+        }
+    }
+    RS_GUARD_JG(jg_obj_get_uint32(jg, root_obj, "busy_poll_microsec",
+        &(jg_obj_uint32){
+            .defa = &(uint32_t){0},
+            .max = &(uint32_t){RS_MAX_BUSY_POLL_MICROSEC},
+            .max_reason = "Busy polling any longer than a second before "
+                "sleeping is a bad idea."
+        }, &conf->busy_poll_microsec));
+    RS_GUARD(parse_busy_poll_hint(jg, root_obj, conf));
+
     RS_GUARD_JG(jg_obj_get_uint32(jg, root_obj, "fd_alloc_c",
         &(jg_obj_uint32){
             .defa = &(uint32_t){RS_DEFAULT_FD_ALLOC_C},
@@ -536,6 +886,11 @@ static rs_ret parse_configuration(
         return RS_FATAL;
     }
 
+    RS_GUARD_JG(jg_obj_get_uint16(jg, root_obj, "ring_shrink_wait",
+        &(jg_obj_uint16){
+            .defa = &(uint16_t){RS_DEFAULT_RING_SHRINK_WAIT}
+        }, &conf->ring_shrink_wait));
+
     RS_GUARD_JG(jg_obj_get_uint32(jg, root_obj, "owrefs_elem_c",
         &(jg_obj_uint32){
             .defa = &(uint32_t){RS_DEFAULT_OWREFS_ELEM_C},
@@ -559,6 +914,25 @@ static rs_ret parse_configuration(
             .min_reason = "Update queue sizes must not be set to zero."
     }, &conf->update_queue_size));
 
+    {
+        char ring_ordering[] = "acquire_release";
+        RS_GUARD_JG(jg_obj_get_callerstr(jg, root_obj, "ring_ordering",
+            &(jg_obj_callerstr){
+                .defa = "delayed",
+                .max_byte_c = RS_CONST_STRLEN("acquire_release"),
+            }, ring_ordering));
+        if (!strcmp(ring_ordering, "delayed")) {
+            conf->ring_ordering = RS_RING_ORDERING_DELAYED;
+        } else if (!strcmp(ring_ordering, "acquire_release")) {
+            conf->ring_ordering = RS_RING_ORDERING_ACQUIRE_RELEASE;
+        } else {
+            RS_LOG(LOG_ERR, "Unrecognized ring_ordering configuration value "
+                "\"%s\". Value must be either \"delayed\" or "
+                "\"acquire_release\".", ring_ordering);
+            return RS_FATAL;
+        }
+    }
+
     RS_GUARD_JG(jg_obj_get_uint8(jg, root_obj, "shutdown_wait_http",
         &(jg_obj_uint8){
             .defa = &(uint8_t){RS_DEFAULT_SHUTDOWN_WAIT_HTTP}
@@ -569,6 +943,32 @@ static rs_ret parse_configuration(
             .defa = &(uint8_t){RS_DEFAULT_SHUTDOWN_WAIT_WS}
         }, &conf->shutdown_wait_http));
 
+    {
+        bool tls_session_tickets = false;
+        RS_GUARD_JG(jg_obj_get_bool(jg, root_obj, "tls_session_tickets",
+            &(bool){false}, &tls_session_tickets));
+        conf->tls_session_tickets = tls_session_tickets;
+    }
+
+    RS_GUARD_JG(jg_obj_get_uint32(jg, root_obj, "tls_ticket_key_lifetime",
+        &(jg_obj_uint32){
+            .defa = &(uint32_t){RS_DEFAULT_TLS_TICKET_KEY_LIFETIME},
+            .min = &(uint32_t){RS_MIN_TLS_TICKET_KEY_LIFETIME},
+            .max = &(uint32_t){RS_MAX_TLS_TICKET_KEY_LIFETIME},
+            .min_reason = "Rotating session ticket keys any more frequently "
+                "would render most tickets useless.",
+            .max_reason = "Session tickets must not outlive 7 days (RFC 8446), "
+                "and remain valid for up to twice the key lifetime."
+        }, &conf->tls_ticket_key_lifetime));
+
+    RS_GUARD_JG(jg_obj_get_uint32(jg, root_obj, "tls_session_cache_size",
+        &(jg_obj_uint32){
+            .defa = &(uint32_t){0},
+            .max = &(uint32_t){RS_MAX_TLS_SESSION_CACHE_SIZE},
+            .max_reason = "Each slot occupies 1 KB of shared memory, so any "
+                "larger cache is almost certainly a configuration mistake."
+        }, &conf->tls_session_cache_size));
+
     jg_arr_get_t * arr = NULL;
     size_t elem_c = 0;
 
@@ -613,11 +1013,14 @@ static rs_ret parse_configuration(
         RS_GUARD_JG(jg_arr_get_obj(jg, arr, i, NULL, &app_obj));
         RS_GUARD(parse_app(jg, app_obj, conf->apps + i, conf));
     }
+    RS_GUARD(expand_app_instances(conf));
+    RS_GUARD(build_route_index(conf));
 
     RS_GUARD_JG(jg_obj_get_uint16(jg, root_obj, "worker_c",
         &(jg_obj_uint16){
             .defa = &(uint16_t){0}
         }, &conf->worker_c));
+    RS_GUARD(parse_worker_pins(jg, root_obj, conf));
     if (!conf->worker_c) {
         long ret = sysconf(_SC_NPROCESSORS_ONLN);
         if (ret == -1) {
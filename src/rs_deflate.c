@@ -0,0 +1,566 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#include "rs_deflate.h"
+#include "rs_util.h" // get_addr_str()
+
+#include <zlib.h> // z_stream, inflate(), deflate(), etc
+
+// The permessage-deflate WebSocket extension (RFC 7692), enabled on a per
+// endpoint basis with "permessage_deflate": true in the configuration file.
+//
+// Outbound: every message an app sends is deflated at most once per worker, no
+// matter how many of its recipients negotiated permessage-deflate, which is
+// only possible because each message is deflated independently of any previous
+// messages; i.e., RingSocket always responds with "server_no_context_takeover",
+// and all of an app's endpoints share the same (smallest) window size. Given
+// that deflating with a fresh context on every message would otherwise be
+// expensive for small messages, messages smaller than RS_DEFLATE_MIN_SIZE bytes
+// are sent uncompressed (which RFC 7692 allows on a per-message basis).
+//
+// Inbound: clients that retain their compression context between messages
+// (i.e., unless "client_no_context_takeover" was agreed upon) get an inflater
+// of their own, which is freed by end_deflate_session() upon peer termination.
+// All other clients share a single inflater that is reset after each message.
+
+#define RS_DEFLATE_MIN_SIZE 64
+#define RS_DEFLATE_MAX_WINDOW_BITS 15
+// zlib deflaters asked for an LZ77 window of 2^8 bytes silently use 2^9 bytes
+// instead, so inflating with a window of 2^8 bytes could fail on their output.
+#define RS_DEFLATE_MIN_INFLATE_WINDOW_BITS 9
+// The longest combined value of all Sec-WebSocket-Extensions headers of a
+// single HTTP upgrade request that is taken into consideration.
+#define RS_DEFLATE_OFFERS_MAX_STRLEN 0xFFF // 4095
+
+// The 4 bytes with which every deflated message ends once flushed with
+// Z_SYNC_FLUSH, which RFC 7692 requires to be removed by the sender and to be
+// appended again by the receiver.
+static uint8_t const deflate_tail[] = {0x00, 0x00, 0xFF, 0xFF};
+
+// Negotiation state of each peer, indexed by peer_i: zeroed unless the peer's
+// HTTP upgrade request contained a valid permessage-deflate offer.
+struct rs_deflate_peer {
+    z_stream * inflater; // Only if the client can take over its context
+    // The raw Sec-WebSocket-Extensions value until an offer is chosen from it
+    char * offers_str;
+    uint16_t offers_strlen;
+    uint8_t has_offer; // boolean
+    uint8_t client_no_context_takeover; // boolean: offered by the client
+    // 0 if not offered, or RS_DEFLATE_MAX_WINDOW_BITS if offered without value
+    uint8_t client_max_window_bits;
+    uint8_t server_max_window_bits; // 0 if not offered
+    uint16_t:16;
+};
+
+struct rs_deflate {
+    struct rs_deflate_peer * peers; // peers_elem_c length array
+    z_stream * * deflaters; // app_c length array of lazily allocated streams
+    z_stream inflater; // Shared by all peers without an inflater of their own
+    uint8_t * inflated; // Of size max_ws_msg_size + 1 (to detect overflow)
+    uint8_t * deflated; // Of size deflated_size
+    size_t deflated_size;
+};
+
+rs_ret init_deflate_state(
+    struct rs_worker * worker
+) {
+    struct rs_conf const * conf = worker->conf;
+    for (size_t i = 0; i < conf->app_c; i++) {
+        if (conf->apps[i].deflate_window_bits) {
+            goto init_deflate_state;
+        }
+    }
+    return RS_OK; // No endpoint has "permessage_deflate" enabled
+    init_deflate_state:
+    RS_CALLOC(worker->deflate, 1);
+    struct rs_deflate * d = worker->deflate;
+    RS_CALLOC(d->peers, worker->peers_elem_c);
+    RS_CALLOC(d->deflaters, conf->app_c);
+    RS_CALLOC(d->inflated, conf->max_ws_msg_size + 1);
+    int ret = inflateInit2(&d->inflater, -RS_DEFLATE_MAX_WINDOW_BITS);
+    if (ret != Z_OK) {
+        RS_LOG(LOG_CRIT, "Unsuccessful inflateInit2(..., %d): %d",
+            -RS_DEFLATE_MAX_WINDOW_BITS, ret);
+        return RS_FATAL;
+    }
+    return RS_OK;
+}
+
+// #############################################################################
+// # Sec-WebSocket-Extensions parsing and negotiation ##########################
+
+static void trim_whitespace(
+    char const * * str,
+    size_t * strlen
+) {
+    while (*strlen && (**str == ' ' || **str == '\t')) {
+        (*str)++;
+        (*strlen)--;
+    }
+    while (*strlen && ((*str)[*strlen - 1] == ' ' ||
+                       (*str)[*strlen - 1] == '\t')) {
+        (*strlen)--;
+    }
+}
+
+static bool token_equals(
+    char const * str,
+    size_t strlen,
+    char const * token // Must be lowercase
+) {
+    for (; strlen; str++, strlen--, token++) {
+        if (!*token ||
+            (*str >= 'A' && *str <= 'Z' ? *str + 32 : *str) != *token) {
+            return false;
+        }
+    }
+    return !*token;
+}
+
+// Returns 0 if str isn't an (optionally quoted) integer in the range [8, 15].
+static uint8_t parse_window_bits(
+    char const * str,
+    size_t strlen
+) {
+    if (strlen > 2 && *str == '"' && str[strlen - 1] == '"') {
+        str++;
+        strlen -= 2;
+    }
+    unsigned bits = 0;
+    for (size_t i = 0; i < strlen; i++) {
+        if (str[i] < '0' || str[i] > '9' || bits > RS_DEFLATE_MAX_WINDOW_BITS) {
+            return 0;
+        }
+        bits = 10 * bits + str[i] - '0';
+    }
+    return bits >= 8 && bits <= RS_DEFLATE_MAX_WINDOW_BITS ? bits : 0;
+}
+
+static bool parse_single_offer(
+    struct rs_deflate_peer * offer,
+    char const * str,
+    size_t strlen
+) {
+    char const * over = str + strlen;
+    char const * param_over = memchr(str, ';', strlen);
+    if (!param_over) {
+        param_over = over;
+    }
+    {
+        char const * name = str;
+        size_t name_strlen = param_over - str;
+        trim_whitespace(&name, &name_strlen);
+        if (!token_equals(name, name_strlen, "permessage-deflate")) {
+            return false;
+        }
+    }
+    bool server_no_context_takeover = false;
+    while (param_over < over) {
+        str = param_over + 1;
+        param_over = memchr(str, ';', over - str);
+        if (!param_over) {
+            param_over = over;
+        }
+        char const * key = str;
+        size_t key_strlen = param_over - str;
+        char const * val = memchr(key, '=', key_strlen);
+        size_t val_strlen = 0;
+        if (val) {
+            key_strlen = val - key;
+            val_strlen = param_over - ++val;
+            trim_whitespace(&val, &val_strlen);
+        }
+        trim_whitespace(&key, &key_strlen);
+        // RFC 7692#section-7: "A server MUST decline an extension negotiation
+        // offer [...] if the negotiation offer contains an extension parameter
+        // not defined for use in an offer [or] with an invalid value [or]
+        // multiple extension parameters with the same name".
+        if (token_equals(key, key_strlen, "server_no_context_takeover")) {
+            if (val || server_no_context_takeover) {
+                return false;
+            }
+            server_no_context_takeover = true;
+        } else if (token_equals(key, key_strlen,
+            "client_no_context_takeover")) {
+            if (val || offer->client_no_context_takeover) {
+                return false;
+            }
+            offer->client_no_context_takeover = true;
+        } else if (token_equals(key, key_strlen, "server_max_window_bits")) {
+            if (!val || offer->server_max_window_bits) {
+                return false;
+            }
+            offer->server_max_window_bits = parse_window_bits(val, val_strlen);
+            if (!offer->server_max_window_bits) {
+                return false;
+            }
+        } else if (token_equals(key, key_strlen, "client_max_window_bits")) {
+            if (offer->client_max_window_bits) {
+                return false;
+            }
+            offer->client_max_window_bits = val ?
+                parse_window_bits(val, val_strlen) : RS_DEFLATE_MAX_WINDOW_BITS;
+            if (!offer->client_max_window_bits) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Store the comma-separated value of a Sec-WebSocket-Extensions header as-is:
+// as long as headers are still being parsed, a subsequent Host header may yet
+// route the peer to a different app and endpoint, so whether any of its
+// permessage-deflate offers is acceptable can't be determined until
+// select_deflate_offer() is called once the HTTP upgrade request is complete.
+rs_ret parse_deflate_offer(
+    struct rs_worker * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i,
+    char const * str,
+    size_t strlen
+) {
+    struct rs_deflate_peer * deflate_peer = worker->deflate->peers + peer_i;
+    // RFC 7230#section-3.2.2: multiple headers with the same name are
+    // equivalent to a single one with their values joined by commas.
+    size_t offset = deflate_peer->offers_str ?
+        deflate_peer->offers_strlen + 1 : 0;
+    if (offset + strlen > RS_DEFLATE_OFFERS_MAX_STRLEN) {
+        RS_LOG(LOG_NOTICE, "Ignoring a Sec-WebSocket-Extensions header of peer "
+            "%s: the combined length of such headers exceeds %d bytes",
+            get_addr_str(peer), RS_DEFLATE_OFFERS_MAX_STRLEN);
+        return RS_OK;
+    }
+    if (deflate_peer->offers_str) {
+        RS_REALLOC(deflate_peer->offers_str, offset + strlen);
+        deflate_peer->offers_str[offset - 1] = ',';
+    } else {
+        RS_CALLOC(deflate_peer->offers_str, strlen);
+    }
+    memcpy(deflate_peer->offers_str + offset, str, strlen);
+    deflate_peer->offers_strlen = offset + strlen;
+    return RS_OK;
+}
+
+// Remember the first acceptable permessage-deflate offer among those stored by
+// parse_deflate_offer(), now that the peer's app and endpoint are final.
+static void select_deflate_offer(
+    struct rs_worker * worker,
+    union rs_peer const * peer,
+    struct rs_deflate_peer * deflate_peer
+) {
+    char * offers_str = deflate_peer->offers_str;
+    char const * str = offers_str;
+    char const * over = str + deflate_peer->offers_strlen;
+    deflate_peer->offers_str = NULL;
+    deflate_peer->offers_strlen = 0;
+    struct rs_conf_app const * app = worker->conf->apps + peer->app_i;
+    if (!app->endpoints[peer->endpoint_i].permessage_deflate) {
+        str = over;
+    }
+    while (!deflate_peer->has_offer && str < over) {
+        char const * offer_over = memchr(str, ',', over - str);
+        if (!offer_over) {
+            offer_over = over;
+        }
+        struct rs_deflate_peer offer = {.has_offer = true};
+        // Decline offers that can't be satisfied without deflating messages
+        // for this peer separately from the app's other recipients.
+        if (parse_single_offer(&offer, str, offer_over - str) &&
+            (!offer.server_max_window_bits ||
+             offer.server_max_window_bits >= app->deflate_window_bits)) {
+            *deflate_peer = offer;
+        }
+        str = offer_over + 1;
+    }
+    RS_FREE(offers_str);
+}
+
+// Returns the window bits with which the client will deflate its messages, or
+// 0 if permessage-deflate can't be used with this peer.
+static uint8_t get_client_window_bits(
+    struct rs_worker * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i
+) {
+    if (!worker->deflate) {
+        return 0;
+    }
+    struct rs_conf_app const * app = worker->conf->apps + peer->app_i;
+    struct rs_conf_endpoint const * endpoint =
+        app->endpoints + peer->endpoint_i;
+    struct rs_deflate_peer * deflate_peer = worker->deflate->peers + peer_i;
+    if (deflate_peer->offers_str) {
+        select_deflate_offer(worker, peer, deflate_peer);
+    }
+    if (!endpoint->permessage_deflate || !deflate_peer->has_offer) {
+        return 0;
+    }
+    // Absent a client_max_window_bits offer, the client must be assumed to use
+    // the maximum window size, in which case RingSocket can't ask for less.
+    return deflate_peer->client_max_window_bits ?
+        RS_MIN(deflate_peer->client_max_window_bits,
+            endpoint->client_max_window_bits) : RS_DEFLATE_MAX_WINDOW_BITS;
+}
+
+size_t get_deflate_response(
+    struct rs_worker * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i,
+    char * dst
+) {
+    uint8_t client_window_bits = get_client_window_bits(worker, peer, peer_i);
+    if (!client_window_bits) {
+        return 0;
+    }
+    struct rs_conf_app const * app = worker->conf->apps + peer->app_i;
+    struct rs_conf_endpoint const * endpoint =
+        app->endpoints + peer->endpoint_i;
+    struct rs_deflate_peer const * deflate_peer =
+        worker->deflate->peers + peer_i;
+    char * const dst_start = dst;
+    dst += sprintf(dst, "Sec-WebSocket-Extensions: permessage-deflate; "
+        "server_no_context_takeover");
+    if (app->deflate_window_bits < RS_DEFLATE_MAX_WINDOW_BITS) {
+        dst += sprintf(dst, "; server_max_window_bits=%" PRIu8,
+            app->deflate_window_bits);
+    }
+    if (endpoint->client_no_context_takeover ||
+        deflate_peer->client_no_context_takeover) {
+        dst += sprintf(dst, "; client_no_context_takeover");
+    }
+    if (client_window_bits < deflate_peer->client_max_window_bits) {
+        dst += sprintf(dst, "; client_max_window_bits=%" PRIu8,
+            client_window_bits);
+    }
+    dst += sprintf(dst, "\r\n");
+    return dst - dst_start;
+}
+
+rs_ret start_deflate_session(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    uint32_t peer_i
+) {
+    uint8_t client_window_bits = get_client_window_bits(worker, peer, peer_i);
+    if (!client_window_bits) {
+        return RS_OK;
+    }
+    peer->ws.is_deflating = true;
+    struct rs_deflate_peer * deflate_peer = worker->deflate->peers + peer_i;
+    if (deflate_peer->client_no_context_takeover || worker->conf->apps[
+        peer->app_i].endpoints[peer->endpoint_i].client_no_context_takeover) {
+        return RS_OK; // The shared inflater will do.
+    }
+    RS_CALLOC(deflate_peer->inflater, 1);
+    int window_bits =
+        -RS_MAX(client_window_bits, RS_DEFLATE_MIN_INFLATE_WINDOW_BITS);
+    int ret = inflateInit2(deflate_peer->inflater, window_bits);
+    if (ret != Z_OK) {
+        RS_LOG(LOG_CRIT, "Unsuccessful inflateInit2(..., %d) for peer %s: %d",
+            window_bits, get_addr_str(peer), ret);
+        return RS_FATAL;
+    }
+    return RS_OK;
+}
+
+void end_deflate_session(
+    struct rs_worker * worker,
+    uint32_t peer_i
+) {
+    if (!worker->deflate) {
+        return;
+    }
+    struct rs_deflate_peer * deflate_peer = worker->deflate->peers + peer_i;
+    if (deflate_peer->inflater) {
+        inflateEnd(deflate_peer->inflater);
+        RS_FREE(deflate_peer->inflater);
+    }
+    RS_FREE(deflate_peer->offers_str); // If the HTTP upgrade was never answered
+    memset(deflate_peer, 0, sizeof(*deflate_peer));
+}
+
+// #############################################################################
+// # Inflating inbound messages ################################################
+
+static rs_ret inflate_chunk(
+    z_stream * inflater,
+    uint8_t const * chunk,
+    uint64_t chunk_size
+) {
+    inflater->next_in = (uint8_t *) chunk;
+    inflater->avail_in = chunk_size;
+    while (inflater->avail_in) {
+        if (!inflater->avail_out) {
+            return RS_AGAIN; // The inflated message is too large.
+        }
+        switch (inflate(inflater, Z_SYNC_FLUSH)) {
+        case Z_OK:
+            continue;
+        case Z_STREAM_END:
+            // The client ended the deflate stream (with a BFINAL block), which
+            // is allowed: any further data starts a new one.
+            if (inflateReset(inflater) != Z_OK) {
+                return RS_CLOSE_PEER;
+            }
+            continue;
+        case Z_BUF_ERROR:
+            // No progress possible, which can only be due to lack of output
+            // space, given that avail_in is non-zero.
+            return RS_AGAIN;
+        default:
+            return RS_CLOSE_PEER; // Corrupt deflate data
+        }
+    }
+    return RS_OK;
+}
+
+// Inflate the payloads of the chain of frames starting at frame into a single
+// contiguous buffer. On RS_CLOSE_PEER, *data_size is set to a value greater
+// than max_ws_msg_size if the inflated data is too large; or to 0 if the
+// deflate data is invalid.
+rs_ret inflate_ws_msg(
+    struct rs_worker * worker,
+    uint32_t peer_i,
+    union rs_wsframe const * frame,
+    uint8_t const * * data,
+    uint64_t * data_size
+) {
+    struct rs_deflate * d = worker->deflate;
+    z_stream * inflater = d->peers[peer_i].inflater;
+    if (!inflater) {
+        inflater = &d->inflater;
+    }
+    inflater->next_out = d->inflated;
+    inflater->avail_out = worker->conf->max_ws_msg_size + 1;
+    rs_ret ret = RS_OK;
+    for (;; frame = rs_get_next_wsframe_cs(frame)) {
+        switch (rs_get_wsframe_opcode(frame)) {
+        case RS_WSFRAME_OPC_PING:
+        case RS_WSFRAME_OPC_PONG:
+            continue;
+        default:
+            break;
+        }
+        uint8_t * payload = NULL;
+        uint64_t payload_size = rs_get_wsframe_cs_payload(frame, &payload);
+        if ((ret = inflate_chunk(inflater, payload, payload_size)) != RS_OK) {
+            goto inflate_failure;
+        }
+        if (rs_get_wsframe_is_final(frame)) {
+            break;
+        }
+    }
+    if ((ret = inflate_chunk(inflater, deflate_tail, sizeof(deflate_tail))) !=
+        RS_OK) {
+        goto inflate_failure;
+    }
+    *data = d->inflated;
+    *data_size = inflater->next_out - d->inflated;
+    if (*data_size > worker->conf->max_ws_msg_size) {
+        ret = RS_AGAIN;
+        goto inflate_failure;
+    }
+    if (inflater == &d->inflater && inflateReset(inflater) != Z_OK) {
+        return RS_FATAL;
+    }
+    return RS_OK;
+    inflate_failure:
+    // Regardless of context takeover, the peer is about to be shut down.
+    if (inflater == &d->inflater && inflateReset(inflater) != Z_OK) {
+        return RS_FATAL;
+    }
+    *data_size = ret == RS_AGAIN ? worker->conf->max_ws_msg_size + 1 : 0;
+    return RS_CLOSE_PEER;
+}
+
+// #############################################################################
+// # Deflating outbound messages ###############################################
+
+static rs_ret get_deflater(
+    struct rs_worker * worker,
+    size_t app_i,
+    z_stream * * deflater
+) {
+    z_stream * * d = worker->deflate->deflaters + app_i;
+    if (!*d) {
+        RS_CALLOC(*d, 1);
+        int window_bits = -worker->conf->apps[app_i].deflate_window_bits;
+        int ret = deflateInit2(*d, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+            window_bits, 8, Z_DEFAULT_STRATEGY);
+        if (ret != Z_OK) {
+            RS_LOG(LOG_CRIT, "Unsuccessful deflateInit2(..., %d, ...): %d",
+                window_bits, ret);
+            return RS_FATAL;
+        }
+    }
+    *deflater = *d;
+    return RS_OK;
+}
+
+// Create a deflated RSV1 copy of the given TEXT or BINARY frame on a worker
+// buffer that remains valid until the next call to this function. Sets
+// *deflated_frame to NULL if deflating isn't worthwhile.
+rs_ret deflate_outbound_frame(
+    struct rs_worker * worker,
+    size_t app_i,
+    union rs_wsframe const * frame,
+    union rs_wsframe * * deflated_frame,
+    uint64_t * deflated_frame_size
+) {
+    *deflated_frame = NULL;
+    switch (rs_get_wsframe_opcode(frame)) {
+    case RS_WSFRAME_OPC_TEXT:
+    case RS_WSFRAME_OPC_BIN:
+        break;
+    default:
+        return RS_OK; // Control frames must not be compressed.
+    }
+    uint64_t payload_size = rs_get_wsframe_payload_size(frame);
+    if (payload_size < RS_DEFLATE_MIN_SIZE) {
+        return RS_OK;
+    }
+    struct rs_deflate * d = worker->deflate;
+    z_stream * deflater = NULL;
+    RS_GUARD(get_deflater(worker, app_i, &deflater));
+    // deflateBound() assumes Z_FINISH, which is smaller than the empty stored
+    // block appended by Z_SYNC_FLUSH (i.e., deflate_tail) plus its header bits.
+    size_t required_size = sizeof(union rs_wsframe) +
+        deflateBound(deflater, payload_size) + 2 * sizeof(deflate_tail);
+    if (d->deflated_size < required_size) {
+        RS_FREE(d->deflated);
+        d->deflated_size = required_size;
+        RS_CALLOC(d->deflated, d->deflated_size);
+    }
+    // Leave room for the largest possible frame head in front of the data.
+    uint8_t * data = d->deflated + sizeof(union rs_wsframe);
+    deflater->next_in = (uint8_t *) frame +
+        rs_get_wsframe_sc_size(frame) - payload_size;
+    deflater->avail_in = payload_size;
+    deflater->next_out = data;
+    deflater->avail_out = d->deflated_size - sizeof(union rs_wsframe);
+    int ret = deflate(deflater, Z_SYNC_FLUSH);
+    uint64_t data_size = deflater->next_out - data;
+    if (deflateReset(deflater) != Z_OK || ret != Z_OK ||
+        deflater->avail_in || data_size < sizeof(deflate_tail)) {
+        RS_LOG(LOG_CRIT, "Unsuccessful deflate() of a %" PRIu64 " byte "
+            "payload: %d", payload_size, ret);
+        return RS_FATAL;
+    }
+    data_size -= sizeof(deflate_tail);
+    if (data_size >= payload_size) {
+        return RS_OK;
+    }
+    union rs_wsframe * f = (union rs_wsframe *) (data -
+        (rs_get_wsframe_sc_size_from_payload_size(data_size) - data_size));
+    rs_clear_wsframe_bit_fields(f);
+    rs_set_wsframe_is_final(f, true);
+    f->reserved_x70 |= 0x40; // RSV1: the "Per-Message Compressed" bit
+    rs_set_wsframe_opcode(f, rs_get_wsframe_opcode(frame));
+    rs_set_wsframe_sc_payload_size(f, data_size);
+    *deflated_frame = f;
+    *deflated_frame_size = data + data_size - (uint8_t *) f;
+    return RS_OK;
+}
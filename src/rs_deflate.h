@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#pragma once
+
+#include "rs_worker.h"
+
+// The longest possible Sec-WebSocket-Extensions response header line (including
+// its trailing CRLF) that get_deflate_response() may write.
+#define RS_DEFLATE_RESPONSE_MAX_STRLEN 160
+
+rs_ret init_deflate_state(
+    struct rs_worker * worker
+);
+
+rs_ret parse_deflate_offer(
+    struct rs_worker * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i,
+    char const * str,
+    size_t strlen
+);
+
+size_t get_deflate_response(
+    struct rs_worker * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i,
+    char * dst // Must have room for RS_DEFLATE_RESPONSE_MAX_STRLEN chars
+);
+
+rs_ret start_deflate_session(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    uint32_t peer_i
+);
+
+void end_deflate_session(
+    struct rs_worker * worker,
+    uint32_t peer_i
+);
+
+rs_ret inflate_ws_msg(
+    struct rs_worker * worker,
+    uint32_t peer_i,
+    union rs_wsframe const * frame,
+    uint8_t const * * data,
+    uint64_t * data_size
+);
+
+rs_ret deflate_outbound_frame(
+    struct rs_worker * worker,
+    size_t app_i,
+    union rs_wsframe const * frame,
+    union rs_wsframe * * deflated_frame,
+    uint64_t * deflated_frame_size
+);
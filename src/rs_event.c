@@ -1,11 +1,14 @@
 // SPDX-License-Identifier: MIT
 // Copyright © 2019 William Budd
 
+#define _POSIX_C_SOURCE 201112L // clock_gettime(), CLOCK_MONOTONIC
+
 #include "rs_event.h"
 #include "rs_from_app.h" // receive_from_app(), remove_pending_owrefs()
 #include "rs_http.h" // handle_http_io()
 #include "rs_socket.h" // listen_to_sockets(), accept_sockets(), etc
 #include "rs_tcp.h" // handle_tcp_io()
+#include "rs_timer.h" // init_timer_wheel(), expire_timers()
 #include "rs_tls.h" // handle_tls_io()
 #include "rs_to_app.h" // send_open_to_app(), send_close_to_app()
 #include "rs_util.h" // get_addr_str(), get_epoll_events_str()
@@ -13,6 +16,17 @@
 
 #include <sys/epoll.h>
 
+// Count the closure of a peer that wasn't already closing for another reason.
+static void count_hangup(
+    struct rs_worker * worker,
+    union rs_peer const * peer
+) {
+    if (peer->mortality == RS_MORTALITY_LIVE) {
+        RS_METRICS_ADD(
+            worker->metrics->close_c_by_reason[RS_CLOSE_REASON_HANGUP], 1);
+    }
+}
+
 rs_ret handle_peer_events(
     struct rs_worker * worker,
     uint32_t peer_i,
@@ -24,6 +38,7 @@ rs_ret handle_peer_events(
         RS_LOG(LOG_WARNING, "Received EPOLLERR (all events: %s)",
             get_epoll_events_str(events));
         // Should not be a common occurence. Fail fast to free up resources.
+        count_hangup(worker, peer);
         peer->mortality = RS_MORTALITY_DEAD;
         if (peer->layer == RS_LAYER_WEBSOCKET) {
             // handle_ws_io() assumes that send_close_to_app() and
@@ -42,6 +57,7 @@ rs_ret handle_peer_events(
         // in transit, provided that the peer is on the WebSocket layer -- so
         // only fail fast on other layers.
         if (peer->layer != RS_LAYER_WEBSOCKET) {
+            count_hangup(worker, peer);
             peer->mortality = RS_MORTALITY_DEAD;
         }
     } else if (events & EPOLLRDHUP) {
@@ -55,6 +71,7 @@ rs_ret handle_peer_events(
         // continue processing as usual if on the WebSocket layer; but fail
         // fast on any other layer.
         if (peer->layer != RS_LAYER_WEBSOCKET) {
+            count_hangup(worker, peer);
             peer->mortality = RS_MORTALITY_DEAD;
         }
     }
@@ -93,30 +110,63 @@ rs_ret handle_peer_events(
     return RS_OK;
 }
 
-void set_shutdown_deadline(
-    union rs_peer * peer,
-    size_t wait_interval
+static rs_ret watch_fd(
+    int epoll_fd,
+    int fd,
+    enum rs_event_kind kind
 ) {
-    // Convert the deadline time to an uint16_t greater than 0.
-    peer->shutdown_deadline = (time(NULL) + wait_interval) % 0xFFFF + 1;
+    struct epoll_event event = {
+        .data = {.u64 = (uint64_t) fd << 32 | kind},
+        .events = EPOLLIN | EPOLLET
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful epoll_ctl(%d, EPOLL_CTL_ADD, %d, "
+            "&event)", epoll_fd, fd);
+        return RS_FATAL;
+    }
+    return RS_OK;
 }
 
-static rs_ret enforce_shutdown_deadlines(
-    struct rs_worker * worker,
-    time_t timestamp
+static bool app_msg_is_pending(
+    struct rs_worker * worker
 ) {
-    uint16_t t = timestamp % 0xFFFF + 1;
-    for (union rs_peer * p = worker->peers; p <= worker->peers +
-        worker->highest_peer_i; p++) {
-        if (p->shutdown_deadline &&
-            (p->shutdown_deadline < t || p->shutdown_deadline > t + 0x7FFF)) {
-            p->mortality = RS_MORTALITY_DEAD;
-            // Calling handle_peer_events() with a MORTALITY_DEAD peer (but
-            // without any actual events) allows cleanup to take place through
-            // all relevant layers.
-            RS_GUARD(handle_peer_events(worker, p - worker->peers, 0));
+    for (size_t app_i = 0; app_i < worker->conf->app_c; app_i++) {
+        uint8_t * w = NULL;
+        RS_CASTED_ATOMIC_LOAD_RELAXED(
+            &worker->ring_pairs[app_i]->outbound_ring.w, w, (uint8_t *));
+        if (w != worker->outbound_consumers[app_i].r) {
+            return true;
         }
     }
+    return false;
+}
+
+// Called by the event loop (of either kind) whenever it finds no events to
+// handle. Returns RS_AGAIN if it should poll for events again rather than go to
+// sleep, or RS_OK if it should go to sleep.
+rs_ret busy_poll(
+    struct rs_worker * worker
+) {
+    if (rs_keep_spinning(&worker->spin)) {
+        if (!worker->is_spinning) {
+            // Withdraw the sleep announcement for the duration of the spin,
+            // which spares apps the eventfd writes that would otherwise be
+            // wasted on this thread: outbound rings are polled here instead.
+            worker->is_spinning = true;
+            RS_ATOMIC_STORE_RELAXED(&worker->sleep_state->is_asleep, false);
+        }
+        if (app_msg_is_pending(worker)) {
+            rs_end_idle(&worker->spin);
+            RS_GUARD(receive_from_app(worker));
+        }
+        return RS_AGAIN;
+    }
+    if (worker->is_spinning) {
+        // The spin is over: have the event loop announce sleep and poll once
+        // more before actually sleeping, as per the usual protocol.
+        worker->is_spinning = false;
+        return RS_AGAIN;
+    }
     return RS_OK;
 }
 
@@ -130,22 +180,10 @@ rs_ret loop_over_events(
     }
     RS_LOG(LOG_DEBUG, "Created an epoll_fd: fd=%d", epoll_fd);
     RS_GUARD(listen_to_sockets(worker, epoll_fd));
-    {
-        struct epoll_event event = {
-            .data = {.u64 = *((uint64_t *) (uint32_t []){
-                RS_EVENT_EVENTFD,
-                worker->eventfd
-            })},
-            .events = EPOLLIN | EPOLLET
-        };
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, worker->eventfd, &event) == -1) {
-            RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful epoll_ctl(%d, "
-                "EPOLL_CTL_ADD, %d (worker->eventfd), &event)", epoll_fd,
-                worker->eventfd);
-            return RS_FATAL;
-        }
-    }
-    time_t timestamp = time(NULL);
+    RS_GUARD(watch_fd(epoll_fd, worker->eventfd, RS_EVENT_EVENTFD));
+    RS_GUARD(init_timer_wheel(worker));
+    RS_GUARD(watch_fd(epoll_fd, worker->timer_wheel.timerfd,
+        RS_EVENT_TIMERFD));
     // Allocate the epoll buffer on the heap too, just in case it could be
     // large enough to gobble up too much stack space.
     struct epoll_event * epoll_buf = NULL;
@@ -157,8 +195,11 @@ rs_ret loop_over_events(
         // returned from 1st epoll_wait() call below, or when the 2nd
         // epoll_wait() call below returns immediately). This ensures that an
         // eventfd event will occur on the 2nd call to epoll_wait() immediately
-        // after an app dequeues an outbound ring update.
-        RS_ATOMIC_STORE_RELAXED(&worker->sleep_state->is_asleep, true);
+        // after an app dequeues an outbound ring update. (Unless busy polling,
+        // in which case this was already done prior to starting the spin.)
+        if (!worker->is_spinning) {
+            RS_ATOMIC_STORE_RELAXED(&worker->sleep_state->is_asleep, true);
+        }
 
         // [1st epoll_wait() call] There may be ring pointer updates pending,
         // but because memory_order_relaxed was used and because the
@@ -176,10 +217,19 @@ rs_ret loop_over_events(
         flush_ring_updates(worker);
 
         if (!event_c) {
+            switch (busy_poll(worker)) {
+            case RS_OK:
+                break;
+            case RS_AGAIN:
+                continue;
+            default:
+                return RS_FATAL;
+            }
             // [2nd epoll_wait() call] A timeout of 0 was needed above to
             // guarantee an opportunity to call flush_ring_updates(), but no
             // events have ocurred yet; so this time call epoll_wait without
             // any timeout (-1) to obtain an event_c > 0.
+            rs_begin_sleep(&worker->spin);
             event_c = epoll_wait(epoll_fd, epoll_buf,
                 worker->conf->epoll_buf_elem_c, -1);
             if (event_c == -1) {
@@ -188,20 +238,15 @@ rs_ret loop_over_events(
                     epoll_fd, worker->conf->epoll_buf_elem_c);
                 return RS_FATAL;
             }
+            rs_end_sleep(&worker->spin);
         }
+        rs_end_idle(&worker->spin);
+        worker->is_spinning = false;
         // Tell apps they can dequeue to outbound rings now without eventfds.
         RS_ATOMIC_STORE_RELAXED(&worker->sleep_state->is_asleep, false);
         for (struct epoll_event * e = epoll_buf; e < epoll_buf + event_c; e++) {
-            uint32_t e_kind = 0;
-            uint32_t e_data = 0;
-            {
-                uint64_t u64 = e->data.u64;
-                // If p were to be assigned directly from &e->data.u64,
-                // GCC 9+ would complain about -Waddress-of-packed-member.
-                uint32_t * p = (uint32_t *) &u64;
-                e_kind = *p++;
-                e_data = *p;
-            }
+            uint32_t const e_kind = (uint32_t) e->data.u64;
+            uint32_t const e_data = e->data.u64 >> 32;
             if (e_kind == RS_EVENT_PEER) {
                 RS_GUARD(handle_peer_events(worker, e_data, e->events));
                 continue;
@@ -209,13 +254,13 @@ rs_ret loop_over_events(
             if (e->events & EPOLLERR) {
                 RS_LOG(LOG_ERR, "Event EPOLLERR occurred on %s fd %d",
                     (char *[]){"???", "encrypted listen", "unencrypted listen",
-                    "event"}[e_kind], (int) e_data);
+                    "event", "timer"}[RS_MIN(e_kind, 4)], (int) e_data);
                 return RS_FATAL;
             }
             if (e->events & EPOLLHUP) {
                 RS_LOG(LOG_ERR, "Event EPOLLHUP occurred on %s fd %d",
                     (char *[]){"???", "encrypted listen", "unencrypted listen",
-                    "event"}[e_kind], (int) e_data);
+                    "event", "timer"}[RS_MIN(e_kind, 4)], (int) e_data);
                 return RS_FATAL;
             }
             switch (e_kind) {
@@ -226,6 +271,9 @@ rs_ret loop_over_events(
                 RS_GUARD(accept_sockets(worker, epoll_fd, e_data,
                     false));
                 continue;
+            case RS_EVENT_TIMERFD:
+                RS_GUARD(expire_timers(worker));
+                continue;
             case RS_EVENT_EVENTFD: default:
                 if (read((int) e_data, (uint64_t []){0}, 8) != 8) {
                     RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful read(eventfd, ...)");
@@ -236,10 +284,5 @@ rs_ret loop_over_events(
             }
         }
         RS_GUARD(receive_from_app(worker));
-        time_t new_timestamp = time(NULL);
-        if (new_timestamp > timestamp + 60) { // No more than 1 check per minute
-            timestamp = new_timestamp;
-            RS_GUARD(enforce_shutdown_deadlines(worker, timestamp));
-        }
     }
 }
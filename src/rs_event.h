@@ -5,13 +5,16 @@
 
 #include "rs_worker.h"
 
-// Stored as the left half of epoll event .u64 data to indicate the contents
-// of that .u64 data's right half.
+// Stored as the lower 32 bits of epoll event .u64 data (and io_uring user_data)
+// to indicate the contents of its upper 32 bits: (uint64_t) data << 32 | kind.
+// Shifting rather than type-punning through a uint32_t array keeps this layout
+// clear of strict aliasing violations, and endianness-independent.
 enum rs_event_kind {
     RS_EVENT_PEER = 0,
     RS_EVENT_ENCRYPTED_LISTENFD = 1,
     RS_EVENT_UNENCRYPTED_LISTENFD = 2,
-    RS_EVENT_EVENTFD = 3
+    RS_EVENT_EVENTFD = 3,
+    RS_EVENT_TIMERFD = 4
 };
 
 rs_ret handle_peer_events(
@@ -20,9 +23,8 @@ rs_ret handle_peer_events(
     uint32_t events
 );
 
-void set_shutdown_deadline(
-    union rs_peer * peer,
-    size_t wait_interval
+rs_ret busy_poll(
+    struct rs_worker * worker
 );
 
 rs_ret loop_over_events(
@@ -1,15 +1,27 @@
 // SPDX-License-Identifier: MIT
 // Copyright © 2019 William Budd
 
+#define _POSIX_C_SOURCE 201112L // clock_gettime(), CLOCK_MONOTONIC
+
+#include "rs_deflate.h" // deflate_outbound_frame()
 #include "rs_event.h" // handle_peer_events()
 #include "rs_from_app.h"
-#include "rs_tcp.h" // write_tcp()
+#include "rs_tcp.h" // write_tcp_vector()
 #include "rs_tls.h" // write_tls()
-#include "rs_to_app.h" // send_close_to_app()
+#include "rs_to_app.h" // send_close_to_app(), send_pause_to_app()
 #include "rs_util.h" // get_addr_str(), move_left()
+#include "rs_websocket.h" // start_backpressure_close()
 
 // "owref" is an abbreviation of "Outbound Write REFerence"
 
+// The maximum number of pending owref frames sent to a peer with a single
+// writev() or SSL_write_ex() call. Equals Linux's IOV_MAX.
+#define RS_OWREF_BATCH_MAX 1024
+
+// Owref frames sent to TLS peers are copied into a coalescing buffer of this
+// size (the maximum TLS record payload size) in order to be encrypted together.
+#define RS_TLS_COALESCE_SIZE 0x4000
+
 rs_ret get_outbound_consumers_from_producers(
     struct rs_worker * worker
 ) {
@@ -32,35 +44,449 @@ rs_ret init_owrefs(
     worker->owrefs_elem_c = worker->conf->owrefs_elem_c;
     RS_CALLOC(worker->owrefs, worker->owrefs_elem_c);
     RS_CALLOC(worker->oldest_owref_i_by_app, worker->conf->app_c);
+    RS_CALLOC(worker->owref_queues, worker->peers_elem_c);
+    if (worker->conf->cert_c) {
+        RS_CALLOC(worker->tls_wbuf, RS_TLS_COALESCE_SIZE);
+        RS_CALLOC(worker->tls_batch_c_by_peer, worker->peers_elem_c);
+    }
     return RS_OK;
 }
 
-static rs_ret send_newest_msg(
+// A heap-allocated copy of the permessage-deflate compressed variant of an
+// outbound frame, referenced by struct rs_owref's .deflated member.
+struct rs_deflated_frame {
+    uint64_t frame_size;
+    uint8_t frame[];
+};
+
+// The newest message received from an app, as shared by the send_newest_msg()
+// calls of all its recipients.
+struct rs_newest_msg {
+    struct rs_consumer_msg const * cmsg;
+    union rs_wsframe * frame;
+    uint64_t frame_size;
+    // The frame to send to peers with which permessage-deflate was negotiated:
+    // a deflated copy on a buffer of rs_deflate.c, or frame itself if deflating
+    // isn't worthwhile. NULL until the first such recipient is encountered.
+    union rs_wsframe * deflated_frame;
+    uint64_t deflated_frame_size;
+    // Allocated only once the deflated frame needs to outlive this message's
+    // processing, as a result of a deflating recipient pending for later.
+    struct rs_deflated_frame * deflated;
+    size_t remaining_recipient_c;
+    size_t app_i;
+};
+
+// Obtain the WebSocket frame of an outbound message with a head of head_size
+// bytes, regardless of whether the frame is stored on the ring itself or
+// referenced through a struct rs_shared_frame pointer (see ringsocket_app.h).
+static union rs_wsframe * get_outbound_frame(
+    struct rs_consumer_msg const * cmsg,
+    size_t head_size,
+    uint64_t * frame_size
+) {
+    if (*cmsg->msg & RS_OUTBOUND_SHARED) {
+        struct rs_shared_frame * shared =
+            *((struct rs_shared_frame * const *) (cmsg->msg + head_size));
+        *frame_size = shared->frame_size;
+        return (union rs_wsframe *) shared->frame;
+    }
+    *frame_size = cmsg->size - head_size;
+    return (union rs_wsframe *) (cmsg->msg + head_size);
+}
+
+// Like get_outbound_frame(), but obtain the deflated frame instead if the owref
+// has one and the peer negotiated permessage-deflate.
+static union rs_wsframe * get_owref_frame(
+    struct rs_owref const * owref,
+    union rs_peer const * peer,
+    uint64_t * frame_size
+) {
+    if (owref->deflated && peer->ws.is_deflating) {
+        *frame_size = owref->deflated->frame_size;
+        return (union rs_wsframe *) owref->deflated->frame;
+    }
+    return get_outbound_frame(owref->cmsg, owref->head_size, frame_size);
+}
+
+// To be called once this worker is done sending the outbound message to all of
+// its recipients. If the message refers to a struct rs_shared_frame, release
+// this worker's reference to it, and free() it if no other worker holds one.
+static void release_outbound_frame(
+    struct rs_consumer_msg const * cmsg,
+    size_t head_size
+) {
+    if (!(*cmsg->msg & RS_OUTBOUND_SHARED)) {
+        return;
+    }
+    struct rs_shared_frame * shared =
+        *((struct rs_shared_frame * const *) (cmsg->msg + head_size));
+    // Unlike ring buffer pointers, reference counts are only updated once per
+    // broadcast per worker, so the cost of acquire/release semantics is moot.
+    if (atomic_fetch_sub_explicit(&shared->ref_c, 1,
+        memory_order_acq_rel) == 1) {
+        RS_FREE(shared);
+    }
+}
+
+// If the outbound message msg is timed (see RS_OUTBOUND_TIMED in
+// ringsocket_app.h), record its latencies up until now: the time at which its
+// write to a peer completed. Any subsequent calls for the same batch of writes
+// reuse the time obtained through *write_time_ns by the 1st call.
+static void record_write_latencies(
+    struct rs_worker * worker,
+    uint8_t const * msg,
+    size_t app_i,
+    uint64_t * write_time_ns
+) {
+    if (!(*msg & RS_OUTBOUND_TIMED)) {
+        return;
+    }
+    if (!*write_time_ns) {
+        *write_time_ns = rs_get_spin_time_ns();
+    }
+    uint64_t produce_time_ns = 0;
+    uint64_t read_time_ns = 0;
+    memcpy(&produce_time_ns, msg + 1, 8);
+    memcpy(&read_time_ns, msg + 9, 8);
+    struct rs_pair_latency * latency = worker->latencies + app_i;
+    rs_record_latency(&latency->outbound, produce_time_ns, *write_time_ns);
+    if (read_time_ns) {
+        rs_record_latency(&latency->end_to_end, read_time_ns, *write_time_ns);
+    }
+}
+
+// Append worker->newest_owref_i to the peer's queue of pending owref indices,
+// where frame_size is that of the frame it is to be sent to the peer as.
+static rs_ret enqueue_newest_owref(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    uint32_t peer_i,
+    uint64_t frame_size
+) {
+    struct rs_owref_queue * queue = worker->owref_queues + peer_i;
+    if (peer->ws.owref_c == queue->elem_c) {
+        if (queue->owref_is) {
+            // Double the queue's size, then move any elements wrapped around
+            // to the start of the array to the newly added space right after
+            // the old end of the array: thanks to the power of 2 sizes, doing
+            // so keeps every element at its masked position.
+            RS_REALLOC(queue->owref_is, 2 * queue->elem_c);
+            memcpy(queue->owref_is + queue->elem_c, queue->owref_is,
+                peer->ws.owref_head_i * sizeof(uint32_t));
+            queue->elem_c *= 2;
+        } else {
+            queue->elem_c = 8;
+            RS_CALLOC(queue->owref_is, queue->elem_c);
+        }
+    }
+    queue->owref_is[(peer->ws.owref_head_i + peer->ws.owref_c++) &
+        (queue->elem_c - 1)] = worker->newest_owref_i;
+    queue->byte_c += frame_size;
+    RS_METRICS_ADD(worker->metrics->queued_owref_c, 1);
+    return RS_OK;
+}
+
+// Get the owref index of the peer's pending message at queue position i, where
+// i == 0 refers to its oldest pending message.
+static size_t get_pending_owref_i(
+    struct rs_worker const * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i,
+    size_t i
+) {
+    struct rs_owref_queue const * queue = worker->owref_queues + peer_i;
+    return queue->owref_is[(peer->ws.owref_head_i + i) & (queue->elem_c - 1)];
+}
+
+static void decrement_pending_owref_count(
+    struct rs_worker * worker,
+    size_t owref_i
+) {
+    struct rs_owref * owref = worker->owrefs + owref_i;
+    if (--owref->remaining_recipient_c) {
+        // One or more of this owref's recipients remain, so the owref itself
+        // must remain too for now.
+        return;
+    }
+    release_outbound_frame(owref->cmsg, owref->head_size);
+    if (owref->deflated) {
+        RS_FREE(owref->deflated);
+    }
+    RS_METRICS_SUB(worker->metrics->owref_c, 1);
+    size_t app_i = owref->app_i;
+    memset(owref, 0, sizeof(struct rs_owref));
+    if (owref_i != worker->oldest_owref_i_by_app[app_i]) {
+        // This owref is done, but an older one is still pending for this app,
+        // so enqueue_ring_update() cannot be called yet.
+        return;
+    }
+    do {
+        owref_i++;
+        owref_i %= worker->owrefs_elem_c;
+        if (owref_i == worker->newest_owref_i) {
+            // All owrefs for this app are done, so enqueue up to the reader,
+            // unless the reader already moved past a message of this app that
+            // receive_from_app() is still processing (e.g., when dropping this
+            // owref made room for queueing that message): enqueue up to that
+            // message then, because it may yet become an owref itself.
+            uint8_t * r = (uint8_t *) worker->outbound_consumers[app_i].r;
+            if (worker->newest_msg && worker->newest_msg->app_i == app_i) {
+                r = (uint8_t *) worker->newest_msg->cmsg;
+            }
+            enqueue_ring_update(worker, r, app_i, false);
+            worker->oldest_owref_i_by_app[app_i] = owref_i;
+            RS_LOG(LOG_DEBUG, "Enqueued ring update for app_i %zu up to "
+            "worker->outbound_readers[%zu]", app_i, app_i);
+            return;
+        }
+    } while (!worker->owrefs[owref_i].remaining_recipient_c ||
+        worker->owrefs[owref_i].app_i != app_i);
+    // Enqueue up to the message pointed at by the owref with index owref_i
+    // (because that message is this app's next message that has remaining
+    // recipients, which therefore cannot be enqueued yet).
+    enqueue_ring_update(worker, (uint8_t *) worker->owrefs[owref_i].cmsg, app_i,
+        false);
+    worker->oldest_owref_i_by_app[app_i] = owref_i;
+    RS_LOG(LOG_INFO, "Enqueued ring update for app_i %zu up to the message "
+        "corresponding to owref_i: %zu", app_i, owref_i);
+}
+
+// Remove the peer's frame_c oldest pending owrefs from its queue, releasing any
+// owrefs of which the peer was the last remaining recipient.
+static void dequeue_pending_owrefs(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    uint32_t peer_i,
+    int frame_c
+) {
+    struct rs_owref_queue * queue = worker->owref_queues + peer_i;
+    for (; frame_c && peer->ws.owref_c; frame_c--, peer->ws.owref_c--) {
+        size_t owref_i = queue->owref_is[peer->ws.owref_head_i];
+        uint64_t frame_size = 0;
+        get_owref_frame(worker->owrefs + owref_i, peer, &frame_size);
+        queue->byte_c -= frame_size;
+        decrement_pending_owref_count(worker, owref_i);
+        peer->ws.owref_head_i++;
+        peer->ws.owref_head_i &= queue->elem_c - 1;
+        RS_METRICS_SUB(worker->metrics->queued_owref_c, 1);
+    }
+}
+
+// Deflate the newest message's frame, unless that was already done for one of
+// its previous recipients.
+static rs_ret get_deflated_frame(
+    struct rs_worker * worker,
+    struct rs_newest_msg * msg
+) {
+    if (!msg->deflated_frame) {
+        RS_GUARD(deflate_outbound_frame(worker, msg->app_i, msg->frame,
+            &msg->deflated_frame, &msg->deflated_frame_size));
+        if (!msg->deflated_frame) {
+            msg->deflated_frame = msg->frame;
+            msg->deflated_frame_size = msg->frame_size;
+        }
+    }
+    return RS_OK;
+}
+
+// Ensure that the deflated frame remains available to owrefs after rs_deflate.c
+// reuses its buffer for the next message.
+static rs_ret keep_deflated_frame(
+    struct rs_newest_msg * msg
+) {
+    if (msg->deflated || msg->deflated_frame == msg->frame) {
+        return RS_OK;
+    }
+    // Because of the flexible array member .frame, use "raw" malloc() instead
+    // of the macros of ringsocket_api.h.
+    msg->deflated = malloc(sizeof(*msg->deflated) + msg->deflated_frame_size);
+    if (!msg->deflated) {
+        RS_LOG(LOG_ALERT, "Failed to malloc().");
+        return RS_FATAL;
+    }
+    msg->deflated->frame_size = msg->deflated_frame_size;
+    memcpy(msg->deflated->frame, msg->deflated_frame,
+        msg->deflated_frame_size);
+    return RS_OK;
+}
+
+// Get the number of the peer's oldest pending owrefs of which writing out has
+// already begun, which must therefore neither be dropped nor be followed by
+// anything other than their own remainder.
+static size_t get_begun_owref_c(
+    struct rs_worker const * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i
+) {
+    if (peer->is_encrypted) {
+        return worker->tls_batch_c_by_peer[peer_i];
+    }
+    return !!peer->old_wsize;
+}
+
+// Remove the owref at queue position i from the peer's queue, releasing it if
+// the peer was its last remaining recipient.
+static void drop_pending_owref(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    uint32_t peer_i,
+    size_t i
+) {
+    struct rs_owref_queue * queue = worker->owref_queues + peer_i;
+    size_t mask = queue->elem_c - 1;
+    uint32_t owref_i = queue->owref_is[(peer->ws.owref_head_i + i) & mask];
+    // Move any older owref indices up by one position, in order to let
+    // dequeue_pending_owrefs() take care of the one at the head instead.
+    for (; i; i--) {
+        queue->owref_is[(peer->ws.owref_head_i + i) & mask] =
+            queue->owref_is[(peer->ws.owref_head_i + i - 1) & mask];
+    }
+    queue->owref_is[peer->ws.owref_head_i] = owref_i;
+    dequeue_pending_owrefs(worker, peer, peer_i, 1);
+    RS_METRICS_ADD(worker->metrics->backpressure_drop_c, 1);
+}
+
+static bool exceeds_backpressure_limits(
+    struct rs_worker const * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i,
+    struct rs_conf_endpoint const * endpoint,
+    uint64_t frame_size
+) {
+    return peer->ws.owref_c >= endpoint->max_queued_msg_c ||
+        worker->owref_queues[peer_i].byte_c + frame_size >
+        endpoint->max_queued_byte_c;
+}
+
+// To be called for the newest message before queueing it for a peer to which
+// it can't be written right away, in order to prevent any single peer that
+// fails to keep up from pinning an unbounded amount of outbound ring memory
+// (which would hold up the rings of all peers of the app on this worker).
+// Returns RS_OK if the message may be queued, RS_AGAIN if it must be discarded
+// instead, or RS_CLOSE_PEER if the peer must be disconnected.
+static rs_ret apply_backpressure_policy(
     struct rs_worker * worker,
-    size_t * remaining_recipient_c,
+    union rs_peer * peer,
     uint32_t peer_i,
-    union rs_wsframe * frame,
+    union rs_wsframe const * frame,
     uint64_t frame_size
+) {
+    if (rs_get_wsframe_opcode(frame) == RS_WSFRAME_OPC_CLOSE) {
+        // Never discard a Close frame sent by the app.
+        return RS_OK;
+    }
+    if (peer->ws.is_paused) {
+        RS_METRICS_ADD(worker->metrics->backpressure_drop_c, 1);
+        return RS_AGAIN;
+    }
+    struct rs_conf_endpoint const * endpoint =
+        worker->conf->apps[peer->app_i].endpoints + peer->endpoint_i;
+    if (!exceeds_backpressure_limits(worker, peer, peer_i, endpoint,
+        frame_size)) {
+        return RS_OK;
+    }
+    switch (endpoint->backpressure_policy) {
+    case RS_BACKPRESSURE_DISCONNECT: default:
+        RS_LOG(LOG_INFO, "Disconnecting peer %s, because queueing another "
+            "%" PRIu64 " byte message would exceed its limits with %" PRIu16
+            " messages of %" PRIu64 " bytes pending already.",
+            get_addr_str(peer), frame_size, peer->ws.owref_c,
+            worker->owref_queues[peer_i].byte_c);
+        return RS_CLOSE_PEER;
+    case RS_BACKPRESSURE_DROP_OLDEST:
+        for (size_t i = get_begun_owref_c(worker, peer, peer_i);
+            i < peer->ws.owref_c;) {
+            struct rs_owref const * owref =
+                worker->owrefs + get_pending_owref_i(worker, peer, peer_i, i);
+            uint64_t old_frame_size = 0;
+            if (rs_get_wsframe_opcode(get_owref_frame(owref, peer,
+                &old_frame_size)) == RS_WSFRAME_OPC_CLOSE) {
+                // Nothing queued after a Close frame would be sent anyway.
+                break;
+            }
+            drop_pending_owref(worker, peer, peer_i, i);
+            if (!exceeds_backpressure_limits(worker, peer, peer_i, endpoint,
+                frame_size)) {
+                return RS_OK;
+            }
+        }
+        // Dropping older messages didn't suffice: drop the newest one too.
+        // Fall through
+    case RS_BACKPRESSURE_DROP_NEWEST:
+        RS_METRICS_ADD(worker->metrics->backpressure_drop_c, 1);
+        return RS_AGAIN;
+    case RS_BACKPRESSURE_PAUSE:
+        RS_METRICS_ADD(worker->metrics->backpressure_drop_c, 1);
+        if (!peer->ws.owref_c) {
+            // The message is simply too large to queue by itself. Don't pause,
+            // because only send_pending_owrefs() would ever resume the peer.
+            return RS_AGAIN;
+        }
+        RS_LOG(LOG_DEBUG, "Pausing peer %s with %" PRIu16 " messages of %"
+            PRIu64 " bytes pending.", get_addr_str(peer), peer->ws.owref_c,
+            worker->owref_queues[peer_i].byte_c);
+        RS_METRICS_ADD(worker->metrics->backpressure_pause_c, 1);
+        peer->ws.is_paused = true;
+        RS_GUARD(send_pause_to_app(worker, peer, peer_i));
+        return RS_AGAIN;
+    }
+}
+
+static rs_ret send_newest_msg(
+    struct rs_worker * worker,
+    struct rs_newest_msg * msg,
+    uint32_t peer_i
 ) {
     union rs_peer * peer = worker->peers + peer_i;
     if (peer->layer != RS_LAYER_WEBSOCKET ||
         peer->mortality != RS_MORTALITY_LIVE) {
         //RS_LOG(LOG_DEBUG, "Not sending newest %zu byte message from app to "
         //    "peer %" PRIu32 ", because it's not live on the WebSocket layer.",
-        //    frame_size, peer_i);
+        //    msg->frame_size, peer_i);
         return RS_OK;
     }
+    union rs_wsframe * frame = msg->frame;
+    uint64_t frame_size = msg->frame_size;
+    if (peer->ws.is_deflating) {
+        RS_GUARD(get_deflated_frame(worker, msg));
+        frame = msg->deflated_frame;
+        frame_size = msg->deflated_frame_size;
+    }
     if (peer->continuation != RS_CONT_NONE) {
+        switch (apply_backpressure_policy(worker, peer, peer_i, frame,
+            frame_size)) {
+        case RS_OK:
+            break;
+        case RS_AGAIN:
+            return RS_OK;
+        case RS_CLOSE_PEER:
+            RS_METRICS_ADD(worker->metrics->close_c_by_reason[
+                RS_CLOSE_REASON_BACKPRESSURE], 1);
+            if (get_begun_owref_c(worker, peer, peer_i)) {
+                // A Close frame can't be sent in the middle of other frames.
+                goto close_peer;
+            }
+            RS_GUARD(send_close_to_app(worker, peer, peer_i));
+            remove_pending_owrefs(worker, peer, peer_i);
+            RS_GUARD(start_backpressure_close(worker, peer));
+            // Call handle_peer_events() with MORTALITY_SHUTDOWN_WRITE (but
+            // without any events) to try to send the Close frame right away.
+            return handle_peer_events(worker, peer_i, 0);
+        default:
+            return RS_FATAL;
+        }
         if (peer->ws.owref_c == UINT16_MAX) {
             RS_LOG(LOG_WARNING, "More outbound write references are pending "
                 "for peer %s than the maximum supported number of 65535: "
                 "shutting the peer down", get_addr_str(peer));
             goto close_peer;
         }
-        if (!peer->ws.owref_c++) {
-            peer->ws.owref_i = worker->newest_owref_i;
+        if (peer->ws.is_deflating) {
+            RS_GUARD(keep_deflated_frame(msg));
         }
-        (*remaining_recipient_c)++;
+        RS_GUARD(enqueue_newest_owref(worker, peer, peer_i, frame_size));
+        msg->remaining_recipient_c++;
         //RS_LOG(LOG_DEBUG, "Not sending newest %zu byte message from app to "
         //    "peer %" PRIu32 " yet, because its continuation state is "
         //    "RS_CONT_%sING (resultant peer->ws.owref_c: %" PRIu8 ").",
@@ -69,12 +495,18 @@ static rs_ret send_newest_msg(
         return RS_OK;
     }
     switch (peer->is_encrypted ? write_tls(worker, peer, frame, frame_size) :
-                                         write_tcp(peer, frame, frame_size)) {
+                                 write_tcp(worker, peer, frame, frame_size)) {
     case RS_OK:
+        RS_METRICS_ADD(worker->metrics->outbound_byte_c, frame_size);
+        RS_METRICS_ADD(worker->metrics->outbound_msg_c, 1);
+        record_write_latencies(worker, msg->cmsg->msg, msg->app_i,
+            &(uint64_t){0});
         if (rs_get_wsframe_opcode(frame) == RS_WSFRAME_OPC_CLOSE) {
             RS_LOG(LOG_DEBUG, "Successfully sent newest %zu byte ws%s close "
                 "message from app to peer %" PRIu32 ".", frame_size,
                 peer->is_encrypted ? "s" : "", peer_i);
+            RS_METRICS_ADD(worker->metrics->close_c_by_reason[
+                RS_CLOSE_REASON_APP], 1);
             peer->mortality = RS_MORTALITY_SHUTDOWN_WRITE;
             // Call handle_peer_events() with MORTALITY_SHUTDOWN_WRITE (but
             // without any events) to try to perform any shutdown procedures
@@ -91,21 +523,32 @@ static rs_ret send_newest_msg(
         RS_LOG(LOG_DEBUG, "Attempt to send newest %zu byte ws%s message from "
             "app to peer %" PRIu32 " was unsuccessful due to RS_AGAIN.",
             frame_size, peer->is_encrypted ? "s" : "", peer_i);
+        RS_METRICS_ADD(worker->metrics->write_eagain_c, 1);
         peer->continuation = RS_CONT_SENDING;
-        peer->ws.owref_c = 1;
-        peer->ws.owref_i = worker->newest_owref_i;
-        (*remaining_recipient_c)++;
+        if (peer->ws.is_deflating) {
+            RS_GUARD(keep_deflated_frame(msg));
+        }
+        RS_GUARD(enqueue_newest_owref(worker, peer, peer_i, frame_size));
+        if (peer->is_encrypted) {
+            // Don't let send_pending_owrefs() coalesce any further messages
+            // with this one until SSL_write_ex() has been retried.
+            worker->tls_batch_c_by_peer[peer_i] = 1;
+        }
+        msg->remaining_recipient_c++;
         return RS_OK;
     case RS_CLOSE_PEER:
         RS_LOG(LOG_WARNING, "Attempt to send newest %zu byte ws%s message from "
             "app to peer %" PRIu32 " was unsuccessful due to RS_CLOSE_PEER.",
             frame_size, peer->is_encrypted ? "s" : "", peer_i);
+        RS_METRICS_ADD(worker->metrics->close_c_by_reason[
+            RS_CLOSE_REASON_HANGUP], 1);
         close_peer:
         if (rs_get_wsframe_opcode(frame) != RS_WSFRAME_OPC_CLOSE) {
             // Only notify the app of peer closure if the message the error
             // occurred on wasn't itself a close message sent by the app.
             RS_GUARD(send_close_to_app(worker, peer, peer_i));
         }
+        remove_pending_owrefs(worker, peer, peer_i);
         peer->mortality = RS_MORTALITY_DEAD;
         // Call handle_peer_events() with MORTALITY_DEAD (but without any
         // events) to abort this peer and free up its resources, layer by layer.
@@ -115,57 +558,95 @@ static rs_ret send_newest_msg(
     }
 }
 
+// Get the index that the owref at owref_i was moved to by reallocate_owrefs().
+static size_t get_moved_owref_i(
+    size_t owref_i,
+    size_t old_elem_c,
+    size_t old_newest_owref_i,
+    size_t added_ref_c
+) {
+    if (owref_i >= old_newest_owref_i) {
+        // Owrefs from newest_owref_i up to the old end of the array are older
+        // than the wrapped around ones at the start, and never need to move.
+        return owref_i;
+    }
+    if (owref_i < added_ref_c) {
+        // De-wrapped into the newly added space after the old end of the array
+        return owref_i + old_elem_c;
+    }
+    // Moved left to take the place of the de-wrapped owrefs
+    return owref_i - added_ref_c;
+}
+
 static rs_ret reallocate_owrefs(
     struct rs_worker * worker
 ) {
     // Reallocate larger worker->owrefs array, and move data around as needed.
-    size_t new_elem_c =
-        worker->conf->realloc_multiplier * worker->owrefs_elem_c;
+    size_t old_elem_c = worker->owrefs_elem_c;
+    size_t old_newest_owref_i = worker->newest_owref_i;
+    size_t new_elem_c = worker->conf->realloc_multiplier * old_elem_c;
     RS_REALLOC(worker->owrefs, new_elem_c);
     RS_LOG(LOG_NOTICE, "Reallocated worker->owrefs with a "
         "worker->owrefs_elem_c increase from %zu to %zu.",
-        worker->owrefs_elem_c, new_elem_c);
-    size_t added_ref_c = new_elem_c - worker->owrefs_elem_c;
-    if (added_ref_c > worker->newest_owref_i) {
+        old_elem_c, new_elem_c);
+    size_t added_ref_c = new_elem_c - old_elem_c;
+    if (added_ref_c > old_newest_owref_i) {
         // added_ref_c is large enough to accomodate a "full de-wrap":
         // move the wrapped around owref elements at the start of the owrefs
         // array to the index equal to the array's old length.
-        memcpy(worker->owrefs + worker->owrefs_elem_c, worker->owrefs,
-            worker->newest_owref_i * sizeof(struct rs_owref));
-        worker->newest_owref_i += worker->owrefs_elem_c;
-        // Update every peer for which ws.owref_i corresponds to a moved index.
-        for (union rs_peer * p = worker->peers;
-            p <= worker->peers + worker->highest_peer_i; p++) {
-            if (p->ws.owref_c && p->ws.owref_i < worker->newest_owref_i) {
-                p->ws.owref_i += worker->owrefs_elem_c;
-            }
-        }
+        memcpy(worker->owrefs + old_elem_c, worker->owrefs,
+            old_newest_owref_i * sizeof(struct rs_owref));
+        worker->newest_owref_i += old_elem_c;
         RS_LOG(LOG_DEBUG, "Full owrefs dewrap completed.");
     } else {
         // added_ref_c is only large enough to accomodate a "partial de-wrap".
-        memcpy(worker->owrefs + worker->owrefs_elem_c, worker->owrefs,
+        memcpy(worker->owrefs + old_elem_c, worker->owrefs,
             added_ref_c * sizeof(struct rs_owref));
         // Move remaining elements to the start of the array to recreate the
         // "wrapping effect".
-        move_left(worker->owrefs, added_ref_c, worker->newest_owref_i);
+        move_left(worker->owrefs, added_ref_c, old_newest_owref_i);
         worker->newest_owref_i -= added_ref_c;
-        // Update every peer for which ws.owref_i corresponds to a moved index.
-        for (union rs_peer * p = worker->peers;
-            p <= worker->peers + worker->highest_peer_i; p++) {
-            if (p->ws.owref_c) {
-                if (p->ws.owref_i < added_ref_c) {
-                    p->ws.owref_i += worker->owrefs_elem_c;
-                } else if (p->ws.owref_i < worker->newest_owref_i) {
-                    p->ws.owref_i -= added_ref_c;
-                }
-            }
-        }
         RS_LOG(LOG_DEBUG, "Partial owrefs dewrap and wrap move completed.");
     }
+    // Update every queued owref index and oldest_owref_i_by_app element that
+    // corresponds to a moved owref.
+    for (uint32_t p_i = 0; p_i <= worker->highest_peer_i; p_i++) {
+        union rs_peer * p = worker->peers + p_i;
+        if (p->layer != RS_LAYER_WEBSOCKET) {
+            continue;
+        }
+        struct rs_owref_queue * queue = worker->owref_queues + p_i;
+        for (size_t i = 0; i < p->ws.owref_c; i++) {
+            uint32_t * owref_i = queue->owref_is +
+                ((p->ws.owref_head_i + i) & (queue->elem_c - 1));
+            *owref_i = get_moved_owref_i(*owref_i, old_elem_c,
+                old_newest_owref_i, added_ref_c);
+        }
+    }
+    for (size_t i = 0; i < worker->conf->app_c; i++) {
+        worker->oldest_owref_i_by_app[i] = get_moved_owref_i(
+            worker->oldest_owref_i_by_app[i], old_elem_c, old_newest_owref_i,
+            added_ref_c);
+    }
     worker->owrefs_elem_c = new_elem_c;
     return RS_OK;
 }
 
+// Is bit (peer_i - base_peer_i) set in the RS_OUTBOUND_(EVERY_EXCEPT_)BITMAP
+// recipient set of word_c words following bitmap[0] == base_peer_i?
+static bool is_in_peer_bitmap(
+    uint32_t const * bitmap,
+    size_t word_c,
+    size_t peer_i
+) {
+    if (peer_i < *bitmap) {
+        return false;
+    }
+    size_t bit_i = peer_i - *bitmap;
+    return bit_i / 32 < word_c &&
+        bitmap[1 + bit_i / 32] & UINT32_C(1) << bit_i % 32;
+}
+
 rs_ret receive_from_app(
     struct rs_worker * worker
 ) {
@@ -175,73 +656,104 @@ rs_ret receive_from_app(
         struct rs_ring_consumer * cons = worker->outbound_consumers + app_i;
         struct rs_consumer_msg * cmsg = NULL;
         while ((cmsg = rs_consume_ring_msg(atomic, cons))) {
-            size_t remaining_recipient_c = 0;
-            size_t head_size = 1;
+            rs_count_consumed_ring_msg(
+                &worker->ring_metrics[app_i].outbound_ring, cmsg);
+            struct rs_newest_msg msg = {.cmsg = cmsg, .app_i = app_i};
+            worker->newest_msg = &msg;
+            size_t head_size = 1 + RS_OUTBOUND_TIMING_SIZE *
+                !!(*cmsg->msg & RS_OUTBOUND_TIMED);
             uint32_t peer_c = 0;
-            uint32_t * peer_i = (uint32_t *) (cmsg->msg + 1);
-            union rs_wsframe * frame = NULL;
-            switch (*cmsg->msg) {
+            uint32_t * peer_i = (uint32_t *) (cmsg->msg + head_size);
+            switch (*cmsg->msg & ~(RS_OUTBOUND_SHARED | RS_OUTBOUND_TIMED)) {
             case RS_OUTBOUND_SINGLE:
                 head_size += 4;
-                frame = (union rs_wsframe *) (cmsg->msg + head_size);
-                RS_GUARD(send_newest_msg(worker, &remaining_recipient_c,
-                    *peer_i, frame, cmsg->size - head_size));
+                msg.frame = get_outbound_frame(cmsg, head_size,
+                    &msg.frame_size);
+                RS_GUARD(send_newest_msg(worker, &msg, *peer_i));
                 break;
             case RS_OUTBOUND_ARRAY:
                 peer_c = *peer_i++;
                 head_size += 4 + 4 * peer_c;
-                frame = (union rs_wsframe *) (cmsg->msg + head_size);
+                msg.frame = get_outbound_frame(cmsg, head_size,
+                    &msg.frame_size);
                 for (size_t i = 0; i < peer_c; i++) {
-                    RS_GUARD(send_newest_msg(worker, &remaining_recipient_c,
-                        peer_i[i], frame, cmsg->size - head_size));
+                    RS_GUARD(send_newest_msg(worker, &msg, peer_i[i]));
                 }
                 break;
             case RS_OUTBOUND_EVERY:
-                frame = (union rs_wsframe *) (cmsg->msg + head_size);
+                msg.frame = get_outbound_frame(cmsg, head_size,
+                    &msg.frame_size);
                 for (size_t p_i = 0; p_i <= worker->highest_peer_i; p_i++) {
                     if (worker->peers[p_i].app_i == app_i) {
-                        RS_GUARD(send_newest_msg(worker, &remaining_recipient_c,
-                            p_i, frame, cmsg->size - head_size));
+                        RS_GUARD(send_newest_msg(worker, &msg, p_i));
                     }
                 }
                 break;
             case RS_OUTBOUND_EVERY_EXCEPT_SINGLE:
                 head_size += 4;
-                frame = (union rs_wsframe *) (cmsg->msg + head_size);
+                msg.frame = get_outbound_frame(cmsg, head_size,
+                    &msg.frame_size);
                 for (size_t p_i = 0; p_i <= worker->highest_peer_i; p_i++) {
                     if (worker->peers[p_i].app_i == app_i && p_i != *peer_i) {
-                        RS_GUARD(send_newest_msg(worker, &remaining_recipient_c,
-                            p_i, frame, cmsg->size - head_size));
+                        RS_GUARD(send_newest_msg(worker, &msg, p_i));
                     }
                 }
                 break;
-            case RS_OUTBOUND_EVERY_EXCEPT_ARRAY: default:
+            case RS_OUTBOUND_EVERY_EXCEPT_ARRAY:
                 peer_c = *peer_i++;
                 head_size += 4 + 4 * peer_c;
-                frame = (union rs_wsframe *) (cmsg->msg + head_size);
+                msg.frame = get_outbound_frame(cmsg, head_size,
+                    &msg.frame_size);
+                // The excluded peer_i array is sorted, so a single merge-style
+                // pass suffices to skip every excluded peer.
+                for (size_t p_i = 0, i = 0; p_i <= worker->highest_peer_i;
+                    p_i++) {
+                    while (i < peer_c && peer_i[i] < p_i) {
+                        i++;
+                    }
+                    if (worker->peers[p_i].app_i == app_i &&
+                        (i == peer_c || peer_i[i] != p_i)) {
+                        RS_GUARD(send_newest_msg(worker, &msg, p_i));
+                    }
+                }
+                break;
+            case RS_OUTBOUND_BITMAP:
+                peer_c = *peer_i++; // Word count + 1
+                head_size += 4 + 4 * peer_c;
+                msg.frame = get_outbound_frame(cmsg, head_size,
+                    &msg.frame_size);
+                for (size_t i = 1; i < peer_c; i++) {
+                    for (uint32_t word = peer_i[i]; word; word &= word - 1) {
+                        RS_GUARD(send_newest_msg(worker, &msg,
+                            *peer_i + 32 * (i - 1) + __builtin_ctz(word)));
+                    }
+                }
+                break;
+            case RS_OUTBOUND_EVERY_EXCEPT_BITMAP: default:
+                peer_c = *peer_i++; // Word count + 1
+                head_size += 4 + 4 * peer_c;
+                msg.frame = get_outbound_frame(cmsg, head_size,
+                    &msg.frame_size);
                 for (size_t p_i = 0; p_i <= worker->highest_peer_i; p_i++) {
-                    if (worker->peers[p_i].app_i == app_i) {
-                        for (size_t i = 0; peer_i[i] != p_i; i++) {
-                            if (i == peer_c) {
-                                RS_GUARD(send_newest_msg(worker,
-                                    &remaining_recipient_c, p_i, frame,
-                                    cmsg->size - head_size));
-                                break;
-                            }
-                        }
+                    if (worker->peers[p_i].app_i == app_i &&
+                        !is_in_peer_bitmap(peer_i, peer_c - 1, p_i)) {
+                        RS_GUARD(send_newest_msg(worker, &msg, p_i));
                     }
                 }
             }
-            if (remaining_recipient_c) {
+            worker->newest_msg = NULL;
+            if (msg.remaining_recipient_c) {
                 struct rs_owref * new = worker->owrefs + worker->newest_owref_i;
                 RS_LOG(LOG_DEBUG, "worker->owrefs[%zu].cmsg == %p, "
                     ".remaining_recipient_c == %" PRIu32 " , .head_size == %"
                     PRIu16 ", .app_i == %" PRIu16 ".", worker->newest_owref_i,
-                    cmsg, remaining_recipient_c, head_size, app_i);
-                new->remaining_recipient_c = remaining_recipient_c;
+                    cmsg, msg.remaining_recipient_c, head_size, app_i);
+                new->remaining_recipient_c = msg.remaining_recipient_c;
                 new->cmsg = cmsg;
+                new->deflated = msg.deflated;
                 new->head_size = head_size;
                 new->app_i = app_i;
+                RS_METRICS_ADD(worker->metrics->owref_c, 1);
                 // Increment to get the next writable owref element,
                 // but wrap around if needed.
                 worker->newest_owref_i++;
@@ -254,7 +766,10 @@ rs_ret receive_from_app(
                         break;
                     }
                 }
-            } else if (worker->newest_owref_i ==
+                continue;
+            }
+            release_outbound_frame(cmsg, head_size);
+            if (worker->newest_owref_i ==
                 worker->oldest_owref_i_by_app[app_i]) {
                 enqueue_ring_update(worker, (uint8_t *) cons->r, app_i, false);
                 //RS_LOG(LOG_DEBUG, "Newest message from app %zu was "
@@ -279,122 +794,118 @@ rs_ret receive_from_app(
     return RS_OK;
 }
 
-static size_t find_next_owref_for_peer(
+// Fill iov with the frames of up to RS_OWREF_BATCH_MAX of the peer's pending
+// owrefs, oldest first, without any modification of owref state.
+// Gathering stops after any WebSocket Close frame, because nothing should be
+// sent after it. Returns the number of frames gathered, which is at least 1.
+static int gather_pending_frames(
     struct rs_worker * worker,
-    uint32_t target_peer_i,
-    size_t owref_i
+    union rs_peer * peer,
+    uint32_t peer_i,
+    struct iovec * iov,
+    bool * has_close_frame
 ) {
-    for (;;) {
-        owref_i++;
-        owref_i %= worker->owrefs_elem_c;
-        struct rs_owref * owref = worker->owrefs + owref_i;
-        if (!owref->cmsg) {
-            RS_LOG(LOG_DEBUG, "Skipping owref_i %zu for peer_i %zu, because "
-                "it's empty (which means it's already done, which also means "
-                "this peer was not one of its recipients).", owref_i,
-                target_peer_i);
-            continue;
+    int max_frame_c = RS_MIN(peer->ws.owref_c, RS_OWREF_BATCH_MAX);
+    size_t max_size = SIZE_MAX;
+    if (peer->is_encrypted) {
+        if (worker->tls_batch_c_by_peer[peer_i]) {
+            // Recreate the batch of the previous RS_AGAIN attempt exactly.
+            max_frame_c = worker->tls_batch_c_by_peer[peer_i];
+        } else {
+            max_size = RS_TLS_COALESCE_SIZE;
         }
-        uint8_t const * msg = owref->cmsg->msg;
-        uint32_t const * peer_i = (uint32_t const *) (msg + 1);
-        uint32_t peer_c = 0;
-        switch (*msg) {
-        case RS_OUTBOUND_SINGLE:
-            if (*peer_i == target_peer_i) {
-                RS_LOG(LOG_DEBUG, "Found next owref_i %zu for peer_i %zu, "
-                    "with message header RS_OUTBOUND_SINGLE.", owref_i,
-                    target_peer_i);
-                return owref_i;
-            }
-            RS_LOG(LOG_DEBUG, "Skipping owref_i %zu for peer_i %zu, because "
-                "it's only addressed to peer_i %zu.", owref_i, target_peer_i,
-                *peer_i);
-            continue;
-        case RS_OUTBOUND_ARRAY:
-            peer_c = *peer_i++;
-            for (size_t i = 0; i < peer_c; i++) {
-                if (peer_i[i] == target_peer_i) {
-                    RS_LOG(LOG_DEBUG, "Found next owref_i %zu for peer_i %zu, "
-                        "with message header RS_OUTBOUND_ARRAY.", owref_i,
-                        target_peer_i);
-                    return owref_i;
-                }
-            }
-            RS_LOG(LOG_DEBUG, "Skipping owref_i %zu for peer_i %zu, because "
-                "it's not mentioned in its array of recipients.", owref_i,
-                target_peer_i);
-            continue;
-        case RS_OUTBOUND_EVERY:
-            RS_LOG(LOG_DEBUG, "Found next owref_i %zu for peer_i %zu, with "
-                "message header RS_OUTBOUND_EVERY.", owref_i, target_peer_i);
-            return owref_i;
-        case RS_OUTBOUND_EVERY_EXCEPT_SINGLE:
-            if (*peer_i != target_peer_i) {
-                RS_LOG(LOG_DEBUG, "Found next owref_i %zu for peer_i %zu, "
-                    "with message header RS_EVERY_EXCEPT_SINGLE.", owref_i,
-                    target_peer_i);
-                return owref_i;
-            }
-            RS_LOG(LOG_DEBUG, "Skipping owref_i %zu for peer_i %zu, because "
-                "it's the one black sheep that it excludes.", owref_i,
-                target_peer_i);
-            continue;
-        case RS_OUTBOUND_EVERY_EXCEPT_ARRAY: default:
-            peer_c = *peer_i++;
-            for (size_t i = 0; *peer_i != target_peer_i; i++) {
-                if (i == peer_c) {
-                    RS_LOG(LOG_DEBUG, "Found next owref_i %zu for peer_i %zu, "
-                        "with message header RS_OUTBOUND_EVERY_EXCEPT_ARRAY.",
-                        owref_i, target_peer_i);
-                    return owref_i;
-                }
-            }
-            RS_LOG(LOG_DEBUG, "Skipping owref_i %zu for peer_i %zu, because "
-                "it's mentioned in its array of excluded recipients.", owref_i,
-                target_peer_i);
+    }
+    size_t size = 0;
+    *has_close_frame = false;
+    for (int i = 0;;) {
+        struct rs_owref * owref =
+            worker->owrefs + get_pending_owref_i(worker, peer, peer_i, i);
+        uint64_t frame_size = 0;
+        union rs_wsframe * frame = get_owref_frame(owref, peer, &frame_size);
+        if (i && size + frame_size > max_size) {
+            // A frame that doesn't fit in the TLS coalescing buffer by itself
+            // is written on its own straight from its original location.
+            return i;
+        }
+        size += frame_size;
+        iov[i++] = (struct iovec){
+            .iov_base = frame,
+            .iov_len = frame_size
+        };
+        if (rs_get_wsframe_opcode(frame) == RS_WSFRAME_OPC_CLOSE) {
+            *has_close_frame = true;
+            return i;
+        }
+        if (i == max_frame_c) {
+            return i;
         }
     }
 }
 
-static void decrement_pending_owref_count(
+static rs_ret write_tls_batch(
     struct rs_worker * worker,
-    size_t owref_i
+    union rs_peer * peer,
+    struct iovec const * iov,
+    int iov_c
 ) {
-    struct rs_owref * owref = worker->owrefs + owref_i;
-    if (--owref->remaining_recipient_c) {
-        // One or more of this owref's recipients remain, so the owref itself
-        // must remain too for now.
-        return;
+    if (iov_c == 1) {
+        return write_tls(worker, peer, iov->iov_base, iov->iov_len);
     }
-    size_t app_i = owref->app_i;
-    memset(owref, 0, sizeof(struct rs_owref));
-    if (owref_i != worker->oldest_owref_i_by_app[app_i]) {
-        // This owref is done, but an older one is still pending for this app,
-        // so enqueue_ring_update() cannot be called yet.
-        return;
+    size_t size = 0;
+    for (int i = 0; i < iov_c; i++) {
+        memcpy(worker->tls_wbuf + size, iov[i].iov_base, iov[i].iov_len);
+        size += iov[i].iov_len;
     }
-    do {
-        owref_i++;
-        owref_i %= worker->owrefs_elem_c;
-        if (owref_i == worker->newest_owref_i) {
-            // All owrefs for this app are done, so enqueue up to the reader.
-            enqueue_ring_update(worker,
-                (uint8_t *) worker->outbound_consumers[app_i].r, app_i, false);
-            worker->oldest_owref_i_by_app[app_i] = owref_i;
-            RS_LOG(LOG_DEBUG, "Enqueued ring update for app_i %zu up to "
-            "worker->outbound_readers[%zu]", app_i, app_i);
+    return write_tls(worker, peer, worker->tls_wbuf, size);
+}
+
+// Count the frame_c frames of iov, gathered from the peer's oldest pending
+// owrefs, as written out completely.
+static void count_sent_frames(
+    struct rs_worker * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i,
+    struct iovec const * iov,
+    int frame_c
+) {
+    uint64_t size = 0;
+    uint64_t write_time_ns = 0;
+    for (int i = 0; i < frame_c; i++) {
+        size += iov[i].iov_len;
+        if (worker->latencies) {
+            struct rs_owref const * owref =
+                worker->owrefs + get_pending_owref_i(worker, peer, peer_i, i);
+            record_write_latencies(worker, owref->cmsg->msg, owref->app_i,
+                &write_time_ns);
+        }
+    }
+    RS_METRICS_ADD(worker->metrics->outbound_byte_c, size);
+    RS_METRICS_ADD(worker->metrics->outbound_msg_c, frame_c);
+}
+
+// Reduce peer->old_wsize as left behind by write_tcp_vector() to an offset into
+// the first frame not written out completely, completing any frames before it.
+static void complete_partially_written_owrefs(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    uint32_t peer_i
+) {
+    uint64_t write_time_ns = 0;
+    for (;;) {
+        struct rs_owref * owref =
+            worker->owrefs + get_pending_owref_i(worker, peer, peer_i, 0);
+        uint64_t frame_size = 0;
+        get_owref_frame(owref, peer, &frame_size);
+        if (peer->old_wsize < frame_size) {
             return;
         }
-    } while (!worker->owrefs[owref_i].remaining_recipient_c ||
-        worker->owrefs[owref_i].app_i != app_i);
-    // Enqueue up to the message pointed at by the owref with index owref_i
-    // (because that message is this app's next message that has remaining
-    // recipients, which therefore cannot be enqueued yet).
-    enqueue_ring_update(worker, (uint8_t *) worker->owrefs[owref_i].cmsg, app_i,
-        false);
-    worker->oldest_owref_i_by_app[app_i] = owref_i;
-    RS_LOG(LOG_INFO, "Enqueued ring update for app_i %zu up to the message "
-        "corresponding to owref_i: %zu", app_i, owref_i);
+        RS_METRICS_ADD(worker->metrics->outbound_byte_c, frame_size);
+        RS_METRICS_ADD(worker->metrics->outbound_msg_c, 1);
+        record_write_latencies(worker, owref->cmsg->msg, owref->app_i,
+            &write_time_ns);
+        peer->old_wsize -= frame_size;
+        dequeue_pending_owrefs(worker, peer, peer_i, 1);
+    }
 }
 
 rs_ret send_pending_owrefs(
@@ -402,30 +913,38 @@ rs_ret send_pending_owrefs(
     union rs_peer * peer,
     uint32_t peer_i
 ) {
-    if (!peer->ws.owref_c) {
-        return RS_OK;
-    }
-    for (;;) {
-        struct rs_owref * owref = worker->owrefs + peer->ws.owref_i;
-        union rs_wsframe * frame =
-            (union rs_wsframe *) (owref->cmsg->msg + owref->head_size);
-        size_t frame_size = owref->cmsg->size - owref->head_size;
+    while (peer->ws.owref_c) {
+        // Rather than calling write_tcp() or write_tls() once for every frame,
+        // gather as many pending frames as possible into a single writev() or
+        // SSL_write_ex() call, saving a lot of syscalls when draining the
+        // backlog of a peer that was unable to keep up for a while.
+        struct iovec iov[RS_OWREF_BATCH_MAX];
+        bool has_close_frame = false;
+        int iov_c = gather_pending_frames(worker, peer, peer_i, iov,
+            &has_close_frame);
         switch (peer->is_encrypted ?
-            write_tls(worker, peer, frame, frame_size) :
-                    write_tcp(peer, frame, frame_size)) {
+            write_tls_batch(worker, peer, iov, iov_c) :
+            write_tcp_vector(worker, peer, iov, iov_c)) {
         case RS_OK:
-            if (rs_get_wsframe_opcode(frame) != RS_WSFRAME_OPC_CLOSE) {
-                RS_LOG(LOG_DEBUG, "Successfully sent %zu byte ws%s %s owref "
-                    "message to peer %" PRIu32 ".", frame_size,
-                    peer->is_encrypted ? "s" : "",
-                    rs_get_wsframe_opcode(frame) == RS_WSFRAME_OPC_BIN ?
-                    "RS_BIN" : "RS_UTF8", peer_i);
-                break;
+            count_sent_frames(worker, peer, peer_i, iov, iov_c);
+            if (peer->is_encrypted) {
+                worker->tls_batch_c_by_peer[peer_i] = 0;
             }
-            RS_LOG(LOG_DEBUG, "Successfully sent %zu byte ws%s close owref "
-                "message to peer %" PRIu32 ".", frame_size,
-                peer->is_encrypted ? "s" : "", peer_i);
+            if (!has_close_frame) {
+                RS_LOG(LOG_DEBUG, "Successfully sent %d ws%s owref message(s) "
+                    "to peer %" PRIu32 ".", iov_c,
+                    peer->is_encrypted ? "s" : "", peer_i);
+                dequeue_pending_owrefs(worker, peer, peer_i, iov_c);
+                continue;
+            }
+            RS_LOG(LOG_DEBUG, "Successfully sent %d ws%s owref message(s) to "
+                "peer %" PRIu32 ", the last of which was a close message.",
+                iov_c, peer->is_encrypted ? "s" : "", peer_i);
+            // The close message itself is left to remove_pending_owrefs().
+            dequeue_pending_owrefs(worker, peer, peer_i, iov_c - 1);
             // This message was a WebSocket Close message.
+            RS_METRICS_ADD(worker->metrics->close_c_by_reason[
+                RS_CLOSE_REASON_APP], 1);
             peer->mortality = RS_MORTALITY_SHUTDOWN_WRITE;
             // Set CONT_NONE to indicate that the ws close msg was already sent.
             peer->continuation = RS_CONT_NONE;
@@ -436,30 +955,39 @@ rs_ret send_pending_owrefs(
             // of RS_AGAIN or completion.
             return handle_peer_events(worker, peer_i, 0);
         case RS_AGAIN:
-            RS_LOG(LOG_DEBUG, "Attempt to send %zu byte ws%s owref message to "
+            RS_LOG(LOG_DEBUG, "Attempt to send %d ws%s owref message(s) to "
                 "peer %" PRIu32 " was unsuccessful due to RS_AGAIN.",
-                frame_size, peer->is_encrypted ? "s" : "", peer_i);
+                iov_c, peer->is_encrypted ? "s" : "", peer_i);
+            RS_METRICS_ADD(worker->metrics->write_eagain_c, 1);
+            if (peer->is_encrypted) {
+                worker->tls_batch_c_by_peer[peer_i] = iov_c;
+            } else {
+                complete_partially_written_owrefs(worker, peer, peer_i);
+            }
             return RS_AGAIN;
         case RS_CLOSE_PEER:
-            RS_LOG(LOG_DEBUG, "Attempt to send %zu byte ws%s owref message to "
+            RS_LOG(LOG_DEBUG, "Attempt to send %d ws%s owref message(s) to "
                 "peer %" PRIu32 " was unsuccessful due to RS_CLOSE_PEER.",
-                frame_size, peer->is_encrypted ? "s" : "", peer_i);
-            if (rs_get_wsframe_opcode(frame) != RS_WSFRAME_OPC_CLOSE) {
-                // Only notify the app of peer closure if the message the error
-                // occurred on wasn't itself a close message sent by the app.
+                iov_c, peer->is_encrypted ? "s" : "", peer_i);
+            if (!has_close_frame) {
+                // Only notify the app of peer closure if the messages the
+                // error occurred on didn't include a close message sent by the
+                // app.
                 RS_GUARD(send_close_to_app(worker, peer, peer_i));
             }
             return RS_CLOSE_PEER;
         default:
             return RS_FATAL;
         }
-        decrement_pending_owref_count(worker, peer->ws.owref_i);
-        if (!--peer->ws.owref_c) {
-            return RS_OK;
-        }
-        peer->ws.owref_i = find_next_owref_for_peer(worker, peer_i,
-            peer->ws.owref_i);
     }
+    if (peer->ws.is_paused) {
+        // All messages the peer fell behind on have been written out, so
+        // resume sending it new ones.
+        RS_LOG(LOG_DEBUG, "Resuming peer %s.", get_addr_str(peer));
+        peer->ws.is_paused = false;
+        RS_GUARD(send_pause_to_app(worker, peer, peer_i));
+    }
+    return RS_OK;
 }
 
 void remove_pending_owrefs(
@@ -467,14 +995,8 @@ void remove_pending_owrefs(
     union rs_peer * peer,
     uint32_t peer_i
 ) {
-    if (!peer->ws.owref_c) {
-        return;
-    }
-    for (size_t owref_i = peer->ws.owref_i;;) {
-        decrement_pending_owref_count(worker, owref_i);
-        if (!--peer->ws.owref_c) {
-            return;
-        }
-        owref_i = find_next_owref_for_peer(worker, peer_i, owref_i);
+    if (peer->is_encrypted && worker->tls_batch_c_by_peer) {
+        worker->tls_batch_c_by_peer[peer_i] = 0;
     }
+    dequeue_pending_owrefs(worker, peer, peer_i, peer->ws.owref_c);
 }
@@ -3,70 +3,215 @@
 
 #include "rs_hash.h"
 
-rs_ret init_hash_state(
-    struct rs_worker * worker
+#if defined(__x86_64__) || defined(__i386__)
+#define RS_HASH_X86
+#include <cpuid.h> // __get_cpuid_count(), bit_SHA
+#include <immintrin.h> // SHA-NI intrinsics
+#endif
+
+// A Sec-WebSocket-Accept value is the base64 encoding of the SHA-1 hash of the
+// client's Sec-WebSocket-Key concatenated with a fixed GUID (RFC6455#section-
+// 1.3). Given that the key is always 22 base64 chars followed by "==", that
+// input is always exactly 60 bytes long, of which only the first 22 differ
+// from one handshake to the next. This file therefore implements just the one
+// SHA-1 message length concerned, the padding of which is constant too:
+// 2 blocks of 64 bytes, of which the 2nd block is entirely constant. Likewise,
+// the base64 encoding of a 20-byte hash always consists of 27 chars plus one
+// '=' padding char.
+//
+// As in rs_simd.c, the SHA-NI variant is compiled through GCC's target
+// attribute, and only used if detect_sha1_support() finds it supported by the
+// CPU at runtime.
+
+#define RS_SHA1_BLOCK_SIZE 64
+
+// Only assigned to by detect_sha1_support() prior to spawning any threads.
+static bool sha_ni_is_supported = false;
+
+void detect_sha1_support(
+    void
+) {
+#ifdef RS_HASH_X86
+    unsigned a = 0;
+    unsigned b = 0;
+    unsigned c = 0;
+    unsigned d = 0;
+    __builtin_cpu_init();
+    sha_ni_is_supported = __get_cpuid_count(7, 0, &a, &b, &c, &d) &&
+        (b & bit_SHA) && __builtin_cpu_supports("sse4.1");
+#endif
+    RS_LOG(LOG_INFO, "Using %s routines for WebSocket key hashing",
+        sha_ni_is_supported ? "SHA-NI" : "scalar");
+}
+
+static uint32_t rotate_left(
+    uint32_t word,
+    unsigned bit_c
 ) {
-    worker->sha1_ctx = EVP_MD_CTX_new();
-    if (!worker->sha1_ctx) {
-        RS_LOG(LOG_CRIT, "Unsuccessful EVP_MD_CTX_new().");
-        return RS_FATAL;
+    return word << bit_c | word >> (32 - bit_c);
+}
+
+// Perform SHA-1 rounds first_i through first_i + 19, all of which share the
+// same round function f and constant k.
+#define RS_SHA1_20_ROUNDS(first_i, f, k) do { \
+    for (size_t i = (first_i); i < (first_i) + 20; i++) { \
+        if (i >= 16) { \
+            /* Only the 16 most recent schedule words are kept around. */ \
+            w[i % 16] = rotate_left(w[(i - 3) % 16] ^ w[(i - 8) % 16] ^ \
+                w[(i - 14) % 16] ^ w[i % 16], 1); \
+        } \
+        uint32_t const temp = rotate_left(a, 5) + (f) + (k) + e + w[i % 16]; \
+        e = d; \
+        d = c; \
+        c = rotate_left(b, 30); \
+        b = a; \
+        a = temp; \
+    } \
+} while (0)
+
+static void hash_sha1_block_scalar(
+    uint32_t * state,
+    uint8_t const * block
+) {
+    uint32_t w[16] = {0};
+    for (size_t i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[4 * i] << 24 |
+            (uint32_t) block[4 * i + 1] << 16 |
+            (uint32_t) block[4 * i + 2] << 8 | block[4 * i + 3];
     }
-    worker->base64_bio = BIO_new(BIO_f_base64());
-    if (!worker->base64_bio) {
-        RS_LOG(LOG_CRIT, "Unsuccessful BIO_new(BIO_f_base64())");
-        return RS_FATAL;
+    uint32_t a = state[0];
+    uint32_t b = state[1];
+    uint32_t c = state[2];
+    uint32_t d = state[3];
+    uint32_t e = state[4];
+    RS_SHA1_20_ROUNDS(0, d ^ (b & (c ^ d)), 0x5A827999);
+    RS_SHA1_20_ROUNDS(20, b ^ c ^ d, 0x6ED9EBA1);
+    RS_SHA1_20_ROUNDS(40, (b & c) | (d & (b | c)), 0x8F1BBCDC);
+    RS_SHA1_20_ROUNDS(60, b ^ c ^ d, 0xCA62C1D6);
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+#ifdef RS_HASH_X86
+// Perform SHA-1 rounds 4 * g through 4 * g + 3 with SHA-NI instructions, where
+// msgs[g % 4] holds the corresponding 4 message schedule words, and msgs[(g +
+// 1..3) % 4] are meanwhile advanced to hold those of 4 rounds later.
+#define RS_SHA1_NI_4_ROUNDS(g) do { \
+    if (g) { \
+        e[(g) % 2] = _mm_sha1nexte_epu32(e[(g) % 2], msgs[(g) % 4]); \
+    } else { \
+        e[0] = _mm_add_epi32(e[0], msgs[0]); \
+    } \
+    e[((g) + 1) % 2] = abcd; \
+    if ((g) >= 3 && (g) <= 18) { \
+        msgs[((g) + 1) % 4] = \
+            _mm_sha1msg2_epu32(msgs[((g) + 1) % 4], msgs[(g) % 4]); \
+    } \
+    abcd = _mm_sha1rnds4_epu32(abcd, e[(g) % 2], (g) / 5); \
+    if ((g) >= 1 && (g) <= 16) { \
+        msgs[((g) + 3) % 4] = \
+            _mm_sha1msg1_epu32(msgs[((g) + 3) % 4], msgs[(g) % 4]); \
+    } \
+    if ((g) >= 2 && (g) <= 17) { \
+        msgs[((g) + 2) % 4] = \
+            _mm_xor_si128(msgs[((g) + 2) % 4], msgs[(g) % 4]); \
+    } \
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void hash_sha1_block_sha_ni(
+    uint32_t * state,
+    uint8_t const * block
+) {
+    // Reverses the byte order of each 32-bit word, and the word order as well.
+    __m128i const shuffle_mask =
+        _mm_set_epi64x(0x0001020304050607ULL, 0x08090A0B0C0D0E0FULL);
+    __m128i abcd = _mm_shuffle_epi32(
+        _mm_loadu_si128((__m128i const *) state), 0x1B);
+    __m128i const abcd_prev = abcd;
+    __m128i e[2] = {_mm_set_epi32((int) state[4], 0, 0, 0)};
+    __m128i const e_prev = e[0];
+    __m128i msgs[4] = {0};
+    for (size_t i = 0; i < 4; i++) {
+        msgs[i] = _mm_shuffle_epi8(
+            _mm_loadu_si128((__m128i const *) (block + 16 * i)), shuffle_mask);
+    }
+    RS_SHA1_NI_4_ROUNDS(0);  RS_SHA1_NI_4_ROUNDS(1);  RS_SHA1_NI_4_ROUNDS(2);
+    RS_SHA1_NI_4_ROUNDS(3);  RS_SHA1_NI_4_ROUNDS(4);  RS_SHA1_NI_4_ROUNDS(5);
+    RS_SHA1_NI_4_ROUNDS(6);  RS_SHA1_NI_4_ROUNDS(7);  RS_SHA1_NI_4_ROUNDS(8);
+    RS_SHA1_NI_4_ROUNDS(9);  RS_SHA1_NI_4_ROUNDS(10); RS_SHA1_NI_4_ROUNDS(11);
+    RS_SHA1_NI_4_ROUNDS(12); RS_SHA1_NI_4_ROUNDS(13); RS_SHA1_NI_4_ROUNDS(14);
+    RS_SHA1_NI_4_ROUNDS(15); RS_SHA1_NI_4_ROUNDS(16); RS_SHA1_NI_4_ROUNDS(17);
+    RS_SHA1_NI_4_ROUNDS(18); RS_SHA1_NI_4_ROUNDS(19);
+    // e[0] now holds the A of 4 rounds ago, from which E follows.
+    e[0] = _mm_sha1nexte_epu32(e[0], e_prev);
+    abcd = _mm_add_epi32(abcd, abcd_prev);
+    _mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1B));
+    state[4] = (uint32_t) _mm_extract_epi32(e[0], 3);
+}
+#endif
+
+static void hash_sha1_block(
+    uint32_t * state,
+    uint8_t const * block
+) {
+#ifdef RS_HASH_X86
+    if (sha_ni_is_supported) {
+        hash_sha1_block_sha_ni(state, block);
+        return;
     }
-    BIO * mem_bio = BIO_new(BIO_s_mem());
-    if (!mem_bio) {
-        RS_LOG(LOG_CRIT, "Unsuccessful BIO_new(BIO_s_mem())");
-        return RS_FATAL;
+#endif
+    hash_sha1_block_scalar(state, block);
+}
+
+static void encode_base64_hash(
+    uint8_t const * hash, // 20 bytes
+    char * dst // 27 chars: the '=' that would follow is left to the caller
+) {
+    static char const chars[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (uint8_t const * over = hash + 18; hash < over; hash += 3) {
+        uint32_t const triplet = (uint32_t) hash[0] << 16 |
+            (uint32_t) hash[1] << 8 | hash[2];
+        *dst++ = chars[triplet >> 18];
+        *dst++ = chars[triplet >> 12 & 0x3F];
+        *dst++ = chars[triplet >> 6 & 0x3F];
+        *dst++ = chars[triplet & 0x3F];
     }
-    BIO_get_mem_ptr(mem_bio, &worker->base64_buf);
-    BIO_push(worker->base64_bio, mem_bio);
-    return RS_OK;
+    uint32_t const pair = (uint32_t) hash[0] << 8 | hash[1];
+    *dst++ = chars[pair >> 10];
+    *dst++ = chars[pair >> 4 & 0x3F];
+    *dst = chars[pair << 2 & 0x3F];
 }
 
 // This function performs no input or output bounds checking:
 // * wskey_22str MUST be an array of exactly 22 bytes.
 // * dst_27str MUST point to at least 27 overwritable destination bytes
-rs_ret get_websocket_key_hash(
-    struct rs_worker * worker,
+void get_websocket_key_hash(
     char const * wskey_22str,
     char * dst_27str
 ) {
-    char token_str[] = "1234567890123456789012=="
-        "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
-    memcpy(token_str, wskey_22str, 22);
-    if (!EVP_DigestInit_ex(worker->sha1_ctx, EVP_sha1(), NULL)) {
-        RS_LOG(LOG_CRIT, "Unsuccessful "
-            "EVP_DigestInit_ex(worker->sha1_ctx, EVP_sha1(), NULL)");
-        return RS_FATAL;
-    }
-    if (!EVP_DigestUpdate(worker->sha1_ctx, token_str,
-        RS_CONST_STRLEN(token_str))) {
-        RS_LOG(LOG_CRIT,
-            "Unsuccessful EVP_DigestUpdate(worker->sha1_ctx, %s, %zu)",
-            token_str, RS_CONST_STRLEN(token_str));
-        return RS_FATAL;
-    }
+    // The 1st block: the key, "==", the GUID, and the start of the padding
+    uint8_t block[RS_SHA1_BLOCK_SIZE] = "1234567890123456789012=="
+        "258EAFA5-E914-47DA-95CA-C5AB0DC85B11\x80";
+    memcpy(block, wskey_22str, 22);
+    // The 2nd block: the remainder of the padding, ending with the message
+    // length in bits as a big-endian uint64_t.
+    static uint8_t const final_block[RS_SHA1_BLOCK_SIZE] = {
+        [RS_SHA1_BLOCK_SIZE - 2] = (60 * 8) >> 8,
+        [RS_SHA1_BLOCK_SIZE - 1] = (60 * 8) & 0xFF
+    };
+    uint32_t state[5] = {
+        0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+    };
+    hash_sha1_block(state, block);
+    hash_sha1_block(state, final_block);
     uint8_t hash[20] = {0};
-    if (!EVP_DigestFinal_ex(worker->sha1_ctx, hash, NULL)) {
-        RS_LOG(LOG_CRIT,
-            "Unsuccessful EVP_DigestFinal_ex(worker->sha1_ctx, hash, NULL)");
-        return RS_FATAL;
-    }
-    BIO_write(worker->base64_bio, hash, 20);
-    BIO_flush(worker->base64_bio);
-    if (worker->base64_buf->length < 28 ||
-        worker->base64_buf->data[27] != '=') {
-        char data[worker->base64_buf->length + 1];
-        memcpy(data, worker->base64_buf->data, worker->base64_buf->length);
-        data[worker->base64_buf->length] = '\0';
-        RS_LOG(LOG_CRIT, "Unexpected base64 websocket key encoding: \"%s\" "
-            "(length: %zu)", data, worker->base64_buf->length);
-        return RS_FATAL;
+    for (size_t i = 0; i < 20; i++) {
+        hash[i] = state[i / 4] >> (24 - 8 * (i % 4));
     }
-    memcpy(dst_27str, worker->base64_buf->data, 27);
-    BIO_reset(worker->base64_bio);
-    return RS_OK;
+    encode_base64_hash(hash, dst_27str);
 }
@@ -5,12 +5,11 @@
 
 #include "rs_worker.h"
 
-rs_ret init_hash_state(
-    struct rs_worker * worker
+void detect_sha1_support(
+    void
 );
 
-rs_ret get_websocket_key_hash(
-    struct rs_worker * worker,
+void get_websocket_key_hash(
     char const * wskey_22str,
     char * dst_27str
 );
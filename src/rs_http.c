@@ -1,10 +1,13 @@
 // SPDX-License-Identifier: MIT
 // Copyright © 2019 William Budd
 
-#include "rs_event.h" // set_shutdown_deadline()
+#include "rs_deflate.h" // parse_deflate_offer(), get_deflate_response(), etc
 #include "rs_hash.h" // get_websocket_key_hash()
 #include "rs_http.h"
+#include "rs_route.h" // find_endpoint()
+#include "rs_simd.h" // equals_http_name(), find_http_delim()
 #include "rs_tcp.h" // read_tcp(), write_tcp()
+#include "rs_timer.h" // set_shutdown_deadline()
 #include "rs_tls.h" // read_tls(), write_tls()
 #include "rs_util.h" // get_addr_str()
 
@@ -21,6 +24,28 @@ static char const * http_errors[] = {
     "HTTP/1.1 405 \r\n\r\n"
 };
 
+// Sec-WebSocket-Extensions header values longer than this are ignored.
+#define RS_HTTP_EXTENSIONS_MAX_STRLEN 0x3FF // 1023
+
+enum rs_http_header {
+    RS_HTTP_HEADER_CONNECTION = 0,
+    RS_HTTP_HEADER_HOST = 1,
+    RS_HTTP_HEADER_ORIGIN = 2,
+    RS_HTTP_HEADER_WSKEY = 3,
+    RS_HTTP_HEADER_WSVERSION = 4,
+    RS_HTTP_HEADER_WSEXTENSIONS = 5,
+    RS_HTTP_HEADER_OTHER = 6, // Any header irrelevant to parsing
+    RS_HTTP_HEADER_UNKNOWN = 7 // Not enough bytes read to tell
+}; // This enum is used by identify_http_header() as index to this array:
+static char const http_header_names[][RS_SIMD_HTTP_NAME_SIZE] = {
+    "connection:",
+    "host:",
+    "origin:",
+    "sec-websocket-key:",
+    "sec-websocket-version:",
+    "sec-websocket-extensions:"
+};
+
 static rs_ret read_http(
     struct rs_worker * worker,
     union rs_peer * peer,
@@ -28,9 +53,19 @@ static rs_ret read_http(
     char * * unsaved_str,
     char * * ch,
     char * * ch_over,
-    char * wskey
+    char * * wskey
 ) {
     char * rbuf = (char *) worker->rbuf;
+    // A wskey parsed during the current call still resides in rbuf, where it's
+    // about to be overwritten: move it to the start of peer->http.char_buf,
+    // where it remains until the HTTP Upgrade response is written.
+    if (*wskey && *wskey != peer->http.char_buf) {
+        if (!peer->http.char_buf) {
+            RS_CALLOC(peer->http.char_buf, 22);
+        }
+        memcpy(peer->http.char_buf, *wskey, 22);
+        *wskey = peer->http.char_buf;
+    }
     // To read as much as possible in one go (and to stay in the same cache
     // area), the 1st byte of the upcoming new read will be placed at the start
     // of rbuf, or at that start plus an offset as required to accomodate
@@ -39,7 +74,7 @@ static rs_ret read_http(
     if (*unsaved_str) {
         unsaved_strlen = *ch - *unsaved_str;
         if (*unsaved_str != rbuf) {
-            memmove(rbuf, unsaved_str, unsaved_strlen);
+            memmove(rbuf, *unsaved_str, unsaved_strlen);
             *unsaved_str = rbuf;
             *ch = rbuf + unsaved_strlen;
         }
@@ -50,7 +85,7 @@ static rs_ret read_http(
     rs_ret ret = peer->is_encrypted ?
         read_tls(worker, peer,
             *ch, worker->conf->worker_rbuf_size - unsaved_strlen, &rsize) :
-        read_tcp(peer,
+        read_tcp(worker, peer,
             *ch, worker->conf->worker_rbuf_size - unsaved_strlen, &rsize);
     *ch_over = *ch + rsize;
     //RS_LOG(LOG_DEBUG, "Read HTTP from peer %s: %.*s",
@@ -67,24 +102,60 @@ static rs_ret read_http(
         // (due to the fact that unsigned types are guaranteed to wrap around on
         // overflow).
         peer->http.partial_strlen = unsaved_strlen;
-        if (peer->http.char_buf == wskey) {
-            RS_REALLOC(peer->http.char_buf, 22 + unsaved_strlen);
-            memcpy(peer->http.char_buf + 22, unsaved_str, unsaved_strlen);
-        } else if (wskey) {
-            RS_CALLOC(peer->http.char_buf, 22 + unsaved_strlen);
-            memcpy(peer->http.char_buf, wskey, 22);
-            memcpy(peer->http.char_buf + 22, unsaved_str, unsaved_strlen);
+        // Store the partial string after the wskey, if any.
+        size_t wskey_size = *wskey ? 22 : 0;
+        if (peer->http.char_buf) {
+            RS_REALLOC(peer->http.char_buf, wskey_size + unsaved_strlen);
         } else {
             RS_CALLOC(peer->http.char_buf, unsaved_strlen);
-            memcpy(peer->http.char_buf, unsaved_str, unsaved_strlen);
         }
-    } else if (wskey && wskey != peer->http.char_buf) {
-        RS_CALLOC(peer->http.char_buf, 22);
-        memcpy(peer->http.char_buf, wskey, 22);
+        memcpy(peer->http.char_buf + wskey_size, *unsaved_str,
+            unsaved_strlen);
     }
     return RS_AGAIN;
 }
 
+// Look up the endpoint matching the given request component(s) together with
+// whichever of the peer's other components were already parsed, as currently
+// referenced by the peer's app_i, endpoint_i and http.origin_i. See rs_route.c.
+static bool match_endpoint(
+    struct rs_conf const * conf,
+    union rs_peer * peer,
+    char const * hostname, // NULL means: use the parsed hostname, if any
+    size_t hostname_strlen,
+    char const * url, // NULL means: use the parsed url, if any
+    size_t url_strlen,
+    bool url_was_parsed,
+    char const * origin, // NULL means: use the parsed origin, if any
+    size_t origin_strlen
+) {
+    struct rs_conf_endpoint const * endpoint =
+        conf->apps[peer->app_i].endpoints + peer->endpoint_i;
+    if (!hostname && peer->http.hostname_was_parsed) {
+        hostname = endpoint->hostname;
+        hostname_strlen = strlen(hostname);
+    }
+    if (!url && url_was_parsed) {
+        url = endpoint->url ? endpoint->url : "";
+        url_strlen = strlen(url);
+    }
+    if (!origin && peer->http.origin_was_parsed) {
+        origin = endpoint->allowed_origins[peer->http.origin_i];
+        origin_strlen = strlen(origin);
+    }
+    struct rs_route_match match = {0};
+    if (!find_endpoint(conf, peer->is_encrypted, hostname, hostname_strlen,
+        url, url_strlen, origin, origin_strlen, &match)) {
+        return false;
+    }
+    peer->app_i = match.app_i;
+    peer->endpoint_i = match.endpoint_i;
+    if (origin) {
+        peer->http.origin_i = match.origin_i;
+    }
+    return true;
+}
+
 static rs_ret match_hostname(
     struct rs_conf const * conf,
     union rs_peer * peer,
@@ -92,53 +163,14 @@ static rs_ret match_hostname(
     size_t hostname_strlen,
     bool url_was_parsed
 ) {
-    // Attempt to find the 1st endpoint hostname match accross all apps and
-    // endpoints at an index position equal to or greater than that of the
-    // endpoint currently referenced by the peer. Depending on the boolean
-    // states of url_was_parsed and peer->http.origin_was_parsed, any endpoint
-    // other than the current endpoint that matches the hostname must also match
-    // the url and/or origin respectively that the current endpoint references.
-    struct rs_conf_app * app = conf->apps + peer->app_i;
-    // The currently referenced endpoint
-    struct rs_conf_endpoint * endpoint = app->endpoints + peer->endpoint_i;
-    if (!strncmp(endpoint->hostname, hostname, hostname_strlen) &&
-        endpoint->is_encrypted == peer->is_encrypted) {
-        peer->http.hostname_was_parsed = true;
-        return RS_OK;
-    }
-    char * url = endpoint->url;
-    char * origin = endpoint->allowed_origin_c ?
-        endpoint->allowed_origins[peer->http.origin_i] : NULL;
-    // The current endpoint did not match the hostname. Try remaining candidates
-    for (;;) {
-        while (++endpoint < app->endpoints + app->endpoint_c) {
-            if (!strncmp(endpoint->hostname, hostname, hostname_strlen) &&
-                endpoint->is_encrypted == peer->is_encrypted &&
-                !(url_was_parsed && strcmp(endpoint->url, url))) {
-                if (!peer->http.origin_was_parsed) {
-                    peer->app_i = app - conf->apps;
-                    peer->endpoint_i = endpoint - app->endpoints;
-                    peer->http.hostname_was_parsed = true;
-                    return RS_OK;
-                }
-                for (size_t i = 0; i < endpoint->allowed_origin_c; i++) {
-                    if (!strcmp(endpoint->allowed_origins[i], origin)) {
-                        peer->app_i = app - conf->apps;
-                        peer->endpoint_i = endpoint - app->endpoints;
-                        peer->http.origin_i = i;
-                        peer->http.hostname_was_parsed = true;
-                        return RS_OK;
-                    }
-                }
-            }
-        }
-        if (++app >= conf->apps + conf->app_c) {
-            RS_LOG(LOG_NOTICE, "Failing peer %s: unrecognized hostname: %.*s",
-                get_addr_str(peer), (int) hostname_strlen, hostname);
-            return RS_CLOSE_PEER;
-        }
-        endpoint = app->endpoints;
+    if (!match_endpoint(conf, peer, hostname, hostname_strlen, NULL, 0,
+        url_was_parsed, NULL, 0)) {
+        RS_LOG(LOG_NOTICE, "Failing peer %s: unrecognized hostname: %.*s",
+            get_addr_str(peer), (int) hostname_strlen, hostname);
+        return RS_CLOSE_PEER;
     }
+    peer->http.hostname_was_parsed = true;
+    return RS_OK;
 }
 
 static rs_ret match_url(
@@ -147,91 +179,76 @@ static rs_ret match_url(
     char * url, // not 0-terminated
     size_t url_strlen
 ) {
-    // Attempt to find the 1st endpoint url match accross all apps and endpoints
-    // at an index position equal to or greater than that of the endpoint
-    // currently referenced by the peer. If peer->http.hostname_was_parsed is
-    // true, any endpoint other than the current endpoint that matches the url
-    // must also match the hostname the current endpoint references.
-    struct rs_conf_app * app = conf->apps + peer->app_i;
-    // The currently referenced endpoint
-    struct rs_conf_endpoint * endpoint = app->endpoints + peer->endpoint_i;
-    if (!strncmp(endpoint->url, url, url_strlen) &&
-        endpoint->is_encrypted == peer->is_encrypted) {
-        return RS_OK;
-    }
-    char * hostname = endpoint++->hostname;
-    // The current endpoint did not match the url. Try remaining candidates.
-    for (;;) {
-        for (;endpoint < app->endpoints + app->endpoint_c; endpoint++) {
-            if (!strncmp(endpoint->url, url, url_strlen) &&
-                endpoint->is_encrypted == peer->is_encrypted &&
-                !(peer->http.hostname_was_parsed &&
-                strcmp(endpoint->hostname, hostname))) {
-                peer->app_i = app - conf->apps;
-                peer->endpoint_i = endpoint - app->endpoints;
-                return RS_OK;
-            }
-        }
-        if (++app >= conf->apps + conf->app_c) {
-            RS_LOG(LOG_NOTICE, "Failing peer %s: unrecognized url: %.*s",
-                get_addr_str(peer), (int) url_strlen, url);
-            return RS_CLOSE_PEER;
-        }
-        endpoint = app->endpoints;
+    if (!match_endpoint(conf, peer, NULL, 0, url, url_strlen, true, NULL, 0)) {
+        RS_LOG(LOG_NOTICE, "Failing peer %s: unrecognized url: %.*s",
+            get_addr_str(peer), (int) url_strlen, url);
+        return RS_CLOSE_PEER;
     }
+    return RS_OK;
 }
 
-static bool match_origin(
+static rs_ret match_origin(
     struct rs_conf const * conf,
     union rs_peer * peer,
     char * origin, // not 0-terminated
     size_t origin_strlen
 ) {
-    // Attempt to find the 1st endpoint origin match accross all apps and
-    // endpoints at an index position equal to or greater than that of the
-    // endpoint currently referenced by the peer. Any endpoint other than the
-    // current endpoint that matches the origin must also match the url the
-    // current endpoint references; and if peer->hostname_was_parsed is true,
-    // then the hostname as well.
-    struct rs_conf_app * app = conf->apps + peer->app_i;
-    // The currently referenced endpoint
-    struct rs_conf_endpoint * endpoint = app->endpoints + peer->endpoint_i;
-    if (endpoint->is_encrypted == peer->is_encrypted) {
-        for (size_t i = 0; i < endpoint->allowed_origin_c; i++) {
-            if (!strncmp(endpoint->allowed_origins[i], origin, origin_strlen)) {
-                peer->http.origin_i = i;
-                peer->http.origin_was_parsed = true;
-                return RS_OK;
-            }
-        }
+    // The url is always parsed before any Origin header is encountered.
+    if (!match_endpoint(conf, peer, NULL, 0, NULL, 0, true, origin,
+        origin_strlen)) {
+        RS_LOG(LOG_NOTICE, "Failing peer %s: unrecognized origin: %.*s",
+            get_addr_str(peer), (int) origin_strlen, origin);
+        return RS_CLOSE_PEER;
     }
-    char * hostname = endpoint->hostname;
-    char * url = endpoint->url;
-    // The current endpoint did not match the origin. Try remaining candidates.
-    for (;;) {
-        while (++endpoint < app->endpoints + app->endpoint_c) {
-            if (endpoint->is_encrypted == peer->is_encrypted &&
-                !strcmp(endpoint->url, url) && 
-                !(peer->http.hostname_was_parsed &&
-                strcmp(endpoint->hostname, hostname))) {
-                for (size_t i = 0; i < endpoint->allowed_origin_c; i++) {
-                    if (!strcmp(endpoint->allowed_origins[i], origin)) {
-                        peer->app_i = app - conf->apps;
-                        peer->endpoint_i = endpoint - app->endpoints;
-                        peer->http.origin_i = i;
-                        peer->http.origin_was_parsed = true;
-                        return RS_OK;
-                    }
-                }
-            }
-        }
-        if (++app >= conf->apps + conf->app_c) {
-            RS_LOG(LOG_NOTICE, "Failing peer %s: unrecognized origin: %.*s",
-                get_addr_str(peer), (int) origin_strlen, origin);
-            return RS_CLOSE_PEER;
+    peer->http.origin_was_parsed = true;
+    return RS_OK;
+}
+
+// Identify the header line starting at ch in one go if its entire name must be
+// present in the bytes read so far: a shortcut past the parser's byte-wise name
+// matching, which remains in use for names that may be cut off by a read.
+static enum rs_http_header identify_http_header(
+    char const * ch,
+    char const * ch_over
+) {
+    if (ch_over - ch < RS_SIMD_HTTP_NAME_SIZE) {
+        return RS_HTTP_HEADER_UNKNOWN;
+    }
+    enum rs_http_header header = RS_HTTP_HEADER_OTHER;
+    switch (*ch) {
+    case 'C': case 'c':
+        header = RS_HTTP_HEADER_CONNECTION;
+        break;
+    case 'H': case 'h':
+        header = RS_HTTP_HEADER_HOST;
+        break;
+    case 'O': case 'o':
+        header = RS_HTTP_HEADER_ORIGIN;
+        break;
+    case 'S': case 's':
+        // "sec-websocket-" is followed by 'k', 'v', or 'e' at index 14
+        switch (ch[14]) {
+        case 'K': case 'k':
+            header = RS_HTTP_HEADER_WSKEY;
+            break;
+        case 'V': case 'v':
+            header = RS_HTTP_HEADER_WSVERSION;
+            break;
+        case 'E': case 'e':
+            header = RS_HTTP_HEADER_WSEXTENSIONS;
+            break;
+        default:
+            return RS_HTTP_HEADER_OTHER;
         }
-        endpoint = app->endpoints;
+        break;
+    case '\r':
+        return RS_HTTP_HEADER_UNKNOWN; // Leave the final CRLF to the parser.
+    default:
+        return RS_HTTP_HEADER_OTHER;
     }
+    char const * name = http_header_names[header];
+    return equals_http_name(ch, name, strlen(name)) ?
+        header : RS_HTTP_HEADER_OTHER;
 }
 
 // Completely re-entrant function: any attempt at parsing all the required HTTP
@@ -269,11 +286,13 @@ static rs_ret parse_http_upgrade_request(
     char * unsaved_str = NULL;
     // If the previous call to this function was broken off while in the middle
     // of parsing an unsaved_str, that partial string was stored in
-    // peer->http.char_buf, and must now be copied to worker->rbuf as a prefix
-    // to a new read().
+    // peer->http.char_buf (following the wskey, if already parsed), and must
+    // now be copied to worker->rbuf as a prefix to a new read().
+    if (peer->http.wskey_was_parsed) {
+        *wskey = peer->http.char_buf;
+    }
     if (peer->http.partial_strlen) {
         if (peer->http.wskey_was_parsed) {
-            *wskey = peer->http.char_buf;
             memcpy(worker->rbuf, peer->http.char_buf + 22,
                 peer->http.partial_strlen);
         } else {
@@ -281,14 +300,16 @@ static rs_ret parse_http_upgrade_request(
                 peer->http.partial_strlen);
             RS_FREE(peer->http.char_buf);
         }
-        ch += peer->http.partial_strlen;
-        ch_over = ch;
+        // Position ch on the last char of the partial string, such that the
+        // RS_H_GETCH() being jumped to below proceeds to read() right after it.
+        ch_over = ch + peer->http.partial_strlen;
+        ch = ch_over - 1;
         unsaved_str = (char *) worker->rbuf;
         peer->http.partial_strlen = 0;
     }
     // The above-mentioned case<->goto label mapping jump table switch:
     // RS_MACRIFY_EACH inserts the RS_H_JUMP macro into this switch for each
-    // distance number provided, 0 through 95; powered by rs_variadic.h.
+    // distance number provided, 0 through 107; powered by rs_variadic.h.
     switch (peer->http.jump_distance) {
 #define RS_H_JUMP(distance) case distance: goto RS_H_##distance
     RS_APPLY_EACH(RS_H_JUMP,   0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11,
@@ -296,7 +317,8 @@ static rs_ret parse_http_upgrade_request(
         30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40, 41, 42, 43, 44, 45, 46, 47,
         48, 49, 50, 51, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61, 62, 63, 64, 65,
         66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82, 83,
-        84, 85, 86, 87, 88, 89, 90, 91, 92, 93, 94, 95);
+        84, 85, 86, 87, 88, 89, 90, 91, 92, 93, 94, 95, 96, 97, 98, 99, 100,
+        101, 102, 103, 104, 105, 106, 107);
 #undef RS_H_JUMP
     default:
         RS_LOG(LOG_CRIT, "Invalid peer->http.jump_distance: %" PRIu8 ". "
@@ -308,7 +330,7 @@ static rs_ret parse_http_upgrade_request(
     RS_H_##jump_distance: \
     if (++ch >= ch_over) { \
         RS_GUARD(read_http(worker, peer, jump_distance, &unsaved_str, &ch, \
-            &ch_over, *wskey)); \
+            &ch_over, wskey)); \
     } \
 } while (0)
     // Often repeated parsing procedures are implemented as nice 'n ugly macros
@@ -337,6 +359,12 @@ static rs_ret parse_http_upgrade_request(
 #define RS_H_GETCH_AND_SKIP_OPTIONAL_WHITESPACE(uint8) do { \
     RS_H_GETCH(uint8); \
 } while (*ch == ' ' || *ch == '\t')
+    // Advance ch to the 1st char equal to any of d0, d1, or d2; but no further
+    // than limit, nor beyond the last char read so far. This lets the byte
+    // loops below skip over any stretch of bytes in need of no closer look.
+#define RS_H_SCAN(limit, d0, d1, d2) do { \
+    ch = find_http_delim(ch, RS_MIN(ch_over - 1, (limit)), (d0), (d1), (d2)); \
+} while (0)
     // Alright, let's actually start parsing some HTTP now...
 
     // RFC7230#section-3.1.1: request method is case-sensitive (uppercase)
@@ -377,6 +405,8 @@ static rs_ret parse_http_upgrade_request(
         RS_H_GETCH(11); RS_H_IFNOT_CH_ERR('/', RS_HTTP_BAD_REQUEST);
         RS_H_GETCH(12); RS_H_IFNOT_CH_ERR('/', RS_HTTP_BAD_REQUEST);
         RS_H_GETCH(13); unsaved_str = ch;
+        RS_H_SCAN(unsaved_str + worker->conf->hostname_max_strlen,
+            '/', ' ', ' ');
         while (*ch != '/') {
             if (*ch == ' ') { // a top-level absolute-form URI
                 if (match_hostname(worker->conf, peer, unsaved_str,
@@ -390,6 +420,8 @@ static rs_ret parse_http_upgrade_request(
                 RS_H_ERR(RS_HTTP_BAD_REQUEST);
             }
             RS_H_GETCH(14);
+            RS_H_SCAN(unsaved_str + worker->conf->hostname_max_strlen,
+                '/', ' ', ' ');
         }
         if (match_hostname(worker->conf, peer, unsaved_str, ch - unsaved_str,
             false) != RS_OK) {
@@ -398,6 +430,7 @@ static rs_ret parse_http_upgrade_request(
         unsaved_str = NULL;
     }
     RS_H_GETCH(15); unsaved_str = ch;
+    RS_H_SCAN(unsaved_str + worker->conf->url_max_strlen, ' ', '?', '#');
     while (*ch != ' ') {
         if (*ch == '?' || *ch == '#') {
             RS_H_ERR(RS_HTTP_NOT_FOUND);
@@ -411,6 +444,7 @@ static rs_ret parse_http_upgrade_request(
                 ch - unsaved_str - worker->conf->url_max_strlen);
             RS_H_ERR(RS_HTTP_NOT_FOUND);
         }
+        RS_H_SCAN(unsaved_str + worker->conf->url_max_strlen, ' ', '?', '#');
     }
     if (match_url(worker->conf, peer, unsaved_str, ch - unsaved_str) != RS_OK) {
         RS_H_ERR(RS_HTTP_NOT_FOUND);
@@ -430,7 +464,33 @@ static rs_ret parse_http_upgrade_request(
     RS_H_IFNOT_CH_ERR('\r', RS_HTTP_BAD_REQUEST);
     parse_line_feed:
     RS_H_GETCH(26); RS_H_IFNOT_CH_ERR('\n', RS_HTTP_BAD_REQUEST);
-    RS_H_GETCH(27); switch (*ch) {
+    RS_H_GETCH(27);
+    // Upon a match, ch is moved to the name's ':', as if matched byte-wise.
+    switch (identify_http_header(ch, ch_over)) {
+    case RS_HTTP_HEADER_CONNECTION:
+        ch += RS_CONST_STRLEN("Connection");
+        goto parse_next_conn_value;
+    case RS_HTTP_HEADER_HOST:
+        ch += RS_CONST_STRLEN("Host");
+        goto parse_host_value;
+    case RS_HTTP_HEADER_ORIGIN:
+        ch += RS_CONST_STRLEN("Origin");
+        goto parse_origin_value;
+    case RS_HTTP_HEADER_WSKEY:
+        ch += RS_CONST_STRLEN("Sec-WebSocket-Key");
+        goto parse_wskey_value;
+    case RS_HTTP_HEADER_WSVERSION:
+        ch += RS_CONST_STRLEN("Sec-WebSocket-Version");
+        goto parse_wsversion_value;
+    case RS_HTTP_HEADER_WSEXTENSIONS:
+        ch += RS_CONST_STRLEN("Sec-WebSocket-Extensions");
+        goto parse_extensions_value;
+    case RS_HTTP_HEADER_OTHER:
+        goto skip_header_line;
+    case RS_HTTP_HEADER_UNKNOWN: default:
+        break;
+    }
+    switch (*ch) {
     case '\r':
         RS_H_GETCH(28); RS_H_IFNOT_CH_ERR('\n', RS_HTTP_BAD_REQUEST);
         if (peer->http.hostname_was_parsed &&
@@ -472,17 +532,20 @@ static rs_ret parse_http_upgrade_request(
             break;
         }
         skip_this_conn_value:
-        if (RS_H_ICH(',')) goto parse_next_conn_value;
-        if (RS_H_ICH('\r')) goto parse_line_feed;
+        RS_H_SCAN(ch_over, ',', '\r', '\r');
+        if (RS_H_CH(',')) goto parse_next_conn_value;
+        if (RS_H_CH('\r')) goto parse_line_feed;
         RS_H_GETCH(47);
         goto skip_this_conn_value;
     case 'H': case 'h':
         RS_H_GETCH(48); if (!RS_H_ICH('O')) break;
         RS_H_GETCH(49); if (!RS_H_ICH('S')) break;
         RS_H_GETCH(50); if (!RS_H_ICH('T')) break;
-        RS_H_GETCH(51); if (!RS_H_ICH(':')) break;
-        RS_H_GETCH_AND_SKIP_OPTIONAL_WHITESPACE(52);
+        RS_H_GETCH(51); if (!RS_H_CH(':')) break;
+        parse_host_value: RS_H_GETCH_AND_SKIP_OPTIONAL_WHITESPACE(52);
         unsaved_str = ch;
+        RS_H_SCAN(unsaved_str + worker->conf->hostname_max_strlen,
+            '\r', ' ', '\t');
         while (*ch != '\r' && *ch != ' ' && *ch != '\t') {
             if (ch >= unsaved_str + worker->conf->hostname_max_strlen) {
                 RS_LOG(LOG_NOTICE, "Failing peer %s: Length of \"%.*s\" "
@@ -493,6 +556,8 @@ static rs_ret parse_http_upgrade_request(
                 RS_H_ERR(RS_HTTP_BAD_REQUEST);
             }
             RS_H_GETCH(53);
+            RS_H_SCAN(unsaved_str + worker->conf->hostname_max_strlen,
+                '\r', ' ', '\t');
         }
         if (match_hostname(worker->conf, peer, unsaved_str, ch - unsaved_str,
             true) != RS_OK) {
@@ -507,9 +572,11 @@ static rs_ret parse_http_upgrade_request(
         RS_H_GETCH(57); if (!RS_H_ICH('G')) break;
         RS_H_GETCH(58); if (!RS_H_ICH('I')) break;
         RS_H_GETCH(59); if (!RS_H_ICH('N')) break;
-        RS_H_GETCH(60); if (!RS_H_ICH(':')) break;
-        RS_H_GETCH_AND_SKIP_OPTIONAL_WHITESPACE(61);
+        RS_H_GETCH(60); if (!RS_H_CH(':')) break;
+        parse_origin_value: RS_H_GETCH_AND_SKIP_OPTIONAL_WHITESPACE(61);
         unsaved_str = ch;
+        RS_H_SCAN(unsaved_str + worker->conf->allowed_origin_max_strlen,
+            '\r', ' ', '\t');
         while (*ch != '\r' && *ch != ' ' && *ch != '\t') {
             if (ch >= unsaved_str + worker->conf->allowed_origin_max_strlen) {
                 RS_LOG(LOG_NOTICE, "Failing peer %s: length of \"%.*s\" "
@@ -520,6 +587,8 @@ static rs_ret parse_http_upgrade_request(
                 RS_H_ERR(RS_HTTP_FORBIDDEN);
             }
             RS_H_GETCH(62);
+            RS_H_SCAN(unsaved_str + worker->conf->allowed_origin_max_strlen,
+                '\r', ' ', '\t');
         }
         if (match_origin(worker->conf, peer, unsaved_str, ch - unsaved_str) !=
             RS_OK) {
@@ -547,7 +616,7 @@ static rs_ret parse_http_upgrade_request(
             RS_H_GETCH(78); if (!RS_H_ICH('E')) break;
             RS_H_GETCH(79); if (!RS_H_ICH('Y')) break;
             RS_H_GETCH(80); if (!RS_H_CH(':')) break;
-            RS_H_GETCH_AND_SKIP_OPTIONAL_WHITESPACE(81);
+            parse_wskey_value: RS_H_GETCH_AND_SKIP_OPTIONAL_WHITESPACE(81);
             unsaved_str = ch;
             do {
                 // check if Base64
@@ -573,43 +642,94 @@ static rs_ret parse_http_upgrade_request(
             RS_H_GETCH(89); if (!RS_H_ICH('O')) break;
             RS_H_GETCH(90); if (!RS_H_ICH('N')) break;
             RS_H_GETCH(91); if (!RS_H_CH(':')) break;
-            RS_H_GETCH_AND_SKIP_OPTIONAL_WHITESPACE(92);
+            parse_wsversion_value: RS_H_GETCH_AND_SKIP_OPTIONAL_WHITESPACE(92);
             RS_H_IFNOT_CH_ERR('1', RS_HTTP_BAD_REQUEST);
             RS_H_GETCH(93); RS_H_IFNOT_CH_ERR('3', RS_HTTP_BAD_REQUEST);
             RS_H_GETCH_AND_SKIP_OPTIONAL_WHITESPACE(94);
             peer->http.wsversion_was_parsed = true;
             goto parse_carriage_return;
+        case 'E': case 'e':
+            RS_H_GETCH(96); if (!RS_H_ICH('X')) break;
+            RS_H_GETCH(97); if (!RS_H_ICH('T')) break;
+            RS_H_GETCH(98); if (!RS_H_ICH('E')) break;
+            RS_H_GETCH(99); if (!RS_H_ICH('N')) break;
+            RS_H_GETCH(100); if (!RS_H_ICH('S')) break;
+            RS_H_GETCH(101); if (!RS_H_ICH('I')) break;
+            RS_H_GETCH(102); if (!RS_H_ICH('O')) break;
+            RS_H_GETCH(103); if (!RS_H_ICH('N')) break;
+            RS_H_GETCH(104); if (!RS_H_ICH('S')) break;
+            RS_H_GETCH(105); if (!RS_H_CH(':')) break;
+            parse_extensions_value:
+            if (!worker->deflate) {
+                break; // No endpoint supports any extensions.
+            }
+            RS_H_GETCH(106);
+            unsaved_str = ch;
+            RS_H_SCAN(unsaved_str + RS_HTTP_EXTENSIONS_MAX_STRLEN,
+                '\r', '\r', '\r');
+            while (!RS_H_CH('\r')) {
+                if (ch >= unsaved_str + RS_HTTP_EXTENSIONS_MAX_STRLEN) {
+                    RS_LOG(LOG_NOTICE, "Ignoring the Sec-WebSocket-Extensions "
+                        "header of peer %s: its length exceeds %d bytes",
+                        get_addr_str(peer), RS_HTTP_EXTENSIONS_MAX_STRLEN);
+                    unsaved_str = NULL;
+                    break;
+                }
+                RS_H_GETCH(107);
+                RS_H_SCAN(unsaved_str + RS_HTTP_EXTENSIONS_MAX_STRLEN,
+                    '\r', '\r', '\r');
+            }
+            if (!unsaved_str) {
+                break;
+            }
+            RS_GUARD(parse_deflate_offer(worker, peer, peer - worker->peers,
+                unsaved_str, ch - unsaved_str));
+            unsaved_str = NULL;
+            goto parse_carriage_return;
         }
     default:
         break;
     }
+    skip_header_line:
+    RS_H_SCAN(ch_over, '\r', '\r', '\r');
     while (!RS_H_CH('\r')) {
         RS_H_GETCH(95);
+        RS_H_SCAN(ch_over, '\r', '\r', '\r');
     }
     goto parse_line_feed;
 }
 
+#define RS_HTTP101_HEAD \
+    "HTTP/1.1 101 Switching Protocols\r\n" \
+    "Upgrade: websocket\r\n" \
+    "Connection: upgrade\r\n" \
+    "Sec-WebSocket-Accept: 123456789012345678901234567=\r\n"
+
 static rs_ret write_http_upgrade_response(
     struct rs_worker * worker,
     union rs_peer * peer,
     char * wskey
 ) {
-    thread_local static char http101[] =
-        "HTTP/1.1 101 Switching Protocols\r\n"
-        "Upgrade: websocket\r\n"
-        "Connection: upgrade\r\n"
-        "Sec-WebSocket-Accept: 123456789012345678901234567=\r\n"
-        "\r\n";
-    char * const wskey_hash_dest = http101 + RS_CONST_STRLEN(http101) -
-        RS_CONST_STRLEN("=\r\n\r\n") - 27;
+    // Followed by an optional Sec-WebSocket-Extensions header and a final CRLF,
+    // both of which are regenerated identically on each (re)try.
+    thread_local static char http101[sizeof(RS_HTTP101_HEAD) +
+        RS_DEFLATE_RESPONSE_MAX_STRLEN + RS_CONST_STRLEN("\r\n")] =
+        RS_HTTP101_HEAD;
+    char * const wskey_hash_dest = http101 + RS_CONST_STRLEN(RS_HTTP101_HEAD) -
+        RS_CONST_STRLEN("=\r\n") - 27;
     if (wskey) {
-        RS_GUARD(get_websocket_key_hash(worker, wskey, wskey_hash_dest));
+        get_websocket_key_hash(wskey, wskey_hash_dest);
     } else {
         memcpy(wskey_hash_dest, peer->http.char_buf, 27);
     }
+    size_t http101_strlen = RS_CONST_STRLEN(RS_HTTP101_HEAD);
+    http101_strlen += get_deflate_response(worker, peer, peer - worker->peers,
+        http101 + http101_strlen);
+    memcpy(http101 + http101_strlen, "\r\n", 2);
+    http101_strlen += 2;
     rs_ret ret = peer->is_encrypted ?
-        write_tls(worker, peer, http101, RS_CONST_STRLEN(http101)) :
-                write_tcp(peer, http101, RS_CONST_STRLEN(http101));
+        write_tls(worker, peer, http101, http101_strlen) :
+        write_tcp(worker, peer, http101, http101_strlen);
     switch (ret) {
     case RS_OK:
         if (peer->http.char_buf) {
@@ -643,7 +763,7 @@ static rs_ret write_http_error_response(
     char const * msg = http_errors[error_i];
     return peer->is_encrypted ?
         write_tls(worker, peer, msg, RS_CONST_STRLEN(msg)) :
-                write_tcp(peer, msg, RS_CONST_STRLEN(msg));
+        write_tcp(worker, peer, msg, RS_CONST_STRLEN(msg));
 }
 
 rs_ret handle_http_io(
@@ -667,8 +787,12 @@ rs_ret handle_http_io(
                     RS_FREE(peer->http.char_buf);
                 }
                 if (peer->mortality == RS_MORTALITY_SHUTDOWN_WRITE) {
+                    RS_METRICS_ADD(worker->metrics->close_c_by_reason[
+                        RS_CLOSE_REASON_HTTP], 1);
                     goto write_http_error;
                 }
+                RS_METRICS_ADD(worker->metrics->close_c_by_reason[
+                    RS_CLOSE_REASON_HANGUP], 1);
                 break;
             case RS_FATAL: default:
                 return RS_FATAL;
@@ -685,11 +809,15 @@ rs_ret handle_http_io(
                 // todo: flush read buffer
                 peer->continuation = RS_CONT_NONE;
                 peer->layer = RS_LAYER_WEBSOCKET;
-                return RS_OK;
+                RS_METRICS_ADD(worker->metrics->upgrade_c, 1);
+                return start_deflate_session(worker, peer,
+                    peer - worker->peers); // rs_deflate.c
             case RS_AGAIN:
                 peer->continuation = RS_CONT_SENDING;
                 return RS_OK;
             case RS_CLOSE_PEER:
+                RS_METRICS_ADD(worker->metrics->close_c_by_reason[
+                    RS_CLOSE_REASON_HANGUP], 1);
                 break;
             case RS_FATAL: default:
                 return RS_FATAL;
@@ -703,7 +831,8 @@ rs_ret handle_http_io(
             // Keep peer->mortality at RS_MORTALITY_SHUTDOWN_WRITE because
             // the next thing will be write_bidirectional_(tls/tcp)_shutdown().
             peer->layer = peer->is_encrypted ? RS_LAYER_TLS : RS_LAYER_TCP;
-            set_shutdown_deadline(peer, worker->conf->shutdown_wait_http);
+            RS_GUARD(set_shutdown_deadline(worker, peer,
+                worker->conf->shutdown_wait_http));
             return RS_OK;
         case RS_AGAIN:
             peer->continuation = RS_CONT_SENDING;
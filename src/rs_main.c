@@ -3,8 +3,13 @@
 
 #define _GNU_SOURCE // getgroups(), setresgid(), and setresuid()
 
+#include "rs_affinity.h" // init_affinity(), set_spawn_affinity()
 #include "rs_conf.h"
+#include "rs_hash.h" // detect_sha1_support()
+#include "rs_metrics.h" // create_metrics()
+#include "rs_simd.h" // detect_simd_support()
 #include "rs_socket.h" // bind_to_ports()
+#include "rs_tls.h" // create_shared_tls_state()
 #include "rs_worker.h" // work(), struct rs_worker_args
 
 #include <dlfcn.h> // dlopen(), dlsym()
@@ -175,7 +180,9 @@ static rs_ret set_credentials_and_capabilities(
         CAP_DAC_READ_SEARCH, // For reading configuration and certificate files
         CAP_NET_BIND_SERVICE, // For binding to privileged ports
         CAP_NET_RAW, // For setsockopt SO_BINDTODEVICE
-        CAP_SYS_NICE, // For setting CPU affinity (currently not implemented)
+#ifdef CAP_BPF // Linux 5.8+
+        CAP_BPF, // For loading the eBPF program of rs_socket.c
+#endif
         CAP_SYS_RESOURCE // For setting RLIMIT_NOFILE above the default maximum
     };
     return remove_all_capabilities_except(caps, RS_ELEM_C(caps));
@@ -282,7 +289,8 @@ static rs_ret get_app_callbacks(
 
 static rs_ret spawn_app_and_worker_threads(
     struct rs_conf const * conf,
-    int (* * app_cbs)(void *)
+    int (* * app_cbs)(void *),
+    struct rs_metrics_head * metrics_head
 ) {
     // Each (app thread <-> worker thread) pair needs access to one allocated
     // rs_ring_pair struct.
@@ -333,8 +341,11 @@ static rs_ret spawn_app_and_worker_threads(
         app_args[i].sleep_state = app_sleep_states + i;
         app_args[i].worker_sleep_states = &worker_sleep_states;
         app_args[i].worker_eventfds = worker_eventfds;
+        app_args[i].metrics_head = metrics_head;
         app_args[i].app_i = i;
         app_args[i].log_max = _rs_log_max;
+        // Let the app thread inherit its configured CPU affinity (if any)
+        RS_GUARD(set_spawn_affinity(&conf->apps[i].pin));
         // Run the app callback as a dedicated (long-lived) C11 thread
         if (thrd_create((thrd_t []){0}, app_cbs[i], app_args + i) !=
             thrd_success) {
@@ -344,6 +355,8 @@ static rs_ret spawn_app_and_worker_threads(
         }
     }
 
+    RS_GUARD(set_spawn_affinity(NULL));
+
     // Wait for all apps to set their sleep state to true, indicating that
     // worker_sleep_states and all ring_pairs have been allocated; which ensures
     // that worker threads are assigned up-to-date ring_pair and sleep_state
@@ -354,6 +367,9 @@ static rs_ret spawn_app_and_worker_threads(
         }
     }
 
+    struct rs_tls_shared * tls_shared = NULL;
+    RS_GUARD(create_shared_tls_state(conf, &tls_shared));
+
     struct rs_worker_args worker_args[conf->worker_c];
     memset(worker_args, 0, sizeof(worker_args));
     for (size_t i = 0;; i++) {
@@ -365,7 +381,12 @@ static rs_ret spawn_app_and_worker_threads(
         worker_args[i].app_sleep_states = app_sleep_states;
         worker_args[i].sleep_state = worker_sleep_states + i;
         worker_args[i].eventfd = worker_eventfds[i];
+        worker_args[i].tls_shared = tls_shared;
+        worker_args[i].metrics_head = metrics_head;
         worker_args[i].worker_i = i;
+        // Let the worker thread inherit its configured CPU affinity (if any)
+        RS_GUARD(set_spawn_affinity(conf->worker_pins ?
+            conf->worker_pins + i : NULL));
         if (i + 1 >= conf->worker_c) {
             // All apps and workers have been spawned, except for the last
             // worker, so now this thread will assume the role of that last
@@ -400,8 +421,13 @@ static rs_ret start(
     // the next few functions.
     struct rs_conf conf = {0};
     RS_GUARD(get_configuration(&conf, arg_c > 1 ? args[1] : NULL));
+    RS_GUARD(init_affinity(&conf));
+    detect_simd_support();
+    detect_sha1_support();
     RS_GUARD(set_limits(&conf));
     RS_GUARD(bind_to_ports(&conf));
+    struct rs_metrics_head * metrics_head = NULL;
+    RS_GUARD(create_metrics(&conf, &metrics_head));
     int (*app_cbs[conf.app_c])(void *); // VLA of function pointers to each app
     memset(app_cbs, 0, sizeof(app_cbs));
     RS_GUARD(get_app_callbacks(&conf, app_cbs));
@@ -410,7 +436,7 @@ static rs_ret start(
     // remove those too now, to ensure that app and worker threads will be
     // created without any privileges at all (with a UID and GID of "ringsock").
     RS_GUARD(remove_all_capabilities_except(NULL, 0));
-    return spawn_app_and_worker_threads(&conf, app_cbs);
+    return spawn_app_and_worker_threads(&conf, app_cbs, metrics_head);
 }
     
 int main(
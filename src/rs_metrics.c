@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#define _GNU_SOURCE // MAP_ANONYMOUS, ftruncate()
+
+#include "rs_metrics.h"
+
+#include <fcntl.h> // open()
+#include <stdio.h> // snprintf()
+#include <sys/mman.h> // mmap()
+#include <time.h> // time()
+#include <unistd.h> // ftruncate(), close(), getpid()
+
+// The segment is created by the main thread prior to spawning any app or worker
+// thread, each of which then only ever stores to its own part of it: see
+// ringsocket_metrics.h. Pages are zero-filled by the kernel either way, so all
+// counters start out at 0 without needing to be touched here, which leaves the
+// page placement of each thread's counters to Linux's "first touch" NUMA policy
+// (see rs_affinity.c).
+
+rs_ret create_metrics(
+    struct rs_conf const * conf,
+    struct rs_metrics_head * * head
+) {
+    size_t const size = rs_get_metrics_size(conf->worker_c, conf->app_c,
+        conf->latency_histograms);
+    int fd = -1;
+    if (conf->metrics_path) {
+        fd = open(conf->metrics_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            RS_LOG_ERRNO(LOG_ERR, "Unsuccessful open(\"%s\", O_RDWR | O_CREAT "
+                "| O_TRUNC, 0644)", conf->metrics_path);
+            return RS_FATAL;
+        }
+        if (ftruncate(fd, size) == -1) {
+            RS_LOG_ERRNO(LOG_ERR, "Unsuccessful ftruncate(%d (\"%s\"), %zu)",
+                fd, conf->metrics_path, size);
+            close(fd);
+            return RS_FATAL;
+        }
+    }
+    void * segment = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        fd == -1 ? MAP_SHARED | MAP_ANONYMOUS : MAP_SHARED, fd, 0);
+    if (segment == MAP_FAILED) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful mmap(NULL, %zu, ...) of the "
+            "metrics segment", size);
+        if (fd != -1) {
+            close(fd);
+        }
+        return RS_FATAL;
+    }
+    // The mapping remains valid after closing the file descriptor.
+    if (fd != -1 && close(fd) == -1) {
+        RS_LOG_ERRNO(LOG_ERR, "Unsuccessful close(%d) of \"%s\"", fd,
+            conf->metrics_path);
+        return RS_FATAL;
+    }
+    *head = segment;
+    (*head)->version = RS_METRICS_VERSION;
+    (*head)->cache_line_size = RS_CACHE_LINE_SIZE;
+    (*head)->worker_c = conf->worker_c;
+    (*head)->app_c = conf->app_c;
+    (*head)->pid = getpid();
+    (*head)->start_time = time(NULL);
+    (*head)->has_latencies = conf->latency_histograms;
+    for (size_t i = 0; i < conf->app_c; i++) {
+        struct rs_conf_app const * app = conf->apps + i;
+        if (app->instance_c > 1) {
+            snprintf((*head)->app_names[i], RS_METRICS_NAME_SIZE, "%s#%u",
+                app->name, app->instance_i + 1);
+        } else {
+            snprintf((*head)->app_names[i], RS_METRICS_NAME_SIZE, "%s",
+                app->name);
+        }
+    }
+    // Readers check the magic string last, so make sure it's stored last too.
+    atomic_thread_fence(memory_order_release);
+    memcpy((*head)->magic, RS_METRICS_MAGIC, sizeof((*head)->magic));
+    if (conf->metrics_path) {
+        RS_LOG(LOG_NOTICE, "Publishing metrics through \"%s\" (%zu bytes)",
+            conf->metrics_path, size);
+    }
+    return RS_OK;
+}
@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#pragma once
+
+#include <ringsocket_conf.h> // struct rs_conf
+#include <ringsocket_metrics.h> // struct rs_metrics_head
+
+// Map the metrics segment described in ringsocket_metrics.h into memory: a
+// shared mapping of the file at conf->metrics_path (created or truncated as
+// needed) if set, or of anonymous memory otherwise; and initialize its head.
+rs_ret create_metrics(
+    struct rs_conf const * conf,
+    struct rs_metrics_head * * head
+);
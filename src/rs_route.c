@@ -0,0 +1,343 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#include "rs_route.h"
+
+#include <inttypes.h> // PRIu32
+
+// An immutable hash index of all configured endpoints, built once by
+// build_route_index() when rs_conf.c loads the configuration, with which
+// rs_http.c can match each relevant HTTP Upgrade request component in roughly
+// one hash lookup, instead of scanning every endpoint of every app.
+//
+// Endpoints are indexed under 3 kinds of keys, because the request components
+// they're matched against can arrive in different orders: the request line
+// normally only provides the URL, with the hostname following in the Host
+// header; but an absolute-form request line provides the hostname first. Each
+// key maps to the group of all endpoints sharing that key, in configuration
+// file order, of which the first one that allows the request's Origin (if any)
+// wins. Allowed origins live in a separate hash set keyed on (endpoint, origin).
+//
+// Port numbers need not be part of any key, because the non-default port
+// number of an endpoint URL is part of its hostname string (e.g.,
+// "example.com:12345"), just like in the Host header of requests for it.
+
+enum rs_route_key_kind {
+    RS_ROUTE_KEY_HOSTNAME_URL = 0,
+    RS_ROUTE_KEY_URL = 1,
+    RS_ROUTE_KEY_HOSTNAME = 2
+};
+
+#define RS_ROUTE_KEY_KIND_C 3
+
+struct rs_endpoint_ref {
+    uint16_t app_i;
+    uint16_t endpoint_i;
+};
+
+struct rs_route_slot {
+    uint32_t hash; // 0 if this slot is empty
+    uint32_t ref_i; // Index into .refs of the first endpoint of the group
+    uint32_t ref_c; // The number of endpoints in the group
+    struct rs_endpoint_ref first; // Holds the key strings compared against
+    uint8_t key_kind; // enum rs_route_key_kind
+    uint8_t is_encrypted; // boolean
+    uint16_t:16;
+};
+
+struct rs_origin_slot {
+    uint32_t hash; // 0 if this slot is empty
+    struct rs_endpoint_ref endpoint;
+    uint16_t origin_i;
+    uint16_t:16;
+};
+
+struct rs_route_index {
+    struct rs_route_slot * route_slots;
+    struct rs_origin_slot * origin_slots;
+    struct rs_endpoint_ref * refs; // The endpoint groups of all route slots
+    uint32_t route_mask; // The number of route slots (a power of 2) minus 1
+    uint32_t origin_mask; // The number of origin slots (a power of 2) minus 1
+};
+
+#define RS_FNV1A_OFFSET_BASIS 0x811C9DC5
+#define RS_FNV1A_PRIME 0x01000193
+
+static uint32_t hash_bytes(
+    uint32_t hash,
+    void const * bytes,
+    size_t size
+) {
+    for (size_t i = 0; i < size; i++) {
+        hash ^= ((uint8_t const *) bytes)[i];
+        hash *= RS_FNV1A_PRIME;
+    }
+    return hash;
+}
+
+static uint32_t finalize_hash(
+    uint32_t hash
+) {
+    return hash ? hash : 1; // 0 is reserved to mark empty slots.
+}
+
+static uint32_t get_route_hash(
+    enum rs_route_key_kind key_kind,
+    bool is_encrypted,
+    char const * hostname,
+    size_t hostname_strlen,
+    char const * url,
+    size_t url_strlen
+) {
+    uint8_t prefix = key_kind << 1 | is_encrypted;
+    uint32_t hash = hash_bytes(RS_FNV1A_OFFSET_BASIS, &prefix, 1);
+    if (key_kind != RS_ROUTE_KEY_URL) {
+        // Include the terminating '\0' as a separator from the url.
+        hash = hash_bytes(hash, hostname, hostname_strlen);
+        hash = hash_bytes(hash, "", 1);
+    }
+    if (key_kind != RS_ROUTE_KEY_HOSTNAME) {
+        hash = hash_bytes(hash, url, url_strlen);
+    }
+    return finalize_hash(hash);
+}
+
+static uint32_t get_origin_hash(
+    struct rs_endpoint_ref endpoint,
+    char const * origin,
+    size_t origin_strlen
+) {
+    uint32_t hash = hash_bytes(RS_FNV1A_OFFSET_BASIS, &endpoint.app_i, 2);
+    hash = hash_bytes(hash, &endpoint.endpoint_i, 2);
+    return finalize_hash(hash_bytes(hash, origin, origin_strlen));
+}
+
+static struct rs_conf_endpoint const * get_endpoint(
+    struct rs_conf const * conf,
+    struct rs_endpoint_ref ref
+) {
+    return conf->apps[ref.app_i].endpoints + ref.endpoint_i;
+}
+
+// Endpoint URLs consisting of only a "/" path are stored as NULL.
+static bool str_equals(
+    char const * conf_str, // 0-terminated, or NULL (equivalent to "")
+    char const * str, // not 0-terminated
+    size_t strlen
+) {
+    if (!conf_str) {
+        return !strlen;
+    }
+    return !strncmp(conf_str, str, strlen) && conf_str[strlen] == '\0';
+}
+
+// Returns the slot holding the given key, or else the empty slot where it
+// belongs.
+static struct rs_route_slot * find_route_slot(
+    struct rs_conf const * conf,
+    uint32_t hash, // As returned by get_route_hash() for the key below
+    enum rs_route_key_kind key_kind,
+    bool is_encrypted,
+    char const * hostname, // Ignored if key_kind == RS_ROUTE_KEY_URL
+    size_t hostname_strlen,
+    char const * url, // Ignored if key_kind == RS_ROUTE_KEY_HOSTNAME
+    size_t url_strlen
+) {
+    struct rs_route_index const * index = conf->route_index;
+    for (uint32_t i = hash;; i++) {
+        struct rs_route_slot * slot = index->route_slots +
+            (i & index->route_mask);
+        if (!slot->hash) {
+            return slot;
+        }
+        if (slot->hash != hash || slot->key_kind != key_kind ||
+            slot->is_encrypted != is_encrypted) {
+            continue;
+        }
+        struct rs_conf_endpoint const * endpoint =
+            get_endpoint(conf, slot->first);
+        if ((key_kind == RS_ROUTE_KEY_URL ||
+             str_equals(endpoint->hostname, hostname, hostname_strlen)) &&
+            (key_kind == RS_ROUTE_KEY_HOSTNAME ||
+             str_equals(endpoint->url, url, url_strlen))) {
+            return slot;
+        }
+    }
+}
+
+// Like find_route_slot(), but for the origin set.
+static struct rs_origin_slot * find_origin_slot(
+    struct rs_conf const * conf,
+    struct rs_endpoint_ref endpoint,
+    char const * origin,
+    size_t origin_strlen
+) {
+    struct rs_route_index const * index = conf->route_index;
+    uint32_t hash = get_origin_hash(endpoint, origin, origin_strlen);
+    for (uint32_t i = hash;; i++) {
+        struct rs_origin_slot * slot = index->origin_slots +
+            (i & index->origin_mask);
+        if (!slot->hash || (slot->hash == hash &&
+            slot->endpoint.app_i == endpoint.app_i &&
+            slot->endpoint.endpoint_i == endpoint.endpoint_i &&
+            str_equals(get_endpoint(conf, endpoint)->allowed_origins[
+            slot->origin_i], origin, origin_strlen))) {
+            return slot;
+        }
+    }
+}
+
+// A power of 2 of at least twice elem_c, to keep probe sequences short.
+static uint32_t get_slot_c(
+    size_t elem_c
+) {
+    uint32_t slot_c = 8;
+    while (slot_c < 2 * elem_c) {
+        slot_c *= 2;
+    }
+    return slot_c;
+}
+
+static struct rs_route_slot * add_endpoint_to_route_slot(
+    struct rs_conf const * conf,
+    struct rs_endpoint_ref ref,
+    enum rs_route_key_kind key_kind
+) {
+    struct rs_conf_endpoint const * endpoint = get_endpoint(conf, ref);
+    char const * url = endpoint->url ? endpoint->url : "";
+    size_t hostname_strlen = strlen(endpoint->hostname);
+    size_t url_strlen = strlen(url);
+    uint32_t hash = get_route_hash(key_kind, endpoint->is_encrypted,
+        endpoint->hostname, hostname_strlen, url, url_strlen);
+    struct rs_route_slot * slot = find_route_slot(conf, hash, key_kind,
+        endpoint->is_encrypted, endpoint->hostname, hostname_strlen, url,
+        url_strlen);
+    if (!slot->hash) {
+        *slot = (struct rs_route_slot){
+            .hash = hash,
+            .first = ref,
+            .key_kind = key_kind,
+            .is_encrypted = endpoint->is_encrypted
+        };
+    }
+    return slot;
+}
+
+rs_ret build_route_index(
+    struct rs_conf * conf
+) {
+    size_t endpoint_c = 0;
+    size_t origin_c = 0;
+    // The endpoints of additional app instances are indexed only through the
+    // 1st instance: see expand_app_instances() in rs_conf.c.
+    for (size_t app_i = 0; app_i < conf->app_c; app_i++) {
+        struct rs_conf_app const * app = conf->apps + app_i;
+        if (app->instance_i) {
+            continue;
+        }
+        endpoint_c += app->endpoint_c;
+        for (size_t i = 0; i < app->endpoint_c; i++) {
+            origin_c += app->endpoints[i].allowed_origin_c;
+        }
+    }
+    RS_CALLOC(conf->route_index, 1);
+    struct rs_route_index * index = conf->route_index;
+    uint32_t route_slot_c = get_slot_c(RS_ROUTE_KEY_KIND_C * endpoint_c);
+    uint32_t origin_slot_c = get_slot_c(origin_c);
+    RS_CALLOC(index->route_slots, route_slot_c);
+    RS_CALLOC(index->origin_slots, origin_slot_c);
+    RS_CALLOC(index->refs, RS_ROUTE_KEY_KIND_C * endpoint_c);
+    index->route_mask = route_slot_c - 1;
+    index->origin_mask = origin_slot_c - 1;
+    // 1st pass: count the number of endpoints sharing each key.
+    for (uint16_t app_i = 0; app_i < conf->app_c; app_i++) {
+        struct rs_conf_app const * app = conf->apps + app_i;
+        if (app->instance_i) {
+            continue;
+        }
+        for (uint16_t i = 0; i < app->endpoint_c; i++) {
+            struct rs_endpoint_ref ref = {.app_i = app_i, .endpoint_i = i};
+            for (int k = 0; k < RS_ROUTE_KEY_KIND_C; k++) {
+                add_endpoint_to_route_slot(conf, ref, k)->ref_c++;
+            }
+            for (uint16_t j = 0; j < app->endpoints[i].allowed_origin_c; j++) {
+                char const * origin = app->endpoints[i].allowed_origins[j];
+                struct rs_origin_slot * slot =
+                    find_origin_slot(conf, ref, origin, strlen(origin));
+                if (!slot->hash) { // Else a duplicate: keep the 1st occurrence.
+                    *slot = (struct rs_origin_slot){
+                        .hash = get_origin_hash(ref, origin, strlen(origin)),
+                        .endpoint = ref,
+                        .origin_i = j
+                    };
+                }
+            }
+        }
+    }
+    // Assign each group its own range of .refs elements.
+    uint32_t ref_c = 0;
+    for (uint32_t i = 0; i < route_slot_c; i++) {
+        struct rs_route_slot * slot = index->route_slots + i;
+        slot->ref_i = ref_c;
+        ref_c += slot->ref_c;
+        slot->ref_c = 0;
+    }
+    // 2nd pass: fill each group in configuration file order.
+    for (uint16_t app_i = 0; app_i < conf->app_c; app_i++) {
+        if (conf->apps[app_i].instance_i) {
+            continue;
+        }
+        for (uint16_t i = 0; i < conf->apps[app_i].endpoint_c; i++) {
+            struct rs_endpoint_ref ref = {.app_i = app_i, .endpoint_i = i};
+            for (int k = 0; k < RS_ROUTE_KEY_KIND_C; k++) {
+                struct rs_route_slot * slot =
+                    add_endpoint_to_route_slot(conf, ref, k);
+                index->refs[slot->ref_i + slot->ref_c++] = ref;
+            }
+        }
+    }
+    RS_LOG(LOG_DEBUG, "Indexed %zu endpoints in %" PRIu32 " route slots, and "
+        "%zu allowed origins in %" PRIu32 " origin slots.", endpoint_c,
+        route_slot_c, origin_c, origin_slot_c);
+    return RS_OK;
+}
+
+bool find_endpoint(
+    struct rs_conf const * conf,
+    bool is_encrypted,
+    char const * hostname,
+    size_t hostname_strlen,
+    char const * url,
+    size_t url_strlen,
+    char const * origin,
+    size_t origin_strlen,
+    struct rs_route_match * match
+) {
+    struct rs_route_index const * index = conf->route_index;
+    enum rs_route_key_kind key_kind = !hostname ? RS_ROUTE_KEY_URL :
+        !url ? RS_ROUTE_KEY_HOSTNAME : RS_ROUTE_KEY_HOSTNAME_URL;
+    struct rs_route_slot const * slot = find_route_slot(conf,
+        get_route_hash(key_kind, is_encrypted, hostname, hostname_strlen, url,
+        url_strlen), key_kind, is_encrypted, hostname, hostname_strlen, url,
+        url_strlen);
+    if (!slot->hash) {
+        return false;
+    }
+    for (uint32_t i = 0; i < slot->ref_c; i++) {
+        struct rs_endpoint_ref ref = index->refs[slot->ref_i + i];
+        *match = (struct rs_route_match){
+            .app_i = ref.app_i,
+            .endpoint_i = ref.endpoint_i
+        };
+        if (!origin) {
+            return true;
+        }
+        struct rs_origin_slot const * origin_slot =
+            find_origin_slot(conf, ref, origin, origin_strlen);
+        if (origin_slot->hash) {
+            match->origin_i = origin_slot->origin_i;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,34 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#pragma once
+
+#include <ringsocket_api.h> // rs_ret
+#include <ringsocket_conf.h> // struct rs_conf
+
+// The endpoint found by find_endpoint(), identified by the indices of its app
+// in conf->apps and of itself in that app's endpoints; plus the index of the
+// allowed origin that was matched (if any).
+struct rs_route_match {
+    uint16_t app_i;
+    uint16_t endpoint_i;
+    uint16_t origin_i;
+};
+
+rs_ret build_route_index(
+    struct rs_conf * conf
+);
+
+// Each string argument may be NULL if not known (yet), except that hostname and
+// url can't both be NULL. Returns false if no endpoint matches.
+bool find_endpoint(
+    struct rs_conf const * conf,
+    bool is_encrypted,
+    char const * hostname, // not 0-terminated
+    size_t hostname_strlen,
+    char const * url, // not 0-terminated
+    size_t url_strlen,
+    char const * origin, // not 0-terminated
+    size_t origin_strlen,
+    struct rs_route_match * match
+);
@@ -0,0 +1,563 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#include "rs_simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RS_SIMD_X86
+#include <immintrin.h> // SSE2, AVX2, and AVX-512 intrinsics
+#endif
+
+// The routines in this file are the byte crunching hot spots of worker threads.
+// Each has a scalar implementation that works everywhere, along with x86 SIMD
+// variants compiled through GCC's target attribute, such that the binary as a
+// whole remains runnable on any x86-64 CPU: detect_simd_support() determines
+// once at startup which of these the CPU it's running on can actually execute.
+
+enum rs_simd_level {
+    RS_SIMD_NONE = 0,
+    RS_SIMD_SSE2 = 1,
+    RS_SIMD_AVX2 = 2,
+    RS_SIMD_AVX512 = 3
+};
+
+// Only assigned to by detect_simd_support() prior to spawning any threads.
+static enum rs_simd_level simd_level = RS_SIMD_NONE;
+
+void detect_simd_support(
+    void
+) {
+#ifdef RS_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        simd_level = RS_SIMD_AVX512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        simd_level = RS_SIMD_AVX2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        simd_level = RS_SIMD_SSE2;
+    }
+#endif
+    RS_LOG(LOG_INFO, "Using %s routines for WebSocket payload unmasking, UTF-8 "
+        "validation, and HTTP Upgrade request scanning",
+        (char *[]){"scalar", "SSE2", "AVX2", "AVX-512"}[simd_level]);
+}
+
+// #############################################################################
+// # WebSocket payload unmasking ###############################################
+
+// Every payload byte at index i is XORed with mask_key[i % 4]. Rotating the key
+// by start_i % 4 yields a 32-bit word applicable to every 4 bytes from start_i
+// onward, which in turn can be broadcast to vectors of any width.
+static uint32_t get_rotated_mask_key(
+    uint8_t const * mask_key,
+    size_t start_i
+) {
+    uint32_t key = 0;
+    memcpy(&key, (uint8_t []){
+        mask_key[start_i % 4],
+        mask_key[(start_i + 1) % 4],
+        mask_key[(start_i + 2) % 4],
+        mask_key[(start_i + 3) % 4]
+    }, 4);
+    return key;
+}
+
+static void unmask_scalar(
+    uint8_t * payload,
+    size_t start_i,
+    size_t over_i,
+    uint8_t const * mask_key
+) {
+    uint32_t const key = get_rotated_mask_key(mask_key, start_i);
+    uint8_t * p = payload + start_i;
+    for (; p + 4 <= payload + over_i; p += 4) {
+        uint32_t word = 0;
+        memcpy(&word, p, 4);
+        word ^= key;
+        memcpy(p, &word, 4);
+    }
+    for (size_t i = p - payload; i < over_i; i++) {
+        payload[i] ^= mask_key[i % 4];
+    }
+}
+
+#ifdef RS_SIMD_X86
+__attribute__((target("sse2")))
+static void unmask_sse2(
+    uint8_t * payload,
+    size_t start_i,
+    size_t over_i,
+    uint8_t const * mask_key
+) {
+    __m128i const key =
+        _mm_set1_epi32((int) get_rotated_mask_key(mask_key, start_i));
+    size_t i = start_i;
+    for (; i + 16 <= over_i; i += 16) {
+        __m128i * p = (__m128i *) (payload + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), key));
+    }
+    unmask_scalar(payload, i, over_i, mask_key);
+}
+
+__attribute__((target("avx2")))
+static void unmask_avx2(
+    uint8_t * payload,
+    size_t start_i,
+    size_t over_i,
+    uint8_t const * mask_key
+) {
+    __m256i const key =
+        _mm256_set1_epi32((int) get_rotated_mask_key(mask_key, start_i));
+    size_t i = start_i;
+    for (; i + 32 <= over_i; i += 32) {
+        __m256i * p = (__m256i *) (payload + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), key));
+    }
+    unmask_scalar(payload, i, over_i, mask_key);
+}
+
+__attribute__((target("avx512f")))
+static void unmask_avx512(
+    uint8_t * payload,
+    size_t start_i,
+    size_t over_i,
+    uint8_t const * mask_key
+) {
+    __m512i const key =
+        _mm512_set1_epi32((int) get_rotated_mask_key(mask_key, start_i));
+    size_t i = start_i;
+    for (; i + 64 <= over_i; i += 64) {
+        void * p = payload + i;
+        _mm512_storeu_si512(p, _mm512_xor_si512(_mm512_loadu_si512(p), key));
+    }
+    unmask_scalar(payload, i, over_i, mask_key);
+}
+#endif
+
+void unmask_wsframe_payload(
+    uint8_t * payload,
+    size_t start_i,
+    size_t over_i,
+    uint8_t const * mask_key
+) {
+    switch (simd_level) {
+#ifdef RS_SIMD_X86
+    case RS_SIMD_AVX512:
+        unmask_avx512(payload, start_i, over_i, mask_key);
+        return;
+    case RS_SIMD_AVX2:
+        unmask_avx2(payload, start_i, over_i, mask_key);
+        return;
+    case RS_SIMD_SSE2:
+        unmask_sse2(payload, start_i, over_i, mask_key);
+        return;
+#endif
+    default:
+        unmask_scalar(payload, start_i, over_i, mask_key);
+    }
+}
+
+// #############################################################################
+// # UTF-8 validation ##########################################################
+
+// All variants below preserve the exact semantics of feeding every byte to
+// rs_validate_utf8_byte() of ringsocket_wsframe.h: the returned state can be
+// passed to the next call in order to resume validation of a byte stream that
+// arrives in pieces (e.g., across partial reads of a WebSocket frame payload).
+
+static enum rs_utf8_state validate_utf8_scalar(
+    enum rs_utf8_state state,
+    uint8_t const * str,
+    size_t size
+) {
+    for (uint8_t const * const over = str + size; str < over; str++) {
+        if ((state = rs_validate_utf8_byte(state, *str)) == RS_UTF8_INVALID) {
+            break;
+        }
+    }
+    return state;
+}
+
+#ifdef RS_SIMD_X86
+// SSE2 lacks the byte shuffle instruction needed for the lookup table approach
+// of the AVX2 variant below, so settle for skipping over ASCII-only stretches.
+__attribute__((target("sse2")))
+static enum rs_utf8_state validate_utf8_sse2(
+    enum rs_utf8_state state,
+    uint8_t const * str,
+    size_t size
+) {
+    uint8_t const * const over = str + size;
+    while (str < over) {
+        if (state == RS_UTF8_OK && str + 16 <= over &&
+            !_mm_movemask_epi8(_mm_loadu_si128((__m128i const *) str))) {
+            str += 16;
+            continue;
+        }
+        if ((state = rs_validate_utf8_byte(state, *str++)) ==
+            RS_UTF8_INVALID) {
+            break;
+        }
+    }
+    return state;
+}
+
+// Each vector element of the AVX2 variant's lookups consists of the following
+// error bit flags, as per the algorithm described by John Keiser and Daniel
+// Lemire in "Validating UTF-8 In Less Than One Instruction Per Byte" (2021).
+#define RS_UTF8_TOO_SHORT (1 << 0) // 11______ 0_______ or 11______ 11______
+#define RS_UTF8_TOO_LONG (1 << 1) // 0_______ 10______
+#define RS_UTF8_OVERLONG_3 (1 << 2) // 11100000 100_____
+#define RS_UTF8_TOO_LARGE (1 << 3) // 11110100 1001____, 11110101 101_____ etc
+#define RS_UTF8_SURROGATE (1 << 4) // 11101101 101_____
+#define RS_UTF8_OVERLONG_2 (1 << 5) // 1100000_ 10______
+#define RS_UTF8_TOO_LARGE_1000 (1 << 6) // 11110101 1000____ etc
+#define RS_UTF8_OVERLONG_4 (1 << 6) // 11110000 1000____
+// Bit 7 is expressed as a negative value, to let flag combinations fit the char
+// parameters of _mm256_setr_epi8() without overflow.
+#define RS_UTF8_TWO_CONTS (-0x80) // 10______ 10______
+#define RS_UTF8_CARRY \
+    (RS_UTF8_TOO_SHORT | RS_UTF8_TOO_LONG | RS_UTF8_TWO_CONTS)
+
+#define RS_UTF8_LOOKUP16(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+// Return the 32 bytes preceding each byte of "cur" by a distance of n bytes,
+// where the first n of those are obtained from the tail end of "prev".
+#define RS_UTF8_PREV(cur, prev, n) \
+    _mm256_alignr_epi8((cur), _mm256_permute2x128_si256((prev), (cur), 0x21), \
+        16 - (n))
+
+__attribute__((target("avx2")))
+static __m256i get_utf8_errors_avx2(
+    __m256i cur,
+    __m256i prev
+) {
+    __m256i const low_nibble_mask = _mm256_set1_epi8(0x0F);
+    __m256i const prev1 = RS_UTF8_PREV(cur, prev, 1);
+    __m256i const byte_1_high = _mm256_shuffle_epi8(RS_UTF8_LOOKUP16(
+        // 0_______ ________ <ASCII in byte 1>
+        RS_UTF8_TOO_LONG, RS_UTF8_TOO_LONG, RS_UTF8_TOO_LONG, RS_UTF8_TOO_LONG,
+        RS_UTF8_TOO_LONG, RS_UTF8_TOO_LONG, RS_UTF8_TOO_LONG, RS_UTF8_TOO_LONG,
+        // 10______ ________ <continuation in byte 1>
+        RS_UTF8_TWO_CONTS, RS_UTF8_TWO_CONTS, RS_UTF8_TWO_CONTS,
+        RS_UTF8_TWO_CONTS,
+        // 1100____ ________ <two byte lead in byte 1>
+        RS_UTF8_TOO_SHORT | RS_UTF8_OVERLONG_2,
+        // 1101____ ________ <two byte lead in byte 1>
+        RS_UTF8_TOO_SHORT,
+        // 1110____ ________ <three byte lead in byte 1>
+        RS_UTF8_TOO_SHORT | RS_UTF8_OVERLONG_3 | RS_UTF8_SURROGATE,
+        // 1111____ ________ <four+ byte lead in byte 1>
+        RS_UTF8_TOO_SHORT | RS_UTF8_TOO_LARGE | RS_UTF8_TOO_LARGE_1000 |
+        RS_UTF8_OVERLONG_4
+    ), _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble_mask));
+    __m256i const byte_1_low = _mm256_shuffle_epi8(RS_UTF8_LOOKUP16(
+        // ____0000 ________
+        RS_UTF8_CARRY | RS_UTF8_OVERLONG_3 | RS_UTF8_OVERLONG_2 |
+        RS_UTF8_OVERLONG_4,
+        // ____0001 ________
+        RS_UTF8_CARRY | RS_UTF8_OVERLONG_2,
+        // ____001_ ________
+        RS_UTF8_CARRY,
+        RS_UTF8_CARRY,
+        // ____0100 ________
+        RS_UTF8_CARRY | RS_UTF8_TOO_LARGE,
+        // ____0101 ________
+        RS_UTF8_CARRY | RS_UTF8_TOO_LARGE | RS_UTF8_TOO_LARGE_1000,
+        // ____011_ ________
+        RS_UTF8_CARRY | RS_UTF8_TOO_LARGE | RS_UTF8_TOO_LARGE_1000,
+        RS_UTF8_CARRY | RS_UTF8_TOO_LARGE | RS_UTF8_TOO_LARGE_1000,
+        // ____1___ ________
+        RS_UTF8_CARRY | RS_UTF8_TOO_LARGE | RS_UTF8_TOO_LARGE_1000,
+        RS_UTF8_CARRY | RS_UTF8_TOO_LARGE | RS_UTF8_TOO_LARGE_1000,
+        RS_UTF8_CARRY | RS_UTF8_TOO_LARGE | RS_UTF8_TOO_LARGE_1000,
+        RS_UTF8_CARRY | RS_UTF8_TOO_LARGE | RS_UTF8_TOO_LARGE_1000,
+        RS_UTF8_CARRY | RS_UTF8_TOO_LARGE | RS_UTF8_TOO_LARGE_1000,
+        // ____1101 ________
+        RS_UTF8_CARRY | RS_UTF8_TOO_LARGE | RS_UTF8_TOO_LARGE_1000 |
+        RS_UTF8_SURROGATE,
+        RS_UTF8_CARRY | RS_UTF8_TOO_LARGE | RS_UTF8_TOO_LARGE_1000,
+        RS_UTF8_CARRY | RS_UTF8_TOO_LARGE | RS_UTF8_TOO_LARGE_1000
+    ), _mm256_and_si256(prev1, low_nibble_mask));
+    __m256i const byte_2_high = _mm256_shuffle_epi8(RS_UTF8_LOOKUP16(
+        // ________ 0_______ <ASCII in byte 2>
+        RS_UTF8_TOO_SHORT, RS_UTF8_TOO_SHORT, RS_UTF8_TOO_SHORT,
+        RS_UTF8_TOO_SHORT, RS_UTF8_TOO_SHORT, RS_UTF8_TOO_SHORT,
+        RS_UTF8_TOO_SHORT, RS_UTF8_TOO_SHORT,
+        // ________ 1000____
+        RS_UTF8_TOO_LONG | RS_UTF8_OVERLONG_2 | RS_UTF8_TWO_CONTS |
+        RS_UTF8_OVERLONG_3 | RS_UTF8_TOO_LARGE_1000 | RS_UTF8_OVERLONG_4,
+        // ________ 1001____
+        RS_UTF8_TOO_LONG | RS_UTF8_OVERLONG_2 | RS_UTF8_TWO_CONTS |
+        RS_UTF8_OVERLONG_3 | RS_UTF8_TOO_LARGE,
+        // ________ 101_____
+        RS_UTF8_TOO_LONG | RS_UTF8_OVERLONG_2 | RS_UTF8_TWO_CONTS |
+        RS_UTF8_SURROGATE | RS_UTF8_TOO_LARGE,
+        RS_UTF8_TOO_LONG | RS_UTF8_OVERLONG_2 | RS_UTF8_TWO_CONTS |
+        RS_UTF8_SURROGATE | RS_UTF8_TOO_LARGE,
+        // ________ 11______
+        RS_UTF8_TOO_SHORT, RS_UTF8_TOO_SHORT, RS_UTF8_TOO_SHORT,
+        RS_UTF8_TOO_SHORT
+    ), _mm256_and_si256(_mm256_srli_epi16(cur, 4), low_nibble_mask));
+    __m256i const special_cases =
+        _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low),
+        byte_2_high);
+    // Bytes 3 and 4 of 3 and 4 byte codepoints must be continuation bytes,
+    // which is the only case in which a TWO_CONTS flag is not an error.
+    __m256i const must_be_2_3_continuation = _mm256_or_si256(
+        // Only 111_____ will be >= 0x80
+        _mm256_subs_epu8(RS_UTF8_PREV(cur, prev, 2), _mm256_set1_epi8(0x60)),
+        // Only 1111____ will be >= 0x80
+        _mm256_subs_epu8(RS_UTF8_PREV(cur, prev, 3), _mm256_set1_epi8(0x70)));
+    return _mm256_xor_si256(special_cases, _mm256_and_si256(
+        must_be_2_3_continuation, _mm256_set1_epi8((char) 0x80)));
+}
+
+__attribute__((target("avx2")))
+static enum rs_utf8_state validate_utf8_avx2(
+    enum rs_utf8_state state,
+    uint8_t const * str,
+    size_t size
+) {
+    uint8_t const * const over = str + size;
+    // Vectorized validation must start on a codepoint boundary, so first
+    // complete any codepoint left unfinished by the previous call.
+    while (state != RS_UTF8_OK) {
+        if (str == over || (state = rs_validate_utf8_byte(state, *str++)) ==
+            RS_UTF8_INVALID) {
+            return state;
+        }
+    }
+    if (str + 32 > over) {
+        return validate_utf8_scalar(state, str, over - str);
+    }
+    // Any byte greater than the corresponding byte in this vector at the end of
+    // a 32 byte block means that its last codepoint is incomplete.
+    __m256i const incomplete_max = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char) (0xF0 - 1), (char) (0xE0 - 1), (char) (0xC0 - 1));
+    __m256i prev = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    __m256i errors = _mm256_setzero_si256();
+    for (; str + 32 <= over; str += 32) {
+        __m256i const cur = _mm256_loadu_si256((__m256i const *) str);
+        if (_mm256_movemask_epi8(cur)) {
+            errors = _mm256_or_si256(errors, get_utf8_errors_avx2(cur, prev));
+            prev_incomplete = _mm256_subs_epu8(cur, incomplete_max);
+        } else {
+            // An all-ASCII block is only erroneous if the previous block ended
+            // with an incomplete codepoint.
+            errors = _mm256_or_si256(errors, prev_incomplete);
+        }
+        prev = cur;
+    }
+    if (!_mm256_testz_si256(errors, errors)) {
+        return RS_UTF8_INVALID;
+    }
+    // Whether the last vectorized block ended with an incomplete codepoint is
+    // left to be determined by rewinding to the start of its last codepoint,
+    // and validating the remainder with the scalar validator to obtain the
+    // state to return. (No errors were found, so said start must be within the
+    // last 4 bytes.)
+    for (int i = 0; (*--str & 0xC0) == 0x80; i++) {
+        if (i == 3) {
+            return RS_UTF8_INVALID;
+        }
+    }
+    return validate_utf8_scalar(RS_UTF8_OK, str, over - str);
+}
+#endif
+
+enum rs_utf8_state validate_utf8(
+    enum rs_utf8_state state,
+    uint8_t const * str,
+    size_t size
+) {
+    switch (simd_level) {
+#ifdef RS_SIMD_X86
+    // An AVX-512 variant of the lookup algorithm would need cross-lane byte
+    // permutes (AVX512-VBMI) to obtain the preceding bytes; whereas in practice
+    // most text payloads are too small to benefit from 64-byte vectors anyway.
+    case RS_SIMD_AVX512: case RS_SIMD_AVX2:
+        return validate_utf8_avx2(state, str, size);
+    case RS_SIMD_SSE2:
+        return validate_utf8_sse2(state, str, size);
+#endif
+    default:
+        return validate_utf8_scalar(state, str, size);
+    }
+}
+
+// #############################################################################
+// # HTTP Upgrade request scanning #############################################
+
+// The parser of rs_http.c is a resumable byte-at-a-time state machine, which
+// remains in charge of all parsing decisions. These routines merely let it
+// skip ahead over stretches of bytes already present in its read buffer: past
+// the uninteresting bytes of header lines and values, and past entire header
+// names.
+
+static bool equals_http_name_scalar(
+    char const * str,
+    char const * name,
+    size_t name_strlen
+) {
+    for (size_t i = 0; i < name_strlen; i++) {
+        char const fold = name[i] >= 'a' && name[i] <= 'z' ? 0x20 : 0;
+        if ((str[i] | fold) != name[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static char * find_http_delim_scalar(
+    char * str,
+    char const * over,
+    char d0,
+    char d1,
+    char d2
+) {
+    for (; str < over; str++) {
+        if (*str == d0 || *str == d1 || *str == d2) {
+            break;
+        }
+    }
+    return str;
+}
+
+#ifdef RS_SIMD_X86
+// Returns a bitmask of which of the 16 chars of str equal those of name, with
+// the same case-insensitivity as equals_http_name().
+__attribute__((target("sse2")))
+static uint32_t get_http_name_eq_mask_sse2(
+    char const * str,
+    char const * name
+) {
+    __m128i const n = _mm_loadu_si128((__m128i const *) name);
+    // Only fold the case of chars of str corresponding to letters of name, so
+    // that, for example, "\r" (0x0D) can't be mistaken for "-" (0x2D).
+    __m128i const fold = _mm_and_si128(_mm_and_si128(
+        _mm_cmpgt_epi8(n, _mm_set1_epi8('a' - 1)),
+        _mm_cmplt_epi8(n, _mm_set1_epi8('z' + 1))), _mm_set1_epi8(0x20));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_or_si128(
+        _mm_loadu_si128((__m128i const *) str), fold), n));
+}
+
+__attribute__((target("sse2")))
+static bool equals_http_name_sse2(
+    char const * str,
+    char const * name,
+    size_t name_strlen
+) {
+    uint32_t const eq_mask = get_http_name_eq_mask_sse2(str, name) |
+        get_http_name_eq_mask_sse2(str + 16, name + 16) << 16;
+    uint32_t const len_mask = name_strlen < 32 ?
+        ((uint32_t) 1 << name_strlen) - 1 : UINT32_MAX;
+    return (eq_mask & len_mask) == len_mask;
+}
+
+__attribute__((target("avx2")))
+static bool equals_http_name_avx2(
+    char const * str,
+    char const * name,
+    size_t name_strlen
+) {
+    __m256i const n = _mm256_loadu_si256((__m256i const *) name);
+    __m256i const fold = _mm256_and_si256(_mm256_and_si256(
+        _mm256_cmpgt_epi8(n, _mm256_set1_epi8('a' - 1)),
+        _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), n)),
+        _mm256_set1_epi8(0x20));
+    uint32_t const eq_mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+        _mm256_or_si256(_mm256_loadu_si256((__m256i const *) str), fold), n));
+    uint32_t const len_mask = name_strlen < 32 ?
+        ((uint32_t) 1 << name_strlen) - 1 : UINT32_MAX;
+    return (eq_mask & len_mask) == len_mask;
+}
+
+__attribute__((target("sse2")))
+static char * find_http_delim_sse2(
+    char * str,
+    char const * over,
+    char d0,
+    char d1,
+    char d2
+) {
+    __m128i const v0 = _mm_set1_epi8(d0);
+    __m128i const v1 = _mm_set1_epi8(d1);
+    __m128i const v2 = _mm_set1_epi8(d2);
+    for (; str + 16 <= over; str += 16) {
+        __m128i const cur = _mm_loadu_si128((__m128i const *) str);
+        uint32_t const mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+            _mm_cmpeq_epi8(cur, v0), _mm_cmpeq_epi8(cur, v1)),
+            _mm_cmpeq_epi8(cur, v2)));
+        if (mask) {
+            return str + __builtin_ctz(mask);
+        }
+    }
+    return find_http_delim_scalar(str, over, d0, d1, d2);
+}
+
+__attribute__((target("avx2")))
+static char * find_http_delim_avx2(
+    char * str,
+    char const * over,
+    char d0,
+    char d1,
+    char d2
+) {
+    __m256i const v0 = _mm256_set1_epi8(d0);
+    __m256i const v1 = _mm256_set1_epi8(d1);
+    __m256i const v2 = _mm256_set1_epi8(d2);
+    for (; str + 32 <= over; str += 32) {
+        __m256i const cur = _mm256_loadu_si256((__m256i const *) str);
+        uint32_t const mask = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(cur, v0),
+            _mm256_cmpeq_epi8(cur, v1)), _mm256_cmpeq_epi8(cur, v2)));
+        if (mask) {
+            return str + __builtin_ctz(mask);
+        }
+    }
+    return find_http_delim_sse2(str, over, d0, d1, d2);
+}
+#endif
+
+bool equals_http_name(
+    char const * str,
+    char const * name,
+    size_t name_strlen
+) {
+    switch (simd_level) {
+#ifdef RS_SIMD_X86
+    // Byte comparison masks of 64-byte vectors require AVX512BW, which is not
+    // implied by the AVX512F support detected; and no header name relevant to
+    // rs_http.c exceeds 32 bytes anyway.
+    case RS_SIMD_AVX512: case RS_SIMD_AVX2:
+        return equals_http_name_avx2(str, name, name_strlen);
+    case RS_SIMD_SSE2:
+        return equals_http_name_sse2(str, name, name_strlen);
+#endif
+    default:
+        return equals_http_name_scalar(str, name, name_strlen);
+    }
+}
+
+char * find_http_delim(
+    char * str,
+    char const * over,
+    char d0,
+    char d1,
+    char d2
+) {
+    switch (simd_level) {
+#ifdef RS_SIMD_X86
+    case RS_SIMD_AVX512: case RS_SIMD_AVX2:
+        return find_http_delim_avx2(str, over, d0, d1, d2);
+    case RS_SIMD_SSE2:
+        return find_http_delim_sse2(str, over, d0, d1, d2);
+#endif
+    default:
+        return find_http_delim_scalar(str, over, d0, d1, d2);
+    }
+}
@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#pragma once
+
+#include "rs_worker.h" // enum rs_utf8_state, rs_ret
+
+void detect_simd_support(
+    void
+);
+
+void unmask_wsframe_payload(
+    uint8_t * payload,
+    size_t start_i, // The index of the 1st byte within payload to be unmasked
+    size_t over_i, // The index following the last byte to be unmasked
+    uint8_t const * mask_key // 4 bytes applicable to payload index 0 onward
+);
+
+enum rs_utf8_state validate_utf8(
+    enum rs_utf8_state state, // As returned by the previous call, if any
+    uint8_t const * str,
+    size_t size
+);
+
+// The number of bytes that both arguments of equals_http_name() must be safe to
+// read from, regardless of the name_strlen argument.
+#define RS_SIMD_HTTP_NAME_SIZE 32
+
+// Returns whether the 1st name_strlen chars of str equal those of name, where
+// any ASCII letter in str matches regardless of its case. Letters in name must
+// be lowercase.
+bool equals_http_name(
+    char const * str,
+    char const * name,
+    size_t name_strlen // May not exceed RS_SIMD_HTTP_NAME_SIZE
+);
+
+// Returns a pointer to the 1st char within [str, over) equal to any of d0, d1,
+// or d2 (which need not be distinct); or over if there is no such char.
+char * find_http_delim(
+    char * str,
+    char const * over,
+    char d0,
+    char d1,
+    char d2
+);
@@ -1,20 +1,102 @@
 // SPDX-License-Identifier: MIT
 // Copyright © 2019 William Budd
 
-#define _GNU_SOURCE // accept4()
+#define _GNU_SOURCE // accept4(), syscall()
 
+#include "rs_affinity.h" // get_cpu_c(), get_worker_i_by_cpu()
 #include "rs_event.h" // rs_event_kind
 #include "rs_slot.h" // alloc_slot(), free_slot()
 #include "rs_socket.h"
+#include "rs_uring.h" // arm_uring_accept(), arm_uring_peer()
 #include "rs_util.h" // get_addr_str()
 
+#include <linux/bpf.h> // struct bpf_insn, union bpf_attr
 #include <linux/filter.h> // struct sock_filter
 #include <sys/epoll.h> // epoll_create1(), epoll_ctl()
+#include <sys/syscall.h> // SYS_bpf
+
+// Load an eBPF program that, when attached to a reuseport group with
+// SO_ATTACH_REUSEPORT_EBPF, steers each incoming connection to a worker pinned
+// to the CPU (or to the NUMA node of the CPU) on which the kernel happens to
+// process the connection's SYN packet (i.e., its RX softirq); keeping all of
+// that connection's processing local to the same CPU core and its caches (or
+// at least to the same NUMA node). This works because the index returned by a
+// reuseport program refers to the position of a listening socket in its
+// reuseport group, which bind_to_ports() ensures corresponds to worker_i by
+// calling listen() on the sockets of each worker in order.
+//
+// Given that RingSocket doesn't depend on libbpf or clang, the program is
+// assembled by hand from raw instructions, equivalent to:
+//
+//     uint32_t cpu = bpf_get_smp_processor_id();
+//     if (cpu == 0) return get_worker_i_by_cpu(0);
+//     if (cpu == 1) return get_worker_i_by_cpu(1);
+//     ... // Only for CPUs for which get_worker_i_by_cpu() finds a worker
+//     return cpu % conf->worker_c;
+//
+// Returns -1 if the kernel refuses to load it, in which case the caller should
+// fall back to the random assignment of bind_socket()'s CBPF program.
+static int load_cpu_steering_program(
+    struct rs_conf const * conf
+) {
+    size_t cpu_c = get_cpu_c();
+    struct bpf_insn insns[3 * cpu_c + 3];
+    memset(insns, 0, sizeof(insns));
+    struct bpf_insn * insn = insns;
+    *insn++ = (struct bpf_insn){
+        .code = BPF_JMP | BPF_CALL,
+        .imm = BPF_FUNC_get_smp_processor_id
+    }; // The return value ends up in register 0
+    for (size_t cpu = 0; cpu < cpu_c; cpu++) {
+        size_t worker_i = 0;
+        if (!get_worker_i_by_cpu(conf, cpu, &worker_i)) {
+            continue;
+        }
+        *insn++ = (struct bpf_insn){
+            .code = BPF_JMP | BPF_JNE | BPF_K,
+            .dst_reg = BPF_REG_0,
+            .off = 2, // Skip the next 2 instructions if not equal
+            .imm = cpu
+        };
+        *insn++ = (struct bpf_insn){
+            .code = BPF_ALU64 | BPF_MOV | BPF_K,
+            .dst_reg = BPF_REG_0,
+            .imm = worker_i
+        };
+        *insn++ = (struct bpf_insn){.code = BPF_JMP | BPF_EXIT};
+    }
+    *insn++ = (struct bpf_insn){
+        .code = BPF_ALU | BPF_MOD | BPF_K,
+        .dst_reg = BPF_REG_0,
+        .imm = conf->worker_c
+    };
+    *insn++ = (struct bpf_insn){.code = BPF_JMP | BPF_EXIT};
+    size_t insn_c = insn - insns;
+    char log_buf[0x400] = {0};
+    int prog_fd = syscall(SYS_bpf, BPF_PROG_LOAD, &(union bpf_attr){
+        .prog_type = BPF_PROG_TYPE_SOCKET_FILTER,
+        .insn_cnt = insn_c,
+        .insns = (uint64_t) (uintptr_t) insns,
+        .license = (uint64_t) (uintptr_t) "MIT",
+        .log_level = 1,
+        .log_size = sizeof(log_buf),
+        .log_buf = (uint64_t) (uintptr_t) log_buf
+    }, sizeof(union bpf_attr));
+    if (prog_fd == -1) {
+        RS_LOG_ERRNO(LOG_WARNING, "Unsuccessful bpf(BPF_PROG_LOAD, ...) of "
+            "the program needed to steer incoming connections to the worker "
+            "pinned to the CPU that received them (CAP_BPF or CAP_SYS_ADMIN "
+            "may be lacking, or the kernel may be too old). Falling back to "
+            "random assignment instead. Verifier log: \"%s\"", log_buf);
+    }
+    return prog_fd;
+}
 
 static rs_ret bind_socket(
     struct rs_conf_port const * port,
     int fd,
     size_t worker_c,
+    int steering_prog_fd,
     struct sockaddr const * addr,
     socklen_t addr_size
 ) {
@@ -30,13 +112,18 @@ static rs_ret bind_socket(
             "SO_REUSEPORT, ...)", fd);
         return RS_FATAL;
     }
-    // SO_ATTACH_REUSEPORT_CBPF only needs to be set once for each port, so
+    // SO_ATTACH_REUSEPORT_(C|E)BPF only needs to be set once for each port, so
     // worker_c parameter is expected to be 0 whenever this function is called
     // again for the same port.
-    if (worker_c) {
-        // Todo: replace this with a CPU affinity-based
-        // SO_ATTACH_REUSEPORT_EBPF program calling bpf_get_smp_processor_id()
-
+    if (worker_c && steering_prog_fd != -1) {
+        // See load_cpu_steering_program()
+        if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF,
+            &steering_prog_fd, sizeof(int)) == -1) {
+            RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful setsockopt(%d, "
+                "SOL_SOCKET, SO_ATTACH_REUSEPORT_EBPF, ...)", fd);
+            return RS_FATAL;
+        }
+    } else if (worker_c) {
         // Assign each incoming socket to a random worker thread, resulting in a
         // roughly equal load distribution vis a vis the Law of Large Numbers.
         // The values of the sock_filter struct below are equal to the output of
@@ -69,6 +156,21 @@ static rs_ret bind_socket(
         RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful bind(%d, addr, addr_size)", fd);
         return RS_FATAL;
     }
+    // Call listen() here rather than from each worker thread, because the
+    // order in which sockets start listening determines their index within
+    // the reuseport group: see load_cpu_steering_program().
+    //
+    // todo: for some bizarre reason listen() _sometimes_ returns EADDRINUSE
+    // even though each listen_fd (as obtained through bind() after setting
+    // both SO_REUSEADDR and SO_REUSEPORT) is never used anywhere but here.
+    //
+    // A possible cause could be an unclean kernel state caused after a
+    // previous execution of RingSocket segfaulted. Currently investigating...
+    if (listen(fd, SOMAXCONN) == -1) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful listen(%d, SOMAXCONN)", fd);
+        return RS_FATAL;
+    }
+    RS_LOG(LOG_DEBUG, "Successful listen(%d, SOMAXCONN)", fd);
     return RS_OK;
 }
 
@@ -76,6 +178,7 @@ static rs_ret bind_ipv4(
     struct rs_conf_port const * port,
     int * fd,
     size_t worker_c,
+    int steering_prog_fd,
     struct in_addr addr
 ) {
     *fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
@@ -86,7 +189,7 @@ static rs_ret bind_ipv4(
     }
     RS_LOG(LOG_DEBUG, "Bind()ing an IPv4 address on port %" PRIu16
         " to a socket_fd: fd=%d", port->port_number, *fd);
-    return bind_socket(port, *fd, worker_c,
+    return bind_socket(port, *fd, worker_c, steering_prog_fd,
         (struct sockaddr *) &(struct sockaddr_in){
             .sin_family = AF_INET,
             .sin_port = RS_HTON16(port->port_number),
@@ -98,6 +201,7 @@ static rs_ret bind_ipv6(
     struct rs_conf_port const * port,
     int * fd,
     size_t worker_c,
+    int steering_prog_fd,
     struct in6_addr addr,
     bool ipv6_is_v6only
 ) {
@@ -115,7 +219,7 @@ static rs_ret bind_ipv6(
     }
     RS_LOG(LOG_DEBUG, "Bind()ing an IPv6 address on port %" PRIu16
         " to a socket_fd: fd=%d", port->port_number, *fd);
-    return bind_socket(port, *fd, worker_c,
+    return bind_socket(port, *fd, worker_c, steering_prog_fd,
         (struct sockaddr *) &(struct sockaddr_in6){
             .sin6_family = AF_INET6,
             .sin6_port = RS_HTON16(port->port_number),
@@ -126,6 +230,10 @@ static rs_ret bind_ipv6(
 rs_ret bind_to_ports(
     struct rs_conf * conf
 ) {
+    int steering_prog_fd = -1;
+    if (conf->worker_pins) {
+        steering_prog_fd = load_cpu_steering_program(conf);
+    }
     for (struct rs_conf_port * port = conf->ports;
         port < conf->ports + conf->port_c; port++) {
         switch (port->listen_ip_kind) {
@@ -150,31 +258,33 @@ rs_ret bind_to_ports(
             // structs to zero, but they're de facto equivalent.
             switch (port->listen_ip_kind) {
             case RS_LISTEN_IP_ANY:
-                RS_GUARD(bind_ipv4(port, fd++, worker_c,
+                RS_GUARD(bind_ipv4(port, fd++, worker_c, steering_prog_fd,
                     (struct in_addr){0}));
-                RS_GUARD(bind_ipv6(port, fd++, worker_c,
+                RS_GUARD(bind_ipv6(port, fd++, worker_c, steering_prog_fd,
                     (struct in6_addr){0}, true));
                 continue;
             case RS_LISTEN_IP_ANY_V6_OR_EMBEDDED_V4:
-                RS_GUARD(bind_ipv6(port, fd++, worker_c,
+                RS_GUARD(bind_ipv6(port, fd++, worker_c, steering_prog_fd,
                     (struct in6_addr){0}, false));
                 continue;
             case RS_LISTEN_IP_ANY_V4:
-                RS_GUARD(bind_ipv4(port, fd++, worker_c,
+                RS_GUARD(bind_ipv4(port, fd++, worker_c, steering_prog_fd,
                     (struct in_addr){0}));
                 continue;
             case RS_LISTEN_IP_ANY_V6:
-                RS_GUARD(bind_ipv6(port, fd++, worker_c,
+                RS_GUARD(bind_ipv6(port, fd++, worker_c, steering_prog_fd,
                     (struct in6_addr){0}, true));
                 continue;
             case RS_LISTEN_IP_SPECIFIC:
                 for (struct in_addr * addr = port->ipv4_addrs;
                     addr < port->ipv4_addrs + port->ipv4_addr_c; addr++) {
-                    RS_GUARD(bind_ipv4(port, fd++, worker_c, *addr));
+                    RS_GUARD(bind_ipv4(port, fd++, worker_c,
+                        steering_prog_fd, *addr));
                 }
                 for (struct in6_addr * addr = port->ipv6_addrs;
                     addr < port->ipv6_addrs + port->ipv6_addr_c; addr++) {
-                    RS_GUARD(bind_ipv6(port, fd++, worker_c, *addr, true));
+                    RS_GUARD(bind_ipv6(port, fd++, worker_c,
+                        steering_prog_fd, *addr, true));
                 }
                 continue;
             default:
@@ -185,6 +295,11 @@ rs_ret bind_to_ports(
             }
         }
     }
+    // Each reuseport group holds its own reference to the program.
+    if (steering_prog_fd != -1 && close(steering_prog_fd) == -1) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful close(%d)", steering_prog_fd);
+        return RS_FATAL;
+    }
     return RS_OK;
 }
 
@@ -196,27 +311,14 @@ rs_ret listen_to_sockets(
         p < worker->conf->ports + worker->conf->port_c; p++) {
         for (size_t i = 0; i < p->listen_fd_c; i++) {
             int listen_fd = p->listen_fds[worker->worker_i][i];
-            // todo: for some bizarre reason listen() _sometimes_ returns
-            // EADDRINUSE even though each listen_fd (as obtained through bind()
-            // after setting both SO_REUSEADDR and SO_REUSEPORT) is never used
-            // anywhere but here, and is unique (i.e., mutually exclusive)
-            // between threads.
-            //
-            // A possible cause could be an unclean kernel state caused after a
-            // previous execution of RingSocket segfaulted. Currently
-            // investigating...
-            if (listen(listen_fd, SOMAXCONN) == -1) {
-                RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful listen(%d, SOMAXCONN)",
-                    listen_fd);
-                return RS_FATAL;
+            if (worker->uring) {
+                RS_GUARD(arm_uring_accept(worker, listen_fd, p->is_encrypted));
+                continue;
             }
-            RS_LOG(LOG_DEBUG, "Successful listen(%d, SOMAXCONN)", listen_fd);
             struct epoll_event event = {
-                .data = {.u64 = *((uint64_t *) (uint32_t []){
-                    p->is_encrypted ? RS_EVENT_ENCRYPTED_LISTENFD :
-                        RS_EVENT_UNENCRYPTED_LISTENFD,
-                    listen_fd,
-                })},
+                .data = {.u64 = (uint64_t) listen_fd << 32 |
+                    (p->is_encrypted ? RS_EVENT_ENCRYPTED_LISTENFD :
+                    RS_EVENT_UNENCRYPTED_LISTENFD)},
                 .events = EPOLLIN | EPOLLET
             };
             if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
@@ -270,34 +372,46 @@ rs_ret accept_sockets(
                 return RS_FATAL;
             }
         }
-        size_t peer_i = 0;
-        if (alloc_slot(&worker->peer_slots, &peer_i) != RS_OK) {
-            RS_LOG(LOG_WARNING, "Accept()ed new peer %s, but all peer slots "
-                "are currently full. Aborting peer.",
-                get_addr_str(&(union rs_peer){.socket_fd = socket_fd}));
-            if (close(socket_fd) == -1) {
-                RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful close(%d)", socket_fd);
-                return RS_FATAL;
-            }
-            continue;
-        }
-        RS_LOG(LOG_DEBUG, "Assigning accept()ed new peer with fd=%d to peer_i "
-            "%zu", socket_fd, peer_i);
-        if (peer_i > worker->highest_peer_i) {
-            worker->highest_peer_i = peer_i;
-        }
-        worker->peers[peer_i].socket_fd = socket_fd;
-        worker->peers[peer_i].is_encrypted = is_encrypted;
-        struct epoll_event event = {
-            .data = {.u64 = *((uint64_t *) (uint32_t []){
-                RS_EVENT_PEER,
-                peer_i
-            })},
-            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET
-        };
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) == -1) {
-            RS_LOG_ERRNO(LOG_ERR, "Unsuccessful epoll_ctl(%d, EPOLL_CTL_ADD, "
-                "%d, &event)", epoll_fd, socket_fd);
+        RS_GUARD(add_peer(worker, epoll_fd, socket_fd, is_encrypted));
+    }
+}
+
+rs_ret add_peer(
+    struct rs_worker * worker,
+    int epoll_fd,
+    int socket_fd,
+    bool is_encrypted
+) {
+    size_t peer_i = 0;
+    if (alloc_slot(&worker->peer_slots, &peer_i) != RS_OK) {
+        RS_LOG(LOG_WARNING, "Accept()ed new peer %s, but all peer slots "
+            "are currently full. Aborting peer.",
+            get_addr_str(&(union rs_peer){.socket_fd = socket_fd}));
+        RS_METRICS_ADD(worker->metrics->reject_c, 1);
+        if (close(socket_fd) == -1) {
+            RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful close(%d)", socket_fd);
+            return RS_FATAL;
         }
+        return RS_OK;
     }
+    RS_LOG(LOG_DEBUG, "Assigning accept()ed new peer with fd=%d to peer_i "
+        "%zu", socket_fd, peer_i);
+    if (peer_i > worker->highest_peer_i) {
+        worker->highest_peer_i = peer_i;
+    }
+    worker->peers[peer_i].socket_fd = socket_fd;
+    worker->peers[peer_i].is_encrypted = is_encrypted;
+    RS_METRICS_ADD(worker->metrics->accept_c, 1);
+    if (worker->uring) {
+        return arm_uring_peer(worker, peer_i);
+    }
+    struct epoll_event event = {
+        .data = {.u64 = (uint64_t) peer_i << 32 | RS_EVENT_PEER},
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) == -1) {
+        RS_LOG_ERRNO(LOG_ERR, "Unsuccessful epoll_ctl(%d, EPOLL_CTL_ADD, "
+            "%d, &event)", epoll_fd, socket_fd);
+    }
+    return RS_OK;
 }
@@ -11,7 +11,7 @@ rs_ret bind_to_ports(
 
 rs_ret listen_to_sockets(
     struct rs_worker * worker,
-    int epoll_fd
+    int epoll_fd // Ignored if worker->uring is set
 );
 
 rs_ret accept_sockets(
@@ -20,3 +20,10 @@ rs_ret accept_sockets(
     int listen_fd,
     bool is_encrypted
 );
+
+rs_ret add_peer(
+    struct rs_worker * worker,
+    int epoll_fd, // Ignored if worker->uring is set
+    int socket_fd,
+    bool is_encrypted
+);
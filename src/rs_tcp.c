@@ -1,18 +1,34 @@
 // SPDX-License-Identifier: MIT
 // Copyright © 2019 William Budd
 
+#include "rs_deflate.h" // end_deflate_session()
 #include "rs_slot.h" // free_slot()
 #include "rs_tcp.h"
 #include "rs_tls.h" // init_tls_session()
+#include "rs_uring.h" // read_uring_peer(), send_uring_peer(), etc
 #include "rs_util.h" // get_addr_str()
 
+// With io_uring, unencrypted peers are read through recv requests instead (see
+// rs_uring.c); whereas peers that dropped down from the TLS layer are not.
+static ssize_t read_peer(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    void * rbuf,
+    size_t rbuf_size
+) {
+    return worker->uring && !peer->is_encrypted ?
+        read_uring_peer(worker, peer - worker->peers, rbuf, rbuf_size) :
+        read(peer->socket_fd, rbuf, rbuf_size);
+}
+
 rs_ret read_tcp(
+    struct rs_worker * worker,
     union rs_peer * peer,
     void * rbuf,
     size_t rbuf_size,
     size_t * rsize
 ) {
-    ssize_t ret = read(peer->socket_fd, rbuf, rbuf_size);
+    ssize_t ret = read_peer(worker, peer, rbuf, rbuf_size);
     if (ret > 0) {
         *rsize = ret;
         return RS_OK;
@@ -33,10 +49,15 @@ rs_ret read_tcp(
 }
 
 rs_ret write_tcp(
+    struct rs_worker * worker,
     union rs_peer * peer,
     void const * wbuf,
     size_t wbuf_size
 ) {
+    if (worker->uring) {
+        struct iovec iov = {.iov_base = (void *) wbuf, .iov_len = wbuf_size};
+        return send_uring_peer(worker, peer, peer - worker->peers, &iov, 1);
+    }
     // The main reason that this function takes a wbuf pointer to the start of
     // the original write message even when resuming partial writes, is to
     // mimic the signature of write_tls() (because SSL_write(_ex)() requires
@@ -65,6 +86,54 @@ rs_ret write_tcp(
     return RS_CLOSE_PEER;
 }
 
+rs_ret write_tcp_vector(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    struct iovec * iov,
+    int iov_c
+) {
+    if (worker->uring) {
+        // Never leaves any peer->old_wsize behind (see send_uring_peer()).
+        return send_uring_peer(worker, peer, peer - worker->peers, iov, iov_c);
+    }
+    // Gather-write counterpart of write_tcp(), treating the concatenation of
+    // all iov_c buffers as a single message. As with write_tcp(), iov should
+    // always start at the original message, while peer->old_wsize holds the
+    // number of bytes already written on previous attempts. Note that iov[0] is
+    // adjusted in-place to skip those bytes.
+    //
+    // Upon RS_AGAIN, peer->old_wsize is set to the number of bytes written
+    // counting from the start of iov[0], which may exceed iov[0].iov_len. It is
+    // therefore up to the caller to reduce it to an offset into the first
+    // buffer that was not written out completely before calling again.
+    size_t remaining_wsize = 0;
+    for (int i = 0; i < iov_c; i++) {
+        remaining_wsize += iov[i].iov_len;
+    }
+    remaining_wsize -= peer->old_wsize;
+    iov[0].iov_base = (uint8_t *) iov[0].iov_base + peer->old_wsize;
+    iov[0].iov_len -= peer->old_wsize;
+    ssize_t ret = writev(peer->socket_fd, iov, iov_c);
+    if (ret > 0) {
+        size_t wsize = ret;
+        if (wsize == remaining_wsize) {
+            peer->old_wsize = 0;
+            return RS_OK;
+        }
+        peer->old_wsize += wsize;
+        peer->is_writing = true;
+        return RS_AGAIN;
+    }
+    if (errno == EAGAIN) {
+        peer->is_writing = true;
+        return RS_AGAIN;
+    }
+    RS_LOG_ERRNO(LOG_ERR, "Unsuccessful writev(%d, iov + %zu, %d) of %zu "
+        "bytes to %s", peer->socket_fd, peer->old_wsize, iov_c,
+        remaining_wsize, get_addr_str(peer));
+    return RS_CLOSE_PEER;
+}
+
 rs_ret write_bidirectional_tcp_shutdown(
     union rs_peer * peer
 ) {
@@ -95,12 +164,12 @@ static rs_ret read_bidirectional_tcp_shutdown(
     // RS_LAYER_TCP, any bytes read() at this stage are not considered usable,
     // so they are ignored by repeatedly reading them into the start of rbuf,
     // to be readily overwritten during any next read().
-    ssize_t rsize = read(peer->socket_fd, worker->rbuf,
+    ssize_t rsize = read_peer(worker, peer, worker->rbuf,
         worker->conf->worker_rbuf_size);
     while (rsize > 0) {
         //RS_LOG(LOG_INFO, "Read(%d, ...) %ld bytes of ignored TCP data from "
         //    "%s", peer->socket_fd, rsize, get_addr_str(peer));
-        rsize = read(peer->socket_fd, worker->rbuf,
+        rsize = read_peer(worker, peer, worker->rbuf,
             worker->conf->worker_rbuf_size);
     }
     if (!rsize) {
@@ -133,6 +202,12 @@ rs_ret handle_tcp_io(
         // handle_http_events(), depending on the value of peer->layer
         return RS_OK;
     case RS_MORTALITY_SHUTDOWN_WRITE:
+        if (worker->uring && uring_peer_is_sending(worker, peer_i)) {
+            // Don't shutdown() before the last send request completes, which
+            // will then call handle_peer_events() again.
+            peer->is_writing = true;
+            return RS_OK;
+        }
         switch (write_bidirectional_tcp_shutdown(peer)) {
         case RS_OK:
             peer->mortality = RS_MORTALITY_SHUTDOWN_READ;
@@ -158,6 +233,10 @@ rs_ret handle_tcp_io(
         break;
     }
     terminate_tcp:
+    if (worker->uring) {
+        RS_GUARD(disarm_uring_peer(worker, peer_i));
+    }
+    end_deflate_session(worker, peer_i);
     if (close(peer->socket_fd) == -1) {
         RS_LOG_ERRNO(LOG_ERR, "Unsuccessful socket close(%d)",
             peer->socket_fd);
@@ -170,6 +249,7 @@ rs_ret handle_tcp_io(
     // continued to trigger. (See Q&A #6 of man 7 epoll.)
     memset(peer, 0, sizeof(union rs_peer));
     free_slot(&worker->peer_slots, peer_i);
+    RS_METRICS_ADD(worker->metrics->close_c, 1);
     if (peer_i < worker->highest_peer_i) {
         return RS_OK;
     }
@@ -5,7 +5,10 @@
 
 #include "rs_worker.h"
 
+#include <sys/uio.h> // struct iovec
+
 rs_ret read_tcp(
+    struct rs_worker * worker,
     union rs_peer * peer,
     void * rbuf,
     size_t rbuf_size,
@@ -13,11 +16,19 @@ rs_ret read_tcp(
 );
 
 rs_ret write_tcp(
+    struct rs_worker * worker,
     union rs_peer * peer,
     void const * wbuf,
     size_t wbuf_size
 );
 
+rs_ret write_tcp_vector(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    struct iovec * iov,
+    int iov_c
+);
+
 rs_ret write_bidirectional_tcp_shutdown(
     union rs_peer * peer
 );
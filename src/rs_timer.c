@@ -0,0 +1,194 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#define _POSIX_C_SOURCE 201112L // clock_gettime(), CLOCK_MONOTONIC
+
+#include "rs_event.h" // handle_peer_events()
+#include "rs_timer.h"
+
+#include <sys/timerfd.h>
+
+// A hashed timer wheel: each worker thread keeps an array of RS_TIMER_SLOT_C
+// slots, where each slot holds a dynamic array of pending timers whose deadline
+// tick modulo RS_TIMER_SLOT_C corresponds to that slot's index. A timerfd
+// watched by the worker's event loop fires once every tick for as long
+// as any timers are pending, upon which expire_timers() only needs to visit the
+// slots of the ticks elapsed since its previous call. Peers without a pending
+// deadline (i.e., the vast majority) are therefore never looked at, in contrast
+// to scanning the entire peers array.
+//
+// Timers are never removed from their slot prematurely. Instead, a peer's
+// .shutdown_deadline field holds a 16-bit digest of the deadline tick it was
+// last assigned, which is reset to 0 by the memset() that accompanies peer
+// termination in rs_tcp.c. Any timer entry that doesn't match its peer's
+// current digest is stale, and is silently discarded when its slot comes up.
+//
+// Only shutdown deadlines are scheduled at present, but other kinds of peer
+// timeouts (e.g., idle or ping timeouts) can be added by storing an additional
+// kind field in struct rs_timer alongside .peer_i.
+
+#define RS_TIMER_TICKS_PER_SEC 10
+// Spans 409.6 seconds, which is longer than any uint8_t shutdown_wait_* setting
+// in seconds; although longer intervals would work too, because each timer is
+// only expired once its full .tick has elapsed.
+#define RS_TIMER_SLOT_C 0x1000
+
+struct rs_timer {
+    uint64_t tick;
+    uint32_t peer_i;
+    uint32_t:32;
+};
+
+struct rs_timer_slot {
+    struct rs_timer * timers;
+    uint32_t elem_c;
+    uint32_t timer_c;
+};
+
+static uint64_t get_current_tick(
+    void
+) {
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * RS_TIMER_TICKS_PER_SEC +
+        (uint64_t) ts.tv_nsec / (1000000000 / RS_TIMER_TICKS_PER_SEC);
+}
+
+static uint16_t get_tick_digest(
+    uint64_t tick
+) {
+    // Never 0, because .shutdown_deadline == 0 means "no deadline".
+    return tick % 0xFFFF + 1;
+}
+
+static rs_ret arm_timerfd(
+    struct rs_worker * worker,
+    bool do_arm // If false, disarm
+) {
+    long tick_ns = do_arm ? 1000000000 / RS_TIMER_TICKS_PER_SEC : 0;
+    struct itimerspec its = {
+        .it_interval = {.tv_nsec = tick_ns},
+        .it_value = {.tv_nsec = tick_ns}
+    };
+    if (timerfd_settime(worker->timer_wheel.timerfd, 0, &its, NULL) == -1) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful timerfd_settime(%d, 0, "
+            "{%ld ns}, NULL)", worker->timer_wheel.timerfd, tick_ns);
+        return RS_FATAL;
+    }
+    return RS_OK;
+}
+
+rs_ret init_timer_wheel(
+    struct rs_worker * worker
+) {
+    struct rs_timer_wheel * wheel = &worker->timer_wheel;
+    RS_CALLOC(wheel->slots, RS_TIMER_SLOT_C);
+    wheel->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (wheel->timerfd == -1) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful timerfd_create(CLOCK_MONOTONIC, "
+            "TFD_NONBLOCK)");
+        return RS_FATAL;
+    }
+    return RS_OK;
+}
+
+static rs_ret add_timer(
+    struct rs_worker * worker,
+    uint64_t tick,
+    uint32_t peer_i
+) {
+    struct rs_timer_slot * slot =
+        worker->timer_wheel.slots + tick % RS_TIMER_SLOT_C;
+    if (slot->timer_c == slot->elem_c) {
+        if (slot->timers) {
+            slot->elem_c *= 2;
+            RS_REALLOC(slot->timers, slot->elem_c);
+        } else {
+            slot->elem_c = 8;
+            RS_CALLOC(slot->timers, slot->elem_c);
+        }
+    }
+    slot->timers[slot->timer_c++] = (struct rs_timer){
+        .tick = tick,
+        .peer_i = peer_i
+    };
+    worker->timer_wheel.timer_c++;
+    return RS_OK;
+}
+
+rs_ret set_shutdown_deadline(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    size_t wait_interval
+) {
+    struct rs_timer_wheel * wheel = &worker->timer_wheel;
+    uint64_t tick = get_current_tick();
+    if (!wheel->timer_c) {
+        // The timerfd is disarmed while the wheel is empty, so the wheel's
+        // notion of the current tick may be outdated: fast forward it.
+        wheel->tick = tick;
+        RS_GUARD(arm_timerfd(worker, true));
+    }
+    tick += wait_interval * RS_TIMER_TICKS_PER_SEC;
+    if (tick <= wheel->tick) {
+        // The slot of wheel->tick was already processed: use the next one.
+        tick = wheel->tick + 1;
+    }
+    peer->shutdown_deadline = get_tick_digest(tick);
+    return add_timer(worker, tick, peer - worker->peers);
+}
+
+static rs_ret expire_slot(
+    struct rs_worker * worker,
+    size_t slot_i,
+    uint64_t current_tick
+) {
+    struct rs_timer_slot * slot = worker->timer_wheel.slots + slot_i;
+    for (uint32_t i = 0; i < slot->timer_c;) {
+        struct rs_timer timer = slot->timers[i];
+        if (timer.tick > current_tick) {
+            // Not due until a later rotation of the wheel
+            i++;
+            continue;
+        }
+        // Remove the timer before acting on it, by moving the slot's last timer
+        // into its place.
+        slot->timers[i] = slot->timers[--slot->timer_c];
+        worker->timer_wheel.timer_c--;
+        union rs_peer * peer = worker->peers + timer.peer_i;
+        if (peer->shutdown_deadline != get_tick_digest(timer.tick)) {
+            continue; // Stale: the peer is gone or has a newer deadline.
+        }
+        RS_METRICS_ADD(worker->metrics->shutdown_timeout_c, 1);
+        peer->mortality = RS_MORTALITY_DEAD;
+        // Calling handle_peer_events() with a MORTALITY_DEAD peer (but without
+        // any actual events) allows cleanup to take place through all relevant
+        // layers.
+        RS_GUARD(handle_peer_events(worker, timer.peer_i, 0));
+    }
+    return RS_OK;
+}
+
+rs_ret expire_timers(
+    struct rs_worker * worker
+) {
+    struct rs_timer_wheel * wheel = &worker->timer_wheel;
+    uint64_t expiration_c = 0;
+    if (read(wheel->timerfd, &expiration_c, 8) != 8 && errno != EAGAIN) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful read(timerfd, ...)");
+        return RS_FATAL;
+    }
+    uint64_t current_tick = get_current_tick();
+    // Should the worker have been held up for longer than a full rotation, all
+    // slots need to be visited, but no slot more than once.
+    uint64_t tick_over = RS_MIN(current_tick, wheel->tick + RS_TIMER_SLOT_C);
+    while (wheel->tick < tick_over) {
+        RS_GUARD(expire_slot(worker, ++wheel->tick % RS_TIMER_SLOT_C,
+            current_tick));
+    }
+    wheel->tick = current_tick;
+    if (!wheel->timer_c) {
+        RS_GUARD(arm_timerfd(worker, false));
+    }
+    return RS_OK;
+}
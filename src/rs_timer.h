@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#pragma once
+
+#include "rs_worker.h" // struct rs_timer_wheel, rs_ret
+
+rs_ret init_timer_wheel(
+    struct rs_worker * worker
+);
+
+rs_ret set_shutdown_deadline(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    size_t wait_interval // in seconds
+);
+
+rs_ret expire_timers(
+    struct rs_worker * worker
+);
@@ -7,6 +7,339 @@
 
 #include <openssl/conf.h>
 #include <openssl/err.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+// #############################################################################
+// # TLS session resumption ####################################################
+
+// Session resumption is disabled unless enabled in the configuration file, in
+// which case it can take either or both of 2 forms:
+//
+// 1) Stateless session tickets: rather than sharing mutable ticket key state
+//    between worker threads, all ticket keys are derived from a single random
+//    secret generated at startup, together with the current "ticket key epoch":
+//    time(NULL) / conf->tls_ticket_key_lifetime. Every worker thread therefore
+//    independently arrives at the same keys, and key rotation happens
+//    implicitly whenever the epoch increments. Tickets issued during the
+//    preceding epoch are still accepted (and renewed), which means a ticket
+//    remains valid for at least 1 and at most 2 key lifetimes.
+//
+// 2) A session ID cache shared by all worker threads: a fixed-size array of
+//    slots indexed by session ID, each guarded by a seqlock-style sequence
+//    number instead of a mutex. Writers that encounter a slot being written to
+//    concurrently simply don't cache their session, and readers that observe a
+//    concurrent write treat it as a cache miss: both merely result in a full
+//    handshake, which is an acceptable price for never having to wait.
+
+#define RS_TLS_TICKET_SECRET_SIZE 32
+#define RS_TLS_TICKET_KEY_NAME_SIZE 16 // As dictated by OpenSSL
+#define RS_TLS_TICKET_KEY_SIZE 32 // For both AES-256-CBC and HMAC-SHA256
+
+#define RS_TLS_CACHED_SESSION_SIZE 0x400 // 1 KB per slot
+
+struct rs_tls_cached_session {
+    atomic_uint_least32_t seq; // Odd while being written to; even otherwise
+    uint16_t id_size;
+    uint16_t der_size; // The i2d_SSL_SESSION() size of .der (0 if empty)
+    uint8_t id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    uint8_t der[RS_TLS_CACHED_SESSION_SIZE - 8 - SSL_MAX_SSL_SESSION_ID_LENGTH];
+};
+
+// Allocated once by create_shared_tls_state(), and shared by all workers.
+struct rs_tls_shared {
+    struct rs_tls_cached_session * sessions; // NULL if the cache is disabled
+    uint8_t ticket_secret[RS_TLS_TICKET_SECRET_SIZE];
+};
+
+// Worker-local copies of the keys derived for the current and previous epoch
+struct rs_tls_ticket_key {
+    uint64_t epoch;
+    uint8_t name[RS_TLS_TICKET_KEY_NAME_SIZE];
+    uint8_t aes_key[RS_TLS_TICKET_KEY_SIZE];
+    uint8_t hmac_key[RS_TLS_TICKET_KEY_SIZE];
+};
+
+rs_ret create_shared_tls_state(
+    struct rs_conf const * conf,
+    struct rs_tls_shared * * tls_shared
+) {
+    if (!conf->tls_session_tickets && !conf->tls_session_cache_size) {
+        *tls_shared = NULL;
+        return RS_OK;
+    }
+    static_assert(sizeof(struct rs_tls_cached_session) ==
+        RS_TLS_CACHED_SESSION_SIZE, "Unexpected rs_tls_cached_session size");
+    RS_CALLOC(*tls_shared, 1);
+    if (conf->tls_session_tickets &&
+        RAND_bytes((*tls_shared)->ticket_secret, RS_TLS_TICKET_SECRET_SIZE) !=
+        1) {
+        RS_LOG(LOG_CRIT, "Unsuccessful RAND_bytes(ticket_secret, %d)",
+            RS_TLS_TICKET_SECRET_SIZE);
+        return RS_FATAL;
+    }
+    if (conf->tls_session_cache_size) {
+        RS_CACHE_ALIGNED_CALLOC((*tls_shared)->sessions,
+            conf->tls_session_cache_size);
+    }
+    RS_LOG(LOG_INFO, "TLS session resumption enabled (session tickets: %s; "
+        "shared session cache slots: %" PRIu32 ")",
+        conf->tls_session_tickets ? "yes" : "no",
+        conf->tls_session_cache_size);
+    return RS_OK;
+}
+
+static struct rs_worker * get_worker_from_tls(
+    SSL * tls
+) {
+    return SSL_CTX_get_app_data(SSL_get_SSL_CTX(tls));
+}
+
+static struct rs_tls_ticket_key * get_ticket_key(
+    struct rs_worker * worker,
+    uint64_t epoch
+) {
+    struct rs_tls_ticket_key * key = worker->tls_ticket_keys + epoch % 2;
+    if (key->epoch == epoch) {
+        return key;
+    }
+    // Derive the name and keys of this epoch as HMAC-SHA256(secret, epoch |
+    // label), where each label byte yields a different 32 byte output.
+    uint8_t input[9] = {0};
+    RS_W_HTON64(input, epoch);
+    uint8_t name[RS_TLS_TICKET_KEY_SIZE] = {0};
+    uint8_t * outputs[] = {name, key->aes_key, key->hmac_key};
+    for (uint8_t label = 0; label < 3; label++) {
+        input[8] = label;
+        if (!HMAC(EVP_sha256(), worker->tls_shared->ticket_secret,
+            RS_TLS_TICKET_SECRET_SIZE, input, sizeof(input), outputs[label],
+            NULL)) {
+            return NULL;
+        }
+    }
+    memcpy(key->name, name, RS_TLS_TICKET_KEY_NAME_SIZE);
+    key->epoch = epoch;
+    return key;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int init_ticket_hmac(
+    EVP_MAC_CTX * hmac_ctx,
+    struct rs_tls_ticket_key * key
+) {
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmac_key,
+            RS_TLS_TICKET_KEY_SIZE),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end()
+    };
+    return EVP_MAC_CTX_set_params(hmac_ctx, params);
+}
+
+static int tls_ticket_key_cb(
+    SSL * tls,
+    uint8_t * key_name,
+    uint8_t * iv,
+    EVP_CIPHER_CTX * cipher_ctx,
+    EVP_MAC_CTX * hmac_ctx,
+    int do_encrypt
+) {
+#else
+static int init_ticket_hmac(
+    HMAC_CTX * hmac_ctx,
+    struct rs_tls_ticket_key * key
+) {
+    return HMAC_Init_ex(hmac_ctx, key->hmac_key, RS_TLS_TICKET_KEY_SIZE,
+        EVP_sha256(), NULL);
+}
+
+static int tls_ticket_key_cb(
+    SSL * tls,
+    uint8_t * key_name,
+    uint8_t * iv,
+    EVP_CIPHER_CTX * cipher_ctx,
+    HMAC_CTX * hmac_ctx,
+    int do_encrypt
+) {
+#endif
+    // Return values as per man SSL_CTX_set_tlsext_ticket_key_cb:
+    // -1: error; 0: no ticket (decryption: full handshake); 1: success;
+    // 2: success, but the ticket should be renewed (decryption only).
+    struct rs_worker * worker = get_worker_from_tls(tls);
+    uint64_t epoch = time(NULL) / worker->conf->tls_ticket_key_lifetime;
+    struct rs_tls_ticket_key * key = NULL;
+    if (do_encrypt) {
+        if (!(key = get_ticket_key(worker, epoch)) ||
+            RAND_bytes(iv, EVP_MAX_IV_LENGTH) != 1) {
+            return -1;
+        }
+        memcpy(key_name, key->name, RS_TLS_TICKET_KEY_NAME_SIZE);
+        return EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL,
+            key->aes_key, iv) && init_ticket_hmac(hmac_ctx, key) ? 1 : -1;
+    }
+    for (uint64_t age = 0; age < 2; age++) { // Current and previous epoch
+        if (!(key = get_ticket_key(worker, epoch - age))) {
+            return -1;
+        }
+        if (!memcmp(key_name, key->name, RS_TLS_TICKET_KEY_NAME_SIZE)) {
+            if (!EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), NULL,
+                key->aes_key, iv) || !init_ticket_hmac(hmac_ctx, key)) {
+                return -1;
+            }
+            return age ? 2 : 1;
+        }
+    }
+    return 0; // Expired or unrecognized: fall back to a full handshake.
+}
+
+static struct rs_tls_cached_session * get_cached_session_slot(
+    struct rs_worker * worker,
+    uint8_t const * id,
+    size_t id_size
+) {
+    // Session IDs are random, so any of their bytes make for a good hash.
+    uint64_t hash = 0;
+    memcpy(&hash, id, RS_MIN(id_size, sizeof(hash)));
+    return worker->tls_shared->sessions +
+        hash % worker->conf->tls_session_cache_size;
+}
+
+static int tls_new_session_cb(
+    SSL * tls,
+    SSL_SESSION * sess
+) {
+    struct rs_worker * worker = get_worker_from_tls(tls);
+    unsigned id_size = 0;
+    uint8_t const * id = SSL_SESSION_get_id(sess, &id_size);
+    int der_size = i2d_SSL_SESSION(sess, NULL);
+    struct rs_tls_cached_session * slot =
+        get_cached_session_slot(worker, id, id_size);
+    if (!id_size || der_size <= 0 || (size_t) der_size > sizeof(slot->der)) {
+        return 0; // Don't cache what doesn't fit.
+    }
+    uint_least32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    if (seq % 2 || !atomic_compare_exchange_strong_explicit(&slot->seq, &seq,
+        seq + 1, memory_order_acquire, memory_order_relaxed)) {
+        return 0; // Another worker is writing to this slot: just skip it.
+    }
+    atomic_thread_fence(memory_order_release);
+    slot->id_size = id_size;
+    memcpy(slot->id, id, id_size);
+    uint8_t * der = slot->der;
+    slot->der_size = i2d_SSL_SESSION(sess, &der);
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+    return 0; // 0: OpenSSL retains ownership of sess.
+}
+
+static SSL_SESSION * tls_get_session_cb(
+    SSL * tls,
+    uint8_t const * id,
+    int id_size,
+    int * do_copy
+) {
+    *do_copy = 0; // The returned session is a fresh d2i_SSL_SESSION() copy.
+    struct rs_worker * worker = get_worker_from_tls(tls);
+    struct rs_tls_cached_session * slot =
+        get_cached_session_slot(worker, id, id_size);
+    uint_least32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq % 2 || slot->id_size != id_size ||
+        memcmp(slot->id, id, id_size)) {
+        return NULL;
+    }
+    uint8_t der[sizeof(slot->der)];
+    size_t der_size = RS_MIN(slot->der_size, sizeof(der));
+    memcpy(der, slot->der, der_size);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+        return NULL; // Overwritten while copying: treat as a cache miss.
+    }
+    uint8_t const * p = der;
+    return d2i_SSL_SESSION(NULL, &p, der_size);
+}
+
+static void tls_remove_session_cb(
+    SSL_CTX * ctx,
+    SSL_SESSION * sess
+) {
+    struct rs_worker * worker = SSL_CTX_get_app_data(ctx);
+    unsigned id_size = 0;
+    uint8_t const * id = SSL_SESSION_get_id(sess, &id_size);
+    if (!id_size) {
+        return;
+    }
+    struct rs_tls_cached_session * slot =
+        get_cached_session_slot(worker, id, id_size);
+    uint_least32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    if (seq % 2 || slot->id_size != id_size || memcmp(slot->id, id, id_size) ||
+        !atomic_compare_exchange_strong_explicit(&slot->seq, &seq, seq + 1,
+        memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+    slot->id_size = 0;
+    slot->der_size = 0;
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+static rs_ret configure_session_resumption(
+    struct rs_worker * worker,
+    SSL_CTX * ctx,
+    size_t cert_i
+) {
+    struct rs_conf const * conf = worker->conf;
+    if (!worker->tls_shared) {
+        // The following options should disable all session/ticket
+        // renegotiation
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+        // _Should_ be redundant, but is --as of Feb 2019-- necessary for TLS1.3
+        if (!SSL_CTX_set_num_tickets(ctx, 0)) {
+            RS_LOG(LOG_CRIT, "Unsuccessful SSL_CTX_set_num_tickets(ctx, 0)");
+            return RS_FATAL;
+        }
+        return RS_OK;
+    }
+    // Prevent sessions established for one certificate from being resumed
+    // under another one.
+    if (!SSL_CTX_set_session_id_context(ctx, (uint8_t *) &(uint32_t){cert_i},
+        sizeof(uint32_t))) {
+        RS_LOG(LOG_CRIT, "Unsuccessful SSL_CTX_set_session_id_context(ctx, "
+            "%zu)", cert_i);
+        return RS_FATAL;
+    }
+    if (conf->tls_session_tickets) {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_ticket_key_cb);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, tls_ticket_key_cb);
+#endif
+    } else {
+        // Without stateless tickets, TLS 1.3 resumption still relies on
+        // tickets, but those then merely reference the session cache by ID.
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    }
+    if (conf->tls_session_cache_size) {
+        // Bypass OpenSSL's internal per-SSL_CTX (i.e., per-worker) cache in
+        // favor of the cache shared between all workers.
+        SSL_CTX_set_session_cache_mode(ctx,
+            SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(ctx, tls_new_session_cb);
+        SSL_CTX_sess_set_get_cb(ctx, tls_get_session_cb);
+        SSL_CTX_sess_set_remove_cb(ctx, tls_remove_session_cb);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+    if (!SSL_CTX_set_num_tickets(ctx, 1)) {
+        RS_LOG(LOG_CRIT, "Unsuccessful SSL_CTX_set_num_tickets(ctx, 1)");
+        return RS_FATAL;
+    }
+    return RS_OK;
+}
+
+// #############################################################################
+// # TLS contexts and I/O ######################################################
 
 static size_t get_subdomain_depth(
     char const * str, // Can be un-0-terminated!
@@ -125,6 +458,11 @@ rs_ret create_tls_contexts(
     struct rs_worker * worker
 ) {
     RS_CALLOC(worker->tls_ctxs, worker->conf->cert_c);
+    if (worker->conf->tls_session_tickets) {
+        // Current and previous epoch. (Given the maximum key lifetime, epoch
+        // 0 lies in the distant past, so the zeroed keys will never be used.)
+        RS_CALLOC(worker->tls_ticket_keys, 2);
+    }
     for (size_t i = 0; i < worker->conf->cert_c; i++) {
         SSL_CTX *ctx = worker->tls_ctxs[i] = SSL_CTX_new(TLS_server_method());
         if (!ctx) {
@@ -146,14 +484,9 @@ rs_ret create_tls_contexts(
             return RS_FATAL;
         }
 
-        // The following options should disable all session/ticket renegotiation
-        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
-        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
-        // _Should_ be redundant, but is --as of Feb 2019-- necessary for TLS1.3
-        if (!SSL_CTX_set_num_tickets(ctx, 0)) {
-            RS_LOG(LOG_CRIT, "Unsuccessful SSL_CTX_set_num_tickets(ctx, 0)");
-            return RS_FATAL;
-        }
+        // Needed by the session resumption callbacks to find their worker.
+        SSL_CTX_set_app_data(ctx, worker);
+        RS_GUARD(configure_session_resumption(worker, ctx, i));
         // Probably redundant
         SSL_CTX_set_options(ctx, SSL_OP_NO_SESSION_RESUMPTION_ON_RENEGOTIATION);
 
@@ -303,8 +636,15 @@ static rs_ret shake_tls_hands(
 ) {
     ERR_clear_error();
     int ret = SSL_accept(peer->tls);
-    return ret == 1 ? RS_OK :
-        check_tls_error(worker, peer, "SSL_accept()", 0, ret, false);
+    if (ret != 1) {
+        return check_tls_error(worker, peer, "SSL_accept()", 0, ret, false);
+    }
+    if (SSL_session_reused(peer->tls)) {
+        RS_METRICS_ADD(worker->metrics->resumed_tls_handshake_c, 1);
+    } else {
+        RS_METRICS_ADD(worker->metrics->full_tls_handshake_c, 1);
+    }
+    return RS_OK;
 }
 
 static rs_ret write_bidirectional_tls_shutdown(
@@ -367,6 +707,8 @@ rs_ret handle_tls_io(
         case RS_CLOSE_PEER:
             // If the TLS handshake fails, immediately abort the connection
             // instead of wasting resources attempting a bi-directional shutdown
+            RS_METRICS_ADD(worker->metrics->close_c_by_reason[
+                RS_CLOSE_REASON_TLS], 1);
             peer->mortality = RS_MORTALITY_DEAD;
             goto terminate_tls;
         case RS_FATAL: default:
@@ -11,6 +11,11 @@ int derive_cert_index_from_hostname(
     size_t hostname_strlen
 );
 
+rs_ret create_shared_tls_state(
+    struct rs_conf const * conf,
+    struct rs_tls_shared * * tls_shared
+);
+
 rs_ret create_tls_contexts(
     struct rs_worker * worker
 );
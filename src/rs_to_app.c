@@ -10,6 +10,7 @@ rs_ret init_inbound_producers(
     for (size_t i = 0; i < worker->conf->app_c; i++) {
         struct rs_ring_producer * prod = worker->inbound_producers + i;
         prod->ring_size = worker->conf->inbound_ring_buf_size;
+        prod->min_ring_size = prod->ring_size;
         RS_CACHE_ALIGNED_CALLOC(prod->ring, prod->ring_size);
         prod->w = prod->ring;
         RS_ATOMIC_STORE_RELAXED(&worker->ring_pairs[i]->inbound_ring.w,
@@ -44,16 +45,23 @@ static rs_ret send_msg_to_app(
     struct rs_worker * worker,
     union rs_peer const * peer,
     uint32_t peer_i,
+    // If NULL, data is copied from the chain of frames on worker->rbuf instead.
+    uint8_t const * data,
     uint64_t data_size,
     enum rs_data_kind data_kind,
     enum rs_inbound_kind inbound_kind
 ) {
     struct rs_ring_producer * prod = worker->inbound_producers + peer->app_i;
     RS_GUARD(rs_produce_ring_msg(&worker->ring_pairs[peer->app_i]->inbound_ring,
-        prod, worker->conf->realloc_multiplier, sizeof(struct rs_inbound_msg) +
-        data_size));
+        prod, worker->conf->realloc_multiplier, worker->conf->ring_shrink_wait,
+        sizeof(struct rs_inbound_msg) + data_size));
 
     struct rs_inbound_msg * imsg = (struct rs_inbound_msg *) prod->w;
+    // Apps read the payload from imsg->payload, so there must be no implicit
+    // tail padding between it and sizeof(*imsg).
+    static_assert(sizeof(*imsg) == 24);
+    imsg->read_time_ns = worker->latencies && inbound_kind == RS_INBOUND_READ ?
+        worker->read_time_ns : 0;
     imsg->peer_i = peer_i;
     imsg->socket_fd = peer->socket_fd;
     imsg->endpoint_id =
@@ -62,7 +70,10 @@ static rs_ret send_msg_to_app(
     imsg->inbound_kind = inbound_kind;
     prod->w += sizeof(*imsg);
 
-    if (data_size) {
+    if (data) {
+        memcpy(prod->w, data, data_size);
+        prod->w += data_size;
+    } else if (data_size) {
         copy_combined_websocket_payloads_to_inbound_ring(prod,
             (union rs_wsframe *) worker->rbuf);
         if ((uint8_t const *) imsg + sizeof(*imsg) + data_size != prod->w) {
@@ -75,17 +86,47 @@ static rs_ret send_msg_to_app(
         }
     }
 
+    rs_count_produced_ring_msg(&worker->ring_metrics[peer->app_i].inbound_ring,
+        prod, sizeof(struct rs_inbound_msg) + data_size);
     enqueue_ring_update(worker, prod->w, peer->app_i, true);
     return RS_OK;
 }
 
+// Apps with a "thread_c" greater than 1 are represented by that many
+// consecutive conf->apps elements, of which the route index only refers to the
+// 1st (see expand_app_instances() in rs_conf.c). Before the app hears of the
+// peer for the first time, choose the instance it will belong to from then on.
+static void assign_app_instance(
+    struct rs_worker const * worker,
+    union rs_peer * peer,
+    uint32_t peer_i
+) {
+    struct rs_conf_app const * app = worker->conf->apps + peer->app_i;
+    if (app->instance_c < 2) {
+        return;
+    }
+    if (app->shard_by == RS_SHARD_BY_ENDPOINT_ID) {
+        // Leave the choice to the app, through its endpoint_id assignments.
+        peer->app_i += app->endpoints[peer->endpoint_i].endpoint_id %
+            app->instance_c;
+        return;
+    }
+    // Fibonacci hashing of the client ID as returned by rs_get_client_id(),
+    // so that peer_i sequences don't map onto instances in lockstep.
+    uint64_t client_id = (uint64_t) peer_i << 32 | (worker->worker_i + 1);
+    uint32_t hash = (client_id * 0x9E3779B97F4A7C15) >> 32;
+    peer->app_i += (uint64_t) hash * app->instance_c >> 32;
+}
+
 rs_ret send_open_to_app(
     struct rs_worker * worker,
-    union rs_peer const * peer,
+    union rs_peer * peer,
     uint32_t peer_i
 ) {
+    assign_app_instance(worker, peer, peer_i);
     return worker->conf->apps[peer->app_i].wants_open_notification ?
-        send_msg_to_app(worker, peer, peer_i, 0, RS_BIN, RS_INBOUND_OPEN) :
+        send_msg_to_app(worker, peer, peer_i, NULL, 0, RS_BIN,
+            RS_INBOUND_OPEN) :
         RS_OK;
 }
 
@@ -96,7 +137,21 @@ rs_ret send_read_to_app(
     uint64_t data_size,
     enum rs_data_kind data_kind
 ) {
-    return send_msg_to_app(worker, peer, peer_i, data_size, data_kind,
+    RS_METRICS_ADD(worker->metrics->inbound_msg_c, 1);
+    return send_msg_to_app(worker, peer, peer_i, NULL, data_size, data_kind,
+        RS_INBOUND_READ);
+}
+
+rs_ret send_inflated_read_to_app(
+    struct rs_worker * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i,
+    uint8_t const * data,
+    uint64_t data_size,
+    enum rs_data_kind data_kind
+) {
+    RS_METRICS_ADD(worker->metrics->inbound_msg_c, 1);
+    return send_msg_to_app(worker, peer, peer_i, data, data_size, data_kind,
         RS_INBOUND_READ);
 }
 
@@ -106,6 +161,16 @@ rs_ret send_close_to_app(
     uint32_t peer_i
 ) {
     return worker->conf->apps[peer->app_i].wants_close_notification ?
-        send_msg_to_app(worker, peer, peer_i, 0, RS_BIN, RS_INBOUND_CLOSE) :
+        send_msg_to_app(worker, peer, peer_i, NULL, 0, RS_BIN,
+            RS_INBOUND_CLOSE) :
         RS_OK;
 }
+
+rs_ret send_pause_to_app(
+    struct rs_worker * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i
+) {
+    return send_msg_to_app(worker, peer, peer_i, NULL, 0, RS_BIN,
+        peer->ws.is_paused ? RS_INBOUND_PAUSE : RS_INBOUND_RESUME);
+}
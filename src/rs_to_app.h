@@ -11,7 +11,7 @@ rs_ret init_inbound_producers(
 
 rs_ret send_open_to_app(
     struct rs_worker * worker,
-    union rs_peer const * peer,
+    union rs_peer * peer, // Its app_i may be reassigned: see rs_to_app.c
     uint32_t peer_i
 );
 
@@ -23,8 +23,27 @@ rs_ret send_read_to_app(
     enum rs_data_kind data_kind
 );
 
+// Like send_read_to_app(), except that the data was inflated into a contiguous
+// buffer by rs_deflate.c, instead of residing in frames on worker->rbuf.
+rs_ret send_inflated_read_to_app(
+    struct rs_worker * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i,
+    uint8_t const * data,
+    uint64_t data_size,
+    enum rs_data_kind data_kind
+);
+
 rs_ret send_close_to_app(
     struct rs_worker * worker,
     union rs_peer const * peer,
     uint32_t peer_i
 );
+
+// Notify the app that the peer was paused or resumed, according to its current
+// peer->ws.is_paused state (see rs_from_app.c).
+rs_ret send_pause_to_app(
+    struct rs_worker * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i
+);
@@ -0,0 +1,732 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#define _GNU_SOURCE // syscall()
+
+#include "rs_event.h" // handle_peer_events(), busy_poll(), etc
+#include "rs_from_app.h" // receive_from_app()
+#include "rs_socket.h" // listen_to_sockets(), add_peer()
+#include "rs_timer.h" // init_timer_wheel(), expire_timers()
+#include "rs_uring.h"
+#include "rs_util.h" // get_addr_str()
+
+#include <linux/io_uring.h>
+#include <sys/epoll.h> // EPOLL* event bitflag macros
+#include <sys/mman.h> // mmap()
+#include <sys/socket.h> // MSG_NOSIGNAL
+#include <sys/syscall.h> // SYS_io_uring_setup, SYS_io_uring_enter
+#include <unistd.h> // syscall()
+
+// An alternative to the epoll-based loop_over_events() of rs_event.c, selected
+// with "event_loop": "io_uring" in the configuration file. It is talked to
+// through raw io_uring_setup() and io_uring_enter() syscalls rather than
+// liburing, so as not to introduce another external dependency.
+//
+// The layered peer state machine (rs_tcp.c -> rs_tls.c -> rs_http.c ->
+// rs_websocket.c) remains unchanged: handle_peer_events() is still called with
+// epoll-style event flags, and all of the following is batched into a single
+// io_uring_enter() call per loop iteration instead of costing separate
+// syscalls:
+// * Reading from unencrypted peers: a recv request is kept in flight for each
+//   of them, the completion of which is handled as an EPOLLIN event, after
+//   which read_tcp() reads the received bytes from the peer's recv_buf instead
+//   of calling read() (see read_uring_peer());
+// * Writing to unencrypted peers: write_tcp() and write_tcp_vector() copy
+//   their data to the peer's send_buf and submit it as a send request (see
+//   send_uring_peer()), the completion of which is handled as an EPOLLOUT
+//   event if the peer was left waiting for it;
+// * Readiness notification of TLS peers, which OpenSSL requires to read and
+//   write synchronously from within the state machine: these are instead
+//   watched with multishot poll requests with the same EPOLLET semantics as
+//   epoll_wait();
+// * Registration of new peers (instead of 1 epoll_ctl() per peer);
+// * Accepting new peers: multishot accept replaces accept_sockets()'s accept4()
+//   loop, with the accepted socket fd being delivered as a completion;
+// * Waking up upon writes to the worker's eventfd (and timer wheel timerfd),
+//   through multishot poll requests on the ring.
+//
+// Requires Linux 5.19 or later (for multishot accept and cancelation by fd).
+
+// Large enough to receive most WebSocket messages with a single recv request.
+// Whenever a recv does fill it completely, the remainder is read() directly.
+#define RS_URING_RECV_BUF_SIZE 0x1000 // 4 KB
+// A peer's send_buf grows to the size of the largest write it has to make, but
+// is free()d after any send larger than this completes.
+#define RS_URING_SEND_BUF_KEEP_SIZE 0x10000 // 64 KB
+
+// The io_uring state of the peers[] slot with the same peer_i
+struct rs_uring_peer {
+    // Incremented whenever the peer's requests are canceled (i.e., whenever
+    // its peers[] slot is about to be vacated): see get_user_data().
+    uint32_t generation;
+    // The remaining members only apply to unencrypted peers.
+    uint32_t recv_i; // Index of the 1st byte of recv_buf not yet read
+    uint32_t recv_size; // Number of bytes of recv_buf not yet read
+    int recv_end; // 0 (EOF) or a negated errno, if has_recv_end
+    int send_errno; // Of the last failed send request, if any
+    uint8_t * recv_buf; // RS_URING_RECV_BUF_SIZE bytes (allocated when needed)
+    uint8_t * send_buf;
+    size_t send_buf_size;
+    size_t send_i; // Index of the 1st byte of send_buf not yet sent
+    size_t send_size;
+    bool has_recv_end;
+    bool recv_may_continue; // The last recv request filled recv_buf entirely
+    bool recv_is_queued; // To be armed by arm_queued_recvs()
+    bool recv_is_in_flight;
+    bool send_is_in_flight;
+};
+
+struct rs_uring {
+    int ring_fd;
+    // Submission queue
+    atomic_uint_least32_t * sq_head; // Advanced by the kernel
+    atomic_uint_least32_t * sq_tail; // Advanced by this worker
+    uint32_t * sq_array;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t sqe_tail; // Including SQEs not yet published through sq_tail
+    struct io_uring_sqe * sqes;
+    // Completion queue
+    atomic_uint_least32_t * cq_head; // Advanced by this worker
+    atomic_uint_least32_t * cq_tail; // Advanced by the kernel
+    uint32_t cq_mask;
+    struct io_uring_cqe * cqes;
+    struct rs_uring_peer * peers; // Indexed by peer_i
+    // Peers of which a recv request is to be submitted: see queue_recv()
+    uint32_t * recv_queue; // peers_elem_c length array
+    uint32_t recv_queue_c;
+};
+
+// Completions carry the same kind/data "u64" layout as epoll event data (see
+// rs_event.h), except that only the lowest 8 bits hold the kind, followed by
+// 24 bits of the generation of the peers[] slot if the kind is RS_EVENT_PEER.
+// Without that generation, a stale completion of a removed poll request could
+// be mistaken for one of whichever peer occupies the same peers[] slot next.
+// Recv and send requests have kinds of their own, with the same generation and
+// peer_i layout as RS_EVENT_PEER. Cancelation requests use RS_URING_IGNORE.
+#define RS_URING_KIND_BIT_C 8
+#define RS_URING_GENERATION_MASK 0xFFFFFF
+#define RS_URING_RECV 0xFD
+#define RS_URING_SEND 0xFE
+#define RS_URING_IGNORE 0xFF
+
+static uint64_t get_user_data(
+    uint32_t kind,
+    uint32_t generation,
+    uint32_t data
+) {
+    return (uint64_t) data << 32 |
+        (generation & RS_URING_GENERATION_MASK) << RS_URING_KIND_BIT_C | kind;
+}
+
+static bool is_stale_peer_completion(
+    struct rs_uring const * uring,
+    struct io_uring_cqe const * cqe,
+    uint32_t peer_i
+) {
+    return ((uint32_t) cqe->user_data >> RS_URING_KIND_BIT_C) !=
+        (uring->peers[peer_i].generation & RS_URING_GENERATION_MASK);
+}
+
+static rs_ret enter_uring(
+    struct rs_uring * uring,
+    uint32_t min_complete // If > 0, block until at least that many CQEs exist
+) {
+    // Publish any newly prepared SQEs to the kernel.
+    atomic_store_explicit(uring->sq_tail, uring->sqe_tail,
+        memory_order_release);
+    uint32_t submit_c = uring->sqe_tail -
+        atomic_load_explicit(uring->sq_head, memory_order_acquire);
+    if (syscall(SYS_io_uring_enter, uring->ring_fd, submit_c, min_complete,
+        min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0) == -1) {
+        switch (errno) {
+        case EINTR:
+        case EAGAIN:
+        case EBUSY:
+            // Any unsubmitted SQEs remain published, so they'll be submitted
+            // during the next call; and completions will be reaped regardless.
+            return RS_OK;
+        default:
+            RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful io_uring_enter(%d, %" PRIu32
+                ", %" PRIu32 ", ...)", uring->ring_fd, submit_c, min_complete);
+            return RS_FATAL;
+        }
+    }
+    return RS_OK;
+}
+
+static rs_ret get_sqe(
+    struct rs_uring * uring,
+    struct io_uring_sqe * * sqe
+) {
+    if (uring->sqe_tail - atomic_load_explicit(uring->sq_head,
+        memory_order_acquire) >= uring->sq_entries) {
+        // The submission queue is full: submit it to make room.
+        RS_GUARD(enter_uring(uring, 0));
+        if (uring->sqe_tail - atomic_load_explicit(uring->sq_head,
+            memory_order_acquire) >= uring->sq_entries) {
+            RS_LOG(LOG_CRIT, "The io_uring submission queue of %" PRIu32
+                " entries remains full after io_uring_enter()",
+                uring->sq_entries);
+            return RS_FATAL;
+        }
+    }
+    uint32_t i = uring->sqe_tail++ & uring->sq_mask;
+    uring->sq_array[i] = i;
+    *sqe = uring->sqes + i;
+    memset(*sqe, 0, sizeof(**sqe));
+    return RS_OK;
+}
+
+static rs_ret init_uring(
+    struct rs_worker * worker
+) {
+    struct rs_uring * uring = NULL;
+    RS_CALLOC(uring, 1);
+    worker->uring = uring;
+    uint32_t sq_entries = RS_MAX(worker->conf->epoll_buf_elem_c, 64);
+    struct io_uring_params params = {
+        .flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP,
+        // Every peer can have a recv and a send completion pending, with some
+        // to spare. (Any excess completions are kept by the kernel regardless,
+        // given IORING_FEAT_NODROP.)
+        .cq_entries = RS_MAX(2 * worker->peers_elem_c, 4 * sq_entries)
+    };
+    uring->ring_fd = syscall(SYS_io_uring_setup, sq_entries, &params);
+    if (uring->ring_fd == -1) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful io_uring_setup(%" PRIu32 ", "
+            "&params): io_uring requires Linux 5.19 or later (or otherwise "
+            "set \"event_loop\" to \"epoll\")", sq_entries);
+        return RS_FATAL;
+    }
+    if (!(params.features & IORING_FEAT_NODROP)) {
+        RS_LOG(LOG_CRIT, "This kernel's io_uring lacks IORING_FEAT_NODROP: "
+            "Linux 5.19 or later is required (or otherwise set "
+            "\"event_loop\" to \"epoll\")");
+        return RS_FATAL;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cq_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = RS_MAX(sq_size, cq_size);
+    }
+    uint8_t * sq_ring = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+    uint8_t * cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? sq_ring :
+        mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        uring->ring_fd, IORING_OFF_CQ_RING);
+    uring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd,
+        IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED ||
+        uring->sqes == MAP_FAILED) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful mmap() of io_uring fd %d",
+            uring->ring_fd);
+        return RS_FATAL;
+    }
+    uring->sq_head = (atomic_uint_least32_t *) (sq_ring + params.sq_off.head);
+    uring->sq_tail = (atomic_uint_least32_t *) (sq_ring + params.sq_off.tail);
+    uring->sq_array = (uint32_t *) (sq_ring + params.sq_off.array);
+    uring->sq_mask = *((uint32_t *) (sq_ring + params.sq_off.ring_mask));
+    uring->sq_entries = params.sq_entries;
+    uring->sqe_tail = atomic_load_explicit(uring->sq_tail,
+        memory_order_relaxed);
+    uring->cq_head = (atomic_uint_least32_t *) (cq_ring + params.cq_off.head);
+    uring->cq_tail = (atomic_uint_least32_t *) (cq_ring + params.cq_off.tail);
+    uring->cq_mask = *((uint32_t *) (cq_ring + params.cq_off.ring_mask));
+    uring->cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+    RS_CALLOC(uring->peers, worker->peers_elem_c);
+    RS_CALLOC(uring->recv_queue, worker->peers_elem_c);
+    RS_LOG(LOG_DEBUG, "Created an io_uring: fd=%d, sq_entries=%" PRIu32 ", "
+        "cq_entries=%" PRIu32, uring->ring_fd, params.sq_entries,
+        params.cq_entries);
+    return RS_OK;
+}
+
+rs_ret arm_uring_accept(
+    struct rs_worker * worker,
+    int listen_fd,
+    bool is_encrypted
+) {
+    struct io_uring_sqe * sqe = NULL;
+    RS_GUARD(get_sqe(worker->uring, &sqe));
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = get_user_data(is_encrypted ? RS_EVENT_ENCRYPTED_LISTENFD :
+        RS_EVENT_UNENCRYPTED_LISTENFD, 0, listen_fd);
+    return RS_OK;
+}
+
+static rs_ret arm_uring_poll(
+    struct rs_worker * worker,
+    int fd,
+    uint64_t user_data,
+    uint32_t events
+) {
+    struct io_uring_sqe * sqe = NULL;
+    RS_GUARD(get_sqe(worker->uring, &sqe));
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = events;
+    sqe->user_data = user_data;
+    return RS_OK;
+}
+
+// Queue a recv request for the unencrypted peer with the given peer_i, unless
+// one is already queued or in flight, or it still has received data (or an
+// EOF/error) waiting to be read. Submission is deferred to arm_queued_recvs(),
+// so that this can be called from within read_uring_peer().
+static void queue_recv(
+    struct rs_uring * uring,
+    uint32_t peer_i
+) {
+    struct rs_uring_peer * p = uring->peers + peer_i;
+    if (p->recv_is_queued || p->recv_is_in_flight || p->recv_size ||
+        p->has_recv_end) {
+        return;
+    }
+    p->recv_is_queued = true;
+    // Bytes could otherwise be read() out of order with those of the recv.
+    p->recv_may_continue = false;
+    // A peer_i is never queued more than once, because recv_is_queued remains
+    // set until arm_queued_recvs() gets to it: even if its peer is closed and
+    // its slot taken over by a new peer in the meantime.
+    uring->recv_queue[uring->recv_queue_c++] = peer_i;
+}
+
+static rs_ret arm_queued_recvs(
+    struct rs_worker * worker
+) {
+    struct rs_uring * uring = worker->uring;
+    for (uint32_t i = 0; i < uring->recv_queue_c; i++) {
+        uint32_t peer_i = uring->recv_queue[i];
+        struct rs_uring_peer * p = uring->peers + peer_i;
+        p->recv_is_queued = false;
+        union rs_peer const * peer = worker->peers + peer_i;
+        if (!peer->socket_fd || peer->is_encrypted) {
+            continue; // The slot was vacated (or taken over by a TLS peer).
+        }
+        if (!p->recv_buf) {
+            RS_CALLOC(p->recv_buf, RS_URING_RECV_BUF_SIZE);
+        }
+        struct io_uring_sqe * sqe = NULL;
+        RS_GUARD(get_sqe(uring, &sqe));
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = peer->socket_fd;
+        sqe->addr = (uintptr_t) p->recv_buf;
+        sqe->len = RS_URING_RECV_BUF_SIZE;
+        sqe->user_data = get_user_data(RS_URING_RECV, p->generation, peer_i);
+        p->recv_is_in_flight = true;
+    }
+    uring->recv_queue_c = 0;
+    return RS_OK;
+}
+
+ssize_t read_uring_peer(
+    struct rs_worker * worker,
+    uint32_t peer_i,
+    void * rbuf,
+    size_t rbuf_size
+) {
+    // Mimic read() on the non-blocking socket_fd, except that any bytes are
+    // copied from those received by the peer's last recv request.
+    struct rs_uring_peer * p = worker->uring->peers + peer_i;
+    if (p->recv_size) {
+        size_t size = RS_MIN(p->recv_size, rbuf_size);
+        memcpy(rbuf, p->recv_buf + p->recv_i, size);
+        p->recv_i += size;
+        p->recv_size -= size;
+        return size;
+    }
+    if (p->has_recv_end) {
+        if (!p->recv_end) {
+            return 0;
+        }
+        errno = -p->recv_end;
+        return -1;
+    }
+    if (p->recv_may_continue) {
+        // The last recv filled recv_buf, so more bytes are probably waiting
+        // already. Given that no recv is in flight, read() them directly
+        // rather than delaying them until a recv completion.
+        ssize_t ret = read(worker->peers[peer_i].socket_fd, rbuf, rbuf_size);
+        p->recv_may_continue = ret > 0 && (size_t) ret == rbuf_size;
+        if (ret != -1 || errno != EAGAIN) {
+            return ret;
+        }
+    }
+    queue_recv(worker->uring, peer_i);
+    errno = EAGAIN;
+    return -1;
+}
+
+static rs_ret submit_send(
+    struct rs_worker * worker,
+    uint32_t peer_i
+) {
+    struct rs_uring_peer * p = worker->uring->peers + peer_i;
+    struct io_uring_sqe * sqe = NULL;
+    RS_GUARD(get_sqe(worker->uring, &sqe));
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = worker->peers[peer_i].socket_fd;
+    sqe->addr = (uintptr_t) (p->send_buf + p->send_i);
+    sqe->len = RS_MIN(p->send_size - p->send_i, UINT32_MAX);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = get_user_data(RS_URING_SEND, p->generation, peer_i);
+    p->send_is_in_flight = true;
+    return RS_OK;
+}
+
+rs_ret send_uring_peer(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    uint32_t peer_i,
+    struct iovec const * iov,
+    int iov_c
+) {
+    // Follow the same return value conventions as write_tcp(), except that
+    // RS_OK means that all iov_c buffers were copied to send_buf to be sent
+    // once the request is submitted, which means they need not be kept around.
+    // Only one send request is in flight per peer at a time, upon completion of
+    // which handle_send_completion() lets any RS_AGAIN be tried again.
+    struct rs_uring_peer * p = worker->uring->peers + peer_i;
+    if (p->send_is_in_flight) {
+        peer->is_writing = true;
+        return RS_AGAIN;
+    }
+    if (p->send_errno) {
+        errno = p->send_errno;
+        RS_LOG_ERRNO(LOG_ERR, "Unsuccessful send request of %zu bytes to %s",
+            p->send_size - p->send_i, get_addr_str(peer));
+        return RS_CLOSE_PEER;
+    }
+    size_t size = 0;
+    for (int i = 0; i < iov_c; i++) {
+        size += iov[i].iov_len;
+    }
+    if (size > p->send_buf_size) {
+        if (p->send_buf) {
+            RS_REALLOC(p->send_buf, size);
+        } else {
+            RS_CALLOC(p->send_buf, size);
+        }
+        p->send_buf_size = size;
+    }
+    size = 0;
+    for (int i = 0; i < iov_c; i++) {
+        memcpy(p->send_buf + size, iov[i].iov_base, iov[i].iov_len);
+        size += iov[i].iov_len;
+    }
+    p->send_i = 0;
+    p->send_size = size;
+    return submit_send(worker, peer_i);
+}
+
+bool uring_peer_is_sending(
+    struct rs_worker const * worker,
+    uint32_t peer_i
+) {
+    return worker->uring->peers[peer_i].send_is_in_flight;
+}
+
+rs_ret arm_uring_peer(
+    struct rs_worker * worker,
+    uint32_t peer_i
+) {
+    union rs_peer const * peer = worker->peers + peer_i;
+    if (!peer->is_encrypted) {
+        // Its 1st recv completion will set the state machine in motion.
+        queue_recv(worker->uring, peer_i);
+        return RS_OK;
+    }
+    // Same events as accept_sockets() registers with epoll_ctl()
+    return arm_uring_poll(worker, peer->socket_fd, get_user_data(RS_EVENT_PEER,
+        worker->uring->peers[peer_i].generation, peer_i),
+        EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+}
+
+rs_ret disarm_uring_peer(
+    struct rs_worker * worker,
+    uint32_t peer_i
+) {
+    // A pending io_uring request holds a reference to its file, which means
+    // that close()ing a peer's socket_fd would not actually close the
+    // connection as long as any of its requests remain active. Cancel them
+    // all first, and submit the cancelation immediately, given that
+    // handle_tcp_io() is about to call close().
+    struct io_uring_sqe * sqe = NULL;
+    RS_GUARD(get_sqe(worker->uring, &sqe));
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = worker->peers[peer_i].socket_fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = get_user_data(RS_URING_IGNORE, 0, 0);
+    struct rs_uring_peer * p = worker->uring->peers + peer_i;
+    // Any completions of the canceled requests still pending (their
+    // -ECANCELED ones in particular) will now be recognized as stale by
+    // handle_completion(), even if a new peer takes over this slot first.
+    p->generation++;
+    p->recv_size = 0;
+    p->has_recv_end = false;
+    p->recv_may_continue = false;
+    p->send_errno = 0;
+    // Buffers still in use by a request in flight are free()d or taken over by
+    // the slot's next peer upon its stale completion.
+    if (!p->recv_is_in_flight) {
+        RS_FREE(p->recv_buf);
+    }
+    if (!p->send_is_in_flight) {
+        RS_FREE(p->send_buf);
+        p->send_buf_size = 0;
+    }
+    return enter_uring(worker->uring, 0);
+}
+
+static rs_ret handle_accept_completion(
+    struct rs_worker * worker,
+    struct io_uring_cqe const * cqe,
+    uint32_t kind,
+    int listen_fd
+) {
+    bool is_encrypted = kind == RS_EVENT_ENCRYPTED_LISTENFD;
+    if (cqe->res >= 0) {
+        RS_GUARD(add_peer(worker, -1, cqe->res, is_encrypted));
+    } else {
+        switch (-cqe->res) {
+        case ECONNABORTED: // Peer already hung up. Kinda rude.
+        case EMFILE:
+        case ENFILE:
+        case ENOBUFS:
+        case ENOMEM:
+            errno = -cqe->res;
+            RS_LOG_ERRNO(LOG_WARNING, "Multishot accept on listen fd %d "
+                "completed with an error", listen_fd);
+            break;
+        default:
+            errno = -cqe->res;
+            RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful multishot accept on listen "
+                "fd %d (note that Linux 5.19 or later is required)", listen_fd);
+            return RS_FATAL;
+        }
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        // The kernel terminated the multishot request: start a new one.
+        RS_GUARD(arm_uring_accept(worker, listen_fd, is_encrypted));
+    }
+    return RS_OK;
+}
+
+static rs_ret handle_recv_completion(
+    struct rs_worker * worker,
+    struct io_uring_cqe const * cqe,
+    uint32_t peer_i
+) {
+    struct rs_uring_peer * p = worker->uring->peers + peer_i;
+    union rs_peer * peer = worker->peers + peer_i;
+    p->recv_is_in_flight = false;
+    if (is_stale_peer_completion(worker->uring, cqe, peer_i)) {
+        // The recv request of a peer that has since been closed, which means
+        // that any new peer in its slot couldn't queue one of its own yet.
+        if (!peer->socket_fd) {
+            RS_FREE(p->recv_buf);
+        } else if (!peer->is_encrypted) {
+            queue_recv(worker->uring, peer_i);
+        }
+        return RS_OK;
+    }
+    uint32_t events = EPOLLIN;
+    if (cqe->res > 0) {
+        p->recv_i = 0;
+        p->recv_size = cqe->res;
+        p->recv_may_continue = cqe->res == RS_URING_RECV_BUF_SIZE;
+    } else {
+        // Let read_uring_peer() return this like read() would.
+        p->has_recv_end = true;
+        p->recv_end = cqe->res;
+        events |= cqe->res ? EPOLLERR : EPOLLRDHUP;
+    }
+    RS_GUARD(handle_peer_events(worker, peer_i, events));
+    if (peer->socket_fd) {
+        // In case the state machine stopped reading before read_uring_peer()
+        // got to return EAGAIN, as it does after a WebSocket Upgrade.
+        queue_recv(worker->uring, peer_i);
+    }
+    return RS_OK;
+}
+
+static rs_ret handle_send_completion(
+    struct rs_worker * worker,
+    struct io_uring_cqe const * cqe,
+    uint32_t peer_i
+) {
+    struct rs_uring_peer * p = worker->uring->peers + peer_i;
+    union rs_peer * peer = worker->peers + peer_i;
+    if (is_stale_peer_completion(worker->uring, cqe, peer_i)) {
+        p->send_is_in_flight = false;
+        if (!peer->socket_fd) {
+            RS_FREE(p->send_buf);
+            p->send_buf_size = 0;
+            return RS_OK;
+        }
+        // Any new peer in this slot may have been made to wait for this.
+        return peer->is_writing ?
+            handle_peer_events(worker, peer_i, EPOLLOUT) : RS_OK;
+    }
+    if (cqe->res < 0) {
+        // Let the next send_uring_peer() call return RS_CLOSE_PEER, just like
+        // a write() to the same peer would have failed.
+        p->send_errno = -cqe->res;
+    } else if ((p->send_i += cqe->res) < p->send_size) {
+        // Unlike write(), a send request is not retried upon partial success.
+        return submit_send(worker, peer_i);
+    } else if (p->send_buf_size > RS_URING_SEND_BUF_KEEP_SIZE) {
+        RS_FREE(p->send_buf);
+        p->send_buf_size = 0;
+    }
+    p->send_is_in_flight = false;
+    if (!peer->is_writing) {
+        return RS_OK;
+    }
+    RS_GUARD(handle_peer_events(worker, peer_i, EPOLLOUT));
+    if (peer->socket_fd) {
+        // See the same call in handle_recv_completion()
+        queue_recv(worker->uring, peer_i);
+    }
+    return RS_OK;
+}
+
+static rs_ret handle_completion(
+    struct rs_worker * worker,
+    struct io_uring_cqe const * cqe
+) {
+    uint32_t const kind = cqe->user_data & ((1 << RS_URING_KIND_BIT_C) - 1);
+    uint32_t const data = cqe->user_data >> 32;
+    switch (kind) {
+    case RS_URING_RECV:
+        return handle_recv_completion(worker, cqe, data);
+    case RS_URING_SEND:
+        return handle_send_completion(worker, cqe, data);
+    case RS_EVENT_PEER:
+        if (is_stale_peer_completion(worker->uring, cqe, data)) {
+            // A stale completion of a poll request that was already canceled
+            return RS_OK;
+        }
+        if (cqe->res < 0) {
+            // The poll request failed for a peer that is therefore best let
+            // go of. (Any -ECANCELED as a result of disarm_uring_peer() is
+            // stale by now, but remains harmless regardless.)
+            if (cqe->res != -ECANCELED && worker->peers[data].socket_fd) {
+                errno = -cqe->res;
+                RS_LOG_ERRNO(LOG_WARNING, "Peer poll completed with an error");
+                if (worker->peers[data].mortality == RS_MORTALITY_LIVE) {
+                    RS_METRICS_ADD(worker->metrics->close_c_by_reason[
+                        RS_CLOSE_REASON_HANGUP], 1);
+                }
+                worker->peers[data].mortality = RS_MORTALITY_DEAD;
+                return handle_peer_events(worker, data, 0);
+            }
+            return RS_OK;
+        }
+        RS_GUARD(handle_peer_events(worker, data, cqe->res));
+        if (!(cqe->flags & IORING_CQE_F_MORE) &&
+            worker->peers[data].socket_fd) {
+            // The kernel terminated the multishot request, yet the peer is
+            // still around: start a new one.
+            RS_GUARD(arm_uring_peer(worker, data));
+        }
+        return RS_OK;
+    case RS_EVENT_ENCRYPTED_LISTENFD:
+    case RS_EVENT_UNENCRYPTED_LISTENFD:
+        return handle_accept_completion(worker, cqe, kind, data);
+    case RS_EVENT_EVENTFD:
+        // The eventfd is non-blocking, which would cause an IORING_OP_READ
+        // request to fail with -EAGAIN rather than wait; hence the poll.
+        if (cqe->res > 0 && read(worker->eventfd, (uint64_t []){0}, 8) != 8 &&
+            errno != EAGAIN) {
+            RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful read(eventfd, ...)");
+            return RS_FATAL;
+        }
+        // Do nothing else for now, because after all completions are
+        // processed, receive_from_app() is called anyway.
+        break;
+    case RS_EVENT_TIMERFD:
+        if (cqe->res > 0) {
+            RS_GUARD(expire_timers(worker));
+        }
+        break;
+    case RS_URING_IGNORE: default:
+        return RS_OK;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        // Re-arm the eventfd or timerfd poll, which the kernel terminated.
+        return arm_uring_poll(worker, data, cqe->user_data, EPOLLIN | EPOLLET);
+    }
+    return RS_OK;
+}
+
+rs_ret loop_over_uring_events(
+    struct rs_worker * worker
+) {
+    RS_GUARD(init_uring(worker));
+    RS_GUARD(listen_to_sockets(worker, -1));
+    RS_GUARD(arm_uring_poll(worker, worker->eventfd,
+        get_user_data(RS_EVENT_EVENTFD, 0, worker->eventfd),
+        EPOLLIN | EPOLLET));
+    RS_GUARD(init_timer_wheel(worker));
+    RS_GUARD(arm_uring_poll(worker, worker->timer_wheel.timerfd,
+        get_user_data(RS_EVENT_TIMERFD, 0, worker->timer_wheel.timerfd),
+        EPOLLIN | EPOLLET));
+    struct rs_uring * uring = worker->uring;
+    RS_LOG(LOG_DEBUG, "Entering io_uring event loop...");
+    for (;;) {
+        // The sleep state protocol is the same as in loop_over_events() of
+        // rs_event.c: see the comments there.
+        if (!worker->is_spinning) {
+            RS_ATOMIC_STORE_RELAXED(&worker->sleep_state->is_asleep, true);
+        }
+
+        // Submit everything queued since the previous iteration, without
+        // waiting: this syscall also serves as the 1st epoll_wait() call's
+        // guard against CPU memory reordering prior to flush_ring_updates().
+        RS_GUARD(arm_queued_recvs(worker));
+        RS_GUARD(enter_uring(uring, 0));
+        flush_ring_updates(worker);
+
+        uint32_t cq_head = atomic_load_explicit(uring->cq_head,
+            memory_order_relaxed);
+        if (cq_head == atomic_load_explicit(uring->cq_tail,
+            memory_order_acquire)) {
+            switch (busy_poll(worker)) { // rs_event.c
+            case RS_OK:
+                break;
+            case RS_AGAIN:
+                continue;
+            default:
+                return RS_FATAL;
+            }
+            rs_begin_sleep(&worker->spin);
+            RS_GUARD(arm_queued_recvs(worker));
+            RS_GUARD(enter_uring(uring, 1));
+            rs_end_sleep(&worker->spin);
+        }
+        rs_end_idle(&worker->spin);
+        worker->is_spinning = false;
+        // Tell apps they can dequeue to outbound rings now without eventfds.
+        RS_ATOMIC_STORE_RELAXED(&worker->sleep_state->is_asleep, false);
+
+        uint32_t cq_tail = atomic_load_explicit(uring->cq_tail,
+            memory_order_acquire);
+        while (cq_head != cq_tail) {
+            // Copy each CQE and release its slot before handling it, so that
+            // the kernel can reuse it straight away.
+            struct io_uring_cqe cqe = uring->cqes[cq_head++ & uring->cq_mask];
+            atomic_store_explicit(uring->cq_head, cq_head,
+                memory_order_release);
+            RS_GUARD(handle_completion(worker, &cqe));
+        }
+        RS_GUARD(receive_from_app(worker));
+    }
+}
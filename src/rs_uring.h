@@ -0,0 +1,48 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+#pragma once
+
+#include "rs_worker.h"
+
+#include <sys/uio.h> // struct iovec
+
+rs_ret arm_uring_accept(
+    struct rs_worker * worker,
+    int listen_fd,
+    bool is_encrypted
+);
+
+ssize_t read_uring_peer(
+    struct rs_worker * worker,
+    uint32_t peer_i,
+    void * rbuf,
+    size_t rbuf_size
+);
+
+rs_ret send_uring_peer(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    uint32_t peer_i,
+    struct iovec const * iov,
+    int iov_c
+);
+
+bool uring_peer_is_sending(
+    struct rs_worker const * worker,
+    uint32_t peer_i
+);
+
+rs_ret arm_uring_peer(
+    struct rs_worker * worker,
+    uint32_t peer_i
+);
+
+rs_ret disarm_uring_peer(
+    struct rs_worker * worker,
+    uint32_t peer_i
+);
+
+rs_ret loop_over_uring_events(
+    struct rs_worker * worker
+);
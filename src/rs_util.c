@@ -259,9 +259,11 @@ char * get_peer_str(
     } else if (peer->layer == RS_LAYER_WEBSOCKET) {
         if (!(log_dst = print_to_log_buf(worker, log_dst,
             "ws.owref_c: %" PRIu16 ", "
-            "ws.owref_i: %" PRIu32 ", ",
+            "ws.owref_head_i: %" PRIu16 ", "
+            "ws.is_deflating: %c, ",
             peer->ws.owref_c,
-            peer->ws.owref_i
+            peer->ws.owref_head_i,
+            peer->ws.is_deflating ? 'Y' : 'N'
         ))) {
             return NULL;
         }
@@ -1,11 +1,15 @@
 // SPDX-License-Identifier: MIT
 // Copyright © 2019 William Budd
 
-#include "rs_event.h" // set_shutdown_deadline()
+#define _POSIX_C_SOURCE 201112L // clock_gettime(), CLOCK_MONOTONIC
+
+#include "rs_deflate.h" // inflate_ws_msg()
 #include "rs_from_app.h" // send_pending_owrefs(), remove_pending_owrefs()
+#include "rs_simd.h" // unmask_wsframe_payload(), validate_utf8()
 #include "rs_tcp.h" // read_tcp(), write_tcp()
+#include "rs_timer.h" // set_shutdown_deadline()
 #include "rs_tls.h" // read_tls(), write_tls()
-#include "rs_to_app.h" // send_read_to_app(), send_close_to_app()
+#include "rs_to_app.h" // send_read_to_app(), send_close_to_app(), etc
 #include "rs_util.h" // move_left(), bin_to_log_buf(), get_addr_str()
 #include "rs_websocket.h"
 
@@ -28,7 +32,9 @@ enum rs_wsframe_close {
     RS_WSFRAME_CLOSE_EMPTY_REPLY   = 0,
     RS_WSFRAME_CLOSE_ERR_PROTOCOL  = 1,
     RS_WSFRAME_CLOSE_ERR_PAYLOAD   = 2,
-    RS_WSFRAME_CLOSE_ERR_TOO_LARGE = 3
+    RS_WSFRAME_CLOSE_ERR_TOO_LARGE = 3,
+    // Not in the array below: see get_close_frame()
+    RS_WSFRAME_CLOSE_BACKPRESSURE  = 4
 }; // Assigned to peer->ws.close_frame, and used as an index to this array:
 static uint8_t const close_frames[][4] = {
 // FIN+CLOSE opcode (0x88) + payload size (0x02 or 0x00) + two byte status code
@@ -54,6 +60,9 @@ struct rs_wsframe_parser {
 
     // Unable to use pong_size>0 instead, given that "empty" pings are allowed.
     bool must_send_pong_response;
+
+    // Set if the message's first frame has its RSV1 bit set (see rs_deflate.c)
+    bool is_compressed;
 };
 
 struct rs_wsframe_parser_storage {
@@ -69,6 +78,7 @@ struct rs_wsframe_parser_storage {
     uint8_t is_continuation;
     uint8_t must_send_pong_response;
     uint8_t pong_payload_size;
+    uint8_t is_compressed;
 
     uint8_t frames[];
 };
@@ -85,10 +95,22 @@ static rs_ret parse_websocket_frame_header(
         return RS_CLOSE_PEER;
     }
     if (wsp->frame->reserved_x70 & 0x70) {
-        RS_LOG(LOG_NOTICE, "Failing peer %s: received a WebSocket frame with "
-            "one or more reserved bits set.", get_addr_str(peer));
-        wsp->close_frame = RS_WSFRAME_CLOSE_ERR_PROTOCOL;
-        return RS_CLOSE_PEER;
+        // RFC 7692#section-6: the RSV1 bit marks a message as compressed
+        // through permessage-deflate, but only on its first frame.
+        switch (rs_get_wsframe_opcode(wsp->frame)) {
+        case RS_WSFRAME_OPC_TEXT:
+        case RS_WSFRAME_OPC_BIN:
+            if ((wsp->frame->reserved_x70 & 0x70) == 0x40 &&
+                peer->ws.is_deflating && !wsp->is_continuation) {
+                wsp->is_compressed = true;
+                break;
+            } // fall through
+        default:
+            RS_LOG(LOG_NOTICE, "Failing peer %s: received a WebSocket frame "
+                "with one or more reserved bits set.", get_addr_str(peer));
+            wsp->close_frame = RS_WSFRAME_CLOSE_ERR_PROTOCOL;
+            return RS_CLOSE_PEER;
+        }
     }
     switch (rs_get_wsframe_opcode(wsp->frame)) {
     case RS_WSFRAME_OPC_CONT:
@@ -254,22 +276,21 @@ static rs_ret unmask_payload_and_validate_any_utf8(
     struct rs_wsframe_parser * wsp,
     size_t masked_size
 ) {
-    uint8_t * mask_key = wsp->payload - 4;
     size_t mask_i =
         wsp->cur_read > wsp->payload ? wsp->cur_read - wsp->payload : 0;
-    if (wsp->data_kind == RS_BIN) {
-        for (; mask_i < masked_size; mask_i++) {
-            wsp->payload[mask_i] ^= mask_key[mask_i % 4];
-        }
-    } else {
-        for (; mask_i < masked_size; mask_i++) {
-            wsp->payload[mask_i] ^= mask_key[mask_i % 4];
-            if ((wsp->utf8_state = rs_validate_utf8_byte(wsp->utf8_state,
-                wsp->payload[mask_i])) == RS_UTF8_INVALID) {
-                wsp->close_frame = RS_WSFRAME_CLOSE_ERR_PAYLOAD;
-                return RS_CLOSE_PEER;
-            }
-        }
+    if (mask_i >= masked_size) {
+        return RS_OK;
+    }
+    // See rs_simd.c for SIMD-accelerated implementations of both of these.
+    unmask_wsframe_payload(wsp->payload, mask_i, masked_size,
+        wsp->payload - 4);
+    // The UTF-8 of compressed messages can only be validated once inflated.
+    if (wsp->data_kind == RS_UTF8 && !wsp->is_compressed &&
+        (wsp->utf8_state = validate_utf8(
+        wsp->utf8_state, wsp->payload + mask_i, masked_size - mask_i)) ==
+        RS_UTF8_INVALID) {
+        wsp->close_frame = RS_WSFRAME_CLOSE_ERR_PAYLOAD;
+        return RS_CLOSE_PEER;
     }
     return RS_OK;
 }
@@ -324,6 +345,44 @@ static rs_ret parse_websocket_frame(
     return RS_OK;
 }
 
+static rs_ret send_inflated_msg(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    uint32_t peer_i,
+    struct rs_wsframe_parser * wsp
+) {
+    uint8_t const * data = NULL;
+    uint64_t data_size = 0;
+    switch (inflate_ws_msg(worker, peer_i, (union rs_wsframe *) worker->rbuf,
+        &data, &data_size)) {
+    case RS_OK:
+        break;
+    case RS_CLOSE_PEER:
+        if (data_size > worker->conf->max_ws_msg_size) {
+            RS_LOG(LOG_NOTICE, "Failing peer %s: inflated WebSocket message "
+                "payload size exceeds the configured \"max_ws_msg_size\" "
+                "value of %zu.", get_addr_str(peer),
+                worker->conf->max_ws_msg_size);
+            wsp->close_frame = RS_WSFRAME_CLOSE_ERR_TOO_LARGE;
+        } else {
+            RS_LOG(LOG_NOTICE, "Failing peer %s: received a WebSocket "
+                "message with invalid permessage-deflate data.",
+                get_addr_str(peer));
+            wsp->close_frame = RS_WSFRAME_CLOSE_ERR_PAYLOAD;
+        }
+        return RS_CLOSE_PEER;
+    case RS_FATAL: default:
+        return RS_FATAL;
+    }
+    if (wsp->data_kind == RS_UTF8 &&
+        validate_utf8(RS_UTF8_OK, data, data_size) != RS_UTF8_OK) {
+        wsp->close_frame = RS_WSFRAME_CLOSE_ERR_PAYLOAD;
+        return RS_CLOSE_PEER;
+    }
+    return send_inflated_read_to_app(worker, peer, peer_i, data, data_size,
+        wsp->data_kind);
+}
+
 static rs_ret parse_websocket(
     struct rs_worker * worker,
     union rs_peer * peer,
@@ -361,8 +420,12 @@ static rs_ret parse_websocket(
             wsp->close_frame = RS_WSFRAME_CLOSE_ERR_PAYLOAD;
             return RS_CLOSE_PEER;
         }
-        RS_GUARD(send_read_to_app(worker, peer, peer_i, wsp->data_size,
-            wsp->data_kind));
+        if (wsp->is_compressed) {
+            RS_GUARD(send_inflated_msg(worker, peer, peer_i, wsp));
+        } else {
+            RS_GUARD(send_read_to_app(worker, peer, peer_i, wsp->data_size,
+                wsp->data_kind));
+        }
         if (frame_incr == wsp->next_read) {
             return RS_OK;
         }
@@ -403,6 +466,7 @@ static rs_ret save_websocket_parse_state(
     peer->ws.storage->is_continuation = wsp->is_continuation;
     peer->ws.storage->must_send_pong_response = wsp->must_send_pong_response;
     peer->ws.storage->pong_payload_size = pong_payload_size;
+    peer->ws.storage->is_compressed = wsp->is_compressed;
 
     memcpy(peer->ws.storage->frames, worker->rbuf, frames_size);
 
@@ -437,6 +501,7 @@ static void load_websocket_parse_state(
     wsp->utf8_state = peer->ws.storage->utf8_state;
     wsp->is_continuation = peer->ws.storage->is_continuation;
     wsp->must_send_pong_response = peer->ws.storage->must_send_pong_response;
+    wsp->is_compressed = peer->ws.storage->is_compressed;
 
     RS_FREE(peer->ws.storage);
     
@@ -459,7 +524,7 @@ static rs_ret send_pong_response(
     return peer->is_encrypted ?
         write_tls(worker, peer, pong_response,
             sizeof(*pong_response) + pong_response->payload_size_x7F) :
-        write_tcp(peer, pong_response,
+        write_tcp(worker, peer, pong_response,
             sizeof(*pong_response) + pong_response->payload_size_x7F);
 }
 
@@ -508,10 +573,16 @@ static rs_ret read_websocket(
         switch (peer->is_encrypted ?
             read_tls(worker,
                 peer, wsp.next_read, rbuf_over - wsp.next_read, &rsize) :
-            read_tcp(
+            read_tcp(worker,
                 peer, wsp.next_read, rbuf_over - wsp.next_read, &rsize)
         ) {
         case RS_OK:
+            RS_METRICS_ADD(worker->metrics->inbound_byte_c, rsize);
+            if (worker->latencies) {
+                // Any message completed by this read is sent to the app with
+                // this timestamp (see send_msg_to_app() in rs_to_app.c).
+                worker->read_time_ns = rs_get_spin_time_ns();
+            }
             wsp.cur_read = wsp.next_read;
             wsp.next_read += rsize;
             switch (parse_websocket(worker, peer, peer_i, &wsp)) {
@@ -531,9 +602,13 @@ static rs_ret read_websocket(
             case RS_CLOSE_PEER: default:
                 peer->ws.close_frame = wsp.close_frame;
                 peer->mortality = RS_MORTALITY_SHUTDOWN_WRITE;
+                RS_METRICS_ADD(worker->metrics->close_c_by_reason[
+                    wsp.close_frame == RS_WSFRAME_CLOSE_EMPTY_REPLY ?
+                    RS_CLOSE_REASON_PEER : RS_CLOSE_REASON_WEBSOCKET], 1);
                 return RS_CLOSE_PEER;
             }
         case RS_AGAIN:
+            RS_METRICS_ADD(worker->metrics->read_eagain_c, 1);
             if (parse_is_incomplete) {
                 RS_LOG(LOG_DEBUG, "RS_AGAIN occurred while attempting to read "
                     "the remainder of a partially parsed WebSocket message: "
@@ -563,7 +638,47 @@ static rs_ret write_websocket_control_frame(
         "%zu byte payload: %s", get_addr_str(peer), frame->payload_size_x7F,
         bin_to_log_buf(worker, frame, frame_size));
     return peer->is_encrypted ? write_tls(worker, peer, frame, frame_size) :
-                                        write_tcp(peer, frame, frame_size);
+                                write_tcp(worker, peer, frame, frame_size);
+}
+
+// Get the Close frame to send according to peer->ws.close_frame, which in the
+// case of RS_WSFRAME_CLOSE_BACKPRESSURE is the one with the peer's endpoint's
+// "backpressure_close_code" as written to the 4 bytes of buf.
+static struct rs_wsframe_sc_small * get_close_frame(
+    struct rs_worker const * worker,
+    union rs_peer const * peer,
+    uint8_t * buf
+) {
+    if (peer->ws.close_frame != RS_WSFRAME_CLOSE_BACKPRESSURE) {
+        return (struct rs_wsframe_sc_small *)
+            close_frames[RS_BOUNDS(0, peer->ws.close_frame, 3)];
+    }
+    uint16_t close_code = worker->conf->apps[peer->app_i]
+        .endpoints[peer->endpoint_i].backpressure_close_code;
+    buf[0] = 0x88;
+    buf[1] = 0x02;
+    buf[2] = close_code >> 8;
+    buf[3] = close_code;
+    return (struct rs_wsframe_sc_small *) buf;
+}
+
+rs_ret start_backpressure_close(
+    struct rs_worker * worker,
+    union rs_peer * peer
+) {
+    // Free whichever continuation data is about to be overwritten by
+    // .close_frame (see union rs_peer in rs_worker.h).
+    if (peer->continuation == RS_CONT_PARSING) {
+        RS_FREE(peer->ws.storage);
+    } else if (peer->continuation == RS_CONT_SENDING) {
+        RS_FREE(peer->ws.pong_response);
+    }
+    peer->ws.close_frame = RS_WSFRAME_CLOSE_BACKPRESSURE;
+    peer->mortality = RS_MORTALITY_SHUTDOWN_WRITE;
+    peer->continuation = RS_CONT_SENDING;
+    // A peer that can't keep up may well not read the Close frame either, so
+    // don't wait for it any longer than for the peer's Close frame reply.
+    return set_shutdown_deadline(worker, peer, worker->conf->shutdown_wait_ws);
 }
 
 rs_ret handle_websocket_io(
@@ -578,8 +693,7 @@ rs_ret handle_websocket_io(
         if (peer->continuation == RS_CONT_SENDING) {
             write_ws_close_msg:
             switch (write_websocket_control_frame(worker, peer,
-                (struct rs_wsframe_sc_small *)
-                close_frames[RS_BOUNDS(0, peer->ws.close_frame, 3)])) {
+                get_close_frame(worker, peer, (uint8_t [4]){0}))) {
             case RS_OK:
                 peer->continuation = RS_CONT_NONE;
                 break;
@@ -592,7 +706,8 @@ rs_ret handle_websocket_io(
                 return RS_FATAL;
             }
         }
-        set_shutdown_deadline(peer, worker->conf->shutdown_wait_ws);
+        RS_GUARD(set_shutdown_deadline(worker, peer,
+            worker->conf->shutdown_wait_ws));
         // Fall through
     default:
         terminate_ws:
@@ -621,6 +736,8 @@ rs_ret handle_websocket_io(
                     peer->continuation = RS_CONT_SENDING;
                     goto write_ws_close_msg;
                 }
+                RS_METRICS_ADD(worker->metrics->close_c_by_reason[
+                    RS_CLOSE_REASON_HANGUP], 1);
                 peer->mortality = RS_MORTALITY_DEAD;
                 goto terminate_ws;
             case RS_FATAL: default:
@@ -640,6 +757,8 @@ rs_ret handle_websocket_io(
                 case RS_CLOSE_PEER:
                     RS_GUARD(send_close_to_app(worker, peer, peer_i));
                     remove_pending_owrefs(worker, peer, peer_i);
+                    RS_METRICS_ADD(worker->metrics->close_c_by_reason[
+                        RS_CLOSE_REASON_HANGUP], 1);
                     peer->mortality = RS_MORTALITY_DEAD;
                     goto terminate_ws;
                 case RS_FATAL: default:
@@ -653,6 +772,8 @@ rs_ret handle_websocket_io(
                 return RS_OK;
             case RS_CLOSE_PEER:
                 remove_pending_owrefs(worker, peer, peer_i);
+                RS_METRICS_ADD(worker->metrics->close_c_by_reason[
+                    RS_CLOSE_REASON_HANGUP], 1);
                 peer->mortality = RS_MORTALITY_DEAD;
                 goto terminate_ws;
             case RS_FATAL: default:
@@ -10,3 +10,12 @@ rs_ret handle_websocket_io(
     union rs_peer * peer,
     uint32_t peer_i
 );
+
+// Prepare the closing handshake with a peer whose pending messages exceeded its
+// endpoint's backpressure limits (see rs_from_app.c), to be initiated by the
+// caller through handle_peer_events(). The app must already have been notified
+// of the closure, and all pending owrefs of the peer must have been removed.
+rs_ret start_backpressure_close(
+    struct rs_worker * worker,
+    union rs_peer * peer
+);
@@ -1,20 +1,21 @@
 // SPDX-License-Identifier: MIT
 // Copyright © 2019 William Budd
 
+#include "rs_deflate.h" // init_deflate_state()
 #include "rs_event.h" // loop_over_events()
 #include "rs_from_app.h" // get_outbound_readers(), init_owrefs()
-#include "rs_hash.h" // init_hash_state()
 #include "rs_slot.h" // init_slots()
 #include "rs_tls.h" // create_tls_contexts()
 #include "rs_to_app.h" // init_inbound_rings()
+#include "rs_uring.h" // loop_over_uring_events()
 #include "rs_worker.h"
 
 static rs_ret init_ring_update_queue(
     struct rs_worker * worker
 ) {
-    worker->ring_queue.size = worker->conf->update_queue_size;
-    RS_CALLOC(worker->ring_queue.updates, worker->ring_queue.size);
-    return RS_OK;
+    return rs_init_ring_queue(&worker->ring_queue,
+        worker->conf->update_queue_size, worker->conf->app_c,
+        worker->conf->ring_ordering);
 }
 
 static rs_ret init_peers_array(
@@ -39,21 +40,40 @@ static rs_ret init_rbuf(
     return RS_OK;
 }
 
+static void init_metrics(
+    struct rs_worker * worker
+) {
+    worker->metrics =
+        rs_get_worker_metrics(worker->metrics_head, worker->worker_i);
+    // This worker's ring pairs are adjacent: see ringsocket_metrics.h
+    worker->ring_metrics =
+        rs_get_ring_pair_metrics(worker->metrics_head, worker->worker_i, 0);
+    worker->latencies =
+        rs_get_pair_latency(worker->metrics_head, worker->worker_i, 0);
+}
+
 static rs_ret _work(
     struct rs_worker * worker
 ) {
     // Thread ID used as prefix by RS_LOG(): see ringsocket_api.h.
-    sprintf(_rs_thread_id_str, "Worker#%zu: ", worker->worker_i + 1);
+    snprintf(_rs_thread_id_str, RS_THREAD_ID_MAX_STRLEN + 1, "Worker#%zu: ",
+        worker->worker_i + 1);
 
+    init_metrics(worker);
     RS_GUARD(init_inbound_producers(worker)); // rs_to_app.c
     RS_GUARD(init_ring_update_queue(worker));
     RS_GUARD(init_peers_array(worker));
     RS_GUARD(init_rbuf(worker));
-    RS_GUARD(init_hash_state(worker)); // rs_hash.c
+    RS_GUARD(init_deflate_state(worker)); // rs_deflate.c
     RS_GUARD(create_tls_contexts(worker)); // rs_tls.c
     RS_GUARD(get_outbound_consumers_from_producers(worker)); // rs_from_app.c
     RS_GUARD(init_owrefs(worker)); // rs_from_app.c
+    rs_init_spin(&worker->spin, worker->conf->busy_poll_microsec,
+        worker->conf->busy_poll_hint); // ringsocket_queue.h
 
+    if (worker->conf->event_loop == RS_EVENT_LOOP_IO_URING) {
+        return loop_over_uring_events(worker); // rs_uring.c
+    }
     return loop_over_events(worker); // rs_event.c
 }
 
@@ -70,6 +90,8 @@ int work(
         .sleep_state = worker_args->sleep_state,
         .app_sleep_states = worker_args->app_sleep_states,
         .eventfd = worker_args->eventfd,
+        .tls_shared = worker_args->tls_shared,
+        .metrics_head = worker_args->metrics_head,
         .worker_i = worker_args->worker_i,
 
         // Defined in ringsocket_wsframe.h. Used by rs_websocket.c.
@@ -95,6 +117,9 @@ rs_ret enqueue_ring_update(
 rs_ret flush_ring_updates(
     struct rs_worker * worker
 ) {
+    // Called once per event loop iteration, which is as good a time as any.
+    rs_publish_thread_metrics(&worker->metrics->thread, &worker->ring_queue,
+        &worker->spin);
     return rs_flush_ring_updates(&worker->ring_queue, worker->ring_pairs,
         worker->app_sleep_states, NULL, worker->conf->app_c);
 }
@@ -34,19 +34,35 @@ struct rs_worker_args {
     struct rs_sleep_state * app_sleep_states; // See ringsocket_queue.h
     struct rs_sleep_state * sleep_state; // See ringsocket_queue.h
     int eventfd;
+
+    // TLS session resumption state shared by all workers (NULL if disabled)
+    struct rs_tls_shared * tls_shared; // See rs_tls.c
+
+    struct rs_metrics_head * metrics_head; // See ringsocket_metrics.h
     
     size_t worker_i;
 };
 
 struct rs_worker {
-    // These 6 members remain indentical to the ones in struct rs_worker_args.
+    // These 8 members remain indentical to the ones in struct rs_worker_args.
     struct rs_conf const * const conf;
     struct rs_ring_pair * * const ring_pairs;
     struct rs_sleep_state * const sleep_state;
     struct rs_sleep_state * const app_sleep_states;
     int const eventfd;
+    struct rs_tls_shared * const tls_shared;
+    struct rs_metrics_head * const metrics_head;
     size_t worker_i;
 
+    // This worker's counters, and its app_c length array of ring pair counters
+    // (see ringsocket_metrics.h)
+    struct rs_worker_metrics * metrics;
+    struct rs_ring_pair_metrics * ring_metrics;
+    // Likewise, unless "latency_histograms" is disabled, in which case NULL
+    struct rs_pair_latency * latencies;
+    // The time of the latest WebSocket read() if latencies isn't NULL
+    uint64_t read_time_ns;
+
     struct rs_ring_queue ring_queue; // See ringsocket_queue.h
     struct rs_ring_producer * inbound_producers; // See ringsocket_ring.h
 
@@ -56,6 +72,25 @@ struct rs_worker {
         size_t i; // The lowest slot index that _could_ be empty
     } peer_slots;
 
+    struct rs_timer_wheel { // For rs_timer.[c|h] usage only
+        struct rs_timer_slot * slots; // Array of RS_TIMER_SLOT_C slots
+        uint64_t tick; // The most recent tick of which the slot was expired
+        size_t timer_c; // Total number of timers pending across all slots
+        int timerfd; // Armed only while timer_c > 0
+    } timer_wheel;
+
+    // NULL unless "event_loop" is set to "io_uring" (see rs_uring.c)
+    struct rs_uring * uring;
+
+    // Busy polling state (see ringsocket_queue.h), and whether the event loop
+    // is in the middle of busy polling (see busy_poll() in rs_event.c)
+    struct rs_spin spin;
+    bool is_spinning;
+
+    // NULL unless any endpoint has "permessage_deflate" enabled (see
+    // rs_deflate.c)
+    struct rs_deflate * deflate;
+
     union rs_peer * peers; // See union definition below
     uint32_t peers_elem_c;
     // Prevents looping over the entire array when targeting all connected peers
@@ -63,19 +98,26 @@ struct rs_worker {
 
     uint8_t * rbuf; // Read buffer for read_tcp()/read_tls()
 
-    // These 3 are used exclusively by rs_hash.c for HTTP Upgrade key hashing.
-    EVP_MD_CTX * sha1_ctx;
-    BIO * base64_bio;
-    BUF_MEM * base64_buf;
-
-    SSL_CTX * * tls_ctxs; // Used exclusively by rs_tls.c
+    // These 2 are used exclusively by rs_tls.c
+    SSL_CTX * * tls_ctxs;
+    struct rs_tls_ticket_key * tls_ticket_keys; // NULL if tickets are disabled
 
     // The remaining members are used exclusively by rs_from_app.c
     struct rs_ring_consumer * outbound_consumers;
     struct rs_owref * owrefs; // See struct definition below
     size_t owrefs_elem_c;
     size_t newest_owref_i;
+    // The message receive_from_app() is in the middle of, if any, which owrefs
+    // released in the meantime must not let its app's ring be read past.
+    struct rs_newest_msg const * newest_msg; // See rs_from_app.c
     size_t * oldest_owref_i_by_app;
+    struct rs_owref_queue * owref_queues; // See struct definition below
+    // Coalescing buffer for batched SSL_write_ex()s of multiple owref frames,
+    // and the number of frames of each TLS peer's batch pending retry (because
+    // OpenSSL requires retries to be called with the same data). Both NULL if
+    // no TLS certificates are configured.
+    uint8_t * tls_wbuf;
+    uint16_t * tls_batch_c_by_peer;
 
     // Defined in ringsocket_wsframe.h. Used by rs_websocket.c to buffer pongs.
     struct rs_wsframe_sc_pong pong_response;
@@ -141,7 +183,7 @@ union rs_peer {
             size_t old_wsize;
         };
         // 3rd and 4th 64-bit blocks
-        uint16_t shutdown_deadline;
+        uint16_t shutdown_deadline; // Tick digest: see rs_timer.c
         uint8_t layer_specific_data[14]; // Allow memset()ting layer data to 0.
     };
 
@@ -177,7 +219,11 @@ union rs_peer {
         uint16_t:16; // Pad past .shutdown_deadline of the shared struct above;
         // owref: "Outbound Write REFerence" (see struct rs_owref below)
         uint16_t owref_c; // Pending outbound write count (see rs_from_app.c)
-        uint32_t owref_i; // This peer's lowest index among worker->owrefs
+        // Start of this peer's queue of owref indices (whose length is at most
+        // 0x10000, given that .owref_c never exceeds UINT16_MAX).
+        uint16_t owref_head_i;
+        uint8_t is_deflating; // boolean: permessage-deflate (see rs_deflate.c)
+        uint8_t is_paused; // boolean: "backpressure_policy" (see rs_from_app.c)
 
         // 4th (max-)64-bit block
         union {
@@ -231,11 +277,29 @@ enum rs_continuation {
 // been (fully) sent yet. (Only applicable when peer layer == LAYER_WEBSOCKET.)
 struct rs_owref {
     struct rs_consumer_msg * cmsg;
+    // A permessage-deflate compressed copy of the cmsg frame, allocated only if
+    // any peer for which .is_deflating is true is among the recipients.
+    struct rs_deflated_frame * deflated; // See rs_from_app.c
     uint32_t remaining_recipient_c;
     uint16_t head_size;
     uint16_t app_i;
 };
 
+// Circular FIFO queue of the worker->owrefs indices of all messages pending for
+// a given peer, in order of arrival, which makes finding a peer's next pending
+// message an O(1) operation. Kept out of line (as worker->owref_queues indexed
+// by peer_i) to preserve the 32 byte size of union rs_peer: the queue's oldest
+// element is at .owref_is[peer->ws.owref_head_i], and its length equals
+// peer->ws.owref_c.
+struct rs_owref_queue {
+    uint32_t * owref_is;
+    uint32_t elem_c; // Always a power of 2, or 0 until first needed
+    uint32_t:32;
+    // The combined size of the frames of all queued owrefs, as limited by the
+    // peer's endpoint's "max_queued_byte_c"
+    uint64_t byte_c;
+};
+
 // rs_worker.c prototypes
 
 int work(
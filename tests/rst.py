@@ -8,6 +8,7 @@ TEST_PATH = "/tmp/rst"
 SHAM_IO = "rst_preload_sham_io.so"
 
 CLIENT_ECHO = "rst_client_echo"
+CLIENT_LOAD = "rst_client_load"
 CLIENT_BROWSER = "rst_client.html"
 CLIENT_BROWSER_DST = "/tmp/rs.html"
 
@@ -103,6 +104,45 @@ def launchClientEcho(log_level, port, app_c, client_c):
     print(f"Echo client launched with {client_c} clients for each of "
           f"{app_c} backend stress test apps.")
 
+def launchClientLoad(log_level, port, client_c):
+    time.sleep(1)
+    shutil.copy2(CLIENT_LOAD, f"{TEST_PATH}")
+    path = pathlib.Path(f"{TEST_PATH}/{CLIENT_LOAD}.json")
+    echo_url = f"ws://localhost:{port}/echo"
+    conf = {
+        "log_level": log_level,
+        "thread_c": 4,
+        "source_addr_c": 16,
+        # Room for the largest messages rst_app_stress may send
+        "rwbuf_size": 20000000,
+        "scenarios": [{
+            "name": "echo_closed_loop",
+            "url": echo_url,
+            "client_c": client_c
+        }, {
+            "name": "echo_open_loop_mixed",
+            "url": echo_url,
+            "client_c": client_c,
+            "msg_rate": 10,
+            "msg_sizes": [
+                {"size": 64, "weight": 90},
+                {"size": 1024, "weight": 9},
+                {"size": 65536, "weight": 1}
+            ]
+        }, {
+            # Must come last, because the stress app treats any connection
+            # closed by the client side as fatal.
+            "name": "stress_bounce",
+            "url": f"ws://localhost:{port}/stress1",
+            "mode": "bounce",
+            "client_c": client_c
+        }]
+    }
+    path.write_text(json.dumps(conf, indent=1) + '\n')
+    out = subprocess.run([f"{TEST_PATH}/{CLIENT_LOAD}",
+        f"{TEST_PATH}/{CLIENT_LOAD}.json"])
+    out.check_returncode()
+
 def launchClientBrowser(port):
     with open(CLIENT_BROWSER, "r") as f:
         client_html = f.read()
@@ -153,6 +193,9 @@ def main():
                "\"stress\": Stress test RingSocket's concurrent IO handling "
                            "accross multiple backend app's by bouncing off "
                            "rs_echo_client.\n"
+               "\"load\": Measure throughput and round trip latency "
+                         "percentiles of the echo and stress backend apps "
+                         "across many connections with rst_client_load.\n"
                "\"browser\": Interactively spawn WebSocket clients from a "
                             "browser to test RingSocket's IO handling.\n"
                "\"autobahn\": Test RingSocket's conformance to every aspect of "
@@ -160,7 +203,7 @@ def main():
                              "a fuzzing client provided by crossbar.io's "
                              "autobahn-testsuite. Requires docker.")
     argp.add_argument("test",
-        choices=("stress", "browser", "autobahn"),
+        choices=("stress", "load", "browser", "autobahn"),
         help="test to perform: see below.")
     argp.add_argument("--log",
         choices=("debug", "info", "notice", "warning", "error"),
@@ -185,8 +228,9 @@ def main():
              "deploy. Default: 1")
     argp.add_argument("--client_c",
         type=int, choices=range(1, 65535), metavar="[1-65535]",
-        help="Stress test only: the number of echo clients to deploy per "
-             "stress test backend app. Default: 1")
+        help="Stress test: the number of echo clients to deploy per "
+             "stress test backend app. Default: 1. Load test: the number of "
+             "connections per scenario. Default: 10000")
     
     if len(sys.argv) < 2:
         argp.print_help()
@@ -207,18 +251,27 @@ def main():
             args.app_c = 1
         if not args.client_c:
             args.client_c = 1
+    elif args.test == "load":
+        if args.app_c:
+            argp.error('--app_c can only be set for mode "stress".')
+        args.app_c = 1
+        if not args.client_c:
+            args.client_c = 10000
     else:
         if args.app_c:
             parser.error('--app_c can only be set for mode "stress".')
         if args.client_c:
-            parser.error('--client_c can only be set for mode "stress".')
+            parser.error('--client_c can only be set for modes "stress" and '
+                '"load".')
         args.app_c = 0
         args.client_c = 0
     
-    launchRingSocket(args.log, args.port, args.sham_io, args.test == "autobahn",
-        args.worker_c, args.app_c)
+    launchRingSocket(args.log, args.port, args.sham_io,
+        args.test in ("autobahn", "load"), args.worker_c, args.app_c)
     if args.test == "stress":
         launchClientEcho(args.log, args.port, args.app_c, args.client_c)
+    elif args.test == "load":
+        launchClientLoad(args.log, args.port, args.client_c)
     elif args.test == "browser":
         launchClientBrowser(args.port)
     else:
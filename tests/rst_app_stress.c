@@ -6,7 +6,7 @@
 #include <ringsocket.h>
 #include <stdio.h> // sprintf
 
-#define RST_MAX_CLIENT_C 1000
+#define RST_MAX_CLIENT_C 0x10000 // As many as rst_client_load might open
 #define RST_MAX_SIMUL_MSG_PER_CLIENT_C 3
 #define RST_MAX_MSG_CONTENT_SIZE 0x800000 // 8 MB
 #define RST_MAX_SIMUL_TOTAL_MSG_BYTE_C 0x4000000 // 64 MB
@@ -269,7 +269,6 @@ rst_ret read_cb(
             return RST_FATAL;
         }
     }
-    }
     // rs_to_every*() calls may cause worker threads to include new recipients
     // for which open_cb() has not been called yet. In that case, the
     // corresponding echo responses from those new clients obviously do not have
@@ -306,7 +305,7 @@ rst_ret read_cb(
         content_size, msg_id, client->port, s->total_msg_byte_c);
     if (s->is_read_only_phase) {
         if (s->total_msg_byte_c) {
-            return RS_OK;
+            return RST_OK;
         }
         RS_LOG(LOG_INFO, "Received and verified echo responses to every "
             "message sent. Re-enabling message writing.");
@@ -0,0 +1,326 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+// This program checks that the outbound ring updates of rs_from_app.c never let
+// an app overwrite messages that are still pending for some peer, in the event
+// that backpressure handling releases an app's only owref while the worker is
+// in the middle of processing that app's next message: the read position can't
+// be published up to the ring reader then, because that already points past
+// the message being processed, which may yet need to be queued too. It plays
+// the parts of both an app thread writing to its outbound ring, and of the
+// peers to which the worker thread writes; doing so for each of these cases:
+// * A peer with a "drop_oldest" backpressure policy is the only recipient of
+//   the app's only owref, which gets dropped to make room for queueing the
+//   broadcast that follows it.
+// * A peer with a "disconnect" backpressure policy is the only recipient of the
+//   app's only owref, which gets removed as a result of exceeding its limits
+//   with a broadcast that another peer then needs to queue.
+// Both end with the read position being published up to the end of the ring
+// once every peer's pending messages have been written out.
+//
+// The rs_from_app.c source file is included directly, such that the worker
+// functions it calls can be replaced with the stubs below; which is why this
+// program needs to be compiled with RingSocket's src directory on the include
+// path.
+//
+// Usage: rst_backpressure
+//
+// The exit status is EXIT_FAILURE if any check fails.
+
+#include "../src/rs_from_app.c"
+
+#include <stdio.h> // printf()
+
+#define RST_RING_SIZE 0x100
+#define RST_PEER_C 2
+
+RS_LOG_VARS; // See the RS_LOG() section in ringsocket_api.h for explanation.
+
+// The latest read position the worker published through enqueue_ring_update()
+static uint8_t const * published_r = NULL;
+
+// #############################################################################
+// # Stubs of the worker functions called by rs_from_app.c #####################
+
+rs_ret write_tcp(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    void const * wbuf,
+    size_t wbuf_size
+) {
+    (void) worker;
+    (void) peer;
+    (void) wbuf;
+    (void) wbuf_size;
+    // Every peer's socket buffer is full until send_pending_owrefs() is called.
+    return RS_AGAIN;
+}
+
+rs_ret write_tcp_vector(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    struct iovec * iov,
+    int iov_c
+) {
+    (void) worker;
+    (void) peer;
+    (void) iov;
+    (void) iov_c;
+    return RS_OK;
+}
+
+rs_ret write_tls(
+    struct rs_worker * worker,
+    union rs_peer * peer,
+    void const * wbuf,
+    size_t wbuf_size
+) {
+    (void) worker;
+    (void) peer;
+    (void) wbuf;
+    (void) wbuf_size;
+    return RS_FATAL; // No peer is encrypted
+}
+
+rs_ret deflate_outbound_frame(
+    struct rs_worker * worker,
+    size_t app_i,
+    union rs_wsframe const * frame,
+    union rs_wsframe * * deflated_frame,
+    uint64_t * deflated_frame_size
+) {
+    (void) worker;
+    (void) app_i;
+    (void) frame;
+    (void) deflated_frame;
+    (void) deflated_frame_size;
+    return RS_FATAL; // No peer is deflating
+}
+
+rs_ret handle_peer_events(
+    struct rs_worker * worker,
+    uint32_t peer_i,
+    uint32_t events
+) {
+    (void) worker;
+    (void) peer_i;
+    (void) events;
+    return RS_OK;
+}
+
+rs_ret send_close_to_app(
+    struct rs_worker * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i
+) {
+    (void) worker;
+    (void) peer;
+    (void) peer_i;
+    return RS_OK;
+}
+
+rs_ret send_pause_to_app(
+    struct rs_worker * worker,
+    union rs_peer const * peer,
+    uint32_t peer_i
+) {
+    (void) worker;
+    (void) peer;
+    (void) peer_i;
+    return RS_OK;
+}
+
+rs_ret start_backpressure_close(
+    struct rs_worker * worker,
+    union rs_peer * peer
+) {
+    (void) worker;
+    peer->mortality = RS_MORTALITY_SHUTDOWN_WRITE;
+    return RS_OK;
+}
+
+rs_ret enqueue_ring_update(
+    struct rs_worker * worker,
+    uint8_t * new_ring_position,
+    size_t app_thread_i,
+    bool is_write
+) {
+    (void) worker;
+    (void) app_thread_i;
+    (void) is_write;
+    published_r = new_ring_position;
+    return RS_OK;
+}
+
+char * get_addr_str(
+    union rs_peer const * peer
+) {
+    (void) peer;
+    return "(test peer)";
+}
+
+void move_left(
+    void * dst,
+    size_t offset,
+    size_t size
+) {
+    memmove(dst, (uint8_t *) dst + offset, size);
+}
+
+// #############################################################################
+// # Test cases ################################################################
+
+struct rst_check {
+    struct rs_ring_pair * pair;
+    uint8_t * w;
+    size_t fail_c;
+};
+
+static void check(
+    struct rst_check * c,
+    bool is_ok,
+    char const * description
+) {
+    if (!is_ok) {
+        printf("FAILED: %s\n", description);
+        c->fail_c++;
+    }
+}
+
+// Append an outbound message of the given kind holding a small binary frame to
+// the ring, where peer_i is only written for RS_OUTBOUND_SINGLE.
+static void produce(
+    struct rst_check * c,
+    enum rs_outbound_kind kind,
+    uint32_t peer_i
+) {
+    uint8_t const frame[] = {0x82, 0x02, 'h', 'i'};
+    uint64_t size = 1 + sizeof(frame) + 4 * (kind == RS_OUTBOUND_SINGLE);
+    memcpy(c->w, &size, 8);
+    c->w += 8;
+    *c->w++ = kind;
+    if (kind == RS_OUTBOUND_SINGLE) {
+        memcpy(c->w, &peer_i, 4);
+        c->w += 4;
+    }
+    memcpy(c->w, frame, sizeof(frame));
+    c->w += sizeof(frame);
+    atomic_store_explicit(&c->pair->outbound_ring.w, (uintptr_t) c->w,
+        memory_order_release);
+}
+
+// Check that the published read position doesn't exceed the message of any
+// owref still pending.
+static void check_pending_owrefs(
+    struct rst_check * c,
+    struct rs_worker const * worker
+) {
+    size_t pending_c = 0;
+    for (size_t i = 0; i < worker->owrefs_elem_c; i++) {
+        struct rs_owref const * owref = worker->owrefs + i;
+        if (owref->remaining_recipient_c) {
+            pending_c++;
+            check(c, published_r <= (uint8_t const *) owref->cmsg,
+                "publishing no read position past any pending message");
+        }
+    }
+    check(c, pending_c == 1, "queueing the broadcast");
+}
+
+static void check_case(
+    struct rst_check * c,
+    uint8_t policy
+) {
+    printf("Releasing the only owref with backpressure policy %s\n",
+        policy == RS_BACKPRESSURE_DROP_OLDEST ? "drop_oldest" : "disconnect");
+    struct rs_conf_endpoint endpoints[RST_PEER_C] = {
+        {
+            .max_queued_byte_c = 0x1000,
+            .max_queued_msg_c = 1,
+            .backpressure_policy = policy
+        }, {
+            .max_queued_byte_c = 0x1000,
+            .max_queued_msg_c = 0x100,
+            .backpressure_policy = RS_BACKPRESSURE_DROP_NEWEST
+        }
+    };
+    struct rs_conf_app app = {.endpoints = endpoints};
+    struct rs_conf conf = {
+        .apps = &app,
+        .realloc_multiplier = 1.5,
+        .owrefs_elem_c = 4,
+        .app_c = 1
+    };
+    alignas(8) uint8_t ring[RST_RING_SIZE] = {0};
+    struct rs_ring_pair pair = {0};
+    atomic_init(&pair.outbound_ring.w, (uintptr_t) ring);
+    atomic_init(&pair.outbound_ring.r, (uintptr_t) ring);
+    struct rs_ring_pair * pairs = &pair;
+    struct rs_worker_metrics metrics = {0};
+    struct rs_ring_pair_metrics ring_metrics = {0};
+    union rs_peer peers[RST_PEER_C] = {0};
+    for (size_t i = 0; i < RST_PEER_C; i++) {
+        peers[i].layer = RS_LAYER_WEBSOCKET;
+        peers[i].endpoint_i = i;
+    }
+    // In the disconnect case, the 2nd peer is the one that needs to queue the
+    // broadcast, by being in the middle of parsing a message of its own.
+    bool const is_disconnect = policy == RS_BACKPRESSURE_DISCONNECT;
+    if (is_disconnect) {
+        peers[1].continuation = RS_CONT_PARSING;
+    }
+    struct rs_worker worker = {
+        .conf = &conf,
+        .ring_pairs = &pairs,
+        .metrics = &metrics,
+        .ring_metrics = &ring_metrics,
+        .peers = peers,
+        .peers_elem_c = RST_PEER_C,
+        .highest_peer_i = is_disconnect
+    };
+    if (get_outbound_consumers_from_producers(&worker) != RS_OK ||
+        init_owrefs(&worker) != RS_OK) {
+        check(c, false, "initializing the worker");
+        return;
+    }
+    c->pair = &pair;
+    c->w = ring;
+    published_r = NULL;
+
+    // Leave the 1st peer with the app's only owref pending
+    produce(c, RS_OUTBOUND_SINGLE, 0);
+    check(c, receive_from_app(&worker) == RS_OK, "receiving the 1st message");
+    check(c, peers[0].ws.owref_c == 1, "queueing the 1st message");
+    check(c, !published_r, "publishing nothing while it's pending");
+
+    // Let the broadcast release that owref, and then be queued itself
+    produce(c, RS_OUTBOUND_EVERY, 0);
+    check(c, receive_from_app(&worker) == RS_OK, "receiving the broadcast");
+    check(c, published_r, "publishing the released owref's message");
+    check_pending_owrefs(c, &worker);
+
+    // Write out the broadcast, after which everything can be published.
+    uint32_t const peer_i = is_disconnect;
+    peers[peer_i].continuation = RS_CONT_NONE;
+    check(c, send_pending_owrefs(&worker, peers + peer_i, peer_i) == RS_OK,
+        "sending the broadcast");
+    check(c, published_r == c->w, "publishing the end of the ring");
+
+    for (size_t i = 0; i < RST_PEER_C; i++) {
+        RS_FREE(worker.owref_queues[i].owref_is);
+    }
+    RS_FREE(worker.owref_queues);
+    RS_FREE(worker.oldest_owref_i_by_app);
+    RS_FREE(worker.owrefs);
+    RS_FREE(worker.outbound_consumers);
+}
+
+int main(
+    void
+) {
+    struct rst_check c = {0};
+    check_case(&c, RS_BACKPRESSURE_DROP_OLDEST);
+    check_case(&c, RS_BACKPRESSURE_DISCONNECT);
+    printf("%zu check(s) failed\n", c.fail_c);
+    return c.fail_c ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+// This program micro-benchmarks the Sec-WebSocket-Accept key hashing of
+// rs_hash.c against the generic OpenSSL EVP digest and BIO base64 path that it
+// replaced, after first verifying that both yield identical results for a set
+// of pseudo-random keys. The rs_hash.c source file is included directly, such
+// that its static functions are available here too; which is why this program
+// needs to be compiled with RingSocket's src directory on the include path.
+
+#define _POSIX_C_SOURCE 201112L // clock_gettime(), CLOCK_MONOTONIC
+
+#include "../src/rs_hash.c"
+
+#include <stdio.h> // printf()
+#include <stdlib.h> // rand(), srand()
+#include <time.h> // clock_gettime()
+
+#define RST_KEY_C 1024
+#define RST_ROUND_C 1000 // Hash each of the RST_KEY_C keys this many times
+
+RS_LOG_VARS; // See the RS_LOG() section in ringsocket_api.h for explanation.
+
+struct rst_evp_state {
+    EVP_MD_CTX * sha1_ctx;
+    BIO * base64_bio;
+    BUF_MEM * base64_buf;
+};
+
+static rs_ret init_evp_state(
+    struct rst_evp_state * evp
+) {
+    evp->sha1_ctx = EVP_MD_CTX_new();
+    evp->base64_bio = BIO_new(BIO_f_base64());
+    BIO * mem_bio = BIO_new(BIO_s_mem());
+    if (!evp->sha1_ctx || !evp->base64_bio || !mem_bio) {
+        printf("Failed to initialize the OpenSSL EVP/BIO state\n");
+        return RS_FATAL;
+    }
+    BIO_get_mem_ptr(mem_bio, &evp->base64_buf);
+    BIO_push(evp->base64_bio, mem_bio);
+    return RS_OK;
+}
+
+// The implementation of get_websocket_key_hash() prior to rs_hash.c's own.
+static rs_ret get_evp_websocket_key_hash(
+    struct rst_evp_state * evp,
+    char const * wskey_22str,
+    char * dst_27str
+) {
+    char token_str[] = "1234567890123456789012=="
+        "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    memcpy(token_str, wskey_22str, 22);
+    uint8_t hash[20] = {0};
+    if (!EVP_DigestInit_ex(evp->sha1_ctx, EVP_sha1(), NULL) ||
+        !EVP_DigestUpdate(evp->sha1_ctx, token_str,
+        RS_CONST_STRLEN(token_str)) ||
+        !EVP_DigestFinal_ex(evp->sha1_ctx, hash, NULL)) {
+        printf("Unsuccessful EVP_Digest*() call\n");
+        return RS_FATAL;
+    }
+    BIO_write(evp->base64_bio, hash, 20);
+    (void) BIO_flush(evp->base64_bio);
+    if (evp->base64_buf->length < 28) {
+        printf("Unexpected base64 length: %zu\n", evp->base64_buf->length);
+        return RS_FATAL;
+    }
+    memcpy(dst_27str, evp->base64_buf->data, 27);
+    (void) BIO_reset(evp->base64_bio);
+    return RS_OK;
+}
+
+static double get_elapsed_ns(
+    struct timespec const * start
+) {
+    struct timespec end = {0};
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 +
+        (end.tv_nsec - start->tv_nsec);
+}
+
+static rs_ret verify(
+    struct rst_evp_state * evp,
+    char (* keys)[22]
+) {
+    for (size_t i = 0; i < RST_KEY_C; i++) {
+        char expected[27] = {0};
+        char actual[27] = {0};
+        RS_GUARD(get_evp_websocket_key_hash(evp, keys[i], expected));
+        get_websocket_key_hash(keys[i], actual);
+        if (memcmp(expected, actual, 27)) {
+            printf("Mismatch for key %.22s==: expected %.27s=, got %.27s=\n",
+                keys[i], expected, actual);
+            return RS_FATAL;
+        }
+    }
+    return RS_OK;
+}
+
+static rs_ret benchmark(
+    struct rst_evp_state * evp,
+    char (* keys)[22]
+) {
+    char dst[27] = {0};
+    struct timespec start = {0};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t round = 0; round < RST_ROUND_C; round++) {
+        for (size_t i = 0; i < RST_KEY_C; i++) {
+            RS_GUARD(get_evp_websocket_key_hash(evp, keys[i], dst));
+        }
+    }
+    double const evp_ns = get_elapsed_ns(&start) / (RST_ROUND_C * RST_KEY_C);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t round = 0; round < RST_ROUND_C; round++) {
+        for (size_t i = 0; i < RST_KEY_C; i++) {
+            get_websocket_key_hash(keys[i], dst);
+            // Prevent the compiler from hoisting anything out of the loop.
+            __asm__ volatile("" : : "r" (dst) : "memory");
+        }
+    }
+    double const rs_ns = get_elapsed_ns(&start) / (RST_ROUND_C * RST_KEY_C);
+    printf("%-8s: %7.1f ns per key\n", "EVP/BIO", evp_ns);
+    printf("%-8s: %7.1f ns per key (%.1fx)\n",
+        sha_ni_is_supported ? "SHA-NI" : "scalar", rs_ns, evp_ns / rs_ns);
+    return RS_OK;
+}
+
+int main(
+    void
+) {
+    static char const chars[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    static char keys[RST_KEY_C][22];
+    srand(time(NULL));
+    for (size_t i = 0; i < RST_KEY_C; i++) {
+        for (size_t j = 0; j < 22; j++) {
+            keys[i][j] = chars[rand() % 64];
+        }
+    }
+    struct rst_evp_state evp = {0};
+    if (init_evp_state(&evp) != RS_OK) {
+        return EXIT_FAILURE;
+    }
+    detect_sha1_support();
+    bool const has_sha_ni = sha_ni_is_supported;
+    // Verify and benchmark the scalar variant, followed by the SHA-NI variant
+    // if available.
+    sha_ni_is_supported = false;
+    if (verify(&evp, keys) != RS_OK || benchmark(&evp, keys) != RS_OK) {
+        return EXIT_FAILURE;
+    }
+    if (has_sha_ni) {
+        sha_ni_is_supported = true;
+        if (verify(&evp, keys) != RS_OK || benchmark(&evp, keys) != RS_OK) {
+            return EXIT_FAILURE;
+        }
+    }
+    printf("All %d keys hashed identically by each variant.\n", RST_KEY_C);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,260 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+// This program benchmarks both "ring_ordering" modes of ringsocket_queue.h
+// against each other: "delayed", where ring pointer updates are stored with
+// memory_order_relaxed after being delayed by an update queue; and
+// "acquire_release", where they are stored immediately with
+// memory_order_release. A producer thread playing the part of a worker sends
+// timestamped messages through a single ring buffer to a consumer thread
+// playing the part of an app, which verifies the contents of each message
+// received and records its latency. Each mode is run in two scenarios:
+// "stream", where the producer never flushes its update queue until it's done;
+// and "batch", where it flushes after every RST_BATCH_SIZE messages, as a
+// worker does at the start of every event loop iteration. Either way the
+// producer yields its CPU after every batch, lest it laps the consumer by more
+// than a whole ring buffer when both threads share a single CPU.
+//
+// x86 CPUs never reorder stores with other stores, which makes both modes
+// behave correctly there regardless. To check either mode against the C11
+// memory model instead (i.e., as if running on a weakly ordered CPU such as
+// ARM), build the "bench_ordering_tsan" target of the Makefile in this
+// directory and run it: ThreadSanitizer then reports any message read that
+// isn't guaranteed to happen after the corresponding write, which it should
+// for "delayed" but not for "acquire_release". That build halts on the first
+// such report (because the time TSan takes to print it lets the producer lap
+// the consumer), which is why "acquire_release" is run first: a TSan run
+// exiting with a report about "delayed" is the expected outcome. Pass either
+// mode name as an argument to run only that mode.
+
+#define _GNU_SOURCE // CLOCK_MONOTONIC
+
+#include <ringsocket_queue.h>
+
+// Not C11 threads: ThreadSanitizer fails to intercept thrd_create() as of
+// glibc 2.34, which breaks "make bench_ordering_tsan".
+#include <pthread.h> // pthread_create(), pthread_join()
+#include <sched.h> // sched_yield()
+#include <stdio.h> // printf(), fflush()
+
+#define RST_MSG_C 1000000
+#define RST_MSG_SIZE 64
+#define RST_BATCH_SIZE 16
+#define RST_RING_SIZE 0x100000
+#define RST_REALLOC_MULTIPLIER 1.5
+#define RST_UPDATE_QUEUE_SIZE 5 // The default "update_queue_size"
+
+RS_LOG_VARS; // See the RS_LOG() section in ringsocket_api.h for explanation.
+
+#ifdef __SANITIZE_THREAD__ // Defined by "gcc -fsanitize=thread"
+char const * __tsan_default_options(
+    void
+) {
+    return "halt_on_error=1";
+}
+#endif
+
+struct rst_bench {
+    struct rs_ring_pair * pair;
+    struct rs_sleep_state * sleep_states; // Never asleep: no wake-ups needed
+    struct rs_ring_producer prod;
+    uint64_t * latencies;
+    size_t corrupt_c;
+    atomic_bool producer_failed;
+    rs_ret producer_ret;
+    rs_ret consumer_ret;
+    uint8_t ring_ordering; // enum rs_ring_ordering
+    bool flushes_per_batch;
+};
+
+static uint64_t get_time_ns(
+    void
+) {
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000000 * (uint64_t) ts.tv_sec + ts.tv_nsec;
+}
+
+static rs_ret _produce(
+    struct rst_bench * b
+) {
+    struct rs_ring_queue queue = {0};
+    RS_GUARD(rs_init_ring_queue(&queue, RST_UPDATE_QUEUE_SIZE, 1,
+        b->ring_ordering));
+    for (uint64_t i = 0; i < RST_MSG_C; i++) {
+        RS_GUARD(rs_produce_ring_msg(&b->pair->inbound_ring, &b->prod,
+            RST_REALLOC_MULTIPLIER, 0, RST_MSG_SIZE));
+        uint64_t const time_ns = get_time_ns();
+        memcpy(b->prod.w, &time_ns, 8);
+        memcpy(b->prod.w + 8, &i, 8);
+        memset(b->prod.w + 16, (uint8_t) i, RST_MSG_SIZE - 16);
+        b->prod.w += RST_MSG_SIZE;
+        RS_GUARD(rs_enqueue_ring_update(&queue, &b->pair, b->sleep_states,
+            NULL, b->prod.w, 0, true));
+        if (!((i + 1) % RST_BATCH_SIZE)) {
+            if (b->flushes_per_batch) {
+                RS_GUARD(rs_flush_ring_updates(&queue, &b->pair,
+                    b->sleep_states, NULL, 1));
+            }
+            sched_yield();
+        }
+    }
+    return rs_flush_ring_updates(&queue, &b->pair, b->sleep_states, NULL, 1);
+}
+
+static void * produce(
+    void * arg
+) {
+    struct rst_bench * b = arg;
+    b->producer_ret = _produce(b);
+    if (b->producer_ret != RS_OK) {
+        // Prevent the consumer from waiting forever.
+        atomic_store(&b->producer_failed, true);
+    }
+    return NULL;
+}
+
+static rs_ret _consume(
+    struct rst_bench * b
+) {
+    struct rs_ring_queue queue = {0};
+    RS_GUARD(rs_init_ring_queue(&queue, RST_UPDATE_QUEUE_SIZE, 1,
+        b->ring_ordering));
+    int const eventfds[1] = {-1}; // Never written to: see sleep_states
+    struct rs_ring_consumer cons = {.r = b->prod.ring};
+    for (uint64_t i = 0; i < RST_MSG_C;) {
+        struct rs_consumer_msg * cmsg =
+            rs_consume_ring_msg(&b->pair->inbound_ring, &cons);
+        if (!cmsg) {
+            if (atomic_load(&b->producer_failed)) {
+                return RS_FATAL;
+            }
+            // Share read progress with the producer while idle, as apps do.
+            RS_GUARD(rs_flush_ring_updates(&queue, &b->pair, b->sleep_states,
+                eventfds, 1));
+            sched_yield();
+            continue;
+        }
+        uint64_t const time_ns = get_time_ns();
+        uint64_t sent_time_ns = 0;
+        uint64_t seq = 0;
+        memcpy(&sent_time_ns, cmsg->msg, 8);
+        memcpy(&seq, cmsg->msg + 8, 8);
+        bool is_corrupt = cmsg->size != RST_MSG_SIZE || seq != i;
+        for (size_t j = 16; j < RST_MSG_SIZE && !is_corrupt; j++) {
+            is_corrupt = cmsg->msg[j] != (uint8_t) i;
+        }
+        b->corrupt_c += is_corrupt;
+        b->latencies[i++] = time_ns - sent_time_ns;
+        RS_GUARD(rs_enqueue_ring_update(&queue, &b->pair, b->sleep_states,
+            eventfds, (uint8_t *) cons.r, 0, false));
+    }
+    return RS_OK;
+}
+
+static void * consume(
+    void * arg
+) {
+    struct rst_bench * b = arg;
+    b->consumer_ret = _consume(b);
+    return NULL;
+}
+
+static int compare_latencies(
+    void const * a,
+    void const * b
+) {
+    uint64_t const la = *((uint64_t const *) a);
+    uint64_t const lb = *((uint64_t const *) b);
+    return (la > lb) - (la < lb);
+}
+
+static rs_ret run(
+    struct rst_bench * b,
+    char const * mode_name,
+    char const * scenario_name
+) {
+    b->prod = (struct rs_ring_producer){
+        .ring_size = RST_RING_SIZE,
+        .min_ring_size = RST_RING_SIZE
+    };
+    RS_CACHE_ALIGNED_CALLOC(b->prod.ring, RST_RING_SIZE);
+    b->prod.w = b->prod.ring;
+    RS_ATOMIC_STORE_RELAXED(&b->pair->inbound_ring.w,
+        (atomic_uintptr_t) b->prod.ring);
+    RS_ATOMIC_STORE_RELAXED(&b->pair->inbound_ring.r,
+        (atomic_uintptr_t) b->prod.ring);
+    b->corrupt_c = 0;
+    atomic_store(&b->producer_failed, false);
+    uint64_t const start_ns = get_time_ns();
+    b->producer_ret = RS_FATAL;
+    b->consumer_ret = RS_FATAL;
+    pthread_t producer;
+    pthread_t consumer;
+    if (pthread_create(&consumer, NULL, consume, b)) {
+        printf("Unsuccessful pthread_create(consumer)\n");
+        return RS_FATAL;
+    }
+    if (pthread_create(&producer, NULL, produce, b)) {
+        printf("Unsuccessful pthread_create(producer)\n");
+        // Prevent the consumer from waiting forever.
+        atomic_store(&b->producer_failed, true);
+        pthread_join(consumer, NULL);
+        return RS_FATAL;
+    }
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    if (b->producer_ret != RS_OK || b->consumer_ret != RS_OK) {
+        printf("Benchmark thread failure\n");
+        return RS_FATAL;
+    }
+    double const elapsed_ns = get_time_ns() - start_ns;
+    qsort(b->latencies, RST_MSG_C, sizeof(uint64_t), compare_latencies);
+    printf("%-15s %-6s: %6.2f M msgs/s; latency (ns) p50 %9" PRIu64
+        ", p99 %9" PRIu64 ", p99.9 %9" PRIu64 "; corrupt: %zu\n", mode_name,
+        scenario_name, 1e3 * RST_MSG_C / elapsed_ns,
+        b->latencies[RST_MSG_C / 2], b->latencies[RST_MSG_C * 99 / 100],
+        b->latencies[RST_MSG_C * 999 / 1000], b->corrupt_c);
+    fflush(stdout); // Lest a TSan halt (see above) discards it
+    RS_FREE(b->prod.ring);
+    RS_FREE(b->prod.prev_ring);
+    return b->corrupt_c ? RS_FATAL : RS_OK;
+}
+
+static rs_ret run_mode(
+    struct rst_bench * b,
+    uint8_t ring_ordering,
+    char const * mode_name
+) {
+    b->ring_ordering = ring_ordering;
+    b->flushes_per_batch = false;
+    RS_GUARD(run(b, mode_name, "stream"));
+    b->flushes_per_batch = true;
+    return run(b, mode_name, "batch");
+}
+
+int main(
+    int arg_c,
+    char * * args
+) {
+    struct rst_bench b = {0};
+    RS_CACHE_ALIGNED_CALLOC(b.pair, 1);
+    RS_CACHE_ALIGNED_CALLOC(b.sleep_states, 1);
+    RS_CALLOC(b.latencies, RST_MSG_C);
+    char const * only_mode = arg_c > 1 ? args[1] : NULL;
+    if (only_mode && strcmp(only_mode, "delayed") &&
+        strcmp(only_mode, "acquire_release")) {
+        printf("Usage: %s [delayed|acquire_release]\n", args[0]);
+        return EXIT_FAILURE;
+    }
+    if ((!only_mode || !strcmp(only_mode, "acquire_release")) &&
+        run_mode(&b, RS_RING_ORDERING_ACQUIRE_RELEASE, "acquire_release") !=
+        RS_OK) {
+        return EXIT_FAILURE;
+    }
+    if ((!only_mode || !strcmp(only_mode, "delayed")) &&
+        run_mode(&b, RS_RING_ORDERING_DELAYED, "delayed") != RS_OK) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,374 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+// This program verifies that every SIMD variant of the WebSocket payload
+// unmasking and UTF-8 validation of rs_simd.c that the CPU supports yields
+// results identical to those of the scalar variant, and then micro-benchmarks
+// each of those variants. The rs_simd.c source file is included directly, such
+// that its static functions and simd_level are available here too; which is
+// why this program needs to be compiled with RingSocket's src directory on the
+// include path.
+//
+// Verification covers the following, at every misalignment of the input within
+// a 64 byte block:
+// * UTF-8 edge cases, both valid ones and invalid ones: overlong encodings,
+//   surrogates, codepoints beyond U+10FFFF, stray continuation bytes, and
+//   truncated sequences; placed at every position within a vector.
+// * Pseudo-random UTF-8 strings of every length up to RST_MAX_STR_SIZE, half of
+//   which contain one of the invalid edge cases; validated both in one go and
+//   in chunks (the way partial reads of a frame payload are validated), split
+//   at every index so as to truncate multi-byte sequences at chunk boundaries.
+// * Unmasking of payloads of every length up to RST_MAX_STR_SIZE, from every
+//   start index within a 4 byte mask key, without touching surrounding bytes.
+//
+// Usage: rst_bench_simd [seed]
+//
+// The seed of the pseudo-random data is printed, so that any failure can be
+// reproduced by passing it as an argument.
+
+#define _POSIX_C_SOURCE 201112L // clock_gettime(), CLOCK_MONOTONIC
+
+#include "../src/rs_simd.c"
+
+#include <stdio.h> // printf()
+#include <stdlib.h> // rand(), srand(), strtoul()
+#include <time.h> // clock_gettime()
+
+#define RST_STR_C 512 // The number of pseudo-random UTF-8 strings to verify
+#define RST_MAX_STR_SIZE 320 // Spans several 64 byte blocks
+#define RST_MAX_OFFSET 64 // Every misalignment within an AVX-512 vector
+#define RST_PADDING_SIZE 40 // More ASCII than fits in an AVX2 vector
+#define RST_BENCH_SIZE 0x10000 // 64 KB
+#define RST_BENCH_ROUND_C 2000 // Must be even: see main()
+
+RS_LOG_VARS; // See the RS_LOG() section in ringsocket_api.h for explanation.
+
+struct rst_utf8_case {
+    char const * str;
+    bool is_valid;
+};
+
+static struct rst_utf8_case const utf8_cases[] = {
+    // The lowest and highest codepoint of each valid range sequence
+    {"\xC2\x80", true}, {"\xDF\xBF", true},
+    {"\xE0\xA0\x80", true}, {"\xE0\xBF\xBF", true},
+    {"\xE1\x80\x80", true}, {"\xEC\xBF\xBF", true},
+    {"\xED\x80\x80", true}, {"\xED\x9F\xBF", true},
+    {"\xEE\x80\x80", true}, {"\xEF\xBF\xBF", true},
+    {"\xF0\x90\x80\x80", true}, {"\xF0\xBF\xBF\xBF", true},
+    {"\xF1\x80\x80\x80", true}, {"\xF3\xBF\xBF\xBF", true},
+    {"\xF4\x80\x80\x80", true}, {"\xF4\x8F\xBF\xBF", true},
+    // Overlong encodings
+    {"\xC0\x80", false}, {"\xC1\xBF", false},
+    {"\xE0\x80\x80", false}, {"\xE0\x9F\xBF", false},
+    {"\xF0\x80\x80\x80", false}, {"\xF0\x8F\xBF\xBF", false},
+    // UTF-16 surrogates
+    {"\xED\xA0\x80", false}, {"\xED\xAF\xBF", false}, {"\xED\xBF\xBF", false},
+    // Codepoints beyond U+10FFFF, and bytes that never occur in UTF-8
+    {"\xF4\x90\x80\x80", false}, {"\xF4\xBF\xBF\xBF", false},
+    {"\xF5\x80\x80\x80", false}, {"\xF7\xBF\xBF\xBF", false},
+    {"\xF8\x88\x80\x80\x80", false}, {"\xFE", false}, {"\xFF", false},
+    // Stray continuation bytes
+    {"\x80", false}, {"\xBF", false}, {"\xC2\x80\x80", false},
+    {"\xE2\x82\xAC\xBF", false}, {"\xF0\x9F\x98\x80\x80", false},
+    // Sequences cut short by ASCII or by another lead byte
+    {"\xC2\x41", false}, {"\xE2\x82\x41", false}, {"\xE2\x41\x82", false},
+    {"\xF0\x9F\x98\x41", false}, {"\xF0\x9F\x41", false},
+    {"\xC2\xC2\x80", false}, {"\xE2\x82\xE2\x82\xAC", false},
+    {"\xF0\x9F\x98\xF0\x9F\x98\x80", false}
+};
+
+static char const * const level_names[] = {"scalar", "SSE2", "AVX2", "AVX-512"};
+
+static double get_elapsed_ns(
+    struct timespec const * start
+) {
+    struct timespec end = {0};
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 +
+        (end.tv_nsec - start->tv_nsec);
+}
+
+static size_t write_codepoint(
+    uint8_t * dst,
+    uint32_t codepoint
+) {
+    if (codepoint < 0x80) {
+        *dst = codepoint;
+        return 1;
+    }
+    if (codepoint < 0x800) {
+        dst[0] = 0xC0 | codepoint >> 6;
+        dst[1] = 0x80 | (codepoint & 0x3F);
+        return 2;
+    }
+    if (codepoint < 0x10000) {
+        dst[0] = 0xE0 | codepoint >> 12;
+        dst[1] = 0x80 | (codepoint >> 6 & 0x3F);
+        dst[2] = 0x80 | (codepoint & 0x3F);
+        return 3;
+    }
+    dst[0] = 0xF0 | codepoint >> 18;
+    dst[1] = 0x80 | (codepoint >> 12 & 0x3F);
+    dst[2] = 0x80 | (codepoint >> 6 & 0x3F);
+    dst[3] = 0x80 | (codepoint & 0x3F);
+    return 4;
+}
+
+// Write a pseudo-random valid codepoint, or a run of ASCII long enough for the
+// SIMD variants to skip over in one go; returning the number of bytes written
+// (at most RST_PADDING_SIZE).
+static size_t write_random_text(
+    uint8_t * dst
+) {
+    switch (rand() % 8) {
+    case 0:
+        return write_codepoint(dst, 0x80 + rand() % (0x800 - 0x80));
+    case 1:
+        for (;;) {
+            uint32_t codepoint = 0x800 + rand() % (0x10000 - 0x800);
+            if (codepoint < 0xD800 || codepoint > 0xDFFF) {
+                return write_codepoint(dst, codepoint);
+            }
+        }
+    case 2:
+        return write_codepoint(dst, 0x10000 + rand() % (0x110000 - 0x10000));
+    case 3:
+        {
+            size_t size = 1 + rand() % RST_PADDING_SIZE;
+            memset(dst, ' ' + rand() % 95, size);
+            return size;
+        }
+    default:
+        *dst = rand() % 0x80;
+        return 1;
+    }
+}
+
+// Fill str with size bytes of pseudo-random UTF-8 text, which may end with a
+// truncated codepoint, and which is made invalid if is_invalid is true.
+static void fill_random_utf8(
+    uint8_t * str,
+    size_t size,
+    bool is_invalid
+) {
+    uint8_t text[RST_PADDING_SIZE] = {0};
+    for (size_t i = 0; i < size;) {
+        size_t const text_size = write_random_text(text);
+        memcpy(str + i, text, RS_MIN(text_size, size - i));
+        i += RS_MIN(text_size, size - i);
+    }
+    if (!is_invalid || !size) {
+        return;
+    }
+    // Overwrite part of the text with an invalid case, which may well split a
+    // valid codepoint in the process.
+    for (;;) {
+        struct rst_utf8_case const * c =
+            utf8_cases + rand() % RS_ELEM_C(utf8_cases);
+        size_t const c_strlen = strlen(c->str);
+        if (!c->is_valid && c_strlen <= size) {
+            memcpy(str + rand() % (size - c_strlen + 1), c->str, c_strlen);
+            return;
+        }
+    }
+}
+
+static rs_ret check_utf8_state(
+    enum rs_utf8_state state,
+    enum rs_utf8_state expected_state,
+    char const * description,
+    uint8_t const * str,
+    size_t size,
+    size_t i
+) {
+    if (state == expected_state) {
+        return RS_OK;
+    }
+    printf("%s UTF-8 validation mismatch for %s at index %zu of %zu bytes: "
+        "expected state %d, got %d. Bytes:", level_names[simd_level],
+        description, i, size, expected_state, state);
+    for (size_t j = 0; j < size; j++) {
+        printf(" %02X", str[j]);
+    }
+    printf("\n");
+    return RS_FATAL;
+}
+
+static rs_ret verify_utf8_cases(
+    uint8_t * buf
+) {
+    for (size_t i = 0; i < RS_ELEM_C(utf8_cases); i++) {
+        struct rst_utf8_case const * c = utf8_cases + i;
+        size_t const c_strlen = strlen(c->str);
+        enum rs_utf8_state const expected_state =
+            c->is_valid ? RS_UTF8_OK : RS_UTF8_INVALID;
+        // Surround the case with ASCII on both sides, and with ASCII preceding
+        // it only (i.e., with the case being the tail end of the input).
+        for (size_t j = 0; j < 2 * RST_MAX_OFFSET; j++) {
+            size_t const prefix_size = j % RST_MAX_OFFSET;
+            size_t const size = prefix_size + c_strlen +
+                (j < RST_MAX_OFFSET ? RST_PADDING_SIZE : 0);
+            memset(buf, 'a', size);
+            memcpy(buf + prefix_size, c->str, c_strlen);
+            RS_GUARD(check_utf8_state(validate_utf8(RS_UTF8_OK, buf, size),
+                expected_state, "an edge case", buf, size, prefix_size));
+            if (c->is_valid) {
+                // Truncating any valid case must yield an incomplete state
+                // identical to that of the scalar variant.
+                size_t const trunc_size = prefix_size + c_strlen - 1;
+                RS_GUARD(check_utf8_state(
+                    validate_utf8(RS_UTF8_OK, buf, trunc_size),
+                    validate_utf8_scalar(RS_UTF8_OK, buf, trunc_size),
+                    "a truncated edge case", buf, trunc_size, prefix_size));
+            }
+        }
+    }
+    return RS_OK;
+}
+
+static rs_ret verify_utf8_strings(
+    uint8_t (* strs)[RST_MAX_STR_SIZE],
+    uint8_t * buf
+) {
+    for (size_t i = 0; i < RST_STR_C; i++) {
+        uint8_t const * str = strs[i];
+        size_t const size = i % (RST_MAX_STR_SIZE + 1);
+        enum rs_utf8_state const expected_state =
+            validate_utf8_scalar(RS_UTF8_OK, str, size);
+        for (size_t offset = 0; offset < RST_MAX_OFFSET; offset++) {
+            memcpy(buf + offset, str, size);
+            RS_GUARD(check_utf8_state(
+                validate_utf8(RS_UTF8_OK, buf + offset, size), expected_state,
+                "a misaligned string", str, size, offset));
+        }
+        for (size_t split_i = 0; split_i <= size; split_i++) {
+            enum rs_utf8_state state =
+                validate_utf8(RS_UTF8_OK, str, split_i);
+            if (state != RS_UTF8_INVALID) {
+                state = validate_utf8(state, str + split_i, size - split_i);
+            }
+            RS_GUARD(check_utf8_state(state, expected_state,
+                "a string split in 2 chunks", str, size, split_i));
+        }
+        enum rs_utf8_state state = RS_UTF8_OK;
+        for (size_t j = 0; j < size && state != RS_UTF8_INVALID;) {
+            size_t chunk_size = 1 + rand() % 70;
+            chunk_size = RS_MIN(chunk_size, size - j);
+            state = validate_utf8(state, str + j, chunk_size);
+            j += chunk_size;
+        }
+        RS_GUARD(check_utf8_state(state, expected_state,
+            "a string split in many chunks", str, size, 0));
+    }
+    return RS_OK;
+}
+
+static rs_ret verify_unmasking(
+    uint8_t const * src,
+    uint8_t * ref,
+    uint8_t * buf
+) {
+    size_t const buf_size = RST_MAX_OFFSET + RST_MAX_STR_SIZE + RST_MAX_OFFSET;
+    for (size_t size = 0; size <= RST_MAX_STR_SIZE; size++) {
+        for (size_t start_i = 0; start_i <= RS_MIN(size, 7); start_i++) {
+            uint8_t mask_key[4] = {rand(), rand(), rand(), rand()};
+            memcpy(ref, src, size);
+            for (size_t i = start_i; i < size; i++) {
+                ref[i] ^= mask_key[i % 4];
+            }
+            for (size_t offset = 0; offset < RST_MAX_OFFSET; offset++) {
+                memset(buf, 0xA5, buf_size);
+                memcpy(buf + offset, src, size);
+                unmask_wsframe_payload(buf + offset, start_i, size, mask_key);
+                bool is_ok = !memcmp(buf + offset, ref, size);
+                for (size_t i = 0; i < buf_size && is_ok; i++) {
+                    is_ok = (i >= offset && i < offset + size) ||
+                        buf[i] == 0xA5;
+                }
+                if (!is_ok) {
+                    printf("%s unmasking mismatch for a %zu byte payload at "
+                        "offset %zu from start index %zu\n",
+                        level_names[simd_level], size, offset, start_i);
+                    return RS_FATAL;
+                }
+            }
+        }
+    }
+    return RS_OK;
+}
+
+static double benchmark_unmasking(
+    uint8_t * payload
+) {
+    uint8_t const mask_key[4] = {0x12, 0x34, 0x56, 0x78};
+    struct timespec start = {0};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t round = 0; round < RST_BENCH_ROUND_C; round++) {
+        unmask_wsframe_payload(payload, 0, RST_BENCH_SIZE, mask_key);
+        // Prevent the compiler from hoisting anything out of the loop.
+        __asm__ volatile("" : : "r" (payload) : "memory");
+    }
+    return RST_BENCH_ROUND_C * RST_BENCH_SIZE / get_elapsed_ns(&start);
+}
+
+static double benchmark_utf8(
+    uint8_t const * str
+) {
+    struct timespec start = {0};
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t round = 0; round < RST_BENCH_ROUND_C; round++) {
+        enum rs_utf8_state state =
+            validate_utf8(RS_UTF8_OK, str, RST_BENCH_SIZE);
+        __asm__ volatile("" : : "r" (state), "r" (str) : "memory");
+    }
+    return RST_BENCH_ROUND_C * RST_BENCH_SIZE / get_elapsed_ns(&start);
+}
+
+int main(
+    int arg_c,
+    char * * args
+) {
+    unsigned const seed =
+        arg_c > 1 ? strtoul(args[1], NULL, 10) : (unsigned) time(NULL);
+    printf("Seed: %u\n", seed);
+    srand(seed);
+    static uint8_t strs[RST_STR_C][RST_MAX_STR_SIZE];
+    for (size_t i = 0; i < RST_STR_C; i++) {
+        fill_random_utf8(strs[i], i % (RST_MAX_STR_SIZE + 1), i % 2);
+    }
+    static uint8_t buf[RST_MAX_OFFSET + RST_MAX_STR_SIZE + RST_MAX_OFFSET];
+    static uint8_t ref[RST_MAX_STR_SIZE];
+    // Benchmark input: ASCII text, and valid text of mixed codepoint sizes
+    // padded with ASCII so as to not end with a truncated codepoint.
+    static uint8_t ascii[RST_BENCH_SIZE];
+    static uint8_t mixed[RST_BENCH_SIZE];
+    for (size_t i = 0; i < RST_BENCH_SIZE; i++) {
+        ascii[i] = ' ' + i % 95;
+    }
+    memset(mixed, ' ', RST_BENCH_SIZE);
+    for (size_t i = 0; i + RST_PADDING_SIZE <= RST_BENCH_SIZE;) {
+        i += write_random_text(mixed + i);
+    }
+    detect_simd_support();
+    enum rs_simd_level const max_level = simd_level;
+    // Verify and benchmark the scalar variant, followed by each SIMD variant
+    // the CPU supports.
+    for (int level = RS_SIMD_NONE; level <= (int) max_level; level++) {
+        simd_level = level;
+        if (verify_utf8_cases(buf) != RS_OK ||
+            verify_utf8_strings(strs, buf) != RS_OK ||
+            verify_unmasking(strs[RST_MAX_STR_SIZE], ref, buf) != RS_OK) {
+            return EXIT_FAILURE;
+        }
+        // RST_BENCH_ROUND_C is even, so unmasking leaves "mixed" as it was.
+        double const unmask_gbps = benchmark_unmasking(mixed);
+        double const ascii_gbps = benchmark_utf8(ascii);
+        double const mixed_gbps = benchmark_utf8(mixed);
+        printf("%-7s: unmasking %6.2f GB/s; UTF-8 validation of ASCII %6.2f "
+            "GB/s, of mixed text %6.2f GB/s\n", level_names[level],
+            unmask_gbps, ascii_gbps, mixed_gbps);
+    }
+    printf("All variants yielded results identical to the scalar variant.\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2020 William Budd
+
+#pragma once
+
+// WebSocket client framing helpers shared by the test clients
+// rst_client_echo.c and rst_client_load.c. Like those clients, these helpers
+// are NOT a full-fledged WebSocket client implementation: they do only what is
+// needed to exercise RingSocket, and they never touch a file descriptor
+// themselves, allowing each client to do its own (plain or TLS) IO.
+
+#include <ringsocket_wsframe.h>
+#include <stdio.h> // sprintf()
+
+// Reserve space at the head of rwbuf when parsing WebSocket to allow replying
+// in-place, which results in messages that are exactly 4 mask key bytes longer.
+#define RST_WS_MASK_KEY_SIZE 4
+
+enum rst_state {
+    RST_READ_HTTP_CRLFCRLF = 0,
+    RST_READ_HTTP_LFCRLF = 1,
+    RST_READ_HTTP_CRLF = 2,
+    RST_READ_HTTP_LF = 3,
+    RST_READ_WS = 4,
+    RST_WRITE_WS = 5
+};
+
+// Returns the strlen of the HTTP upgrade request written to buf, which must
+// have room for at least 1000 bytes plus the endpoint's URL and hostname.
+static inline int rst_sprint_http_upgrade_request(
+    char * buf,
+    struct rs_conf_endpoint const * endpoint
+) {
+    // Send a dummy WebSocket key in flagrant disregard of RFC6455, because
+    // that's not the aspect of the standard we're interested in testing here.
+    return sprintf(buf,
+        "GET /%s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: 1234567890123456789012==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n",
+        endpoint->url,
+        endpoint->hostname
+    );
+}
+
+// Scan the size bytes of buf for the CRLFCRLF sequence terminating the server's
+// HTTP upgrade response, the rest of which is ignored. The scan resumes from
+// wherever the previous call left off according to *state. Returns RS_OK with
+// *parsed_size set to the number of bytes up to and including that sequence
+// once it is found, or RS_AGAIN if all of buf was scanned without finding it.
+static inline rs_ret rst_parse_http_response(
+    uint16_t * state,
+    uint8_t const * buf,
+    size_t size,
+    size_t * parsed_size
+) {
+    for (size_t i = 0; i < size;) {
+        switch (buf[i++]) {
+        case '\r':
+            switch (*state) {
+            case RST_READ_HTTP_CRLFCRLF:
+                *state = RST_READ_HTTP_LFCRLF;
+                continue;
+            case RST_READ_HTTP_CRLF:
+                *state = RST_READ_HTTP_LF;
+                continue;
+            default:
+                break;
+            }
+            break;
+        case '\n':
+            switch (*state) {
+            case RST_READ_HTTP_LFCRLF:
+                *state = RST_READ_HTTP_CRLF;
+                continue;
+            case RST_READ_HTTP_LF:
+                *state = RST_READ_WS;
+                *parsed_size = i;
+                return RS_OK;
+            default:
+                break;
+            }
+        }
+        *state = RST_READ_HTTP_CRLFCRLF;
+    }
+    return RS_AGAIN;
+}
+
+// Parse the server-to-client frame at wsbuf, of which all bytes up to next_read
+// have been received so far. Returns RS_AGAIN if that's not enough to contain
+// the whole frame, RS_CLOSE_PEER if it's a Close frame, or RS_FATAL if its
+// opcode is anything else these test clients don't expect to receive.
+static inline rs_ret rst_parse_wsframe(
+    uint8_t const * wsbuf,
+    uint8_t const * next_read,
+    uint64_t * header_size,
+    uint64_t * payload_size,
+    uint64_t * frame_size
+) {
+    union rs_wsframe const * frame = (union rs_wsframe const *) wsbuf;
+    if (next_read < frame->sc_small.payload) {
+        return RS_AGAIN;
+    }
+    switch (rs_get_wsframe_opcode(frame)) {
+    case RS_WSFRAME_OPC_CONT:
+    case RS_WSFRAME_OPC_TEXT:
+    case RS_WSFRAME_OPC_BIN:
+        break;
+    case RS_WSFRAME_OPC_CLOSE:
+        return RS_CLOSE_PEER;
+    default:
+        return RS_FATAL;
+    }
+    switch (frame->payload_size_x7F) {
+    default:
+        *header_size = sizeof(frame->sc_small);
+        *payload_size = frame->payload_size_x7F;
+        break;
+    case 126:
+        if (next_read < frame->sc_medium.payload) {
+            return RS_AGAIN;
+        }
+        *header_size = sizeof(frame->sc_medium);
+        *payload_size = RS_R_NTOH16(frame->sc_medium.payload_size);
+        break;
+    case 127:
+        if (next_read < frame->sc_large.payload) {
+            return RS_AGAIN;
+        }
+        *header_size = sizeof(frame->sc_large);
+        *payload_size = RS_R_NTOH64(frame->sc_large.payload_size);
+    }
+    *frame_size = *header_size + *payload_size;
+    return next_read < wsbuf + *frame_size ? RS_AGAIN : RS_OK;
+}
+
+static inline void rst_mask_wsframe_payload(
+    uint8_t * payload,
+    uint64_t payload_size,
+    uint8_t const * mask
+) {
+    for (size_t i = 0; i < payload_size; i++) {
+        payload[i] ^= mask[i % 4];
+    }
+}
+
+// Write the header of a client-to-server frame with the given mask key to dst,
+// which must have room for at least sizeof(struct rs_wsframe_cs_large) bytes.
+// Returns the size of that header, at which the payload is to be written.
+static inline size_t rst_set_wsframe_cs_header(
+    uint8_t * dst,
+    enum rs_wsframe_opcode opcode,
+    uint64_t payload_size,
+    uint32_t mask_key
+) {
+    union rs_wsframe * frame = (union rs_wsframe *) dst;
+    memset(frame, 0, sizeof(struct rs_wsframe_cs_large));
+    rs_set_wsframe_is_final(frame, true);
+    rs_set_wsframe_opcode(frame, opcode);
+    rs_set_wsframe_is_masked(frame, true);
+    rs_set_wsframe_payload_size(frame, payload_size);
+    size_t const header_size =
+        payload_size <= 125 ? sizeof(struct rs_wsframe_cs_small) :
+        payload_size <= UINT16_MAX ? sizeof(struct rs_wsframe_cs_medium) :
+        sizeof(struct rs_wsframe_cs_large);
+    memcpy(dst + header_size - 4, &mask_key, 4); // The mask key ends the header
+    return header_size;
+}
+
+// Turn the server-to-client frame at wsbuf (as parsed by rst_parse_wsframe())
+// into a masked client-to-server frame with the same payload, by moving its
+// header RST_WS_MASK_KEY_SIZE bytes back to make room for the mask key. Returns
+// the start of the resulting frame, which is RST_WS_MASK_KEY_SIZE bytes larger.
+static inline uint8_t * rst_mask_wsframe_in_place(
+    uint8_t * wsbuf,
+    uint64_t header_size,
+    uint64_t payload_size,
+    uint32_t mask_key
+) {
+    uint8_t * mask = NULL;
+    switch (header_size) {
+    case sizeof(struct rs_wsframe_sc_small):
+        *((uint16_t *) (wsbuf - 4)) = *((uint16_t *) wsbuf);
+        mask = wsbuf - 2;
+        break;
+    case sizeof(struct rs_wsframe_sc_medium):
+        *((uint32_t *) (wsbuf - 4)) = *((uint32_t *) wsbuf);
+        mask = wsbuf;
+        break;
+    case sizeof(struct rs_wsframe_sc_large): default:
+        *((uint32_t *) (wsbuf - 4)) = *((uint32_t *) wsbuf);
+        *((uint32_t *) wsbuf) = *((uint32_t *) (wsbuf + 4));
+        *((uint32_t *) (wsbuf + 4)) = *((uint32_t *) (wsbuf + 8));
+        mask = wsbuf + 6;
+    }
+    wsbuf[-3] |= 0x80; // Set the mask bit
+    memcpy(mask, &mask_key, 4);
+    rst_mask_wsframe_payload(mask + 4, payload_size, mask);
+    return wsbuf - RST_WS_MASK_KEY_SIZE;
+}
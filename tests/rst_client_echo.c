@@ -8,35 +8,23 @@
 
 #define _POSIX_C_SOURCE 201112L // getaddrinfo()
 
+#include "rst_client.h"
+
 #include <fcntl.h>
 #include <jgrandson.h>
 #include <netdb.h>
-#include <ringsocket_wsframe.h>
 #include <stdbool.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
-// Preserve space at the head of rwbuf when parsing WebSocket to allow replying
-// in-place, which results in messages that are exactly 4 mask key bytes longer.
-#define RST_WS_MASK_KEY_SIZE 4
-
 #define RST_CONNECT_ATTEMPT_C 100
 #define RST_COOL_OFF_INIT_NS 10000000 // 0.01s
 #define RST_COOL_OFF_MULT 1.5
 
 RS_LOG_VARS; // See the RS_LOG() section in ringsocket_api.h for explanation.
 
-enum rst_state {
-    RST_READ_HTTP_CRLFCRLF = 0,
-    RST_READ_HTTP_LFCRLF = 1,
-    RST_READ_HTTP_CRLF = 2,
-    RST_READ_HTTP_LF = 3,
-    RST_READ_WS = 4,
-    RST_WRITE_WS = 5
-};
-
 struct rst_client {
     uint8_t * storage;
     uint8_t * next_read;
@@ -125,19 +113,8 @@ static rs_ret write_http_upgrade_request(
     struct rs_conf_endpoint const * endpoint,
     struct rst_client * client
 ) {
-    // Send a dummy WebSocket key in flagrant disregard of RFC6455, because
-    // that's not the aspect of the standard we're interested in testing here.
-    int http_strlen = sprintf(rwbuf, // sizeof(rwbuf) > 1000 guaranteed
-        "GET /%s HTTP/1.1\r\n"
-        "Host: %s\r\n"
-        "Upgrade: websocket\r\n"
-        "Connection: Upgrade\r\n"
-        "Sec-WebSocket-Key: 1234567890123456789012==\r\n"
-        "Sec-WebSocket-Version: 13\r\n"
-        "\r\n",
-        endpoint->url,
-        endpoint->hostname
-    );
+    // sizeof(rwbuf) > 1000 guaranteed
+    int http_strlen = rst_sprint_http_upgrade_request(rwbuf, endpoint);
     if (write(client->fd, rwbuf, http_strlen) != http_strlen) {
         RS_LOG_ERRNO(LOG_ERR, "Unsuccessful write(%d, rwbuf, %d) on port %"
             PRIu16, client->fd, http_strlen, client->port);
@@ -266,101 +243,47 @@ static rs_ret read_http(
                 client->fd, client->port);
             return RS_FATAL;
         default:
-            for (ssize_t i = 0; i < rsize;) {
-                switch (rwbuf[i++]) {
-                case '\r':
-                    switch (client->state) {
-                    case RST_READ_HTTP_CRLFCRLF:
-                        client->state = RST_READ_HTTP_LFCRLF;
-                        continue;
-                    case RST_READ_HTTP_CRLF:
-                        client->state = RST_READ_HTTP_LF;
-                        continue;
-                    default:
-                        break;
-                    }
-                    break;
-                case '\n':
-                    switch (client->state) {
-                    case RST_READ_HTTP_LFCRLF:
-                        client->state = RST_READ_HTTP_CRLF;
-                        continue;
-                    case RST_READ_HTTP_LF:
-                        RS_LOG(LOG_DEBUG, "HTTP handshake completed for socket "
-                            "fd %d on port %" PRIu16, client->fd, client->port);
-                        client->state = RST_READ_WS;
-                        if (i < rsize) {
-                            memmove(rwbuf, rwbuf + i, rsize - i);
-                        }
-                        return RS_OK;
-                    default:
-                        break;
-                    }
+            {
+                size_t i = 0;
+                if (rst_parse_http_response(&client->state, (uint8_t *) rwbuf,
+                    rsize, &i) == RS_AGAIN) {
+                    continue;
+                }
+                RS_LOG(LOG_DEBUG, "HTTP handshake completed for socket fd %d "
+                    "on port %" PRIu16, client->fd, client->port);
+                if (i < (size_t) rsize) {
+                    memmove(rwbuf, rwbuf + i, rsize - i);
                 }
-                client->state = RST_READ_HTTP_CRLFCRLF;
+                return RS_OK;
             }
         }
     }
 }
 
-static rs_ret parse_websocket_frame_header(
+static rs_ret parse_websocket_frame(
     struct rst_client * client,
-    union rs_wsframe const * frame,
+    uint8_t const * wsbuf,
     uint64_t * header_size,
-    uint64_t * payload_size
+    uint64_t * payload_size,
+    uint64_t * frame_size
 ) {
-    switch (rs_get_wsframe_opcode(frame)) {
-    case RS_WSFRAME_OPC_CONT:
-    case RS_WSFRAME_OPC_TEXT:
-    case RS_WSFRAME_OPC_BIN:
-        break;
-    case RS_WSFRAME_OPC_CLOSE:
+    rs_ret ret = rst_parse_wsframe(wsbuf, client->next_read, header_size,
+        payload_size, frame_size);
+    switch (ret) {
+    case RS_CLOSE_PEER:
         RS_LOG(LOG_WARNING, "Received WebSocket Close frame for fd %d on port %"
             PRIu16 ": shutting down...", client->fd, client->port);
-        return RS_CLOSE_PEER;
-    default:
+        break;
+    case RS_FATAL:
         RS_LOG(LOG_WARNING, "Received unexpected opcode %d for fd %d on port %"
-            PRIu16 ": shutting down...", rs_get_wsframe_opcode(frame),
+            PRIu16 ": shutting down...",
+            rs_get_wsframe_opcode((union rs_wsframe const *) wsbuf),
             client->fd, client->port);
-        return RS_FATAL;
-    }
-    if (client->next_read < frame->sc_small.payload) {
-        return RS_AGAIN;
-    }
-    switch (frame->payload_size_x7F) {
+        break;
     default:
-        *header_size = sizeof(frame->sc_small);
-        *payload_size = frame->payload_size_x7F;
-        return RS_OK;
-    case 126:
-        if (client->next_read < frame->sc_medium.payload) {
-            return RS_AGAIN;
-        }
-        *header_size = sizeof(frame->sc_medium);
-        *payload_size = RS_R_NTOH16(frame->sc_medium.payload_size);
-        return RS_OK;
-    case 127:
-        if (client->next_read < frame->sc_large.payload) {
-            return RS_AGAIN;
-        }
-        *header_size = sizeof(frame->sc_large);
-        *payload_size = RS_R_NTOH64(frame->sc_large.payload_size);
-        return RS_OK;
+        break;
     }
-}
-
-static rs_ret parse_websocket_frame(
-    struct rst_client * client,
-    uint8_t const * wsbuf,
-    uint64_t * header_size,
-    uint64_t * payload_size,
-    uint64_t * frame_size
-) {
-    union rs_wsframe const * frame = (union rs_wsframe const *) wsbuf;
-    RS_GUARD(parse_websocket_frame_header(client, frame, header_size,
-        payload_size));
-    *frame_size = *header_size + *payload_size;
-    return client->next_read < wsbuf + *frame_size ? RS_AGAIN : RS_OK;
+    return ret;
 }
 
 static rs_ret write_websocket(
@@ -404,34 +327,13 @@ static rs_ret mask_and_write_websocket(
     uint64_t frame_size
 ) {
     client->state = RST_WRITE_WS;
-    uint8_t * mask = NULL;
-    switch (header_size) {
-    case sizeof(struct rs_wsframe_sc_small):
-        *((uint16_t *) (wsbuf - 4)) = *((uint16_t *) wsbuf);
-        mask = wsbuf - 2;
-        break;
-    case sizeof(struct rs_wsframe_sc_medium):
-        *((uint32_t *) (wsbuf - 4)) = *((uint32_t *) wsbuf);
-        mask = wsbuf;
-        break;
-    case sizeof(struct rs_wsframe_sc_large): default:
-        *((uint32_t *) (wsbuf - 4)) = *((uint32_t *) wsbuf);
-        *((uint32_t *) wsbuf) = *((uint32_t *) (wsbuf + 4));
-        *((uint32_t *) (wsbuf + 4)) = *((uint32_t *) (wsbuf + 8));
-        mask = wsbuf + 6;
-    }
-    wsbuf[-3] |= 0x80; // Set the mask bit
-    *((uint16_t *) mask) = UINT16_MAX * (rand() / (RAND_MAX + 1.));
-    *((uint16_t *) (mask + 2)) = UINT16_MAX * (rand() / (RAND_MAX + 1.));
-    uint8_t * payload = mask + 4;
     RS_LOG(LOG_DEBUG, "Masking %zu+4+(16+%zu)=%zu bytes with ID %" PRIu64
         " received frame for fd %d on port %" PRIu16,
-        header_size, payload_size - 16, frame_size + 4, RS_R_NTOH64(payload),
-        client->fd, client->port);
-    for (size_t i = 0; i < payload_size; i++) {
-        payload[i] ^= mask[i % 4];
-    }
-    return write_websocket(client, wsbuf - 4, frame_size + 4);
+        header_size, payload_size - 16, frame_size + 4,
+        RS_R_NTOH64(wsbuf + header_size), client->fd, client->port);
+    return write_websocket(client, rst_mask_wsframe_in_place(wsbuf,
+        header_size, payload_size, UINT32_MAX * (rand() / (RAND_MAX + 1.))),
+        frame_size + 4);
 }
 
 static rs_ret save_to_storage(
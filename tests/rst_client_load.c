@@ -0,0 +1,1354 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2020 William Budd
+
+// This program is a multi-threaded WebSocket load generator intended for
+// measuring RingSocket's throughput and round trip latency across tens of
+// thousands of concurrent ws:// and/or wss:// connections. Like
+// rst_client_echo.c, with which it shares the framing helpers of rst_client.h,
+// it is NOT a full-fledged client, NOT secure (e.g., it doesn't verify TLS
+// certificates), and should NOT be used for anything other than the
+// aforementioned purpose.
+//
+// Its configuration file (rs_client_load.json by default) holds an object with
+// an array of "scenarios", and optionally "thread_c" (default: 1),
+// "source_addr_c" (default: 0), "rwbuf_size" (per thread, default: 1 MB),
+// "epoll_buf_elem_c" (default: 1000), and "log_level" (default: "notice"). Each
+// scenario is an object with a "name", "url", "mode" (default: "echo"),
+// "client_c", and "duration_sec" (default: 10); plus, in echo mode, "msg_rate"
+// (default: 0) and "msg_sizes": an array of objects with a "size" and a
+// "weight" (default: 1) each (default: 64 byte messages only).
+//
+// It runs every scenario listed in its configuration file in turn. Each thread
+// opens its share of the scenario's "client_c" connections through its own
+// epoll instance, with at most RST_MAX_PENDING_CONN_C connection attempts in
+// flight at any time. If "source_addr_c" is set, connections to an IPv4
+// loopback destination are spread across that many source addresses starting
+// at 127.0.0.1, so as not to be limited to a single ephemeral port range. Once
+// every thread has finished connecting, measurement starts for "duration_sec"
+// seconds, in either of two modes:
+//
+// "echo" (for use with rst_app_echo): every message sent starts with the
+// CLOCK_MONOTONIC time at which it was sent and the connection's message
+// sequence number, followed by filler bytes; so that each echoed message
+// received can be verified and its round trip time recorded. Each connection
+// sends "msg_rate" messages per second, scheduled open-loop in round-robin
+// order per thread; or if "msg_rate" is 0, closed-loop: sending the next
+// message as soon as its previous message is echoed back. Message sizes are
+// drawn from the weighted "msg_sizes" mix. If a connection is still waiting to
+// finish writing its previous message when its next one is due, that message
+// is skipped rather than queued, and counted as such.
+//
+// "bounce" (for use with rst_app_stress): every message received is masked and
+// echoed back, just like rst_client_echo.c does. Those messages originate from
+// the app, which verifies the echoes itself; so only throughput is measured.
+// Note that rst_app_stress expects to be the side doing any connection closing,
+// so a bounce scenario only makes sense as the last scenario of a run.
+//
+// Round trip times are recorded in the same log-linear histograms used by
+// RingSocket's own "latency_histograms" (see ringsocket_metrics.h), which means
+// that the reported percentiles are bucket upper bounds: at most 6.25% larger
+// than the actual values.
+
+#define _GNU_SOURCE // getaddrinfo(), CLOCK_MONOTONIC, IP_BIND_ADDRESS_NO_PORT
+
+#include "rst_client.h"
+
+#include <jgrandson.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <stdio.h> // printf()
+#include <sys/epoll.h>
+#include <sys/resource.h> // setrlimit()
+#include <sys/socket.h>
+#include <threads.h> // thrd_create(), thrd_join()
+#include <time.h>
+#include <unistd.h>
+
+#define RST_MAX_PENDING_CONN_C 256 // Per thread
+#define RST_CONNECT_TIMEOUT_NS 30000000000 // 30s
+#define RST_DRAIN_TIMEOUT_NS 2000000000 // 2s
+#define RST_MAX_EPOLL_TIMEOUT_MS 10
+#define RST_MSG_HEAD_SIZE 16 // Send time followed by sequence number
+#define RST_SCENARIO_NAME_MAX_STRLEN 31
+#define RST_MAX_SOURCE_ADDR_C 0x10000
+
+RS_LOG_VARS; // See the RS_LOG() section in ringsocket_api.h for explanation.
+
+enum rst_mode {
+    RST_MODE_ECHO = 0,
+    RST_MODE_BOUNCE = 1
+};
+
+enum rst_phase {
+    RST_PHASE_CONNECT = 0,
+    RST_PHASE_WAIT = 1,
+    RST_PHASE_MEASURE = 2,
+    RST_PHASE_DRAIN = 3
+};
+
+enum rst_conn_phase {
+    RST_CONN_UNOPENED = 0,
+    RST_CONN_CONNECTING = 1,
+    RST_CONN_TLS_HANDSHAKE = 2,
+    RST_CONN_UPGRADING = 3,
+    RST_CONN_OPEN = 4,
+    RST_CONN_CLOSED = 5
+};
+
+struct rst_msg_size {
+    size_t size;
+    size_t weight;
+};
+
+struct rst_scenario {
+    struct rs_conf_endpoint endpoint;
+    struct rst_msg_size * msg_sizes;
+    size_t msg_size_c;
+    size_t total_weight;
+    size_t client_c;
+    double msg_rate; // Per connection per second, or 0 if closed-loop
+    uint32_t duration_sec;
+    uint8_t mode; // enum rst_mode
+    char name[RST_SCENARIO_NAME_MAX_STRLEN + 1];
+};
+
+struct rst_conn {
+    SSL * tls; // NULL if unencrypted
+    uint8_t * rstorage; // Received bytes of a frame yet to be received in full
+    uint8_t * wstorage; // Bytes yet to be written
+    size_t rstorage_size;
+    size_t wstorage_size;
+    uint64_t sent_seq;
+    uint64_t recv_seq;
+    int fd;
+    uint16_t port;
+    uint16_t state; // enum rst_state
+    uint8_t phase; // enum rst_conn_phase
+};
+
+struct rst_stats {
+    uint64_t sent_c;
+    uint64_t recv_c;
+    uint64_t sent_byte_c;
+    uint64_t recv_byte_c;
+    uint64_t skipped_c; // Not sent due to a previous write still in progress
+    uint64_t corrupt_c; // Echoes with unexpected contents
+    uint64_t lost_c; // Sent messages never echoed back
+    uint64_t conn_c; // Connections upgraded to WebSocket successfully
+    uint64_t conn_fail_c; // Connections that failed to get that far
+    uint64_t drop_c; // Upgraded connections that closed prematurely
+};
+
+// Shared by all threads of a single scenario run
+struct rst_run {
+    struct rst_scenario const * scen;
+    SSL_CTX * tls_ctx;
+    struct sockaddr_storage addr;
+    socklen_t addr_size;
+    size_t rwbuf_size;
+    size_t epoll_buf_elem_c;
+    uint32_t source_addr_c;
+    uint16_t thread_c;
+    atomic_uint_least16_t connected_thread_c;
+    atomic_uint_least64_t start_ns; // 0 until every thread is connected
+    atomic_bool has_failed;
+};
+
+struct rst_thread {
+    struct rst_run * run;
+    struct rst_conn * conns;
+    uint8_t * rwbuf;
+    uint8_t * wbuf;
+    struct epoll_event * epoll_buf;
+    size_t conn_c;
+    size_t next_conn_i; // The next connection to be opened
+    size_t pending_c; // Connections being opened
+    size_t open_c;
+    size_t cursor; // The next connection in the open-loop round-robin order
+    uint64_t outstanding_c; // Messages sent that are yet to be echoed back
+    uint64_t scheduled_c; // Open-loop messages sent or skipped so far
+    uint64_t start_ns;
+    uint64_t rng;
+    struct rst_stats stats;
+    struct rs_histogram histogram;
+    thrd_t thrd;
+    int epoll_fd;
+    uint16_t thread_i;
+    uint8_t phase; // enum rst_phase
+};
+
+static char const default_conf_path[] = "rs_client_load.json";
+
+#define RS_GUARD_JG(_jg_ret) do { \
+    if ((_jg_ret) != JG_OK) { \
+        RS_LOG(LOG_ERR, "Error parsing configuration file: %s", \
+            jg_get_err_str(jg, NULL, NULL)); \
+        return RS_FATAL; \
+    } \
+} while (0)
+
+static uint64_t get_time_ns(
+    void
+) {
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000000 * (uint64_t) ts.tv_sec + ts.tv_nsec;
+}
+
+static uint64_t get_random( // xorshift64: crappy randomness is OK here
+    struct rst_thread * t
+) {
+    t->rng ^= t->rng << 13;
+    t->rng ^= t->rng >> 7;
+    t->rng ^= t->rng << 17;
+    return t->rng;
+}
+
+static rs_ret parse_scenario(
+    jg_t * jg,
+    jg_obj_get_t * obj,
+    size_t max_msg_size,
+    struct rst_scenario * scen
+) {
+    RS_GUARD_JG(jg_obj_get_callerstr(jg, obj, "name",
+        &(jg_obj_callerstr){
+            .max_byte_c = RST_SCENARIO_NAME_MAX_STRLEN
+        }, scen->name));
+    {
+        char * url = NULL;
+        RS_GUARD_JG(jg_obj_get_str(jg, obj, "url", NULL, &url));
+        RS_GUARD(rs_parse_canon_ws_url(url, &scen->endpoint));
+        RS_FREE(url);
+    }
+    {
+        char mode[] = "bounce";
+        RS_GUARD_JG(jg_obj_get_callerstr(jg, obj, "mode",
+            &(jg_obj_callerstr){
+                .defa = "echo",
+                .max_byte_c = RS_CONST_STRLEN("bounce"),
+            }, mode));
+        if (!strcmp(mode, "echo")) {
+            scen->mode = RST_MODE_ECHO;
+        } else if (!strcmp(mode, "bounce")) {
+            scen->mode = RST_MODE_BOUNCE;
+        } else {
+            RS_LOG(LOG_ERR, "Unrecognized mode \"%s\" of scenario \"%s\". "
+                "Value must be either \"echo\" or \"bounce\".", mode,
+                scen->name);
+            return RS_FATAL;
+        }
+    }
+    RS_GUARD_JG(jg_obj_get_sizet(jg, obj, "client_c",
+        &(jg_obj_sizet){
+            .min = &(size_t){1}
+        }, &scen->client_c));
+    RS_GUARD_JG(jg_obj_get_uint32(jg, obj, "duration_sec",
+        &(jg_obj_uint32){
+            .defa = &(uint32_t){10},
+            .min = &(uint32_t){1}
+        }, &scen->duration_sec));
+    if (scen->mode == RST_MODE_BOUNCE) {
+        return RS_OK; // Messages originate from the app: nothing else applies.
+    }
+    RS_GUARD_JG(jg_obj_get_double(jg, obj, "msg_rate", &(double){0},
+        &scen->msg_rate));
+    if (scen->msg_rate < 0) {
+        RS_LOG(LOG_ERR, "The msg_rate of scenario \"%s\" must not be negative",
+            scen->name);
+        return RS_FATAL;
+    }
+    jg_arr_get_t * arr = NULL;
+    RS_GUARD_JG(jg_obj_get_arr_defa(jg, obj, "msg_sizes", NULL, &arr,
+        &scen->msg_size_c));
+    if (!scen->msg_size_c) {
+        RS_CALLOC(scen->msg_sizes, 1);
+        *scen->msg_sizes = (struct rst_msg_size){.size = 64, .weight = 1};
+        scen->msg_size_c = scen->total_weight = 1;
+        return RS_OK;
+    }
+    RS_CALLOC(scen->msg_sizes, scen->msg_size_c);
+    for (size_t i = 0; i < scen->msg_size_c; i++) {
+        jg_obj_get_t * size_obj = NULL;
+        RS_GUARD_JG(jg_arr_get_obj(jg, arr, i, NULL, &size_obj));
+        RS_GUARD_JG(jg_obj_get_sizet(jg, size_obj, "size",
+            &(jg_obj_sizet){
+                .min = &(size_t){RST_MSG_HEAD_SIZE},
+                .min_reason = "Every message must have room for its send time "
+                    "and sequence number.",
+                .max = &(size_t){max_msg_size},
+                .max_reason = "Messages echoed back must fit in rwbuf_size."
+            }, &scen->msg_sizes[i].size));
+        RS_GUARD_JG(jg_obj_get_sizet(jg, size_obj, "weight",
+            &(jg_obj_sizet){
+                .defa = &(size_t){1}
+            }, &scen->msg_sizes[i].weight));
+        scen->total_weight += scen->msg_sizes[i].weight;
+    }
+    if (!scen->total_weight) {
+        RS_LOG(LOG_ERR, "The msg_sizes weights of scenario \"%s\" must not all "
+            "be zero", scen->name);
+        return RS_FATAL;
+    }
+    return RS_OK;
+}
+
+static rs_ret get_conf(
+    char const * conf_path,
+    size_t * rwbuf_size,
+    size_t * epoll_buf_elem_c,
+    uint16_t * thread_c,
+    uint32_t * source_addr_c,
+    struct rst_scenario * * scens,
+    size_t * scen_c
+) {
+    jg_t * jg = jg_init();
+    RS_GUARD_JG(jg_parse_file(jg, conf_path ? conf_path : default_conf_path));
+
+    jg_obj_get_t * root_obj = NULL;
+    RS_GUARD_JG(jg_root_get_obj(jg, NULL, &root_obj));
+
+    {
+        char log_level[] = "notice";
+        RS_GUARD_JG(jg_obj_get_callerstr(jg, root_obj, "log_level",
+            &(jg_obj_callerstr){
+                .defa = "notice",
+                .max_byte_c = RS_CONST_STRLEN("notice"),
+            }, log_level));
+        RS_GUARD(rs_set_log_level(log_level));
+    }
+
+    RS_GUARD_JG(jg_obj_get_sizet(jg, root_obj, "rwbuf_size",
+        &(jg_obj_sizet){
+            .defa = &(size_t){0x100000}, // 1 MB
+            .min = &(size_t){0x1000}
+        }, rwbuf_size));
+    RS_GUARD_JG(jg_obj_get_sizet(jg, root_obj, "epoll_buf_elem_c",
+        &(jg_obj_sizet){
+            .defa = &(size_t){1000},
+            .min = &(size_t){1}
+        }, epoll_buf_elem_c));
+    RS_GUARD_JG(jg_obj_get_uint16(jg, root_obj, "thread_c",
+        &(jg_obj_uint16){
+            .defa = &(uint16_t){1},
+            .min = &(uint16_t){1}
+        }, thread_c));
+    RS_GUARD_JG(jg_obj_get_uint32(jg, root_obj, "source_addr_c",
+        &(jg_obj_uint32){
+            .defa = &(uint32_t){0},
+            .max = &(uint32_t){RST_MAX_SOURCE_ADDR_C}
+        }, source_addr_c));
+
+    // Leave room for the largest frame header plus RST_WS_MASK_KEY_SIZE
+    size_t const max_msg_size = *rwbuf_size - RST_WS_MASK_KEY_SIZE -
+        sizeof(struct rs_wsframe_sc_large);
+    jg_arr_get_t * arr = NULL;
+    RS_GUARD_JG(jg_obj_get_arr(jg, root_obj, "scenarios",
+        &(jg_obj_arr){
+            .min_c = 1
+        }, &arr, scen_c));
+    RS_CALLOC(*scens, *scen_c);
+    for (size_t i = 0; i < *scen_c; i++) {
+        jg_obj_get_t * obj = NULL;
+        RS_GUARD_JG(jg_arr_get_obj(jg, arr, i, NULL, &obj));
+        RS_GUARD(parse_scenario(jg, obj, max_msg_size, *scens + i));
+    }
+
+    jg_free(jg);
+    return RS_OK;
+}
+
+static rs_ret resolve_endpoint(
+    struct rst_run * run
+) {
+    struct rs_conf_endpoint const * endpoint = &run->scen->endpoint;
+    struct addrinfo * ai = NULL;
+    struct addrinfo ai_preset = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM
+    };
+    int ret = -1;
+    char * colon = strchr(endpoint->hostname, ':');
+    if (colon) {
+        *colon = '\0';
+        ret = getaddrinfo(endpoint->hostname, colon + 1, &ai_preset, &ai);
+        *colon = ':';
+    } else {
+        ret = getaddrinfo(endpoint->hostname,
+            endpoint->is_encrypted ? "443" : "80", &ai_preset, &ai);
+    }
+    if (ret) {
+        RS_LOG(LOG_ERR, "Unsuccessful getaddrinfo() for %s: %s",
+            endpoint->hostname, gai_strerror(ret));
+        return RS_FATAL;
+    }
+    // Unlike rst_client_echo.c, don't bother trying any other results.
+    memcpy(&run->addr, ai->ai_addr, ai->ai_addrlen);
+    run->addr_size = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    return RS_OK;
+}
+
+static void raise_fd_limit(
+    size_t client_c
+) {
+    struct rlimit rl = {0};
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        RS_LOG_ERRNO(LOG_WARNING, "Unsuccessful getrlimit(RLIMIT_NOFILE, ...)");
+        return;
+    }
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+            RS_LOG_ERRNO(LOG_WARNING,
+                "Unsuccessful setrlimit(RLIMIT_NOFILE, ...)");
+            getrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+    if (rl.rlim_cur < client_c + 64) {
+        RS_LOG(LOG_WARNING, "The file descriptor limit of %ju is too low for "
+            "opening %zu connections: consider raising the hard limit.",
+            (uintmax_t) rl.rlim_cur, client_c);
+    }
+}
+
+static rs_ret read_io(
+    struct rst_conn * conn,
+    uint8_t * buf,
+    size_t size,
+    size_t * rsize
+) {
+    if (conn->tls) {
+        int ret = SSL_read(conn->tls, buf, RS_MIN(size, INT_MAX));
+        if (ret > 0) {
+            *rsize = ret;
+            return RS_OK;
+        }
+        switch (SSL_get_error(conn->tls, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            return RS_AGAIN;
+        case SSL_ERROR_ZERO_RETURN:
+            RS_LOG(LOG_INFO, "TLS connection closed by peer on port %" PRIu16,
+                conn->port);
+            return RS_CLOSE_PEER;
+        default:
+            RS_LOG(LOG_INFO, "Unsuccessful SSL_read() on port %" PRIu16 ": %s",
+                conn->port, ERR_reason_error_string(ERR_get_error()));
+            ERR_clear_error();
+            return RS_CLOSE_PEER;
+        }
+    }
+    ssize_t ret = read(conn->fd, buf, size);
+    switch (ret) {
+    case -1:
+        if (errno == EAGAIN) {
+            return RS_AGAIN;
+        }
+        RS_LOG_ERRNO(LOG_INFO, "Unsuccessful read(%d, ...) on port %" PRIu16,
+            conn->fd, conn->port);
+        return RS_CLOSE_PEER;
+    case 0:
+        RS_LOG(LOG_INFO, "read(%d, ...) 0 bytes on port %" PRIu16, conn->fd,
+            conn->port);
+        return RS_CLOSE_PEER;
+    default:
+        *rsize = ret;
+        return RS_OK;
+    }
+}
+
+static rs_ret write_io(
+    struct rst_conn * conn,
+    uint8_t const * buf,
+    size_t size,
+    size_t * wsize
+) {
+    if (conn->tls) {
+        // SSL_MODE_ENABLE_PARTIAL_WRITE makes this behave like write().
+        int ret = SSL_write(conn->tls, buf, RS_MIN(size, INT_MAX));
+        if (ret > 0) {
+            *wsize = ret;
+            return RS_OK;
+        }
+        switch (SSL_get_error(conn->tls, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            *wsize = 0;
+            return RS_OK;
+        default:
+            RS_LOG(LOG_INFO, "Unsuccessful SSL_write() on port %" PRIu16
+                ": %s", conn->port, ERR_reason_error_string(ERR_get_error()));
+            ERR_clear_error();
+            return RS_CLOSE_PEER;
+        }
+    }
+    ssize_t ret = write(conn->fd, buf, size);
+    if (ret == -1) {
+        if (errno == EAGAIN) {
+            *wsize = 0;
+            return RS_OK;
+        }
+        RS_LOG_ERRNO(LOG_INFO, "Unsuccessful write(%d, buf, %zu) on port %"
+            PRIu16, conn->fd, size, conn->port);
+        return RS_CLOSE_PEER;
+    }
+    *wsize = ret;
+    return RS_OK;
+}
+
+static rs_ret store_unwritten(
+    struct rst_conn * conn,
+    uint8_t const * buf,
+    size_t size
+) {
+    uint8_t * wstorage = realloc(conn->wstorage, conn->wstorage_size + size);
+    if (!wstorage) {
+        RS_LOG(LOG_ERR, "Unsuccessful realloc(..., %zu)",
+            conn->wstorage_size + size);
+        return RS_FATAL;
+    }
+    memcpy(wstorage + conn->wstorage_size, buf, size);
+    conn->wstorage = wstorage;
+    conn->wstorage_size += size;
+    return RS_OK;
+}
+
+// Write as much of buf as possible, storing the rest to be written once the
+// socket becomes writable again (in order of course, behind anything already
+// stored).
+static rs_ret write_conn(
+    struct rst_conn * conn,
+    uint8_t const * buf,
+    size_t size
+) {
+    if (conn->wstorage_size) {
+        return store_unwritten(conn, buf, size);
+    }
+    // Keep writing until the socket would block, given that a partial write
+    // doesn't imply that it would (e.g., SSL_write() writes a record at once).
+    for (size_t wsize = 0; size; buf += wsize, size -= wsize) {
+        RS_GUARD(write_io(conn, buf, size, &wsize));
+        if (!wsize) {
+            return store_unwritten(conn, buf, size);
+        }
+    }
+    return RS_OK;
+}
+
+static rs_ret flush_conn(
+    struct rst_conn * conn
+) {
+    while (conn->wstorage_size) {
+        size_t wsize = 0;
+        RS_GUARD(write_io(conn, conn->wstorage, conn->wstorage_size, &wsize));
+        if (!wsize) {
+            return RS_OK;
+        }
+        conn->wstorage_size -= wsize;
+        memmove(conn->wstorage, conn->wstorage + wsize, conn->wstorage_size);
+    }
+    RS_FREE(conn->wstorage);
+    return RS_OK;
+}
+
+static size_t get_random_msg_size(
+    struct rst_thread * t
+) {
+    struct rst_scenario const * scen = t->run->scen;
+    size_t w = get_random(t) % scen->total_weight;
+    for (struct rst_msg_size const * s = scen->msg_sizes;; s++) {
+        if (w < s->weight) {
+            return s->size;
+        }
+        w -= s->weight;
+    }
+}
+
+static rs_ret send_msg(
+    struct rst_thread * t,
+    struct rst_conn * conn
+) {
+    if (conn->wstorage_size) {
+        t->stats.skipped_c++;
+        return RS_OK;
+    }
+    size_t const payload_size = get_random_msg_size(t);
+    uint32_t const mask_key = get_random(t);
+    uint8_t * payload = t->wbuf + rst_set_wsframe_cs_header(t->wbuf,
+        RS_WSFRAME_OPC_BIN, payload_size, mask_key);
+    memset(payload + RST_MSG_HEAD_SIZE, (uint8_t) conn->sent_seq,
+        payload_size - RST_MSG_HEAD_SIZE);
+    uint64_t const time_ns = get_time_ns();
+    memcpy(payload, &time_ns, 8);
+    memcpy(payload + 8, &conn->sent_seq, 8);
+    rst_mask_wsframe_payload(payload, payload_size, (uint8_t *) &mask_key);
+    conn->sent_seq++;
+    t->outstanding_c++;
+    t->stats.sent_c++;
+    t->stats.sent_byte_c += payload_size;
+    return write_conn(conn, t->wbuf, payload + payload_size - t->wbuf);
+}
+
+static rs_ret receive_echo(
+    struct rst_thread * t,
+    struct rst_conn * conn,
+    uint8_t const * payload,
+    uint64_t payload_size
+) {
+    uint64_t const time_ns = get_time_ns();
+    t->stats.recv_c++;
+    t->stats.recv_byte_c += payload_size;
+    if (conn->recv_seq == conn->sent_seq) {
+        RS_LOG(LOG_WARNING, "Received an unsolicited message on port %" PRIu16,
+            conn->port);
+        t->stats.corrupt_c++;
+        return RS_OK;
+    }
+    uint64_t sent_time_ns = 0;
+    uint64_t seq = UINT64_MAX;
+    if (payload_size >= RST_MSG_HEAD_SIZE) {
+        memcpy(&sent_time_ns, payload, 8);
+        memcpy(&seq, payload + 8, 8);
+    }
+    bool is_corrupt = seq != conn->recv_seq;
+    for (size_t i = RST_MSG_HEAD_SIZE; i < payload_size && !is_corrupt; i++) {
+        is_corrupt = payload[i] != (uint8_t) seq;
+    }
+    conn->recv_seq++;
+    t->outstanding_c--;
+    if (is_corrupt) {
+        RS_LOG(LOG_WARNING, "Received a corrupt echo of %" PRIu64 " bytes on "
+            "port %" PRIu16, payload_size, conn->port);
+        t->stats.corrupt_c++;
+    } else {
+        rs_record_latency(&t->histogram, sent_time_ns, time_ns);
+    }
+    if (t->run->scen->msg_rate || t->phase != RST_PHASE_MEASURE) {
+        return RS_OK;
+    }
+    return send_msg(t, conn); // Closed-loop
+}
+
+static rs_ret receive_frame(
+    struct rst_thread * t,
+    struct rst_conn * conn,
+    uint8_t * frame,
+    uint64_t header_size,
+    uint64_t payload_size,
+    uint64_t frame_size
+) {
+    if (t->run->scen->mode == RST_MODE_ECHO) {
+        return receive_echo(t, conn, frame + header_size, payload_size);
+    }
+    if (t->phase == RST_PHASE_MEASURE) {
+        t->stats.recv_c++;
+        t->stats.recv_byte_c += payload_size;
+        t->stats.sent_c++;
+        t->stats.sent_byte_c += payload_size;
+    }
+    return write_conn(conn, rst_mask_wsframe_in_place(frame, header_size,
+        payload_size, get_random(t)), frame_size + RST_WS_MASK_KEY_SIZE);
+}
+
+// Parse whatever frames are received in full between *frame and next_read,
+// leaving *frame pointing at any remaining bytes of a partially received frame.
+static rs_ret parse_frames(
+    struct rst_thread * t,
+    struct rst_conn * conn,
+    uint8_t * * frame,
+    uint8_t const * next_read
+) {
+    if (conn->state != RST_READ_WS) {
+        size_t parsed_size = 0;
+        if (rst_parse_http_response(&conn->state, *frame, next_read - *frame,
+            &parsed_size) == RS_AGAIN) {
+            *frame += next_read - *frame;
+            return RS_OK;
+        }
+        RS_LOG(LOG_DEBUG, "HTTP handshake completed for socket fd %d on port %"
+            PRIu16, conn->fd, conn->port);
+        *frame += parsed_size;
+        conn->phase = RST_CONN_OPEN;
+        t->pending_c--;
+        t->open_c++;
+        t->stats.conn_c++;
+    }
+    for (uint64_t header_size = 0, payload_size = 0, frame_size = 0;
+        *frame < next_read; *frame += frame_size) {
+        switch (rst_parse_wsframe(*frame, next_read, &header_size,
+            &payload_size, &frame_size)) {
+        case RS_OK:
+            RS_GUARD(receive_frame(t, conn, *frame, header_size, payload_size,
+                frame_size));
+            continue;
+        case RS_AGAIN:
+            return RS_OK;
+        case RS_CLOSE_PEER:
+            RS_LOG(LOG_INFO, "Received WebSocket Close frame on port %" PRIu16,
+                conn->port);
+            return RS_CLOSE_PEER;
+        default:
+            RS_LOG(LOG_WARNING, "Received unexpected opcode %d on port %"
+                PRIu16, rs_get_wsframe_opcode((union rs_wsframe *) *frame),
+                conn->port);
+            return RS_CLOSE_PEER;
+        }
+    }
+    return RS_OK;
+}
+
+static rs_ret read_conn(
+    struct rst_thread * t,
+    struct rst_conn * conn
+) {
+    uint8_t * const wsbuf = t->rwbuf + RST_WS_MASK_KEY_SIZE;
+    uint8_t * const wsbuf_over = t->rwbuf + t->run->rwbuf_size;
+    uint8_t * next_read = wsbuf;
+    if (conn->rstorage) {
+        memcpy(wsbuf, conn->rstorage, conn->rstorage_size);
+        next_read += conn->rstorage_size;
+        RS_FREE(conn->rstorage);
+    }
+    uint8_t * frame = wsbuf;
+    for (;;) {
+        size_t rsize = 0;
+        switch (read_io(conn, next_read, wsbuf_over - next_read, &rsize)) {
+        case RS_OK:
+            next_read += rsize;
+            if (next_read < wsbuf_over) {
+                continue;
+            }
+            // Make room by parsing whatever frames are complete already.
+            RS_GUARD(parse_frames(t, conn, &frame, next_read));
+            if (frame == wsbuf) {
+                RS_LOG(LOG_ERR, "The configured rwbuf_size of %zu is too small "
+                    "for the size of the messages received.",
+                    t->run->rwbuf_size);
+                return RS_FATAL;
+            }
+            memmove(wsbuf, frame, next_read - frame);
+            next_read = wsbuf + (next_read - frame);
+            frame = wsbuf;
+            continue;
+        case RS_AGAIN:
+            break;
+        default:
+            return RS_CLOSE_PEER;
+        }
+        break;
+    }
+    RS_GUARD(parse_frames(t, conn, &frame, next_read));
+    conn->rstorage_size = next_read - frame;
+    if (conn->rstorage_size) {
+        conn->rstorage = malloc(conn->rstorage_size);
+        if (!conn->rstorage) {
+            RS_LOG(LOG_ERR, "Unsuccessful malloc(%zu)", conn->rstorage_size);
+            return RS_FATAL;
+        }
+        memcpy(conn->rstorage, frame, conn->rstorage_size);
+    }
+    return RS_OK;
+}
+
+static void close_conn(
+    struct rst_thread * t,
+    struct rst_conn * conn
+) {
+    switch (conn->phase) {
+    case RST_CONN_UNOPENED:
+        t->next_conn_i++;
+        // Fall through
+    case RST_CONN_CONNECTING:
+    case RST_CONN_TLS_HANDSHAKE:
+    case RST_CONN_UPGRADING:
+        if (conn->phase != RST_CONN_UNOPENED) {
+            t->pending_c--;
+        }
+        t->stats.conn_fail_c++;
+        break;
+    case RST_CONN_OPEN:
+        t->open_c--;
+        if (t->phase != RST_PHASE_DRAIN) {
+            t->stats.drop_c++;
+        }
+        t->stats.lost_c += conn->sent_seq - conn->recv_seq;
+        t->outstanding_c -= conn->sent_seq - conn->recv_seq;
+        break;
+    default:
+        return;
+    }
+    if (conn->tls) {
+        SSL_free(conn->tls);
+        conn->tls = NULL;
+    }
+    if (conn->fd != -1 && close(conn->fd) == -1) {
+        RS_LOG_ERRNO(LOG_WARNING, "Unsuccessful close(%d)", conn->fd);
+    }
+    conn->fd = -1;
+    RS_FREE(conn->rstorage);
+    RS_FREE(conn->wstorage);
+    conn->rstorage_size = conn->wstorage_size = 0;
+    conn->phase = RST_CONN_CLOSED;
+}
+
+static rs_ret open_conn(
+    struct rst_thread * t,
+    struct rst_conn * conn
+) {
+    struct rst_run const * run = t->run;
+    conn->fd = socket(run->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (conn->fd == -1) {
+        RS_LOG_ERRNO(LOG_WARNING, "Unsuccessful socket(...)");
+        return RS_CLOSE_PEER;
+    }
+    struct sockaddr_in const * dst = (struct sockaddr_in const *) &run->addr;
+    if (run->source_addr_c && dst->sin_family == AF_INET &&
+        RS_NTOH32(dst->sin_addr.s_addr) >> 24 == 127) {
+        size_t const global_conn_i =
+            (size_t) run->thread_c * (conn - t->conns) + t->thread_i;
+        struct sockaddr_in src = {
+            .sin_family = AF_INET,
+            .sin_addr = {
+                .s_addr = RS_HTON32(0x7F000001 +
+                    (uint32_t) (global_conn_i % run->source_addr_c))
+            }
+        };
+        // Let connect() pick the port, allowing the same port to be reused
+        // across different source addresses.
+        if (setsockopt(conn->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &(int){1},
+            sizeof(int)) == -1) {
+            RS_LOG_ERRNO(LOG_WARNING, "Unsuccessful setsockopt(%d, IPPROTO_IP, "
+                "IP_BIND_ADDRESS_NO_PORT, ...)", conn->fd);
+        }
+        if (bind(conn->fd, (struct sockaddr *) &src, sizeof(src)) == -1) {
+            RS_LOG_ERRNO(LOG_WARNING, "Unsuccessful bind(%d, ...)", conn->fd);
+            return RS_CLOSE_PEER;
+        }
+    }
+    conn->phase = RST_CONN_CONNECTING;
+    t->pending_c++;
+    t->next_conn_i++;
+    if (connect(conn->fd, (struct sockaddr const *) &run->addr, run->addr_size)
+        == -1 && errno != EINPROGRESS) {
+        RS_LOG_ERRNO(LOG_WARNING, "Unsuccessful connect(%d, ...)", conn->fd);
+        return RS_CLOSE_PEER;
+    }
+    struct epoll_event event = {
+        .data = {.ptr = conn},
+        .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET
+    };
+    if (epoll_ctl(t->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) == -1) {
+        RS_LOG_ERRNO(LOG_ERR, "Unsuccessful epoll_ctl(%d, EPOLL_CTL_ADD, %d, "
+            "&event)", t->epoll_fd, conn->fd);
+        return RS_FATAL;
+    }
+    return RS_OK;
+}
+
+static rs_ret open_conns(
+    struct rst_thread * t
+) {
+    while (t->pending_c < RST_MAX_PENDING_CONN_C &&
+        t->next_conn_i < t->conn_c) {
+        struct rst_conn * conn = t->conns + t->next_conn_i;
+        switch (open_conn(t, conn)) {
+        case RS_OK:
+            continue;
+        case RS_CLOSE_PEER:
+            close_conn(t, conn);
+            continue;
+        default:
+            return RS_FATAL;
+        }
+    }
+    return RS_OK;
+}
+
+static rs_ret send_upgrade_request(
+    struct rst_thread * t,
+    struct rst_conn * conn
+) {
+    conn->phase = RST_CONN_UPGRADING;
+    int http_strlen = rst_sprint_http_upgrade_request((char *) t->wbuf,
+        &t->run->scen->endpoint);
+    return write_conn(conn, t->wbuf, http_strlen);
+}
+
+static rs_ret handshake_tls(
+    struct rst_thread * t,
+    struct rst_conn * conn
+) {
+    int ret = SSL_do_handshake(conn->tls);
+    if (ret == 1) {
+        return send_upgrade_request(t, conn);
+    }
+    switch (SSL_get_error(conn->tls, ret)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return RS_OK;
+    default:
+        RS_LOG(LOG_INFO, "Unsuccessful SSL_do_handshake() on port %" PRIu16
+            ": %s", conn->port, ERR_reason_error_string(ERR_get_error()));
+        ERR_clear_error();
+        return RS_CLOSE_PEER;
+    }
+}
+
+static rs_ret start_tls(
+    struct rst_thread * t,
+    struct rst_conn * conn
+) {
+    conn->phase = RST_CONN_TLS_HANDSHAKE;
+    conn->tls = SSL_new(t->run->tls_ctx);
+    if (!conn->tls) {
+        RS_LOG(LOG_ERR, "Unsuccessful SSL_new(): %s",
+            ERR_reason_error_string(ERR_get_error()));
+        return RS_FATAL;
+    }
+    if (!SSL_set_fd(conn->tls, conn->fd)) {
+        RS_LOG(LOG_ERR, "Unsuccessful SSL_set_fd(tls, %d)", conn->fd);
+        return RS_FATAL;
+    }
+    {
+        // Server Name Indication: the hostname without any port suffix
+        char const * hostname = t->run->scen->endpoint.hostname;
+        char sni[256] = {0};
+        size_t const hostname_strlen = strcspn(hostname, ":");
+        memcpy(sni, hostname, RS_MIN(hostname_strlen, sizeof(sni) - 1));
+        SSL_set_tlsext_host_name(conn->tls, sni);
+    }
+    SSL_set_connect_state(conn->tls);
+    return handshake_tls(t, conn);
+}
+
+static rs_ret complete_connect(
+    struct rst_thread * t,
+    struct rst_conn * conn
+) {
+    int err = 0;
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err,
+        &(socklen_t){sizeof(err)}) == -1 || err) {
+        errno = err ? err : errno;
+        RS_LOG_ERRNO(LOG_INFO, "Unsuccessful connect(%d, ...)", conn->fd);
+        return RS_CLOSE_PEER;
+    }
+    struct sockaddr_storage addr = {0};
+    if (getsockname(conn->fd, (struct sockaddr *) &addr,
+        &(socklen_t){sizeof(addr)}) == -1) {
+        RS_LOG_ERRNO(LOG_WARNING, "Unsuccessful getsockname(%d, ...)",
+            conn->fd);
+        return RS_CLOSE_PEER;
+    }
+    conn->port = RS_NTOH16(addr.ss_family == AF_INET6 ?
+        ((struct sockaddr_in6 *) &addr)->sin6_port :
+        ((struct sockaddr_in *) &addr)->sin_port
+    );
+    return t->run->scen->endpoint.is_encrypted ?
+        start_tls(t, conn) : send_upgrade_request(t, conn);
+}
+
+static rs_ret handle_event(
+    struct rst_thread * t,
+    struct rst_conn * conn,
+    uint32_t events
+) {
+    if (events & EPOLLERR) {
+        int err = 0;
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err,
+            &(socklen_t){sizeof(err)});
+        errno = err;
+        RS_LOG_ERRNO(LOG_INFO, "Received EPOLLERR for fd %d on port %" PRIu16,
+            conn->fd, conn->port);
+        return RS_CLOSE_PEER;
+    }
+    switch (conn->phase) {
+    case RST_CONN_CONNECTING:
+        if (!(events & EPOLLOUT)) {
+            return RS_OK;
+        }
+        RS_GUARD(complete_connect(t, conn));
+        break;
+    case RST_CONN_TLS_HANDSHAKE:
+        RS_GUARD(handshake_tls(t, conn));
+        if (conn->phase == RST_CONN_TLS_HANDSHAKE) {
+            return RS_OK;
+        }
+        break;
+    case RST_CONN_UPGRADING:
+    case RST_CONN_OPEN:
+        RS_GUARD(flush_conn(conn));
+        break;
+    default:
+        return RS_OK;
+    }
+    RS_GUARD(read_conn(t, conn));
+    if (events & (EPOLLHUP | EPOLLRDHUP)) {
+        RS_LOG(LOG_INFO, "Received EPOLLHUP or EPOLLRDHUP for fd %d on port %"
+            PRIu16, conn->fd, conn->port);
+        return RS_CLOSE_PEER;
+    }
+    return RS_OK;
+}
+
+static rs_ret send_due_msgs(
+    struct rst_thread * t,
+    uint64_t now_ns
+) {
+    double const rate = t->run->scen->msg_rate * t->open_c;
+    uint64_t const due_c = 1e-9 * rate * (now_ns - t->start_ns);
+    while (t->scheduled_c < due_c && t->open_c) {
+        struct rst_conn * conn = t->conns + t->cursor++;
+        t->cursor %= t->conn_c;
+        if (conn->phase != RST_CONN_OPEN) {
+            continue;
+        }
+        t->scheduled_c++;
+        switch (send_msg(t, conn)) {
+        case RS_OK:
+            continue;
+        case RS_CLOSE_PEER:
+            close_conn(t, conn);
+            continue;
+        default:
+            return RS_FATAL;
+        }
+    }
+    return RS_OK;
+}
+
+static rs_ret start_measuring(
+    struct rst_thread * t,
+    uint64_t start_ns
+) {
+    t->phase = RST_PHASE_MEASURE;
+    t->start_ns = start_ns;
+    if (t->run->scen->mode != RST_MODE_ECHO || t->run->scen->msg_rate) {
+        return RS_OK;
+    }
+    // Closed-loop: send every connection its first message.
+    for (struct rst_conn * conn = t->conns; conn < t->conns + t->conn_c;
+        conn++) {
+        if (conn->phase != RST_CONN_OPEN) {
+            continue;
+        }
+        switch (send_msg(t, conn)) {
+        case RS_OK:
+            continue;
+        case RS_CLOSE_PEER:
+            close_conn(t, conn);
+            continue;
+        default:
+            return RS_FATAL;
+        }
+    }
+    return RS_OK;
+}
+
+static int get_epoll_timeout_ms(
+    struct rst_thread const * t,
+    uint64_t now_ns
+) {
+    if (t->phase != RST_PHASE_MEASURE || !t->run->scen->msg_rate ||
+        !t->open_c) {
+        return RST_MAX_EPOLL_TIMEOUT_MS;
+    }
+    double const rate = t->run->scen->msg_rate * t->open_c;
+    uint64_t const due_ns = t->start_ns + 1e9 * (t->scheduled_c + 1) / rate;
+    if (due_ns <= now_ns) {
+        return 0;
+    }
+    return RS_MIN((int) ((due_ns - now_ns + 999999) / 1000000),
+        RST_MAX_EPOLL_TIMEOUT_MS);
+}
+
+// Returns RS_CLOSE_PEER once this thread is done with the current scenario.
+static rs_ret update_phase(
+    struct rst_thread * t,
+    uint64_t now_ns,
+    uint64_t connect_deadline_ns,
+    uint64_t * drain_deadline_ns
+) {
+    struct rst_run * run = t->run;
+    switch (t->phase) {
+    case RST_PHASE_CONNECT:
+        if (t->pending_c || t->next_conn_i < t->conn_c) {
+            if (now_ns < connect_deadline_ns) {
+                RS_GUARD(open_conns(t));
+                return RS_OK;
+            }
+            RS_LOG(LOG_WARNING, "Giving up on %zu connections not yet "
+                "established within %ds", t->pending_c + t->conn_c -
+                t->next_conn_i, (int) (RST_CONNECT_TIMEOUT_NS / 1000000000));
+            for (struct rst_conn * conn = t->conns;
+                conn < t->conns + t->conn_c; conn++) {
+                if (conn->phase != RST_CONN_OPEN) {
+                    close_conn(t, conn);
+                }
+            }
+        }
+        t->phase = RST_PHASE_WAIT;
+        if (atomic_fetch_add(&run->connected_thread_c, 1) ==
+            run->thread_c - 1) {
+            // This is the last thread to finish connecting: start measuring.
+            atomic_store(&run->start_ns, now_ns);
+        }
+        // Fall through
+    case RST_PHASE_WAIT:
+        {
+            uint64_t const start_ns = atomic_load(&run->start_ns);
+            if (!start_ns) {
+                return atomic_load(&run->has_failed) ? RS_FATAL : RS_OK;
+            }
+            RS_GUARD(start_measuring(t, start_ns));
+        }
+        // Fall through
+    case RST_PHASE_MEASURE:
+        if (now_ns - t->start_ns < 1000000000 * run->scen->duration_sec) {
+            return run->scen->msg_rate ? send_due_msgs(t, now_ns) : RS_OK;
+        }
+        t->phase = RST_PHASE_DRAIN;
+        *drain_deadline_ns = now_ns + RST_DRAIN_TIMEOUT_NS;
+        // Fall through
+    case RST_PHASE_DRAIN: default:
+        if (t->outstanding_c && now_ns < *drain_deadline_ns) {
+            return RS_OK;
+        }
+        for (struct rst_conn * conn = t->conns; conn < t->conns + t->conn_c;
+            conn++) {
+            close_conn(t, conn);
+        }
+        return RS_CLOSE_PEER; // Done
+    }
+}
+
+static rs_ret _run_thread(
+    struct rst_thread * t
+) {
+    struct rst_run * run = t->run;
+    t->epoll_fd = epoll_create1(0);
+    if (t->epoll_fd == -1) {
+        RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful epoll_create1(0)");
+        return RS_FATAL;
+    }
+    for (struct rst_conn * conn = t->conns; conn < t->conns + t->conn_c;
+        conn++) {
+        conn->fd = -1;
+    }
+    uint64_t const connect_deadline_ns = get_time_ns() + RST_CONNECT_TIMEOUT_NS;
+    uint64_t drain_deadline_ns = 0;
+    RS_GUARD(open_conns(t));
+    for (;;) {
+        int event_c = epoll_wait(t->epoll_fd, t->epoll_buf,
+            run->epoll_buf_elem_c, get_epoll_timeout_ms(t, get_time_ns()));
+        if (event_c == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            RS_LOG_ERRNO(LOG_CRIT, "Unsuccessful epoll_wait(%d, epoll_buf, "
+                "%zu, ...)", t->epoll_fd, run->epoll_buf_elem_c);
+            return RS_FATAL;
+        }
+        for (struct epoll_event * e = t->epoll_buf; e < t->epoll_buf + event_c;
+            e++) {
+            struct rst_conn * conn = e->data.ptr;
+            switch (handle_event(t, conn, e->events)) {
+            case RS_OK:
+                continue;
+            case RS_CLOSE_PEER:
+                close_conn(t, conn);
+                continue;
+            default:
+                return RS_FATAL;
+            }
+        }
+        switch (update_phase(t, get_time_ns(), connect_deadline_ns,
+            &drain_deadline_ns)) {
+        case RS_OK:
+            continue;
+        case RS_CLOSE_PEER:
+            return RS_OK;
+        default:
+            return RS_FATAL;
+        }
+    }
+}
+
+static int run_thread(
+    void * arg
+) {
+    struct rst_thread * t = arg;
+    rs_ret ret = _run_thread(t);
+    if (ret != RS_OK) {
+        // Prevent any other threads from waiting for this one forever.
+        atomic_store(&t->run->has_failed, true);
+    }
+    if (t->epoll_fd != -1) {
+        close(t->epoll_fd);
+    }
+    return ret;
+}
+
+static void print_results(
+    struct rst_scenario const * scen,
+    struct rst_stats const * s,
+    uint64_t const * hist,
+    double setup_sec
+) {
+    uint64_t count = 0;
+    for (size_t i = 0; i < RS_HISTOGRAM_BUCKET_C; i++) {
+        count += hist[i];
+    }
+    printf("%-31s %-6s %7" PRIu64 " %7" PRIu64 " %7" PRIu64 " %7.2f "
+        "%11.1f %9.2f", scen->name,
+        scen->mode == RST_MODE_ECHO ? "echo" : "bounce", s->conn_c,
+        s->conn_fail_c, s->drop_c, setup_sec,
+        (double) s->recv_c / scen->duration_sec,
+        1e-6 * s->recv_byte_c / scen->duration_sec);
+    if (count) {
+        printf(" %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64,
+            rs_get_histogram_quantile(hist, NULL, count, .5),
+            rs_get_histogram_quantile(hist, NULL, count, .99),
+            rs_get_histogram_quantile(hist, NULL, count, .999),
+            rs_get_histogram_quantile(hist, NULL, count, 1));
+    } else {
+        printf(" %10s %10s %10s %10s", "-", "-", "-", "-");
+    }
+    printf(" %9" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n", s->skipped_c,
+        s->corrupt_c, s->lost_c);
+    fflush(stdout);
+}
+
+static rs_ret run_scenario(
+    struct rst_run * run,
+    struct rst_thread * threads,
+    bool * is_corrupt
+) {
+    RS_GUARD(resolve_endpoint(run));
+    uint64_t const setup_start_ns = get_time_ns();
+    for (uint16_t i = 0; i < run->thread_c; i++) {
+        struct rst_thread * t = threads + i;
+        // Distribute connections such that connection N of the scenario as a
+        // whole is connection N / thread_c of thread N % thread_c.
+        t->conn_c = run->scen->client_c / run->thread_c +
+            (i < run->scen->client_c % run->thread_c);
+        RS_CALLOC(t->conns, RS_MAX(t->conn_c, 1));
+        if (thrd_create(&t->thrd, run_thread, t) != thrd_success) {
+            RS_LOG(LOG_CRIT, "Unsuccessful thrd_create()");
+            return RS_FATAL;
+        }
+    }
+    rs_ret ret = RS_OK;
+    for (uint16_t i = 0; i < run->thread_c; i++) {
+        int thread_ret = RS_FATAL;
+        thrd_join(threads[i].thrd, &thread_ret);
+        if (thread_ret != RS_OK) {
+            ret = RS_FATAL;
+        }
+    }
+    if (ret != RS_OK) {
+        return RS_FATAL;
+    }
+    struct rst_stats total = {0};
+    uint64_t hist[RS_HISTOGRAM_BUCKET_C] = {0};
+    for (struct rst_thread * t = threads; t < threads + run->thread_c; t++) {
+        for (uint64_t * dst = (uint64_t *) &total, * src =
+            (uint64_t *) &t->stats; dst < (uint64_t *) (&total + 1); ) {
+            *dst++ += *src++;
+        }
+        for (size_t i = 0; i < RS_HISTOGRAM_BUCKET_C; i++) {
+            hist[i] += atomic_load_explicit(t->histogram.bucket_c + i,
+                memory_order_relaxed);
+        }
+        RS_FREE(t->conns);
+    }
+    print_results(run->scen, &total, hist,
+        1e-9 * (atomic_load(&run->start_ns) - setup_start_ns));
+    *is_corrupt |= total.corrupt_c;
+    return RS_OK;
+}
+
+static rs_ret _main(
+    int arg_c,
+    char * const * args
+) {
+    if (arg_c > 2) {
+        RS_LOG(LOG_WARNING, "%s received %d command-line arguments, but can "
+            "handle only one: the path to the configuration file -- which in "
+            "this case is assumed to be: \"%s\". Ignoring all other arguments!",
+            args[0], arg_c, args[1]);
+    }
+
+    struct rst_run run = {0};
+    struct rst_scenario * scens = NULL;
+    size_t scen_c = 0;
+    RS_GUARD(get_conf(arg_c > 1 ? args[1] : NULL, &run.rwbuf_size,
+        &run.epoll_buf_elem_c, &run.thread_c, &run.source_addr_c, &scens,
+        &scen_c));
+
+    size_t max_client_c = 0;
+    for (struct rst_scenario * s = scens; s < scens + scen_c; s++) {
+        max_client_c = RS_MAX(max_client_c, s->client_c);
+        if (s->endpoint.is_encrypted && !run.tls_ctx) {
+            run.tls_ctx = SSL_CTX_new(TLS_client_method());
+            if (!run.tls_ctx) {
+                RS_LOG(LOG_ERR, "Unsuccessful SSL_CTX_new(): %s",
+                    ERR_reason_error_string(ERR_get_error()));
+                return RS_FATAL;
+            }
+            // Loopback load testing only: certificates are not verified.
+            SSL_CTX_set_verify(run.tls_ctx, SSL_VERIFY_NONE, NULL);
+            SSL_CTX_set_mode(run.tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        }
+    }
+    raise_fd_limit(max_client_c);
+
+    struct rst_thread * threads = NULL;
+    RS_CALLOC(threads, run.thread_c);
+    for (uint16_t i = 0; i < run.thread_c; i++) {
+        struct rst_thread * t = threads + i;
+        t->thread_i = i;
+        RS_CALLOC(t->rwbuf, run.rwbuf_size);
+        RS_CALLOC(t->wbuf, run.rwbuf_size);
+        RS_CALLOC(t->epoll_buf, run.epoll_buf_elem_c);
+    }
+
+    printf("# %s: %u thread(s); %u source address(es); round trip latency "
+        "percentiles in ns, as histogram bucket upper bounds\n", args[0],
+        run.thread_c, run.source_addr_c);
+    printf("%-31s %-6s %7s %7s %7s %7s %11s %9s %10s %10s %10s %10s "
+        "%9s %9s %9s\n", "scenario", "mode", "conn_c", "failed", "dropped",
+        "setup_s", "msg/s", "MB/s", "p50", "p99", "p99.9", "max", "skipped",
+        "corrupt", "lost");
+    bool is_corrupt = false;
+    for (struct rst_scenario * s = scens; s < scens + scen_c; s++) {
+        run.scen = s;
+        atomic_store(&run.connected_thread_c, 0);
+        atomic_store(&run.start_ns, 0);
+        atomic_store(&run.has_failed, false);
+        for (uint16_t i = 0; i < run.thread_c; i++) {
+            struct rst_thread * t = threads + i;
+            *t = (struct rst_thread){
+                .run = &run,
+                .rwbuf = t->rwbuf,
+                .wbuf = t->wbuf,
+                .epoll_buf = t->epoll_buf,
+                .epoll_fd = -1,
+                .rng = (0x9E3779B97F4A7C15 * (i + 1) ^ get_time_ns()) | 1,
+                .thread_i = i
+            };
+        }
+        RS_GUARD(run_scenario(&run, threads, &is_corrupt));
+    }
+    return is_corrupt ? RS_FATAL : RS_OK;
+}
+
+int main(
+    int arg_c, // 1 or 2
+    char * * args // "rst_client_load" and optionally the path to the conf file
+) {
+    openlog(args[0], LOG_PID, LOG_USER);
+    return _main(arg_c, args) == RS_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,214 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+// This program checks the zero-copy rs_reserve_...() and rs_commit() functions
+// of ringsocket.h, together with the rs_close_peer() that app callbacks trigger
+// by returning a WebSocket close code, without a running RingSocket server: it
+// plays the part of an app thread with a single worker thread, and then that
+// of the worker thread consuming what was written to its outbound ring. It does
+// so for each of the following cases:
+// * Committing a payload as large as reserved, and ones small enough to need a
+//   shorter frame head than reserved for (i.e., for which the payload is moved
+//   left), for every combination of the 3 frame head sizes.
+// * Closing the current peer right after such a commit: the close frame must
+//   follow the committed message on the same outbound ring.
+// * Attempting to close the current peer while a reservation is still pending,
+//   and returning from a callback while one is: both must fail with RS_FATAL
+//   without anything being written to the outbound ring, whereas committing
+//   the reservation afterwards must still succeed as usual.
+//
+// Usage: rst_reserve
+//
+// The exit status is EXIT_FAILURE if any check fails. (Rejected attempts are
+// logged at LOG_ERR as usual, so expect those log lines to be present.)
+
+#include <ringsocket.h>
+
+#include <stdio.h> // printf()
+
+#define RST_PEER_I 7
+#define RST_CLOSE_CODE 4000
+
+RS_LOG_VARS; // See the RS_LOG() section in ringsocket_api.h for explanation.
+
+struct rst_check {
+    rs_t * rs;
+    struct rs_ring_consumer cons;
+    size_t fail_c;
+};
+
+struct rst_case {
+    uint64_t reserve_size;
+    uint64_t commit_size;
+};
+
+static struct rst_case const cases[] = {
+    {100, 100}, {200, 100}, {70000, 100},
+    {1000, 1000}, {70000, 1000}, {70000, 70000}
+};
+
+static void check(
+    struct rst_check * c,
+    bool is_ok,
+    char const * description
+) {
+    if (!is_ok) {
+        printf("FAILED: %s\n", description);
+        c->fail_c++;
+    }
+}
+
+static uint8_t get_payload_byte(
+    uint64_t reserve_size,
+    uint64_t i
+) {
+    return (reserve_size + i) % 251;
+}
+
+// Consume the next outbound ring message, and return the frame it holds for
+// peer_i RST_PEER_I, or NULL if no (valid) message exists.
+static union rs_wsframe const * consume_frame(
+    struct rst_check * c,
+    enum rs_wsframe_opcode opcode
+) {
+    struct rs_consumer_msg * cmsg =
+        rs_consume_ring_msg(&c->rs->ring_pairs[0]->outbound_ring, &c->cons);
+    if (!cmsg) {
+        check(c, false, "missing outbound ring message");
+        return NULL;
+    }
+    uint32_t peer_i = 0;
+    memcpy(&peer_i, cmsg->msg + 1, 4);
+    union rs_wsframe const * frame = (union rs_wsframe *) (cmsg->msg + 5);
+    bool const is_ok = *cmsg->msg == RS_OUTBOUND_SINGLE &&
+        peer_i == RST_PEER_I && rs_get_wsframe_is_final(frame) &&
+        rs_get_wsframe_opcode(frame) == opcode &&
+        5 + rs_get_wsframe_sc_size(frame) == cmsg->size;
+    check(c, is_ok, "outbound ring message layout");
+    return is_ok ? frame : NULL;
+}
+
+static void check_committed(
+    struct rst_check * c,
+    struct rst_case const * rc
+) {
+    union rs_wsframe const * frame = consume_frame(c, RS_WSFRAME_OPC_BIN);
+    if (!frame) {
+        return;
+    }
+    uint64_t const payload_size = rs_get_wsframe_payload_size(frame);
+    check(c, payload_size == rc->commit_size, "committed payload size");
+    check(c, rs_get_wsframe_sc_size(frame) ==
+        rs_get_wsframe_sc_size_from_payload_size(rc->commit_size),
+        "minimal frame head size");
+    uint8_t const * payload = (uint8_t const *) frame +
+        rs_get_wsframe_sc_size(frame) - payload_size;
+    for (uint64_t i = 0; i < payload_size; i++) {
+        if (payload[i] != get_payload_byte(rc->reserve_size, i)) {
+            check(c, false, "committed payload contents");
+            return;
+        }
+    }
+}
+
+static void check_closed(
+    struct rst_check * c
+) {
+    union rs_wsframe const * frame = consume_frame(c, RS_WSFRAME_OPC_CLOSE);
+    if (!frame) {
+        return;
+    }
+    check(c, rs_get_wsframe_payload_size(frame) == 2 &&
+        RS_R_NTOH16(frame->sc_small.payload) == RST_CLOSE_CODE,
+        "close frame status code");
+}
+
+static void reserve(
+    struct rst_check * c,
+    struct rst_case const * rc
+) {
+    uint8_t * payload = rs_reserve_cur(c->rs, rc->reserve_size);
+    for (uint64_t i = 0; i < rc->commit_size; i++) {
+        payload[i] = get_payload_byte(rc->reserve_size, i);
+    }
+}
+
+static void check_case(
+    struct rst_check * c,
+    struct rst_case const * rc
+) {
+    rs_t * rs = c->rs;
+    printf("Reserving %" PRIu64 " bytes, committing %" PRIu64 " bytes\n",
+        rc->reserve_size, rc->commit_size);
+
+    // Reserve, commit, close
+    reserve(c, rc);
+    rs_commit(rs, RS_BIN, rc->commit_size);
+    check(c, rs_close_peer(rs, RST_CLOSE_CODE) == RS_OK,
+        "closing after committing");
+    check_committed(c, rc);
+    check_closed(c);
+
+    // Reserve, close (rejected), return from a callback (rejected), commit
+    reserve(c, rc);
+    uint8_t const * w = rs->outbound_producers->w;
+    check(c, rs_close_peer(rs, RST_CLOSE_CODE) == RS_FATAL,
+        "rejecting closing while reserved");
+    check(c, rs_guard_peer_cb(rs, RST_CLOSE_CODE) == RS_FATAL,
+        "rejecting a close code returned while reserved");
+    check(c, rs_guard_peer_cb(rs, 0) == RS_FATAL,
+        "rejecting a callback return while reserved");
+    check(c, rs->outbound_producers->w == w,
+        "leaving the outbound ring alone while reserved");
+    check(c, !rs_consume_ring_msg(&rs->ring_pairs[0]->outbound_ring, &c->cons),
+        "publishing nothing while reserved");
+    rs_commit(rs, RS_BIN, rc->commit_size);
+    check(c, rs_guard_peer_cb(rs, 0) == RS_OK,
+        "accepting a callback return after committing");
+    check_committed(c, rc);
+}
+
+int main(
+    void
+) {
+    struct rs_conf conf = {
+        .outbound_ring_buf_size = 0x40000,
+        .max_ws_msg_size = 0x100000,
+        .realloc_multiplier = 1.5,
+        .worker_c = 1
+    };
+    struct rs_ring_pair * pair = NULL;
+    struct rs_sleep_state * sleep_state = NULL; // Never asleep: no wake-ups
+    struct rs_ring_pair_metrics * ring_metrics = NULL;
+    struct rs_ring_queue queue = {0};
+    int const eventfds[1] = {-1}; // Never written to: see sleep_state
+    RS_CACHE_ALIGNED_CALLOC(pair, 1);
+    RS_CACHE_ALIGNED_CALLOC(sleep_state, 1);
+    RS_CACHE_ALIGNED_CALLOC(ring_metrics, 1);
+    if (rs_init_ring_queue(&queue, 1, 1, RS_RING_ORDERING_ACQUIRE_RELEASE) !=
+        RS_OK) {
+        return EXIT_FAILURE;
+    }
+    rs_t rs = {
+        .conf = &conf,
+        .ring_pairs = &pair,
+        .ring_queue = &queue,
+        .worker_sleep_states = sleep_state,
+        .worker_eventfds = eventfds,
+        .ring_metrics = &ring_metrics,
+        .inbound_peer_i = RST_PEER_I,
+        .cb = RS_CB_READ
+    };
+    if (rs_init_outbound_producers(&rs) != RS_OK) {
+        return EXIT_FAILURE;
+    }
+    struct rst_check c = {
+        .rs = &rs,
+        .cons = {.r = rs.outbound_producers->ring}
+    };
+    for (size_t i = 0; i < RS_ELEM_C(cases); i++) {
+        check_case(&c, cases + i);
+    }
+    printf("%zu check(s) failed\n", c.fail_c);
+    return c.fail_c ? EXIT_FAILURE : EXIT_SUCCESS;
+}
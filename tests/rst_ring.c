@@ -0,0 +1,366 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+// This program benchmarks RingSocket's ring buffers as implemented by
+// ringsocket_ring.h and ringsocket_queue.h, by having a producer thread send
+// timestamped messages through a single ring buffer to a consumer thread, each
+// pinned to a CPU of its own. It does so for every combination of the
+// following parameters:
+// * The message size, of which the first 16 bytes hold a timestamp and a
+//   sequence number, and the rest a fill byte, all of which is verified by the
+//   consumer.
+// * The "update_queue_size" of both threads (see ringsocket_queue.h), as well
+//   as "ring_ordering" set to "acquire_release", for which update queues are
+//   irrelevant.
+// * The initial ring buffer size: starting out small enough to make the
+//   producer grow the ring buffer for lack of room, as happens to RingSocket's
+//   rings during bursts of traffic.
+// * The "realloc_multiplier" by which ring buffers grow.
+//
+// Every run reports its throughput, its per-message latency distribution from
+// production to consumption (recorded with the same log-linear histograms as
+// "latency_histograms": see ringsocket_metrics.h), its number of ring buffer
+// growth events, its final ring buffer size and its high-water mark. Like the
+// producer of a worker thread, the producer flushes its update queue after
+// every RST_BATCH_SIZE messages. (Both threads take a timestamp for every
+// message, which lowers throughput somewhat for the smallest messages.)
+//
+// Results are printed as comma-separated values with a header row, preceded
+// by a few lines starting with '#' that describe the environment; for easy
+// comparison between builds, compilers, CPUs and RS_CACHE_LINE_SIZE values.
+//
+// Usage: rst_ring [msg_c [producer_cpu consumer_cpu]]
+//
+// If no CPUs are given, the first two CPUs available are used; or if only one
+// is available, both threads share it, in which case the producer yields its
+// CPU after every batch and every ring buffer growth event.
+//
+// A run in which the producer fills up a whole new ring buffer before the
+// consumer is even known to have reached it fails with the same RS_FATAL as
+// RingSocket would, which is reported with a status of "fatal": a sign that
+// the ring buffer size is too small for the lag involved (which on a shared CPU
+// depends on the whims of the scheduler). In contrast, a status of "corrupt"
+// means the consumer encountered unexpected message contents, in which case
+// the exit status is EXIT_FAILURE.
+
+#define _GNU_SOURCE // CLOCK_MONOTONIC, sched_setaffinity(), CPU_SET()
+
+#include <ringsocket_metrics.h>
+
+#include <sched.h> // sched_getaffinity(), sched_setaffinity()
+#include <stdio.h> // printf()
+#include <threads.h> // thrd_create(), thrd_join(), thrd_yield()
+
+#define RST_DEFAULT_MSG_C 200000
+#define RST_BATCH_SIZE 16
+#define RST_MSG_HEAD_SIZE 16 // uint64_t time_ns, uint64_t seq
+
+static uint64_t const msg_sizes[] = {16, 128, 1024, 8192};
+// 0 stands for "ring_ordering" "acquire_release", the rest for "delayed".
+static uint8_t const update_queue_sizes[] = {0, 1, 2, 5, 16};
+static size_t const ring_sizes[] = {0x4000, 0x40000, 0x400000};
+static double const realloc_multipliers[] = {1.5, 2};
+
+RS_LOG_VARS; // See the RS_LOG() section in ringsocket_api.h for explanation.
+
+struct rst_run {
+    uint64_t msg_size;
+    size_t ring_size;
+    double realloc_multiplier;
+    uint8_t update_queue_size;
+};
+
+struct rst_bench {
+    struct rs_ring_pair * pair;
+    struct rs_sleep_state * sleep_states; // Never asleep: no wake-ups needed
+    struct rs_ring_producer prod;
+    struct rs_histogram * latencies; // Only stored to by the consumer
+    struct rst_run run;
+    uint64_t msg_c;
+    uint64_t consumed_c;
+    size_t grow_c;
+    size_t corrupt_c;
+    atomic_bool producer_failed;
+    bool shares_cpu;
+};
+
+static uint64_t get_time_ns(
+    void
+) {
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000000 * (uint64_t) ts.tv_sec + ts.tv_nsec;
+}
+
+static rs_ret init_queue(
+    struct rst_bench const * b,
+    struct rs_ring_queue * queue
+) {
+    return rs_init_ring_queue(queue, RS_MAX(b->run.update_queue_size, 1), 1,
+        b->run.update_queue_size ? RS_RING_ORDERING_DELAYED :
+        RS_RING_ORDERING_ACQUIRE_RELEASE);
+}
+
+static void free_queue(
+    struct rs_ring_queue * queue
+) {
+    RS_FREE(queue->updates);
+    RS_FREE(queue->pending_wake_is);
+    RS_FREE(queue->wake_is_pending);
+}
+
+static rs_ret _produce(
+    struct rst_bench * b,
+    struct rs_ring_queue * queue
+) {
+    uint64_t const msg_size = b->run.msg_size;
+    for (uint64_t i = 0; i < b->msg_c; i++) {
+        size_t const ring_size = b->prod.ring_size;
+        RS_GUARD(rs_produce_ring_msg(&b->pair->inbound_ring, &b->prod,
+            b->run.realloc_multiplier, 0, msg_size));
+        bool const has_grown = b->prod.ring_size != ring_size;
+        b->grow_c += has_grown;
+        uint64_t const time_ns = get_time_ns();
+        memcpy(b->prod.w, &time_ns, 8);
+        memcpy(b->prod.w + 8, &i, 8);
+        memset(b->prod.w + RST_MSG_HEAD_SIZE, (uint8_t) i,
+            msg_size - RST_MSG_HEAD_SIZE);
+        b->prod.w += msg_size;
+        RS_GUARD(rs_enqueue_ring_update(queue, &b->pair, b->sleep_states,
+            NULL, b->prod.w, 0, true));
+        if (!((i + 1) % RST_BATCH_SIZE) || (has_grown && b->shares_cpu)) {
+            RS_GUARD(rs_flush_ring_updates(queue, &b->pair, b->sleep_states,
+                NULL, 1));
+            if (b->shares_cpu) {
+                // Let the consumer catch up with (and move on to) the new ring.
+                thrd_yield();
+            }
+        }
+    }
+    return rs_flush_ring_updates(queue, &b->pair, b->sleep_states, NULL, 1);
+}
+
+static int produce(
+    void * arg
+) {
+    struct rst_bench * b = arg;
+    struct rs_ring_queue queue = {0};
+    rs_ret ret = init_queue(b, &queue);
+    if (ret == RS_OK) {
+        ret = _produce(b, &queue);
+    }
+    if (ret != RS_OK) {
+        // Prevent the consumer from waiting forever.
+        atomic_store(&b->producer_failed, true);
+    }
+    free_queue(&queue);
+    return ret;
+}
+
+static rs_ret _consume(
+    struct rst_bench * b,
+    struct rs_ring_queue * queue
+) {
+    int const eventfds[1] = {-1}; // Never written to: see sleep_states
+    struct rs_ring_consumer cons = {.r = b->prod.ring};
+    for (uint64_t i = 0; i < b->msg_c; b->consumed_c = i) {
+        struct rs_consumer_msg * cmsg =
+            rs_consume_ring_msg(&b->pair->inbound_ring, &cons);
+        if (!cmsg) {
+            if (atomic_load(&b->producer_failed)) {
+                return RS_FATAL;
+            }
+            // Share read progress with the producer while idle, as apps do.
+            RS_GUARD(rs_flush_ring_updates(queue, &b->pair, b->sleep_states,
+                eventfds, 1));
+            if (b->shares_cpu) {
+                thrd_yield();
+            }
+            continue;
+        }
+        uint64_t const time_ns = get_time_ns();
+        uint64_t sent_time_ns = 0;
+        uint64_t seq = 0;
+        memcpy(&sent_time_ns, cmsg->msg, 8);
+        memcpy(&seq, cmsg->msg + 8, 8);
+        bool is_corrupt = cmsg->size != b->run.msg_size || seq != i;
+        for (size_t j = RST_MSG_HEAD_SIZE; j < cmsg->size && !is_corrupt; j++) {
+            is_corrupt = cmsg->msg[j] != (uint8_t) i;
+        }
+        b->corrupt_c += is_corrupt;
+        rs_record_latency(b->latencies, sent_time_ns, time_ns);
+        i++;
+        RS_GUARD(rs_enqueue_ring_update(queue, &b->pair, b->sleep_states,
+            eventfds, (uint8_t *) cons.r, 0, false));
+    }
+    return RS_OK;
+}
+
+static int consume(
+    void * arg
+) {
+    struct rst_bench * b = arg;
+    struct rs_ring_queue queue = {0};
+    rs_ret ret = init_queue(b, &queue);
+    if (ret == RS_OK) {
+        ret = _consume(b, &queue);
+    }
+    free_queue(&queue);
+    return ret;
+}
+
+static rs_ret pin_to_cpu(
+    int cpu
+) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+        fprintf(stderr, "Unsuccessful sched_setaffinity() for CPU %d: %s\n",
+            cpu, strerror(errno));
+        return RS_FATAL;
+    }
+    return RS_OK;
+}
+
+// Spawn the consumer and the producer in that order, each inheriting the CPU
+// affinity set for it beforehand (as in rs_affinity.c).
+static rs_ret run(
+    struct rst_bench * b,
+    int producer_cpu,
+    int consumer_cpu
+) {
+    b->prod = (struct rs_ring_producer){
+        .ring_size = b->run.ring_size,
+        .min_ring_size = b->run.ring_size
+    };
+    RS_CACHE_ALIGNED_CALLOC(b->prod.ring, b->run.ring_size);
+    b->prod.w = b->prod.ring;
+    RS_ATOMIC_STORE_RELAXED(&b->pair->inbound_ring.w,
+        (atomic_uintptr_t) b->prod.ring);
+    RS_ATOMIC_STORE_RELAXED(&b->pair->inbound_ring.r,
+        (atomic_uintptr_t) b->prod.ring);
+    memset(b->latencies, 0, sizeof(*b->latencies));
+    b->consumed_c = 0;
+    b->grow_c = 0;
+    b->corrupt_c = 0;
+    atomic_store(&b->producer_failed, false);
+    thrd_t producer;
+    thrd_t consumer;
+    RS_GUARD(pin_to_cpu(consumer_cpu));
+    if (thrd_create(&consumer, consume, b) != thrd_success) {
+        fprintf(stderr, "Unsuccessful thrd_create()\n");
+        return RS_FATAL;
+    }
+    RS_GUARD(pin_to_cpu(producer_cpu));
+    uint64_t const start_ns = get_time_ns();
+    if (thrd_create(&producer, produce, b) != thrd_success) {
+        fprintf(stderr, "Unsuccessful thrd_create()\n");
+        return RS_FATAL;
+    }
+    int producer_ret = RS_FATAL;
+    int consumer_ret = RS_FATAL;
+    thrd_join(producer, &producer_ret);
+    thrd_join(consumer, &consumer_ret);
+    double const elapsed_ns = get_time_ns() - start_ns;
+    char const * status = b->corrupt_c ? "corrupt" : "ok";
+    if (producer_ret != RS_OK || consumer_ret != RS_OK) {
+        status = "fatal";
+    }
+    uint64_t latencies[RS_HISTOGRAM_BUCKET_C] = {0};
+    for (size_t i = 0; i < RS_HISTOGRAM_BUCKET_C; i++) {
+        latencies[i] = atomic_load_explicit(b->latencies->bucket_c + i,
+            memory_order_relaxed);
+    }
+    // Any rates and quantiles of a failed run only cover the messages it
+    // managed to consume.
+    printf("%" PRIu64 ",%s,%d,%zu,%.2f,%" PRIu64 ",%.0f,%.0f,%.1f,%" PRIu64
+        ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%zu,%zu,%zu,%zu,%s\n",
+        b->run.msg_size,
+        b->run.update_queue_size ? "delayed" : "acquire_release",
+        b->run.update_queue_size, b->run.ring_size,
+        b->run.realloc_multiplier, b->consumed_c, elapsed_ns,
+        1e9 * b->consumed_c / elapsed_ns,
+        1e3 * b->consumed_c * b->run.msg_size / elapsed_ns, // MB/s
+        rs_get_histogram_quantile(latencies, NULL, b->consumed_c, .5),
+        rs_get_histogram_quantile(latencies, NULL, b->consumed_c, .99),
+        rs_get_histogram_quantile(latencies, NULL, b->consumed_c, .999),
+        rs_get_histogram_quantile(latencies, NULL, b->consumed_c, 1),
+        b->grow_c, b->prod.ring_size, b->prod.high_water_size, b->corrupt_c,
+        status);
+    fflush(stdout);
+    RS_FREE(b->prod.ring);
+    RS_FREE(b->prod.prev_ring);
+    return b->corrupt_c ? RS_FATAL : RS_OK;
+}
+
+int main(
+    int arg_c,
+    char * * args
+) {
+    if (arg_c != 1 && arg_c != 2 && arg_c != 4) {
+        printf("Usage: %s [msg_c [producer_cpu consumer_cpu]]\n", args[0]);
+        return EXIT_FAILURE;
+    }
+    // Don't let syslog() calls for every ring buffer growth event skew results.
+    _rs_log_max = LOG_WARNING;
+    struct rst_bench b = {
+        .msg_c = arg_c > 1 ? strtoull(args[1], NULL, 10) : RST_DEFAULT_MSG_C
+    };
+    if (!b.msg_c) {
+        printf("msg_c must be greater than 0\n");
+        return EXIT_FAILURE;
+    }
+    int producer_cpu = -1;
+    int consumer_cpu = -1;
+    if (arg_c > 2) {
+        producer_cpu = atoi(args[2]);
+        consumer_cpu = atoi(args[3]);
+    } else {
+        cpu_set_t cpus;
+        if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1) {
+            perror("Unsuccessful sched_getaffinity()");
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < CPU_SETSIZE && consumer_cpu < 0; i++) {
+            if (CPU_ISSET(i, &cpus)) {
+                *(producer_cpu < 0 ? &producer_cpu : &consumer_cpu) = i;
+            }
+        }
+        if (consumer_cpu < 0) {
+            consumer_cpu = producer_cpu;
+        }
+    }
+    b.shares_cpu = producer_cpu == consumer_cpu;
+    RS_CACHE_ALIGNED_CALLOC(b.pair, 1);
+    RS_CACHE_ALIGNED_CALLOC(b.sleep_states, 1);
+    RS_CACHE_ALIGNED_CALLOC(b.latencies, 1);
+    printf("# rst_ring: %" PRIu64 " messages per run; producer CPU %d, "
+        "consumer CPU %d%s\n", b.msg_c, producer_cpu, consumer_cpu,
+        b.shares_cpu ? " (shared: producer yields after every batch)" : "");
+    printf("# RS_CACHE_LINE_SIZE %d; batch size %d; compiler %s\n",
+        RS_CACHE_LINE_SIZE, RST_BATCH_SIZE, __VERSION__);
+    printf("msg_size,ring_ordering,update_queue_size,initial_ring_size,"
+        "realloc_multiplier,msg_c,elapsed_ns,msgs_per_sec,mb_per_sec,"
+        "latency_p50_ns,latency_p99_ns,latency_p999_ns,latency_max_ns,grow_c,"
+        "final_ring_size,high_water_size,corrupt_c,status\n");
+    int exit_status = EXIT_SUCCESS;
+    for (size_t i = 0; i < RS_ELEM_C(msg_sizes); i++) {
+        for (size_t j = 0; j < RS_ELEM_C(update_queue_sizes); j++) {
+            for (size_t k = 0; k < RS_ELEM_C(ring_sizes); k++) {
+                for (size_t l = 0; l < RS_ELEM_C(realloc_multipliers); l++) {
+                    b.run = (struct rst_run){
+                        .msg_size = msg_sizes[i],
+                        .update_queue_size = update_queue_sizes[j],
+                        .ring_size = ring_sizes[k],
+                        .realloc_multiplier = realloc_multipliers[l]
+                    };
+                    if (run(&b, producer_cpu, consumer_cpu) != RS_OK) {
+                        exit_status = EXIT_FAILURE;
+                    }
+                }
+            }
+        }
+    }
+    return exit_status;
+}
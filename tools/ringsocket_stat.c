@@ -0,0 +1,457 @@
+// SPDX-License-Identifier: MIT
+// Copyright © 2019 William Budd
+
+// ringsocket_stat prints the counters that a running RingSocket process
+// publishes through the metrics segment at its configured "metrics_path" (see
+// ringsocket_metrics.h and README.md): once, or every interval_sec seconds if
+// an interval is given. Counters are then printed as rates per second over the
+// last interval instead, whereas gauges are always printed as is. If
+// "latency_histograms" is enabled, the p50, p99, p99.9 and maximum latency of
+// every stage of every app are printed too: of all messages since startup, or
+// of only those recorded during the last interval.
+//
+// Usage: ringsocket_stat metrics_path [interval_sec]
+//
+// The segment is mapped read-only and never locked, so running this has no
+// effect whatsoever on RingSocket itself; but it must have been compiled with
+// the same RS_CACHE_LINE_SIZE.
+
+#define _GNU_SOURCE // CLOCK_MONOTONIC, kill()
+
+#include <ringsocket_app.h> // ringsocket_metrics.h, enum rs_inbound_kind
+
+#include <fcntl.h> // open()
+#include <signal.h> // kill()
+#include <stdio.h> // printf()
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // fstat()
+#include <unistd.h> // close(), sleep()
+
+RS_LOG_VARS; // See the RS_LOG() section in ringsocket_api.h for explanation.
+
+struct rss_field {
+    char const * name;
+    size_t offset;
+    bool is_gauge;
+};
+
+#define RSS_FIELD(type, member, is_gauge) \
+    {#member, offsetof(type, member), is_gauge}
+
+#define RSS_THREAD_FIELDS(type) \
+    RSS_FIELD(type, thread.needed_wake_c, false), \
+    RSS_FIELD(type, thread.sent_wake_c, false), \
+    RSS_FIELD(type, thread.sleep_c, false), \
+    RSS_FIELD(type, thread.sleep_ns, false), \
+    RSS_FIELD(type, thread.spin_hit_c, false), \
+    RSS_FIELD(type, thread.spin_ns, false)
+
+static struct rss_field const worker_fields[] = {
+    RSS_FIELD(struct rs_worker_metrics, inbound_byte_c, false),
+    RSS_FIELD(struct rs_worker_metrics, inbound_msg_c, false),
+    RSS_FIELD(struct rs_worker_metrics, outbound_byte_c, false),
+    RSS_FIELD(struct rs_worker_metrics, outbound_msg_c, false),
+    RSS_FIELD(struct rs_worker_metrics, read_eagain_c, false),
+    RSS_FIELD(struct rs_worker_metrics, write_eagain_c, false),
+    RSS_FIELD(struct rs_worker_metrics, accept_c, false),
+    RSS_FIELD(struct rs_worker_metrics, reject_c, false),
+    RSS_FIELD(struct rs_worker_metrics, upgrade_c, false),
+    RSS_FIELD(struct rs_worker_metrics, close_c, false),
+    {"close_c (peer)", offsetof(struct rs_worker_metrics,
+        close_c_by_reason[RS_CLOSE_REASON_PEER]), false},
+    {"close_c (app)", offsetof(struct rs_worker_metrics,
+        close_c_by_reason[RS_CLOSE_REASON_APP]), false},
+    {"close_c (http)", offsetof(struct rs_worker_metrics,
+        close_c_by_reason[RS_CLOSE_REASON_HTTP]), false},
+    {"close_c (websocket)", offsetof(struct rs_worker_metrics,
+        close_c_by_reason[RS_CLOSE_REASON_WEBSOCKET]), false},
+    {"close_c (tls)", offsetof(struct rs_worker_metrics,
+        close_c_by_reason[RS_CLOSE_REASON_TLS]), false},
+    {"close_c (hangup)", offsetof(struct rs_worker_metrics,
+        close_c_by_reason[RS_CLOSE_REASON_HANGUP]), false},
+    {"close_c (backpressure)", offsetof(struct rs_worker_metrics,
+        close_c_by_reason[RS_CLOSE_REASON_BACKPRESSURE]), false},
+    RSS_FIELD(struct rs_worker_metrics, shutdown_timeout_c, false),
+    RSS_FIELD(struct rs_worker_metrics, full_tls_handshake_c, false),
+    RSS_FIELD(struct rs_worker_metrics, resumed_tls_handshake_c, false),
+    RSS_FIELD(struct rs_worker_metrics, owref_c, true),
+    RSS_FIELD(struct rs_worker_metrics, queued_owref_c, true),
+    RSS_FIELD(struct rs_worker_metrics, backpressure_drop_c, false),
+    RSS_FIELD(struct rs_worker_metrics, backpressure_pause_c, false),
+    RSS_THREAD_FIELDS(struct rs_worker_metrics)
+};
+
+static struct rss_field const app_fields[] = {
+    {"open_c", offsetof(struct rs_app_metrics,
+        inbound_c_by_kind[RS_INBOUND_OPEN]), false},
+    {"read_c", offsetof(struct rs_app_metrics,
+        inbound_c_by_kind[RS_INBOUND_READ]), false},
+    {"close_c", offsetof(struct rs_app_metrics,
+        inbound_c_by_kind[RS_INBOUND_CLOSE]), false},
+    {"pause_c", offsetof(struct rs_app_metrics,
+        inbound_c_by_kind[RS_INBOUND_PAUSE]), false},
+    {"resume_c", offsetof(struct rs_app_metrics,
+        inbound_c_by_kind[RS_INBOUND_RESUME]), false},
+    RSS_FIELD(struct rs_app_metrics, timer_c, false),
+    RSS_THREAD_FIELDS(struct rs_app_metrics)
+};
+
+// Load field_c fields of the counters at src into dst.
+static void load_fields(
+    uint64_t * dst,
+    void const * src,
+    struct rss_field const * fields,
+    size_t field_c
+) {
+    for (size_t i = 0; i < field_c; i++) {
+        dst[i] = atomic_load_explicit((atomic_uint_least64_t const *)
+            ((uint8_t const *) src + fields[i].offset), memory_order_relaxed);
+    }
+}
+
+struct rss_snapshot {
+    uint64_t * workers; // worker_c * RS_ELEM_C(worker_fields)
+    uint64_t * apps; // app_c * RS_ELEM_C(app_fields)
+    uint64_t * rings; // worker_c * app_c * 2 * RSS_RING_FIELD_C
+    // NULL, or app_c * RSS_STAGE_C * RS_HISTOGRAM_BUCKET_C: the pair latency
+    // histograms of each app are summed over all workers.
+    uint64_t * latencies;
+    uint64_t time_ns;
+};
+
+// The latency histograms kept for each app, in the order of stage_names
+#define RSS_STAGE_C 4
+
+static char const * const stage_names[RSS_STAGE_C] = {
+    "inbound", // struct rs_app_latency
+    "callback", // struct rs_app_latency
+    "outbound", // struct rs_pair_latency
+    "end_to_end" // struct rs_pair_latency
+};
+
+// The ring values kept for each ring buffer, in order: produced_byte_c minus
+// consumed_byte_c, produced_msg_c, ring_size, high_water_size, and realloc_c.
+#define RSS_RING_FIELD_C 5
+
+static void load_ring(
+    uint64_t * dst,
+    struct rs_ring_metrics const * ring
+) {
+    // Loading the consumer's count first ensures a fill that isn't negative,
+    // given that neither count ever decreases.
+    uint64_t consumed_byte_c = atomic_load_explicit(&ring->consumed_byte_c,
+        memory_order_relaxed);
+    dst[0] = atomic_load_explicit(&ring->produced_byte_c, memory_order_relaxed)
+        - consumed_byte_c;
+    dst[1] = atomic_load_explicit(&ring->produced_msg_c, memory_order_relaxed);
+    dst[2] = atomic_load_explicit(&ring->ring_size, memory_order_relaxed);
+    dst[3] = atomic_load_explicit(&ring->high_water_size,
+        memory_order_relaxed);
+    dst[4] = atomic_load_explicit(&ring->realloc_c, memory_order_relaxed);
+}
+
+// Add the bucket counts of the histogram at src to those at dst.
+static void load_histogram(
+    uint64_t * dst,
+    struct rs_histogram const * src
+) {
+    for (size_t i = 0; i < RS_HISTOGRAM_BUCKET_C; i++) {
+        dst[i] += atomic_load_explicit(src->bucket_c + i, memory_order_relaxed);
+    }
+}
+
+static void load_latencies(
+    struct rs_metrics_head * head,
+    uint64_t * dst
+) {
+    memset(dst, 0, head->app_c * RSS_STAGE_C * RS_HISTOGRAM_BUCKET_C *
+        sizeof(uint64_t));
+    for (size_t j = 0; j < head->app_c; j++) {
+        struct rs_app_latency * app = rs_get_app_latency(head, j);
+        load_histogram(dst, &app->inbound);
+        load_histogram(dst + RS_HISTOGRAM_BUCKET_C, &app->callback);
+        for (size_t i = 0; i < head->worker_c; i++) {
+            struct rs_pair_latency * pair = rs_get_pair_latency(head, i, j);
+            load_histogram(dst + 2 * RS_HISTOGRAM_BUCKET_C, &pair->outbound);
+            load_histogram(dst + 3 * RS_HISTOGRAM_BUCKET_C, &pair->end_to_end);
+        }
+        dst += RSS_STAGE_C * RS_HISTOGRAM_BUCKET_C;
+    }
+}
+
+static uint64_t get_time_ns(
+    void
+) {
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000000 * (uint64_t) ts.tv_sec + ts.tv_nsec;
+}
+
+static void take_snapshot(
+    struct rs_metrics_head * head,
+    struct rss_snapshot * s
+) {
+    s->time_ns = get_time_ns();
+    for (size_t i = 0; i < head->worker_c; i++) {
+        load_fields(s->workers + i * RS_ELEM_C(worker_fields),
+            rs_get_worker_metrics(head, i), worker_fields,
+            RS_ELEM_C(worker_fields));
+    }
+    for (size_t i = 0; i < head->app_c; i++) {
+        load_fields(s->apps + i * RS_ELEM_C(app_fields),
+            rs_get_app_metrics(head, i), app_fields, RS_ELEM_C(app_fields));
+    }
+    uint64_t * ring = s->rings;
+    for (size_t i = 0; i < head->worker_c; i++) {
+        for (size_t j = 0; j < head->app_c; j++) {
+            struct rs_ring_pair_metrics * pair =
+                rs_get_ring_pair_metrics(head, i, j);
+            load_ring(ring, &pair->inbound_ring);
+            ring += RSS_RING_FIELD_C;
+            load_ring(ring, &pair->outbound_ring);
+            ring += RSS_RING_FIELD_C;
+        }
+    }
+    if (s->latencies) {
+        load_latencies(head, s->latencies);
+    }
+}
+
+// Print the current value of a gauge or absolute counter; or if prev is given,
+// the rate per second at which a counter increased since prev.
+static void print_value(
+    uint64_t val,
+    uint64_t const * prev,
+    bool is_gauge,
+    double elapsed_sec
+) {
+    if (prev && !is_gauge) {
+        printf(" %14.1f", (val - *prev) / elapsed_sec);
+    } else {
+        printf(" %14" PRIu64, val);
+    }
+}
+
+// Print a table with a row for each field and a column for each thread,
+// followed by a column of totals.
+static void print_thread_table(
+    char const * title,
+    struct rss_field const * fields,
+    size_t field_c,
+    char const * const * thread_names,
+    size_t thread_c,
+    uint64_t const * vals,
+    uint64_t const * prev_vals, // NULL if not printing rates
+    double elapsed_sec
+) {
+    printf("%-24s", title);
+    for (size_t i = 0; i < thread_c; i++) {
+        printf(" %14.14s", thread_names[i]);
+    }
+    printf(" %14s\n", "total");
+    for (size_t i = 0; i < field_c; i++) {
+        printf("%-24s", fields[i].name);
+        uint64_t total = 0;
+        uint64_t prev_total = 0;
+        for (size_t j = 0; j < thread_c; j++) {
+            size_t k = j * field_c + i;
+            print_value(vals[k], prev_vals ? prev_vals + k : NULL,
+                fields[i].is_gauge, elapsed_sec);
+            total += vals[k];
+            prev_total += prev_vals ? prev_vals[k] : 0;
+        }
+        print_value(total, prev_vals ? &prev_total : NULL, fields[i].is_gauge,
+            elapsed_sec);
+        printf("\n");
+    }
+    printf("\n");
+}
+
+static void print_ring_table(
+    struct rs_metrics_head const * head,
+    char const * const * worker_names,
+    struct rss_snapshot const * s,
+    struct rss_snapshot const * prev, // NULL if not printing rates
+    double elapsed_sec
+) {
+    printf("%-40s %14s %14s %14s %14s %14s\n", "ring",
+        prev ? "msg/s" : "msg_c", "fill", "ring_size", "high_water_size",
+        "realloc_c");
+    char name[2 * RS_METRICS_NAME_SIZE + 16] = {0};
+    for (size_t i = 0; i < head->worker_c; i++) {
+        for (size_t j = 0; j < head->app_c; j++) {
+            for (size_t k = 0; k < 2; k++) {
+                size_t r = ((i * head->app_c + j) * 2 + k) * RSS_RING_FIELD_C;
+                uint64_t const * ring = s->rings + r;
+                // The inbound ring first, followed by the outbound ring
+                snprintf(name, sizeof(name), "%s -> %s",
+                    k ? head->app_names[j] : worker_names[i],
+                    k ? worker_names[i] : head->app_names[j]);
+                printf("%-40.40s", name);
+                print_value(ring[1], prev ? prev->rings + r + 1 : NULL, false,
+                    elapsed_sec);
+                printf(" %14" PRIu64 " %14" PRIu64 " %14" PRIu64 " %14" PRIu64
+                    "\n", ring[0], ring[2], ring[3], ring[4]);
+            }
+        }
+    }
+    printf("\n");
+}
+
+static void print_latency_table(
+    struct rs_metrics_head const * head,
+    struct rss_snapshot const * s,
+    struct rss_snapshot const * prev, // NULL if not printing rates
+    double elapsed_sec
+) {
+    printf("%-40s %14s %14s %14s %14s %14s\n", "latency (ns)",
+        prev ? "msg/s" : "msg_c", "p50", "p99", "p99.9", "max");
+    char name[RS_METRICS_NAME_SIZE + 16] = {0};
+    for (size_t j = 0; j < head->app_c; j++) {
+        for (size_t k = 0; k < RSS_STAGE_C; k++) {
+            size_t h = (j * RSS_STAGE_C + k) * RS_HISTOGRAM_BUCKET_C;
+            uint64_t const * hist = s->latencies + h;
+            uint64_t const * prev_hist = prev ? prev->latencies + h : NULL;
+            uint64_t count = 0;
+            for (size_t i = 0; i < RS_HISTOGRAM_BUCKET_C; i++) {
+                count += hist[i] - (prev_hist ? prev_hist[i] : 0);
+            }
+            snprintf(name, sizeof(name), "%s %s", head->app_names[j],
+                stage_names[k]);
+            printf("%-40.40s", name);
+            if (prev) {
+                printf(" %14.1f", count / elapsed_sec);
+            } else {
+                printf(" %14" PRIu64, count);
+            }
+            if (!count) {
+                printf(" %14s %14s %14s %14s\n", "-", "-", "-", "-");
+                continue;
+            }
+            printf(" %14" PRIu64 " %14" PRIu64 " %14" PRIu64 " %14" PRIu64
+                "\n", rs_get_histogram_quantile(hist, prev_hist, count, .5),
+                rs_get_histogram_quantile(hist, prev_hist, count, .99),
+                rs_get_histogram_quantile(hist, prev_hist, count, .999),
+                rs_get_histogram_quantile(hist, prev_hist, count, 1));
+        }
+    }
+    printf("\n");
+}
+
+static int print_metrics(
+    struct rs_metrics_head * head,
+    unsigned interval_sec
+) {
+    char worker_name_bufs[head->worker_c][16];
+    char const * worker_names[head->worker_c];
+    for (size_t i = 0; i < head->worker_c; i++) {
+        sprintf(worker_name_bufs[i], "Worker#%zu", i + 1);
+        worker_names[i] = worker_name_bufs[i];
+    }
+    char const * app_names[head->app_c];
+    for (size_t i = 0; i < head->app_c; i++) {
+        app_names[i] = head->app_names[i];
+    }
+    struct rss_snapshot snapshots[2] = {{0}};
+    for (size_t i = 0; i < 2; i++) {
+        RS_CALLOC(snapshots[i].workers,
+            head->worker_c * RS_ELEM_C(worker_fields));
+        RS_CALLOC(snapshots[i].apps, head->app_c * RS_ELEM_C(app_fields));
+        RS_CALLOC(snapshots[i].rings,
+            head->worker_c * head->app_c * 2 * RSS_RING_FIELD_C);
+        if (head->has_latencies) {
+            RS_CALLOC(snapshots[i].latencies,
+                head->app_c * RSS_STAGE_C * RS_HISTOGRAM_BUCKET_C);
+        }
+    }
+    struct rss_snapshot * s = snapshots;
+    struct rss_snapshot * prev = NULL;
+    for (;;) {
+        take_snapshot(head, s);
+        if (!interval_sec || prev) {
+            double const elapsed_sec =
+                prev ? (s->time_ns - prev->time_ns) / 1e9 : 0;
+            printf("RingSocket pid %" PRId64 " (up %" PRId64 " s)%s\n\n",
+                head->pid, (int64_t) time(NULL) - head->start_time,
+                prev ? ": counters per second" : "");
+            print_thread_table("worker", worker_fields, RS_ELEM_C(worker_fields),
+                worker_names, head->worker_c, s->workers,
+                prev ? prev->workers : NULL, elapsed_sec);
+            print_thread_table("app", app_fields, RS_ELEM_C(app_fields),
+                app_names, head->app_c, s->apps, prev ? prev->apps : NULL,
+                elapsed_sec);
+            print_ring_table(head, worker_names, s, prev, elapsed_sec);
+            if (s->latencies) {
+                print_latency_table(head, s, prev, elapsed_sec);
+            }
+            fflush(stdout);
+        }
+        if (!interval_sec) {
+            return EXIT_SUCCESS;
+        }
+        prev = s;
+        s = s == snapshots ? snapshots + 1 : snapshots;
+        sleep(interval_sec);
+    }
+}
+
+int main(
+    int arg_c,
+    char * * args
+) {
+    if (arg_c < 2 || arg_c > 3) {
+        printf("Usage: %s metrics_path [interval_sec]\n", args[0]);
+        return EXIT_FAILURE;
+    }
+    unsigned interval_sec = arg_c > 2 ? strtoul(args[2], NULL, 10) : 0;
+    int fd = open(args[1], O_RDONLY);
+    if (fd == -1) {
+        perror("Unsuccessful open() of the metrics file");
+        return EXIT_FAILURE;
+    }
+    struct stat st = {0};
+    if (fstat(fd, &st) == -1) {
+        perror("Unsuccessful fstat() of the metrics file");
+        return EXIT_FAILURE;
+    }
+    if ((size_t) st.st_size < rs_get_metrics_head_size(0)) {
+        printf("%s is too small to be a RingSocket metrics file.\n", args[1]);
+        return EXIT_FAILURE;
+    }
+    struct rs_metrics_head * head =
+        mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (head == MAP_FAILED) {
+        perror("Unsuccessful mmap() of the metrics file");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    if (memcmp(head->magic, RS_METRICS_MAGIC, sizeof(head->magic))) {
+        printf("%s is not a RingSocket metrics file (or RingSocket is still "
+            "starting up).\n", args[1]);
+        return EXIT_FAILURE;
+    }
+    atomic_thread_fence(memory_order_acquire); // See create_metrics()
+    if (head->version != RS_METRICS_VERSION) {
+        printf("%s has metrics layout version %" PRIu32 ", whereas this "
+            "program expects version %d.\n", args[1], head->version,
+            RS_METRICS_VERSION);
+        return EXIT_FAILURE;
+    }
+    if (head->cache_line_size != RS_CACHE_LINE_SIZE) {
+        printf("%s was written by RingSocket compiled with an "
+            "RS_CACHE_LINE_SIZE of %" PRIu32 ", whereas this program was "
+            "compiled with %d.\n", args[1], head->cache_line_size,
+            RS_CACHE_LINE_SIZE);
+        return EXIT_FAILURE;
+    }
+    if ((size_t) st.st_size < rs_get_metrics_size(head->worker_c,
+        head->app_c, head->has_latencies)) {
+        printf("%s is truncated.\n", args[1]);
+        return EXIT_FAILURE;
+    }
+    if (kill(head->pid, 0) == -1 && errno == ESRCH) {
+        printf("Warning: RingSocket process %" PRId64 " is no longer running: "
+            "printing its final counters.\n\n", head->pid);
+    }
+    return print_metrics(head, interval_sec);
+}